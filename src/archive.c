@@ -0,0 +1,689 @@
+/// @file archive.c
+///
+/// Definitions for archived event log segments.
+
+#define _GNU_SOURCE
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <threads.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include "archive.h"
+#include "cipher.h"
+#include "event.h"
+
+#define ARCHIVE_MAGIC 0x5345475541524331ULL
+#define ARCHIVE_VERSION 1
+
+// Footer flag set when blocks are sealed
+#define ARCHIVE_FLAG_SEALED 0x1
+
+// Set in the fragment number blocks are sealed at, along with the first event
+// id of the segment and the block number, so that a block can't pass for an
+// event fragment or snapshot chunk
+#define ARCHIVE_POSITION_FLAG 0xC0000000u
+
+//==============================================================================
+// Types
+//==============================================================================
+
+typedef struct archive_footer_t {
+  uint64_t magic;        // ARCHIVE_MAGIC.
+  uint32_t version;      // Layout version.
+  uint32_t flags;        // ARCHIVE_FLAG_* bits.
+  uint64_t first_id;     // First event id in the segment.
+  uint64_t last_id;      // Last event id in the segment.
+  uint64_t index_offset; // Offset of the block index, then the event index.
+  uint32_t num_blocks;   // Number of blocks.
+  uint32_t num_entries;  // Number of events.
+} ArchiveFooter;
+
+typedef struct archive_segment_t {
+  uint64_t serial;              // Unique number of the mapping.
+  uint64_t first_id;            // First event id in the segment.
+  uint64_t last_id;             // Last event id in the segment.
+  uint8_t *map;                 // Mapping of the segment file.
+  uint64_t size;                // Size of the mapping in bytes.
+  const ArchiveBlock *blocks;   // Block index.
+  const ArchiveEntry *entries;  // Event index, sorted by id.
+  uint32_t num_blocks;          // Number of blocks.
+  uint32_t num_entries;         // Number of events.
+  bool sealed;                  // Whether blocks are encrypted.
+} ArchiveSegment;
+
+typedef struct archive_cache_t {
+  uint64_t serial;          // Serial of the segment of the cached block, or 0.
+  uint32_t block;           // Number of the cached block.
+  uint8_t *raw;             // The decompressed block.
+  uint64_t raw_capacity;    // Capacity of the decompressed block buffer.
+  uint8_t *opened;          // Buffer for opening sealed blocks.
+  uint64_t opened_capacity; // Capacity of the opening buffer.
+  bool registered;          // Whether the exit destructor is registered.
+} ArchiveCache;
+
+//==============================================================================
+// Variables
+//==============================================================================
+
+static pthread_rwlock_t archive_lock = PTHREAD_RWLOCK_INITIALIZER;
+static ArchiveSegment *archive_segments = NULL;
+static uint32_t archive_num_segments = 0;
+static uint64_t archive_serial = 0;
+
+static pthread_once_t archive_once = PTHREAD_ONCE_INIT;
+static pthread_key_t archive_cache_key;
+static thread_local ArchiveCache archive_cache;
+
+//==============================================================================
+// Prototypes
+//==============================================================================
+
+/// Compress (and seal) the block being filled and append it to the segment.
+///
+/// @param[in] writer  Handle for the writer.
+///
+/// @return  0  Success.
+/// @return -1  Failure.
+int flush_archive_block(ArchiveWriter *writer);
+
+/// Release the buffers of a writer.
+///
+/// @param[in] writer  Handle for the writer.
+void free_archive_writer(ArchiveWriter *writer);
+
+/// Grow a buffer to hold at least a number of bytes.
+///
+/// @param[in] buffer    Pointer to the buffer.
+/// @param[in] capacity  Pointer to the capacity of the buffer.
+/// @param[in] size      Number of bytes needed.
+///
+/// @return  0  Success.
+/// @return -1  Failure.
+int reserve_archive_buffer(void **buffer, uint64_t *capacity, uint64_t size);
+
+/// Check the footer and index of a mapped segment, and describe it.
+///
+/// @param[in] segment  Handle for the segment, with map and size set.
+///
+/// @return  0  Success.
+/// @return -1  Failure (not a valid segment).
+int parse_archive_segment(ArchiveSegment *segment);
+
+/// Find the segment which may hold an event. The archive lock must be held.
+///
+/// @param[in] id  The event identifier.
+///
+/// @return  Handle for the segment.
+/// @return  NULL  No segment covers the event.
+const ArchiveSegment *find_archive_segment(uint64_t id);
+
+/// Get a decompressed block of a segment, from the calling thread's cache if
+/// it was the last one read.
+///
+/// @param[in] segment  Handle for the segment.
+/// @param[in] block    The block number.
+///
+/// @return  Pointer to the decompressed block.
+/// @return  NULL  Failure.
+const uint8_t *load_archive_block(const ArchiveSegment *segment,
+                                  uint32_t block);
+
+/// Create the key used to release thread caches at thread exit.
+void archive_init(void);
+
+/// Release the calling thread's cache at thread exit.
+///
+/// @param[in] arg  Handle for the thread's cache.
+void archive_cache_destructor(void *arg);
+
+//==============================================================================
+// Functions
+//==============================================================================
+
+int archive_writer_open(ArchiveWriter *writer, const char *dir) {
+  int fd;
+
+  memset(writer, 0, sizeof(ArchiveWriter));
+
+  if ((snprintf(writer->dir, ARCHIVE_PATH_MAX, "%s", dir) >=
+       ARCHIVE_PATH_MAX) ||
+      (snprintf(writer->tmp_path, ARCHIVE_PATH_MAX, "%s/.segment-XXXXXX",
+                dir) >= ARCHIVE_PATH_MAX))
+    return -1;
+
+  fd = mkstemp(writer->tmp_path);
+  if (fd < 0)
+    return -1;
+
+  writer->file = fdopen(fd, "wb");
+  if (!writer->file) {
+    close(fd);
+    unlink(writer->tmp_path);
+    return -1;
+  }
+
+  writer->sealed = cipher_enabled();
+
+  // Success
+  return 0;
+}
+
+int archive_writer_add(ArchiveWriter *writer, const Event *event) {
+  ArchiveEntry *entry;
+
+  // Events are indexed by binary search, and the block offsets are 32-bit
+  if ((writer->num_entries &&
+       (event->id <= writer->entries[(writer->num_entries - 1)].id)) ||
+      (event->data_length > UINT32_MAX))
+    return -1;
+
+  // Start a new block once the current one is full. Events larger than a block
+  // get a block of their own.
+  if (writer->block_events &&
+      ((writer->raw_length + event->data_length) > ARCHIVE_BLOCK_SIZE) &&
+      flush_archive_block(writer))
+    return -1;
+
+  if (((writer->raw_length + event->data_length) > UINT32_MAX) ||
+      reserve_archive_buffer((void **)&writer->raw, &writer->raw_capacity,
+                             (writer->raw_length + event->data_length)))
+    return -1;
+
+  if (writer->num_entries == writer->entries_capacity) {
+    uint32_t capacity =
+        writer->entries_capacity ? (2 * writer->entries_capacity) : 1024;
+    ArchiveEntry *entries =
+        realloc(writer->entries, (sizeof(ArchiveEntry) * capacity));
+
+    if (!entries)
+      return -1;
+    writer->entries = entries;
+    writer->entries_capacity = capacity;
+  }
+
+  if (event->data_length)
+    memcpy((writer->raw + writer->raw_length), event->data,
+           event->data_length);
+
+  entry = (writer->entries + writer->num_entries++);
+  entry->id = event->id;
+  entry->length = event->data_length;
+  entry->block = writer->num_blocks;
+  entry->offset = (uint32_t)writer->raw_length;
+
+  writer->raw_length += event->data_length;
+  ++writer->block_events;
+
+  // Success
+  return 0;
+}
+
+int archive_writer_finish(ArchiveWriter *writer, char *path) {
+  char final_path[ARCHIVE_PATH_MAX];
+  uint8_t padding[8] = {0};
+  ArchiveFooter footer;
+  uint32_t pad;
+  int dir_fd;
+
+  if (!writer->num_entries || flush_archive_block(writer))
+    goto fail;
+
+  // The index is read in place from the mapping, so it must be aligned
+  pad = (uint32_t)((8 - (writer->file_offset % 8)) % 8);
+
+  footer.magic = ARCHIVE_MAGIC;
+  footer.version = ARCHIVE_VERSION;
+  footer.flags = writer->sealed ? ARCHIVE_FLAG_SEALED : 0;
+  footer.first_id = writer->entries[0].id;
+  footer.last_id = writer->entries[(writer->num_entries - 1)].id;
+  footer.index_offset = (writer->file_offset + pad);
+  footer.num_blocks = writer->num_blocks;
+  footer.num_entries = writer->num_entries;
+
+  if ((fwrite(padding, 1, pad, writer->file) != pad) ||
+      (fwrite(writer->blocks, sizeof(ArchiveBlock), writer->num_blocks,
+              writer->file) != writer->num_blocks) ||
+      (fwrite(writer->entries, sizeof(ArchiveEntry), writer->num_entries,
+              writer->file) != writer->num_entries) ||
+      (fwrite(&footer, sizeof(ArchiveFooter), 1, writer->file) != 1) ||
+      fflush(writer->file) || fsync(fileno(writer->file)))
+    goto fail;
+
+  // Segments are immutable once they have their final name
+  if (snprintf(final_path, ARCHIVE_PATH_MAX, "%s/%020llu-%020llu%s",
+               writer->dir, (unsigned long long)footer.first_id,
+               (unsigned long long)footer.last_id,
+               ARCHIVE_SEGMENT_SUFFIX) >= ARCHIVE_PATH_MAX)
+    goto fail;
+
+  fclose(writer->file);
+  writer->file = NULL;
+  if (rename(writer->tmp_path, final_path))
+    goto fail;
+
+  // Make the rename durable before the caller clears the events elsewhere
+  dir_fd = open(writer->dir, O_RDONLY);
+  if (dir_fd >= 0) {
+    fsync(dir_fd);
+    close(dir_fd);
+  }
+
+  if (path)
+    memcpy(path, final_path, ARCHIVE_PATH_MAX);
+  free_archive_writer(writer);
+
+  // Success
+  return 0;
+
+// Failure
+fail:
+  archive_writer_abort(writer);
+  return -1;
+}
+
+void archive_writer_abort(ArchiveWriter *writer) {
+  if (writer->file)
+    fclose(writer->file);
+  writer->file = NULL;
+  unlink(writer->tmp_path);
+  free_archive_writer(writer);
+}
+
+int archive_open(const char *dir) {
+  char path[ARCHIVE_PATH_MAX];
+  struct dirent *entry;
+  size_t suffix_length = strlen(ARCHIVE_SEGMENT_SUFFIX);
+  DIR *handle = opendir(dir);
+
+  if (!handle)
+    return -1;
+
+  // Segments being written start with a '.', and are skipped
+  while ((entry = readdir(handle))) {
+    size_t length = strlen(entry->d_name);
+
+    if ((entry->d_name[0] == '.') || (length <= suffix_length) ||
+        strcmp((entry->d_name + length - suffix_length),
+               ARCHIVE_SEGMENT_SUFFIX))
+      continue;
+
+    if ((snprintf(path, ARCHIVE_PATH_MAX, "%s/%s", dir, entry->d_name) >=
+         ARCHIVE_PATH_MAX) ||
+        archive_add_segment(path)) {
+      closedir(handle);
+      archive_close();
+      return -1;
+    }
+  }
+
+  closedir(handle);
+
+  // Success
+  return 0;
+}
+
+int archive_add_segment(const char *path) {
+  ArchiveSegment segment;
+  ArchiveSegment *segments;
+  struct stat st;
+  uint32_t pos;
+  int fd;
+
+  fd = open(path, O_RDONLY);
+  if (fd < 0)
+    return -1;
+  if (fstat(fd, &st) || ((uint64_t)st.st_size < sizeof(ArchiveFooter))) {
+    close(fd);
+    return -1;
+  }
+
+  segment.size = st.st_size;
+  segment.map = mmap(NULL, segment.size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (segment.map == MAP_FAILED)
+    return -1;
+
+  if (parse_archive_segment(&segment))
+    goto fail;
+
+  pthread_rwlock_wrlock(&archive_lock);
+
+  // Keep segments sorted, so that lookups are a binary search
+  for (pos = 0; (pos < archive_num_segments) &&
+                (archive_segments[pos].first_id < segment.first_id);
+       ++pos)
+    ;
+  if (((pos > 0) &&
+       (archive_segments[(pos - 1)].last_id >= segment.first_id)) ||
+      ((pos < archive_num_segments) &&
+       (archive_segments[pos].first_id <= segment.last_id)))
+    goto fail_locked;
+
+  segments = realloc(archive_segments,
+                     (sizeof(ArchiveSegment) * (archive_num_segments + 1)));
+  if (!segments)
+    goto fail_locked;
+
+  memmove((segments + pos + 1), (segments + pos),
+          (sizeof(ArchiveSegment) * (archive_num_segments - pos)));
+  segment.serial = ++archive_serial;
+  segments[pos] = segment;
+  archive_segments = segments;
+  ++archive_num_segments;
+
+  pthread_rwlock_unlock(&archive_lock);
+
+  // Success
+  return 0;
+
+// Failure
+fail_locked:
+  pthread_rwlock_unlock(&archive_lock);
+fail:
+  munmap(segment.map, segment.size);
+  return -1;
+}
+
+void archive_close(void) {
+  pthread_rwlock_wrlock(&archive_lock);
+
+  for (uint32_t i = 0; i < archive_num_segments; ++i)
+    munmap(archive_segments[i].map, archive_segments[i].size);
+
+  free((void *)archive_segments);
+  archive_segments = NULL;
+  archive_num_segments = 0;
+
+  pthread_rwlock_unlock(&archive_lock);
+}
+
+bool archive_enabled(void) {
+  bool enabled;
+
+  pthread_rwlock_rdlock(&archive_lock);
+  enabled = (archive_num_segments != 0);
+  pthread_rwlock_unlock(&archive_lock);
+
+  return enabled;
+}
+
+int archive_last_id(uint64_t *id) {
+  int result = 1;
+
+  pthread_rwlock_rdlock(&archive_lock);
+  if (archive_num_segments) {
+    *id = archive_segments[(archive_num_segments - 1)].last_id;
+    result = 0;
+  }
+  pthread_rwlock_unlock(&archive_lock);
+
+  return result;
+}
+
+int archive_read_event(Event *event) {
+  const ArchiveSegment *segment;
+  const ArchiveEntry *entry = NULL;
+  const uint8_t *raw;
+  uint32_t low = 0;
+  uint32_t high;
+  int result = -1;
+
+  pthread_rwlock_rdlock(&archive_lock);
+
+  segment = find_archive_segment(event->id);
+  if (!segment) {
+    pthread_rwlock_unlock(&archive_lock);
+    return 1;
+  }
+
+  // Archived ids needn't be contiguous
+  high = segment->num_entries;
+  while (low < high) {
+    uint32_t mid = (low + ((high - low) / 2));
+
+    if (segment->entries[mid].id < event->id) {
+      low = (mid + 1);
+    } else {
+      high = mid;
+    }
+  }
+  if ((low == segment->num_entries) ||
+      (segment->entries[low].id != event->id)) {
+    pthread_rwlock_unlock(&archive_lock);
+    return 1;
+  }
+  entry = (segment->entries + low);
+
+  raw = load_archive_block(segment, entry->block);
+  if (raw && ((entry->offset + entry->length) <=
+              segment->blocks[entry->block].raw_length)) {
+    event->data = alloc_event_data(entry->length ? entry->length : 1);
+    if (event->data) {
+      memcpy(event->data, (raw + entry->offset), entry->length);
+      event->data_length = entry->length;
+      result = 0;
+    }
+  }
+
+  pthread_rwlock_unlock(&archive_lock);
+
+  // Success or failure
+  return result;
+}
+
+int flush_archive_block(ArchiveWriter *writer) {
+  ArchiveBlock *block;
+  uLongf length;
+
+  if (!writer->block_events)
+    return 0;
+
+  if (writer->num_blocks == writer->blocks_capacity) {
+    uint32_t capacity =
+        writer->blocks_capacity ? (2 * writer->blocks_capacity) : 64;
+    ArchiveBlock *blocks =
+        realloc(writer->blocks, (sizeof(ArchiveBlock) * capacity));
+
+    if (!blocks)
+      return -1;
+    writer->blocks = blocks;
+    writer->blocks_capacity = capacity;
+  }
+
+  length = compressBound(writer->raw_length);
+  if (reserve_archive_buffer((void **)&writer->packed,
+                             &writer->packed_capacity,
+                             (length + CIPHER_OVERHEAD)) ||
+      (compress2(writer->packed, &length, writer->raw, writer->raw_length,
+                 Z_DEFAULT_COMPRESSION) != Z_OK))
+    return -1;
+
+  // Blocks are sealed in place, after compression, since ciphertext doesn't
+  // compress
+  if (writer->sealed) {
+    if (cipher_seal(writer->packed, NULL, 0, writer->packed, length,
+                    writer->entries[0].id,
+                    (ARCHIVE_POSITION_FLAG | writer->num_blocks)))
+      return -1;
+    length += CIPHER_OVERHEAD;
+  }
+
+  if ((length > UINT32_MAX) ||
+      (fwrite(writer->packed, 1, length, writer->file) != length))
+    return -1;
+
+  block = (writer->blocks + writer->num_blocks++);
+  block->offset = writer->file_offset;
+  block->length = (uint32_t)length;
+  block->raw_length = (uint32_t)writer->raw_length;
+
+  writer->file_offset += length;
+  writer->raw_length = 0;
+  writer->block_events = 0;
+
+  // Success
+  return 0;
+}
+
+void free_archive_writer(ArchiveWriter *writer) {
+  free((void *)writer->raw);
+  free((void *)writer->packed);
+  free((void *)writer->blocks);
+  free((void *)writer->entries);
+  writer->raw = NULL;
+  writer->packed = NULL;
+  writer->blocks = NULL;
+  writer->entries = NULL;
+}
+
+int reserve_archive_buffer(void **buffer, uint64_t *capacity, uint64_t size) {
+  uint64_t new_capacity = *capacity ? *capacity : ARCHIVE_BLOCK_SIZE;
+  void *grown;
+
+  if (size <= *capacity)
+    return 0;
+
+  while (new_capacity < size)
+    new_capacity *= 2;
+
+  grown = realloc(*buffer, new_capacity);
+  if (!grown)
+    return -1;
+
+  *buffer = grown;
+  *capacity = new_capacity;
+
+  // Success
+  return 0;
+}
+
+int parse_archive_segment(ArchiveSegment *segment) {
+  ArchiveFooter footer;
+  uint64_t index_size;
+
+  memcpy(&footer, (segment->map + segment->size - sizeof(ArchiveFooter)),
+         sizeof(ArchiveFooter));
+
+  if ((footer.magic != ARCHIVE_MAGIC) || (footer.version != ARCHIVE_VERSION) ||
+      !footer.num_entries || (footer.index_offset % 8))
+    return -1;
+
+  index_size = (((uint64_t)footer.num_blocks * sizeof(ArchiveBlock)) +
+                ((uint64_t)footer.num_entries * sizeof(ArchiveEntry)));
+  if ((footer.index_offset + index_size + sizeof(ArchiveFooter)) !=
+      segment->size)
+    return -1;
+
+  segment->first_id = footer.first_id;
+  segment->last_id = footer.last_id;
+  segment->blocks = (const ArchiveBlock *)(segment->map + footer.index_offset);
+  segment->entries =
+      (const ArchiveEntry *)(segment->blocks + footer.num_blocks);
+  segment->num_blocks = footer.num_blocks;
+  segment->num_entries = footer.num_entries;
+  segment->sealed = (footer.flags & ARCHIVE_FLAG_SEALED);
+
+  // Blocks must lie before the index, and events within their blocks' count
+  for (uint32_t i = 0; i < segment->num_blocks; ++i)
+    if ((segment->blocks[i].offset + segment->blocks[i].length) >
+        footer.index_offset)
+      return -1;
+  for (uint32_t i = 0; i < segment->num_entries; ++i)
+    if (segment->entries[i].block >= segment->num_blocks)
+      return -1;
+
+  // Success
+  return 0;
+}
+
+const ArchiveSegment *find_archive_segment(uint64_t id) {
+  uint32_t low = 0;
+  uint32_t high = archive_num_segments;
+
+  // Find the last segment starting at or before the id
+  while (low < high) {
+    uint32_t mid = (low + ((high - low) / 2));
+
+    if (archive_segments[mid].first_id <= id) {
+      low = (mid + 1);
+    } else {
+      high = mid;
+    }
+  }
+
+  if (!low || (archive_segments[(low - 1)].last_id < id))
+    return NULL;
+
+  return (archive_segments + low - 1);
+}
+
+const uint8_t *load_archive_block(const ArchiveSegment *segment,
+                                  uint32_t block) {
+  ArchiveCache *cache = &archive_cache;
+  const ArchiveBlock *stored = (segment->blocks + block);
+  const uint8_t *packed = (segment->map + stored->offset);
+  uLong packed_length = stored->length;
+  uLongf raw_length = stored->raw_length;
+
+  if ((cache->serial == segment->serial) && (cache->block == block))
+    return cache->raw;
+
+  // Register the exit destructor the first time this thread reads a block
+  if (!cache->registered) {
+    pthread_once(&archive_once, archive_init);
+    pthread_setspecific(archive_cache_key, cache);
+    cache->registered = true;
+  }
+
+  cache->serial = 0;
+  if (reserve_archive_buffer((void **)&cache->raw, &cache->raw_capacity,
+                             (stored->raw_length ? stored->raw_length : 1)))
+    return NULL;
+
+  if (segment->sealed) {
+    if ((packed_length < CIPHER_OVERHEAD) ||
+        reserve_archive_buffer((void **)&cache->opened,
+                               &cache->opened_capacity, packed_length))
+      return NULL;
+
+    packed_length -= CIPHER_OVERHEAD;
+    if (cipher_open(cache->opened, NULL, 0, packed, packed_length,
+                    segment->first_id, (ARCHIVE_POSITION_FLAG | block)))
+      return NULL;
+    packed = cache->opened;
+  }
+
+  if ((uncompress(cache->raw, &raw_length, packed, packed_length) != Z_OK) ||
+      (raw_length != stored->raw_length))
+    return NULL;
+
+  cache->serial = segment->serial;
+  cache->block = block;
+  return cache->raw;
+}
+
+void archive_init(void) {
+  pthread_key_create(&archive_cache_key, archive_cache_destructor);
+}
+
+void archive_cache_destructor(void *arg) {
+  ArchiveCache *cache = (ArchiveCache *)arg;
+
+  free((void *)cache->raw);
+  free((void *)cache->opened);
+  cache->raw = NULL;
+  cache->opened = NULL;
+  cache->raw_capacity = 0;
+  cache->opened_capacity = 0;
+  cache->serial = 0;
+}
@@ -0,0 +1,154 @@
+/// @file archive.h
+///
+/// Declarations for the cold tier of the event log: immutable, compressed,
+/// indexed segment files on a local or mounted filesystem, holding ranges of
+/// old events which have been cleared from the cluster.
+///
+/// A segment packs consecutive events into blocks of about ARCHIVE_BLOCK_SIZE
+/// bytes, each compressed with zlib, and ends with an index of its blocks and
+/// events and a footer. Readers map segments and decompress one block at a
+/// time, keeping the last block per thread, so that sequential replays of old
+/// events decompress each block once. Segments are written in host byte order,
+/// as they are local to a host.
+///
+/// When encryption is enabled while a segment is written, each compressed
+/// block is sealed, and the same key must be set to read it back.
+///
+/// Documentation links:
+///   https://www.zlib.net/manual.html
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "event.h"
+
+// Target uncompressed size of a segment block in bytes
+#define ARCHIVE_BLOCK_SIZE (1024 * 1024)
+
+// File name extension of finished segments
+#define ARCHIVE_SEGMENT_SUFFIX ".seg"
+
+// Maximum length of a segment path
+#define ARCHIVE_PATH_MAX 4096
+
+//==============================================================================
+// Types
+//==============================================================================
+
+typedef struct archive_block_t {
+  uint64_t offset;     // Offset of the compressed block in the file.
+  uint32_t length;     // Length of the stored block in bytes.
+  uint32_t raw_length; // Length of the block once decompressed.
+} ArchiveBlock;
+
+typedef struct archive_entry_t {
+  uint64_t id;     // Event identifier.
+  uint64_t length; // Length of the event data in bytes.
+  uint32_t block;  // Block holding the event.
+  uint32_t offset; // Offset of the event in the decompressed block.
+} ArchiveEntry;
+
+typedef struct archive_writer_t {
+  char dir[ARCHIVE_PATH_MAX];      // Directory of the segment.
+  char tmp_path[ARCHIVE_PATH_MAX]; // Path of the segment while being written.
+  FILE *file;                      // Segment file.
+  uint64_t file_offset;            // Bytes written to the file.
+  uint8_t *raw;                    // Block being filled.
+  uint64_t raw_length;             // Bytes in the block being filled.
+  uint64_t raw_capacity;           // Capacity of the block being filled.
+  uint32_t block_events;           // Events in the block being filled.
+  uint8_t *packed;                 // Compressed (and sealed) block buffer.
+  uint64_t packed_capacity;        // Capacity of the compressed buffer.
+  ArchiveBlock *blocks;            // Index of finished blocks.
+  uint32_t num_blocks;             // Number of finished blocks.
+  uint32_t blocks_capacity;        // Capacity of the block index.
+  ArchiveEntry *entries;           // Index of events.
+  uint32_t num_entries;            // Number of events.
+  uint32_t entries_capacity;       // Capacity of the event index.
+  bool sealed;                     // Whether blocks are encrypted.
+} ArchiveWriter;
+
+//==============================================================================
+// Prototypes
+//==============================================================================
+
+/// Start writing a segment in a directory. The segment only appears under its
+/// final name once archive_writer_finish() succeeds.
+///
+/// @param[in] writer  Handle for the writer.
+/// @param[in] dir     Directory to write the segment into.
+///
+/// @return  0  Success.
+/// @return -1  Failure.
+int archive_writer_open(ArchiveWriter *writer, const char *dir);
+
+/// Add an event to a segment. Events must be added in increasing id order.
+///
+/// @param[in] writer  Handle for the writer.
+/// @param[in] event   The event.
+///
+/// @return  0  Success.
+/// @return -1  Failure.
+int archive_writer_add(ArchiveWriter *writer, const Event *event);
+
+/// Finish a segment: write its last block, index and footer, sync it, and move
+/// it to its final name. The writer is released either way.
+///
+/// @param[in] writer  Handle for the writer.
+/// @param[in] path    Pointer to the write location of the final path (of
+///                    ARCHIVE_PATH_MAX bytes), or NULL.
+///
+/// @return  0  Success.
+/// @return -1  Failure (including an empty segment).
+int archive_writer_finish(ArchiveWriter *writer, char *path);
+
+/// Abandon a segment, removing its file and releasing the writer.
+///
+/// @param[in] writer  Handle for the writer.
+void archive_writer_abort(ArchiveWriter *writer);
+
+/// Map every segment in a directory, so that reads of archived events are
+/// served from them.
+///
+/// @param[in] dir  Directory holding the segments.
+///
+/// @return  0  Success.
+/// @return -1  Failure.
+int archive_open(const char *dir);
+
+/// Map one more segment, e.g. one just written.
+///
+/// @param[in] path  Path of the segment.
+///
+/// @return  0  Success.
+/// @return -1  Failure (including a segment overlapping a mapped one).
+int archive_add_segment(const char *path);
+
+/// Unmap every segment. No reads may be in progress.
+void archive_close(void);
+
+/// Check whether any segments are mapped.
+///
+/// @return  Whether archived reads are enabled.
+bool archive_enabled(void);
+
+/// Get the last event id held by the mapped segments.
+///
+/// @param[in] id  Pointer to the write location of the event id.
+///
+/// @return  0  Success.
+/// @return  1  No segments are mapped.
+int archive_last_id(uint64_t *id);
+
+/// Read an event from the mapped segments.
+///
+/// @param[in] event  Handle for the event. The event id must be set. On
+///                   success, the data is allocated with alloc_event_data().
+///
+/// @return  0  Success.
+/// @return  1  The event isn't archived.
+/// @return -1  Failure (a damaged segment).
+int archive_read_event(Event *event);
@@ -0,0 +1,417 @@
+/// @file baseline.c
+///
+/// Definitions for the benchmark baseline store and the comparison of runs.
+
+#define _GNU_SOURCE
+
+#include <math.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/utsname.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "baseline.h"
+
+// Number of tab-separated fields in a line of the store
+#define BASELINE_NUM_FIELDS 11
+
+//==============================================================================
+// Types
+//==============================================================================
+
+typedef struct baseline_line_t {
+  uint64_t run_id;                   // Identifier of the run.
+  uint64_t fingerprint;              // Fingerprint of the environment.
+  char *fields[BASELINE_NUM_FIELDS]; // Every field, within the line.
+} BaselineLine;
+
+//==============================================================================
+// Prototypes
+//==============================================================================
+
+/// Split a line of the store into its fields, in place.
+///
+/// @param[in] text  The line, without its newline.
+/// @param[in] line  Pointer to the write location of the parsed line.
+///
+/// @return  0  Success.
+/// @return -1  Failure (the line is malformed).
+int baseline_parse_line(char *text, BaselineLine *line);
+
+/// Copy a string into a field, replacing the tabs and newlines which would
+/// break the store's lines with spaces.
+///
+/// @param[in] field  The field, of BASELINE_MAX_FIELD bytes.
+/// @param[in] value  The string.
+void baseline_copy_field(char *field, const char *value);
+
+/// Hash bytes with 64-bit FNV-1a.
+///
+/// @param[in] hash    Hash of the preceding bytes.
+/// @param[in] data    The bytes.
+/// @param[in] length  Number of bytes.
+///
+/// @return  The hash.
+uint64_t baseline_hash(uint64_t hash, const void *data, uint64_t length);
+
+/// Draw a pseudo-random number (splitmix64).
+///
+/// @param[in] state  The generator's state.
+///
+/// @return  The number.
+uint64_t baseline_random(uint64_t *state);
+
+/// Compare two doubles for qsort().
+int compare_doubles(const void *a, const void *b);
+
+//==============================================================================
+// Functions
+//==============================================================================
+
+void baseline_env_detect(BaselineEnv *env) {
+  struct utsname name;
+  char host[BASELINE_MAX_FIELD];
+  char *text = NULL;
+  size_t capacity = 0;
+  FILE *cpuinfo;
+  uint64_t hash = 14695981039346656037ULL;
+
+  memset(env, 0, sizeof(BaselineEnv));
+
+  if (!gethostname(host, BASELINE_MAX_FIELD)) {
+    host[BASELINE_MAX_FIELD - 1] = '\0';
+    baseline_copy_field(env->host, host);
+  }
+  if (!uname(&name))
+    baseline_copy_field(env->kernel, name.release);
+  baseline_copy_field(env->compiler, __VERSION__);
+  env->num_cpus = (uint32_t)sysconf(_SC_NPROCESSORS_ONLN);
+
+  // The model name is the same for every CPU, so the first is enough
+  baseline_copy_field(env->cpu, "unknown");
+  cpuinfo = fopen("/proc/cpuinfo", "r");
+  if (cpuinfo) {
+    while (getline(&text, &capacity, cpuinfo) > 0) {
+      char *value = strchr(text, ':');
+
+      if (strncmp(text, "model name", 10) || !value)
+        continue;
+
+      value += (value[1] == ' ') ? 2 : 1;
+      value[strcspn(value, "\n")] = '\0';
+      baseline_copy_field(env->cpu, value);
+      break;
+    }
+    free((void *)text);
+    fclose(cpuinfo);
+  }
+
+  hash = baseline_hash(hash, env->host, strlen(env->host) + 1);
+  hash = baseline_hash(hash, env->kernel, strlen(env->kernel) + 1);
+  hash = baseline_hash(hash, env->cpu, strlen(env->cpu) + 1);
+  hash = baseline_hash(hash, env->compiler, strlen(env->compiler) + 1);
+  hash = baseline_hash(hash, &env->num_cpus, sizeof(uint32_t));
+
+  // A fingerprint of 0 matches any environment when finding runs
+  env->fingerprint = hash ? hash : 1;
+}
+
+uint64_t baseline_new_run_id(void) {
+  struct timespec now;
+
+  clock_gettime(CLOCK_REALTIME, &now);
+
+  return (((uint64_t)now.tv_sec * 1000000) + ((uint64_t)now.tv_nsec / 1000));
+}
+
+int baseline_append(const char *path, uint64_t run_id, const BaselineEnv *env,
+                    const char *name, uint32_t trial, double throughput,
+                    double p99) {
+  FILE *store;
+  char field[BASELINE_MAX_FIELD];
+  int err;
+
+  // A NaN or infinity would poison every comparison against the run
+  if (!isfinite(throughput) || !isfinite(p99))
+    return -1;
+
+  store = fopen(path, "a");
+  if (!store)
+    return -1;
+
+  baseline_copy_field(field, name);
+
+  err = (fprintf(store,
+                 "%llu\t%016llx\t%s\t%s\t%s\t%u\t%s\t%s\t%u\t%.6f\t%.6f\n",
+                 (unsigned long long)run_id,
+                 (unsigned long long)env->fingerprint, env->host, env->kernel,
+                 env->cpu, env->num_cpus, env->compiler, field, trial,
+                 throughput, p99) < 0);
+  if (fclose(store))
+    err = 1;
+
+  // Success or failure
+  return err ? -1 : 0;
+}
+
+int baseline_find_run(const char *path, uint64_t before, uint64_t fingerprint,
+                      uint64_t *run_id) {
+  FILE *store = fopen(path, "r");
+  char *text = NULL;
+  size_t capacity = 0;
+  ssize_t length;
+  bool found = false;
+
+  if (!store)
+    return -1;
+
+  while ((length = getline(&text, &capacity, store)) > 0) {
+    BaselineLine line;
+
+    text[strcspn(text, "\n")] = '\0';
+    if (baseline_parse_line(text, &line))
+      continue;
+
+    if ((before && (line.run_id >= before)) ||
+        (fingerprint && (line.fingerprint != fingerprint)))
+      continue;
+
+    if (!found || (line.run_id > *run_id))
+      *run_id = line.run_id;
+    found = true;
+  }
+
+  free((void *)text);
+  fclose(store);
+
+  // Success
+  return found ? 0 : 1;
+}
+
+int baseline_load_run(const char *path, uint64_t run_id, BaselineRun *run) {
+  FILE *store = fopen(path, "r");
+  char *text = NULL;
+  size_t capacity = 0;
+  ssize_t length;
+
+  memset(run, 0, sizeof(BaselineRun));
+  if (!store)
+    return -1;
+
+  run->id = run_id;
+
+  while ((length = getline(&text, &capacity, store)) > 0) {
+    BaselineSeries *series;
+    BaselineLine line;
+
+    text[strcspn(text, "\n")] = '\0';
+    if (baseline_parse_line(text, &line) || (line.run_id != run_id))
+      continue;
+
+    // Every line of a run has the same environment
+    if (!run->num_series) {
+      baseline_copy_field(run->env.host, line.fields[2]);
+      baseline_copy_field(run->env.kernel, line.fields[3]);
+      baseline_copy_field(run->env.cpu, line.fields[4]);
+      run->env.num_cpus = (uint32_t)strtoul(line.fields[5], NULL, 10);
+      baseline_copy_field(run->env.compiler, line.fields[6]);
+      run->env.fingerprint = line.fingerprint;
+    }
+
+    series = (BaselineSeries *)baseline_find_series(run, line.fields[7]);
+    if (!series) {
+      BaselineSeries *grown = (BaselineSeries *)realloc(
+          run->series, (sizeof(BaselineSeries) * (run->num_series + 1)));
+
+      if (!grown)
+        goto fail;
+      run->series = grown;
+
+      series = (run->series + run->num_series);
+      memset(series, 0, sizeof(BaselineSeries));
+      strncpy(series->name, line.fields[7], (BASELINE_MAX_NAME - 1));
+      ++run->num_series;
+    }
+
+    if (series->num_trials < BASELINE_MAX_TRIALS) {
+      double throughput = strtod(line.fields[9], NULL);
+      double p99 = strtod(line.fields[10], NULL);
+
+      // Trials with a NaN or infinity are skipped, like malformed lines
+      if (!isfinite(throughput) || !isfinite(p99))
+        continue;
+
+      series->throughput[series->num_trials] = throughput;
+      series->p99[series->num_trials] = p99;
+      ++series->num_trials;
+    }
+  }
+
+  free((void *)text);
+  fclose(store);
+
+  // Success
+  return run->num_series ? 0 : 1;
+
+  // Failure
+fail:
+  free((void *)text);
+  fclose(store);
+  baseline_run_free(run);
+  return -1;
+}
+
+void baseline_run_free(BaselineRun *run) {
+  free((void *)run->series);
+  run->series = NULL;
+  run->num_series = 0;
+}
+
+const BaselineSeries *baseline_find_series(const BaselineRun *run,
+                                           const char *name) {
+  for (uint32_t i = 0; i < run->num_series; ++i) {
+    if (!strncmp(run->series[i].name, name, (BASELINE_MAX_NAME - 1)))
+      return (run->series + i);
+  }
+
+  return NULL;
+}
+
+int baseline_bootstrap_ratio(const double *base, uint32_t num_base,
+                             const double *cand, uint32_t num_cand,
+                             uint64_t seed, double *low, double *high) {
+  double *ratios;
+  double base_mean = 0.0;
+  double alpha = ((1.0 - BASELINE_CONFIDENCE) / 2);
+  uint32_t num_ratios = 0;
+
+  if (!num_base || !num_cand)
+    return -1;
+
+  for (uint32_t i = 0; i < num_base; ++i) {
+    base_mean += base[i];
+  }
+  if (base_mean <= 0.0)
+    return -1;
+
+  ratios = (double *)malloc(sizeof(double) * BASELINE_BOOTSTRAP_SAMPLES);
+  if (!ratios)
+    return -1;
+
+  // Each resample draws as many trials as were run, with replacement, from
+  // both runs
+  for (uint32_t s = 0; s < BASELINE_BOOTSTRAP_SAMPLES; ++s) {
+    double base_sum = 0.0;
+    double cand_sum = 0.0;
+
+    for (uint32_t i = 0; i < num_base; ++i) {
+      base_sum += base[baseline_random(&seed) % num_base];
+    }
+    for (uint32_t i = 0; i < num_cand; ++i) {
+      cand_sum += cand[baseline_random(&seed) % num_cand];
+    }
+
+    if (base_sum > 0.0)
+      ratios[num_ratios++] = ((cand_sum / num_cand) / (base_sum / num_base));
+  }
+
+  qsort(ratios, num_ratios, sizeof(double), compare_doubles);
+  *low = ratios[(uint32_t)(alpha * (num_ratios - 1))];
+  *high = ratios[(uint32_t)((1.0 - alpha) * (num_ratios - 1))];
+  free((void *)ratios);
+
+  // Success
+  return 0;
+}
+
+int baseline_compare(const BaselineSeries *base, const BaselineSeries *cand,
+                     double threshold, BaselineVerdict *verdict) {
+  uint64_t seed = baseline_hash(14695981039346656037ULL, base->name,
+                                strlen(base->name));
+
+  // Resampling is seeded by the benchmark's name, so verdicts are repeatable
+  if (baseline_bootstrap_ratio(base->throughput, base->num_trials,
+                               cand->throughput, cand->num_trials, seed,
+                               &verdict->throughput_low,
+                               &verdict->throughput_high))
+    return -1;
+
+  // Runs without any batch times have no p99 to compare
+  if (baseline_bootstrap_ratio(base->p99, base->num_trials, cand->p99,
+                               cand->num_trials, seed, &verdict->p99_low,
+                               &verdict->p99_high)) {
+    verdict->p99_low = 1.0;
+    verdict->p99_high = 1.0;
+  }
+
+  verdict->regressed = ((verdict->throughput_high < (1.0 - threshold)) ||
+                        (verdict->p99_low > (1.0 + threshold)));
+
+  // Success
+  return 0;
+}
+
+int baseline_parse_line(char *text, BaselineLine *line) {
+  char *end;
+
+  for (uint32_t i = 0; i < BASELINE_NUM_FIELDS; ++i) {
+    line->fields[i] = text;
+    text = strchr(text, '\t');
+
+    // The last field ends the line, and every other ends at a tab
+    if ((i == (BASELINE_NUM_FIELDS - 1)) != !text)
+      return -1;
+    if (text)
+      *text++ = '\0';
+  }
+
+  line->run_id = strtoull(line->fields[0], &end, 10);
+  if (*end || (end == line->fields[0]))
+    return -1;
+  line->fingerprint = strtoull(line->fields[1], &end, 16);
+  if (*end || (end == line->fields[1]))
+    return -1;
+
+  // Success
+  return 0;
+}
+
+void baseline_copy_field(char *field, const char *value) {
+  uint32_t i;
+
+  for (i = 0; value[i] && (i < (BASELINE_MAX_FIELD - 1)); ++i) {
+    field[i] = ((value[i] == '\t') || (value[i] == '\n')) ? ' ' : value[i];
+  }
+  field[i] = '\0';
+}
+
+uint64_t baseline_hash(uint64_t hash, const void *data, uint64_t length) {
+  const uint8_t *bytes = (const uint8_t *)data;
+
+  for (uint64_t i = 0; i < length; ++i) {
+    hash ^= bytes[i];
+    hash *= 1099511628211ULL;
+  }
+
+  return hash;
+}
+
+uint64_t baseline_random(uint64_t *state) {
+  uint64_t z = (*state += 0x9E3779B97F4A7C15ULL);
+
+  z = ((z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL);
+  z = ((z ^ (z >> 27)) * 0x94D049BB133111EBULL);
+
+  return (z ^ (z >> 31));
+}
+
+int compare_doubles(const void *a, const void *b) {
+  double x = *(const double *)a;
+  double y = *(const double *)b;
+
+  return (x > y) - (x < y);
+}
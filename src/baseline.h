@@ -0,0 +1,171 @@
+/// @file baseline.h
+///
+/// Declarations for the benchmark baseline store, and for the statistical
+/// comparison of two benchmark runs.
+///
+/// The store is a local text file which benchmarks append one line to per
+/// trial, tab-separated: the run id, the fingerprint of the environment and
+/// the fields it hashes, the name of the benchmark, the trial number, the
+/// throughput in events per second, and the p99 batch time in ms. Runs are
+/// compared one benchmark at a time, by bootstrap confidence intervals of the
+/// ratio of the candidate's mean to the baseline's, so that a regression is
+/// only reported when the trials show it with confidence.
+///
+/// Documentation links:
+///   https://en.wikipedia.org/wiki/Bootstrapping_(statistics)
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Maximum lengths of a benchmark name and of the environment fields
+#define BASELINE_MAX_NAME 96
+#define BASELINE_MAX_FIELD 128
+
+// Maximum number of trials of one benchmark in a run
+#define BASELINE_MAX_TRIALS 64
+
+// Resamples drawn for each confidence interval, and its confidence level
+#define BASELINE_BOOTSTRAP_SAMPLES 2000
+#define BASELINE_CONFIDENCE 0.95
+
+// Relative change reported as a regression by default
+#define BASELINE_DEFAULT_THRESHOLD 0.05
+
+//==============================================================================
+// Types
+//==============================================================================
+
+typedef struct baseline_env_t {
+  char host[BASELINE_MAX_FIELD];     // Host name.
+  char kernel[BASELINE_MAX_FIELD];   // Kernel release.
+  char cpu[BASELINE_MAX_FIELD];      // CPU model.
+  char compiler[BASELINE_MAX_FIELD]; // Compiler version of the benchmark.
+  uint32_t num_cpus;                 // Number of online CPUs.
+  uint64_t fingerprint;              // Hash of the fields above.
+} BaselineEnv;
+
+typedef struct baseline_series_t {
+  char name[BASELINE_MAX_NAME];           // Name of the benchmark.
+  uint32_t num_trials;                    // Number of trials.
+  double throughput[BASELINE_MAX_TRIALS]; // Events per second of each trial.
+  double p99[BASELINE_MAX_TRIALS];        // p99 batch ms of each trial.
+} BaselineSeries;
+
+typedef struct baseline_run_t {
+  uint64_t id;            // Identifier of the run (its start time in us).
+  BaselineEnv env;        // Environment the run was measured in.
+  BaselineSeries *series; // Trials of each benchmark.
+  uint32_t num_series;    // Number of benchmarks.
+} BaselineRun;
+
+typedef struct baseline_verdict_t {
+  double throughput_low;  // Confidence interval of the throughput ratio.
+  double throughput_high;
+  double p99_low;         // Confidence interval of the p99 ratio.
+  double p99_high;
+  bool regressed;         // Whether either regressed beyond the threshold.
+} BaselineVerdict;
+
+//==============================================================================
+// Prototypes
+//==============================================================================
+
+/// Describe the environment the process runs in, and fingerprint it.
+///
+/// @param[in] env  Pointer to the write location of the environment.
+void baseline_env_detect(BaselineEnv *env);
+
+/// Identify a new run by its start time, so that later runs sort after.
+///
+/// @return  The run id, in microseconds since the epoch.
+uint64_t baseline_new_run_id(void);
+
+/// Append the result of one trial to a store, creating it if needed.
+///
+/// @param[in] path        Path of the store.
+/// @param[in] run_id      Identifier of the run.
+/// @param[in] env         Environment of the run.
+/// @param[in] name        Name of the benchmark.
+/// @param[in] trial       Number of the trial.
+/// @param[in] throughput  Events per second.
+/// @param[in] p99         p99 batch time in ms.
+///
+/// @return  0  Success.
+/// @return -1  Failure (including a throughput or p99 which isn't finite).
+int baseline_append(const char *path, uint64_t run_id, const BaselineEnv *env,
+                    const char *name, uint32_t trial, double throughput,
+                    double p99);
+
+/// Find a run in a store.
+///
+/// @param[in] path         Path of the store.
+/// @param[in] before       Only runs before this id are found, or 0 for any.
+/// @param[in] fingerprint  Only runs in this environment are found, or 0 for
+///                         any.
+/// @param[in] run_id       Pointer to the write location of the latest such
+///                         run's id.
+///
+/// @return  0  Success.
+/// @return  1  No such run is stored.
+/// @return -1  Failure.
+int baseline_find_run(const char *path, uint64_t before, uint64_t fingerprint,
+                      uint64_t *run_id);
+
+/// Load the trials of a run from a store, skipping malformed lines and trials
+/// whose results aren't finite.
+///
+/// @param[in] path    Path of the store.
+/// @param[in] run_id  Identifier of the run.
+/// @param[in] run     Pointer to the write location of the run.
+///
+/// @return  0  Success.
+/// @return  1  The run isn't stored.
+/// @return -1  Failure.
+int baseline_load_run(const char *path, uint64_t run_id, BaselineRun *run);
+
+/// Release the memory of a loaded run.
+///
+/// @param[in] run  Handle for the run.
+void baseline_run_free(BaselineRun *run);
+
+/// Find a benchmark in a loaded run.
+///
+/// @param[in] run   Handle for the run.
+/// @param[in] name  Name of the benchmark.
+///
+/// @return  The benchmark's trials, or NULL if it wasn't run.
+const BaselineSeries *baseline_find_series(const BaselineRun *run,
+                                           const char *name);
+
+/// Compute a bootstrap confidence interval of the ratio of the mean of the
+/// candidate samples to the mean of the baseline samples.
+///
+/// @param[in] base       Baseline samples.
+/// @param[in] num_base   Number of baseline samples.
+/// @param[in] cand       Candidate samples.
+/// @param[in] num_cand   Number of candidate samples.
+/// @param[in] seed       Seed of the resampling.
+/// @param[in] low        Pointer to the write location of the lower bound.
+/// @param[in] high       Pointer to the write location of the upper bound.
+///
+/// @return  0  Success.
+/// @return -1  Failure (no samples, or a baseline mean of 0).
+int baseline_bootstrap_ratio(const double *base, uint32_t num_base,
+                             const double *cand, uint32_t num_cand,
+                             uint64_t seed, double *low, double *high);
+
+/// Compare a candidate's trials of a benchmark against the baseline's. The
+/// candidate regressed if its throughput is lower, or its p99 higher, by more
+/// than the threshold across the whole confidence interval.
+///
+/// @param[in] base       Baseline trials.
+/// @param[in] cand       Candidate trials.
+/// @param[in] threshold  Relative change tolerated (e.g. 0.05).
+/// @param[in] verdict    Pointer to the write location of the verdict.
+///
+/// @return  0  Success.
+/// @return -1  Failure.
+int baseline_compare(const BaselineSeries *base, const BaselineSeries *cand,
+                     double threshold, BaselineVerdict *verdict);
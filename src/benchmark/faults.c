@@ -0,0 +1,384 @@
+/// @file faults.c
+///
+/// Fault-injection benchmark for Seguro. Writes and reads back mock events,
+/// first without faults and then with retryable errors and latency spikes
+/// injected at the configured rates, and reports how much throughput, retries
+/// and latency the faults cost.
+///
+/// Documentation links:
+///   https://www.gnu.org/software/libc/manual/html_node/Using-Getopt.html
+///   https://linux.die.net/man/3/getopt_long
+///   https://apple.github.io/foundationdb/api-error-codes.html
+
+#include <foundationdb/fdb_c.h>
+#include <getopt.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../constants.h"
+#include "../event.h"
+#include "../event_batch.h"
+#include "../fdb.h"
+#include "../fdb_faults.h"
+#include "../fdb_slow_log.h"
+#include "../fdb_timer.h"
+#include "../metrics.h"
+
+// Events written per call, and so per latency sample, by the write phase
+#define FAULT_BENCH_WRITE_CALL 10
+
+//==============================================================================
+// Types
+//==============================================================================
+
+typedef struct phase_result_t {
+  uint32_t num_ok;          // Events written or read back.
+  uint32_t num_failed;      // Events which failed.
+  uint64_t num_bytes;       // Event data bytes written or read back.
+  uint64_t retries;         // Transactions retried.
+  double t_wall;            // Wall-clock time of the phase in ms.
+  BatchHistogram latencies; // Time of each call in ms.
+} PhaseResult;
+
+//==============================================================================
+// Variables
+//==============================================================================
+
+// Mock events, and the faults injected into the second run
+static uint32_t num_events = 1000;
+static uint32_t event_size = 1000;
+static FaultConfig faults = {.not_committed = 0.01,
+                             .unknown_result = 0.005,
+                             .too_old = 0.005,
+                             .spike_rate = 0.01,
+                             .spike_ms = 50.0,
+                             .seed = 1};
+
+// Retry policy of every run, FoundationDB's defaults unless set
+static int64_t retry_limit = -1;
+static int64_t max_delay_ms = 1000;
+
+//==============================================================================
+// Prototypes
+//==============================================================================
+
+/// Write the events in calls of FAULT_BENCH_WRITE_CALL, and time each call.
+///
+/// @param[in] events  Array of events to write.
+/// @param[in] result  Pointer to the write location of the results.
+void write_phase(Event *events, PhaseResult *result);
+
+/// Read the events back one at a time, and time each read.
+///
+/// @param[in] events  Array of the events written.
+/// @param[in] result  Pointer to the write location of the results.
+void read_phase(const Event *events, PhaseResult *result);
+
+/// Print the results of a phase.
+///
+/// @param[in] name    Name of the phase.
+/// @param[in] result  The results of the phase.
+void print_phase(const char *name, const PhaseResult *result);
+
+/// Print how much worse a phase did with faults than without.
+///
+/// @param[in] name    Name of the phase.
+/// @param[in] clean   The results without faults.
+/// @param[in] faulty  The results with faults.
+void print_inflation(const char *name, const PhaseResult *clean,
+                     const PhaseResult *faulty);
+
+/// Parse command-line options. Exits on invalid options.
+///
+/// @param[in] argc  Number of command-line options provided.
+/// @param[in] argv  Array of command-line options provided.
+void parse_options(int argc, char **argv);
+
+/// Parse a percentage into a share. Exits on an invalid percentage.
+///
+/// @param[in] str  The string to parse.
+///
+/// @return  The share, between 0 and 1.
+double parse_share(const char *str);
+
+/// Print that a fatal error occurred and exit.
+void fatal_error(void);
+
+//==============================================================================
+// Functions
+//==============================================================================
+
+/// Execute the Seguro fault-injection benchmark.
+///
+/// @param[in] argc  Number of command-line options provided.
+/// @param[in] argv  Array of command-line options provided.
+///
+/// @return  0  Success
+/// @return -1  Failure (error occurred)
+int main(int argc, char **argv) {
+  PhaseResult clean[2], faulty[2];
+  Event *events;
+
+  parse_options(argc, argv);
+
+  // Initialize FoundationDB database
+  fdb_init_database();
+  fdb_init_network_thread();
+  if (fdb_set_retry_policy(retry_limit, max_delay_ms))
+    fatal_error();
+
+  // Generate mock events
+  srand(time(0));
+  events = (Event *)malloc(sizeof(Event) * num_events);
+  if (!events)
+    fatal_error();
+  for (uint32_t i = 0; i < num_events; ++i) {
+    uint8_t *data = (uint8_t *)alloc_event_data(event_size);
+
+    for (uint32_t j = 0; j < event_size; ++j) {
+      data[j] = rand() % 256;
+    }
+    events[i].id = i;
+    events[i].data_length = event_size;
+    events[i].data = data;
+  }
+
+  printf("    events  %u\n", num_events);
+  printf("event size  %u bytes\n", event_size);
+  printf("     fault  not_committed %.2f%%, commit_unknown_result %.2f%%, "
+         "transaction_too_old %.2f%%, spikes %.2f%% of %.1f ms\n",
+         (faults.not_committed * 100.0), (faults.unknown_result * 100.0),
+         (faults.too_old * 100.0), (faults.spike_rate * 100.0),
+         faults.spike_ms);
+
+  // The same events are written and read without and then with faults, and
+  // cleared in between without any
+  for (uint32_t run = 0; run < 2; ++run) {
+    PhaseResult *results = run ? faulty : clean;
+
+    printf("\n       run  %s\n", (run ? "with faults" : "without faults"));
+    if (run && fdb_set_faults(&faults))
+      fatal_error();
+
+    write_phase(events, results);
+    print_phase("write", results);
+    read_phase(events, (results + 1));
+    print_phase("read", (results + 1));
+
+    if (fdb_set_faults(NULL) || fdb_clear_database())
+      fatal_error();
+  }
+
+  printf("\n       run  inflation with faults\n");
+  print_inflation("write", clean, faulty);
+  print_inflation("read", (clean + 1), (faulty + 1));
+
+  // Release event data
+  for (uint32_t i = 0; i < num_events; ++i) {
+    free_event(events + i);
+  }
+  free((void *)events);
+
+  // Clean up FoundationDB database
+  fdb_shutdown_network_thread();
+  fdb_shutdown_database();
+
+  // Success
+  return 0;
+}
+
+void write_phase(Event *events, PhaseResult *result) {
+  double t_start = slow_log_time_ms();
+
+  memset(result, 0, sizeof(PhaseResult));
+  batch_histogram_reset(&result->latencies);
+  metrics_reset();
+
+  for (uint32_t i = 0; i < num_events; i += FAULT_BENCH_WRITE_CALL) {
+    uint32_t n = ((num_events - i) < FAULT_BENCH_WRITE_CALL)
+                     ? (num_events - i)
+                     : FAULT_BENCH_WRITE_CALL;
+    double t_call = slow_log_time_ms();
+
+    // Failed writes are counted, not fatal: goodput only counts the rest
+    if (fdb_write_event_array((events + i), n)) {
+      result->num_failed += n;
+      continue;
+    }
+
+    batch_histogram_add(&result->latencies, (slow_log_time_ms() - t_call));
+    result->num_ok += n;
+    for (uint32_t j = 0; j < n; ++j) {
+      result->num_bytes += events[i + j].data_length;
+    }
+  }
+
+  result->t_wall = (slow_log_time_ms() - t_start);
+  result->retries = metrics_get(METRIC_WRITE_RETRIES);
+}
+
+void read_phase(const Event *events, PhaseResult *result) {
+  double t_start = slow_log_time_ms();
+
+  memset(result, 0, sizeof(PhaseResult));
+  batch_histogram_reset(&result->latencies);
+  metrics_reset();
+
+  for (uint32_t i = 0; i < num_events; ++i) {
+    Event read = {events[i].id, 0, NULL};
+    double t_call = slow_log_time_ms();
+
+    if (fdb_read_event(&read)) {
+      ++result->num_failed;
+      continue;
+    }
+
+    batch_histogram_add(&result->latencies, (slow_log_time_ms() - t_call));
+    ++result->num_ok;
+    result->num_bytes += read.data_length;
+    free_event(&read);
+  }
+
+  result->t_wall = (slow_log_time_ms() - t_start);
+
+  // Expired reads carry on in a fresh transaction, and others back off
+  result->retries = (metrics_get(METRIC_READ_ROLLOVERS) +
+                     metrics_get(METRIC_READ_RETRIES));
+}
+
+void print_phase(const char *name, const PhaseResult *result) {
+  double seconds = (result->t_wall / 1000.0);
+
+  printf("     phase  %s\n", name);
+  printf("   goodput  %12.1f events/s  %10.2f MB/s\n",
+         (result->num_ok / seconds),
+         ((result->num_bytes / (1024.0 * 1024.0)) / seconds));
+  printf("    failed  %12u events\n", result->num_failed);
+  printf("   retries  %12llu  %10.3f /event\n",
+         (unsigned long long)result->retries,
+         (result->num_ok ? ((double)result->retries / result->num_ok) : 0.0));
+  printf("  p50 call  %12f ms\n",
+         batch_histogram_percentile(&result->latencies, 50));
+  printf("  p99 call  %12f ms\n",
+         batch_histogram_percentile(&result->latencies, 99));
+  printf("  max call  %12f ms\n", result->latencies.t_max);
+}
+
+void print_inflation(const char *name, const PhaseResult *clean,
+                     const PhaseResult *faulty) {
+  double clean_rate = (clean->num_ok / clean->t_wall);
+  double faulty_rate = (faulty->num_ok / faulty->t_wall);
+  double clean_p50 = batch_histogram_percentile(&clean->latencies, 50);
+  double clean_p99 = batch_histogram_percentile(&clean->latencies, 99);
+
+  printf("     phase  %s\n", name);
+  printf("   goodput  %12.3f x\n",
+         ((clean_rate > 0) ? (faulty_rate / clean_rate) : 0.0));
+  printf("  p50 call  %12.3f x\n",
+         ((clean_p50 > 0)
+              ? (batch_histogram_percentile(&faulty->latencies, 50) / clean_p50)
+              : 0.0));
+  printf("  p99 call  %12.3f x\n",
+         ((clean_p99 > 0)
+              ? (batch_histogram_percentile(&faulty->latencies, 99) / clean_p99)
+              : 0.0));
+}
+
+void parse_options(int argc, char **argv) {
+  int opt;
+
+  static struct option long_options[] = {
+      {"events", required_argument, 0, 'n'},
+      {"size", required_argument, 0, 's'},
+      {"not-committed", required_argument, 0, 'c'},
+      {"unknown-result", required_argument, 0, 'u'},
+      {"too-old", required_argument, 0, 'o'},
+      {"spike-rate", required_argument, 0, 'p'},
+      {"spike-ms", required_argument, 0, 'm'},
+      {"seed", required_argument, 0, 'e'},
+      {"retry-limit", required_argument, 0, 'r'},
+      {"max-delay", required_argument, 0, 'd'},
+      {0, 0, 0, 0},
+  };
+
+  while ((opt = getopt_long(argc, argv, "n:s:c:u:o:p:m:e:r:d:", long_options,
+                            NULL)) != -1) {
+    switch (opt) {
+    case 'n':
+      num_events = (uint32_t)strtoul(optarg, NULL, 10);
+      if (!num_events)
+        goto usage;
+      break;
+    case 's':
+      event_size = (uint32_t)strtoul(optarg, NULL, 10);
+      if (!event_size)
+        goto usage;
+      break;
+    case 'c':
+      faults.not_committed = parse_share(optarg);
+      break;
+    case 'u':
+      faults.unknown_result = parse_share(optarg);
+      break;
+    case 'o':
+      faults.too_old = parse_share(optarg);
+      break;
+    case 'p':
+      faults.spike_rate = parse_share(optarg);
+      break;
+    case 'm':
+      faults.spike_ms = atof(optarg);
+      break;
+    case 'e':
+      faults.seed = strtoull(optarg, NULL, 10);
+      break;
+    case 'r':
+      retry_limit = strtoll(optarg, NULL, 10);
+      break;
+    case 'd':
+      max_delay_ms = strtoll(optarg, NULL, 10);
+      if (max_delay_ms < 0)
+        goto usage;
+      break;
+    default:
+      goto usage;
+    }
+  }
+
+  // Check the faults before spending time on the run without them
+  if (fdb_set_faults(&faults) || fdb_set_faults(NULL)) {
+    fprintf(stderr, "Commit faults add up to more than 100%%, or the spike "
+                    "length is negative\n");
+    exit(1);
+  }
+
+  return;
+
+usage:
+  fprintf(stderr,
+          "usage: %s [--events N] [--size BYTES] [--not-committed PCT] "
+          "[--unknown-result PCT] [--too-old PCT] [--spike-rate PCT] "
+          "[--spike-ms MS] [--seed N] [--retry-limit N] [--max-delay MS]\n",
+          argv[0]);
+  exit(1);
+}
+
+double parse_share(const char *str) {
+  double share = (atof(str) / 100.0);
+
+  if ((share < 0.0) || (share > 1.0)) {
+    fprintf(stderr, "Invalid percentage: %s\n", str);
+    exit(1);
+  }
+
+  return share;
+}
+
+void fatal_error(void) {
+  fprintf(stderr, "Fatal error during benchmarks\n");
+  exit(1);
+}
@@ -8,18 +8,34 @@
 ///   https://apple.github.io/foundationdb/benchmarking.html
 
 #include <foundationdb/fdb_c.h>
+#include <getopt.h>
 #include <limits.h>
 #include <math.h>
+#include <openssl/rand.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <time.h>
 
+#include "../baseline.h"
+#include "../cipher.h"
 #include "../constants.h"
 #include "../event.h"
 #include "../fdb.h"
+#include "../fdb_slow_log.h"
 #include "../fdb_timer.h"
+#include "../perf_counters.h"
+#include "../placement.h"
+#include "../slab.h"
+
+// Transactions slower than this are recorded in the slow-operation log
+#define SLOW_OP_THRESHOLD_MS 2.0
+// Fraction of transactions recorded in the slow-operation log regardless of
+// latency
+#define SLOW_OP_SAMPLE_RATE 0.001
+// Number of slow-operation records kept per benchmark run
+#define SLOW_OP_CAPACITY 8
 
 //==============================================================================
 // Types
@@ -30,6 +46,20 @@ typedef struct data_config_t {
   uint32_t event_size;
 } DataConfig;
 
+//==============================================================================
+// Variables
+//==============================================================================
+
+// Counters of the process's threads, if any could be opened
+static PerfCounters perf_counters;
+static bool perf_counting = false;
+
+// Trials of each benchmark, and the store their results are appended to
+static uint32_t num_trials = 1;
+static const char *baseline_path = NULL;
+static BaselineEnv baseline_env;
+static uint64_t baseline_run_id;
+
 //==============================================================================
 // Prototypes
 //==============================================================================
@@ -55,8 +85,10 @@ void run_write_benchmark_async(DataConfig config);
 /// @param[in] num_events   Number of events in array.
 /// @param[in] num_frags    Number of fragments per event.
 /// @param[in] batch_size   Batch size of writes per FoundationDB transaction.
-void timed_array_write(FragmentedEvent *events, uint32_t num_events,
-                       uint32_t num_frags, uint32_t batch_size);
+///
+/// @return  Wall-clock time of the write in ms.
+double timed_array_write(FragmentedEvent *events, uint32_t num_events,
+                         uint32_t num_frags, uint32_t batch_size);
 
 /// Write an array of events to a FoundationDB cluster and time the process.
 ///
@@ -66,8 +98,20 @@ void timed_array_write(FragmentedEvent *events, uint32_t num_events,
 /// @param[in] num_events   Number of events in array.
 /// @param[in] num_frags    Number of fragments per event.
 /// @param[in] batch_size   Batch size of writes per FoundationDB transaction.
-void timed_array_write_async(FragmentedEvent *events, uint32_t num_events,
-                             uint32_t num_frags, uint32_t batch_size);
+///
+/// @return  Wall-clock time of the write in ms.
+double timed_array_write_async(FragmentedEvent *events, uint32_t num_events,
+                               uint32_t num_frags, uint32_t batch_size);
+
+/// Append the result of a trial to the baseline store, if one was given.
+///
+/// @param[in] method      Name of the write method.
+/// @param[in] config      Configuration settings of the benchmark.
+/// @param[in] batch_size  Batch size of the benchmark.
+/// @param[in] trial       Number of the trial.
+/// @param[in] t_wall      Wall-clock time of the trial in ms.
+void record_trial(const char *method, DataConfig config, uint32_t batch_size,
+                  uint32_t trial, double t_wall);
 
 /// Generate an array of mock events and fragment them.
 ///
@@ -78,6 +122,17 @@ void timed_array_write_async(FragmentedEvent *events, uint32_t num_events,
 void load_mock_events(Event **events, FragmentedEvent **f_events,
                       uint32_t num_events, uint32_t size);
 
+/// Start counting a benchmark phase.
+void begin_phase(void);
+
+/// Stop counting a benchmark phase, and print its counts.
+///
+/// @param[in] phase       Name of the phase.
+/// @param[in] events      Array of the events processed by the phase.
+/// @param[in] num_events  Number of events in the array.
+void end_phase(const char *phase, FragmentedEvent *events,
+               uint32_t num_events);
+
 /// Releases memory allocated for mock events.
 ///
 /// @param[in] events       Array of raw events to free.
@@ -86,6 +141,12 @@ void load_mock_events(Event **events, FragmentedEvent **f_events,
 void release_events_memory(Event *events, FragmentedEvent *f_events,
                            uint32_t num_events);
 
+/// Parse command-line options. Exits on invalid options.
+///
+/// @param[in] argc  Number of command-line options provided.
+/// @param[in] argv  Array of command-line options provided.
+void parse_options(int argc, char **argv);
+
 /// Print that a fatal error occurred and exit.
 void fatal_error(void);
 
@@ -109,13 +170,39 @@ uint32_t parse_pos_int(char const *str);
 /// @return  0  Success
 /// @return -1  Failure (error occurred)
 int main(int argc, char **argv) {
+  // Configure thread placement before any threads are created
+  parse_options(argc, argv);
+
+  if (baseline_path) {
+    baseline_run_id = baseline_new_run_id();
+    baseline_env_detect(&baseline_env);
+    printf("  baseline  run %llu, environment %016llx\n",
+           (unsigned long long)baseline_run_id,
+           (unsigned long long)baseline_env.fingerprint);
+  }
+
   // Initialize FoundationDB database
   fdb_init_database();
   fdb_init_network_thread();
 
+  // The benchmark thread builds transactions, and first touches the mock event
+  // data, so pinning it also places the event data on its NUMA node
+  if (placement_apply(THREAD_ROLE_WORKER))
+    fatal_error();
+
+  // Record outlier transactions, so that max batch times can be explained
+  fdb_slow_log_configure(SLOW_OP_THRESHOLD_MS, SLOW_OP_SAMPLE_RATE,
+                         SLOW_OP_CAPACITY);
+
+  // Count the network thread's work too, so counters are opened once it runs
+  perf_counting = !perf_counters_open(&perf_counters);
+
   // Run benchmarks
   run_benchmarks();
 
+  if (perf_counting)
+    perf_counters_close(&perf_counters);
+
   // Clean up FoundationDB database
   fdb_shutdown_network_thread();
   fdb_shutdown_database();
@@ -163,13 +250,21 @@ void run_write_benchmark(DataConfig config) {
 
   // Array batch writes for each batch size
   for (uint8_t i = 0; i < num_bs; ++i) {
-    printf("\n");
-    printf("    events  %u\n", num_events);
-    printf("event size  %u bytes\n", event_size);
-    printf("batch size  %u\n", batch_sizes[i]);
-    printf(" fragments  %u\n", num_fragments);
-    printf("    method  synchronous\n");
-    timed_array_write(events, num_events, num_fragments, batch_sizes[i]);
+    for (uint32_t t = 0; t < num_trials; ++t) {
+      double t_wall;
+
+      printf("\n");
+      printf("    events  %u\n", num_events);
+      printf("event size  %u bytes\n", event_size);
+      printf("batch size  %u\n", batch_sizes[i]);
+      printf(" fragments  %u\n", num_fragments);
+      printf("    method  synchronous\n");
+      if (num_trials > 1)
+        printf("     trial  %u of %u\n", (t + 1), num_trials);
+      t_wall = timed_array_write(events, num_events, num_fragments,
+                                 batch_sizes[i]);
+      record_trial("synchronous", config, batch_sizes[i], t, t_wall);
+    }
   }
 
   // Clean up heap
@@ -196,64 +291,108 @@ void run_write_benchmark_async(DataConfig config) {
 
   // Array batch writes for each batch size
   for (uint8_t i = 0; i < num_bs; ++i) {
-    printf("\n");
-    printf("    events  %u\n", num_events);
-    printf("event size  %u bytes\n", event_size);
-    printf("batch size  %u\n", batch_sizes[i]);
-    printf(" fragments  %u\n", num_fragments);
-    printf("    method  asynchronous\n");
-    timed_array_write_async(events, num_events, num_fragments, batch_sizes[i]);
+    for (uint32_t t = 0; t < num_trials; ++t) {
+      double t_wall;
+
+      printf("\n");
+      printf("    events  %u\n", num_events);
+      printf("event size  %u bytes\n", event_size);
+      printf("batch size  %u\n", batch_sizes[i]);
+      printf(" fragments  %u\n", num_fragments);
+      printf("    method  asynchronous\n");
+      if (num_trials > 1)
+        printf("     trial  %u of %u\n", (t + 1), num_trials);
+      t_wall = timed_array_write_async(events, num_events, num_fragments,
+                                       batch_sizes[i]);
+      record_trial("asynchronous", config, batch_sizes[i], t, t_wall);
+    }
   }
 
   // Clean up heap
   release_events_memory(raw_events, events, num_events);
 }
 
-void timed_array_write(FragmentedEvent *events, uint32_t num_events,
-                       uint32_t num_frags, uint32_t batch_size) {
+double timed_array_write(FragmentedEvent *events, uint32_t num_events,
+                         uint32_t num_frags, uint32_t batch_size) {
   clock_t c_start, c_end;
+  double t_start, t_wall;
 
   fdb_set_batch_size(batch_size);
 
   // Write array of events in batches
+  begin_phase();
   c_start = clock();
+  t_start = slow_log_time_ms();
   int error = fdb_timed_write_event_array(events, num_events);
   if (error)
     fatal_error();
 
+  t_wall = (slow_log_time_ms() - t_start);
   c_end = clock();
 
   // Print timing results
   printf("  cpu time  %12f ms\n",
          (((double)(c_end - c_start)) / CLOCKS_PER_SEC) * 1000.0);
+  end_phase("write", events, num_events);
 
   // Clean up the FoundationDB cluster
   if (fdb_clear_timed_database(num_events, num_frags))
     fatal_error();
+
+  // Print the slowest and sampled transactions of the run
+  fdb_slow_log_print(stdout);
+  fdb_slow_log_reset();
+
+  return t_wall;
 }
 
-void timed_array_write_async(FragmentedEvent *events, uint32_t num_events,
-                             uint32_t num_frags, uint32_t batch_size) {
+double timed_array_write_async(FragmentedEvent *events, uint32_t num_events,
+                               uint32_t num_frags, uint32_t batch_size) {
   clock_t c_start, c_end;
+  double t_start, t_wall;
 
   fdb_set_batch_size(batch_size);
 
   // Write array of events in batches, and print a bar as a visual indicator of
   // progress
+  begin_phase();
   c_start = clock();
+  t_start = slow_log_time_ms();
   int error = fdb_timed_write_event_array_async(events, num_events);
   if (error)
     fatal_error();
 
+  t_wall = (slow_log_time_ms() - t_start);
   c_end = clock();
 
   // Print timing results
   printf("  cpu time  %12f ms\n",
          (((double)(c_end - c_start)) / CLOCKS_PER_SEC) * 1000.0);
+  end_phase("write", events, num_events);
 
   // Clean up the FoundationDB cluster
   if (fdb_clear_timed_database_async(num_events, num_frags))
     fatal_error();
+
+  return t_wall;
+}
+
+void record_trial(const char *method, DataConfig config, uint32_t batch_size,
+                  uint32_t trial, double t_wall) {
+  char name[BASELINE_MAX_NAME];
+  double throughput;
+  double p99 = batch_histogram_percentile(fdb_timer_batches(), 99);
+
+  if (!baseline_path)
+    return;
+
+  snprintf(name, BASELINE_MAX_NAME, "%s events=%u size=%u batch=%u", method,
+           config.num_events, config.event_size, batch_size);
+  throughput = ((t_wall > 0) ? (config.num_events / (t_wall / 1000.0)) : 0.0);
+
+  if (baseline_append(baseline_path, baseline_run_id, &baseline_env, name,
+                      trial, throughput, p99))
+    fatal_error();
 }
 
 void load_mock_events(Event **events, FragmentedEvent **f_events,
@@ -267,7 +406,7 @@ void load_mock_events(Event **events, FragmentedEvent **f_events,
   // Write random key/values into the given array.
   for (uint32_t i = 0; i < num_events; ++i) {
     // Generate random byte data
-    uint8_t *data = (uint8_t *)malloc(sizeof(uint8_t) * size);
+    uint8_t *data = (uint8_t *)alloc_event_data(sizeof(uint8_t) * size);
     for (uint64_t j = 0; j < size; ++j) {
       data[j] = rand() % 256;
     }
@@ -280,9 +419,11 @@ void load_mock_events(Event **events, FragmentedEvent **f_events,
 
   // Fragment events
   *f_events = (FragmentedEvent *)malloc(sizeof(FragmentedEvent) * num_events);
+  begin_phase();
   for (uint32_t i = 0; i < num_events; ++i) {
     fragment_event((*events + i), (*f_events + i));
   }
+  end_phase("fragment", *f_events, num_events);
 }
 
 void load_lmdb_events(Event **events, FragmentedEvent **f_events,
@@ -299,6 +440,31 @@ void load_lmdb_events(Event **events, FragmentedEvent **f_events,
   }
 }
 
+void begin_phase(void) {
+  if (perf_counting)
+    perf_counters_start(&perf_counters);
+}
+
+void end_phase(const char *phase, FragmentedEvent *events,
+               uint32_t num_events) {
+  uint64_t num_bytes = 0;
+
+  if (!perf_counting)
+    return;
+
+  perf_counters_stop(&perf_counters);
+
+  // The first fragment holds the remainder, and the rest are full
+  for (uint32_t i = 0; i < num_events; ++i) {
+    num_bytes += (events[i].payload_length +
+                  ((uint64_t)(events[i].num_fragments - 1) *
+                   OPTIMAL_VALUE_SIZE));
+  }
+
+  printf("     phase  %s\n", phase);
+  perf_counters_print(&perf_counters, stdout, num_events, num_bytes);
+}
+
 void release_events_memory(Event *events, FragmentedEvent *f_events,
                            uint32_t num_events) {
   // Release fragment pointers
@@ -318,6 +484,72 @@ void release_events_memory(Event *events, FragmentedEvent *f_events,
   free((void *)events);
 }
 
+void parse_options(int argc, char **argv) {
+  uint8_t key[CIPHER_KEY_SIZE];
+  int opt;
+
+  static struct option long_options[] = {
+      {"network-cpus", required_argument, 0, 'n'},
+      {"worker-cpus", required_argument, 0, 'w'},
+      {"slab", no_argument, 0, 's'},
+      {"encrypt", no_argument, 0, 'e'},
+      {"in-flight", required_argument, 0, 'i'},
+      {"trials", required_argument, 0, 't'},
+      {"baseline", required_argument, 0, 'b'},
+      {0, 0, 0, 0},
+  };
+
+  while ((opt = getopt_long(argc, argv, "n:w:sei:t:b:", long_options,
+                            NULL)) != -1) {
+    switch (opt) {
+    case 'n':
+      if (placement_set_cpus(THREAD_ROLE_NETWORK, optarg))
+        goto usage;
+      printf("   network  cpus %s\n", optarg);
+      break;
+    case 'w':
+      if (placement_set_cpus(THREAD_ROLE_WORKER, optarg))
+        goto usage;
+      printf("    worker  cpus %s\n", optarg);
+      break;
+    case 's':
+      set_event_allocator(&slab_event_allocator);
+      printf(" allocator  slab\n");
+      break;
+    case 'e':
+      // A throwaway key, since the benchmark never reads its events back
+      if (RAND_bytes(key, CIPHER_KEY_SIZE) != 1)
+        fatal_error();
+      cipher_set_key(key);
+      printf("encryption  aes-256-gcm\n");
+      break;
+    case 'i':
+      if (fdb_set_async_in_flight(parse_pos_int(optarg)))
+        goto usage;
+      break;
+    case 't':
+      num_trials = parse_pos_int(optarg);
+      if (!num_trials || (num_trials > BASELINE_MAX_TRIALS))
+        goto usage;
+      break;
+    case 'b':
+      baseline_path = optarg;
+      break;
+    default:
+      goto usage;
+    }
+  }
+
+  return;
+
+usage:
+  fprintf(stderr,
+          "usage: %s [--network-cpus LIST] [--worker-cpus LIST] [--slab] "
+          "[--encrypt] [--in-flight N] [--trials N] [--baseline FILE]\n",
+          argv[0]);
+  exit(1);
+}
+
 void fatal_error(void) {
   fprintf(stderr, "Fatal error during benchmarks\n");
   exit(1);
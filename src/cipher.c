@@ -0,0 +1,254 @@
+/// @file cipher.c
+///
+/// Definitions for the at-rest encryption of event fragments.
+
+#include <openssl/evp.h>
+#include <openssl/rand.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <threads.h>
+
+#include "cipher.h"
+
+//==============================================================================
+// Types
+//==============================================================================
+
+typedef struct cipher_context_t {
+  EVP_CIPHER_CTX *seal;   // Encryption context, holding the key schedule.
+  EVP_CIPHER_CTX *open;   // Decryption context, holding the key schedule.
+  uint8_t nonce_field[8]; // Random field of the thread's nonces.
+  uint32_t nonce_count;   // Seals under the current field.
+  uint32_t generation;    // Key generation the contexts were keyed with.
+  bool registered;        // Whether the exit destructor is registered.
+} CipherContext;
+
+//==============================================================================
+// Variables
+//==============================================================================
+
+static uint8_t cipher_key[CIPHER_KEY_SIZE];
+static atomic_bool cipher_on = false;
+
+// Incremented on every key change, so that threads re-key their contexts
+static atomic_uint cipher_generation = 1;
+
+static pthread_once_t cipher_once = PTHREAD_ONCE_INIT;
+static pthread_key_t cipher_context_key;
+static thread_local CipherContext cipher_context;
+
+//==============================================================================
+// Prototypes
+//==============================================================================
+
+/// Create the key used to release thread contexts at thread exit, and make
+/// forked children re-key, so that they don't repeat their parent's nonces.
+void cipher_init(void);
+
+/// Make every thread of a forked child re-key its contexts.
+void cipher_after_fork(void);
+
+/// Release the calling thread's contexts at thread exit.
+///
+/// @param[in] arg  Handle for the thread's contexts.
+void cipher_context_destructor(void *arg);
+
+/// Get the calling thread's contexts, (re-)keying them if the key changed.
+/// Expanding the key schedule is the expensive part of setting up AES, so it is
+/// done once per thread and key rather than once per fragment.
+///
+/// @return  Handle for the contexts.
+/// @return  NULL  Failure.
+CipherContext *cipher_thread_context(void);
+
+/// Take the next nonce of the calling thread: its random field, then its count
+/// of seals, big-endian. A new field is drawn when the count runs out.
+///
+/// @param[in] context  Handle for the thread's contexts.
+/// @param[in] nonce    Pointer to the write location (of CIPHER_NONCE_SIZE
+///                     bytes).
+///
+/// @return  0  Success.
+/// @return -1  Failure (no random field could be drawn).
+int cipher_next_nonce(CipherContext *context, uint8_t *nonce);
+
+/// Encode the position of an event fragment, authenticated with it: the event
+/// identifier and fragment number, big-endian.
+///
+/// @param[in] position  Pointer to the write location (of 12 bytes).
+/// @param[in] event_id  The unique event identifier.
+/// @param[in] fragment  The fragment number.
+void cipher_position(uint8_t *position, uint64_t event_id, uint32_t fragment);
+
+//==============================================================================
+// Functions
+//==============================================================================
+
+void cipher_set_key(const uint8_t *key) {
+  pthread_once(&cipher_once, cipher_init);
+
+  if (key)
+    memcpy(cipher_key, key, CIPHER_KEY_SIZE);
+
+  atomic_fetch_add(&cipher_generation, 1);
+  atomic_store(&cipher_on, (key != NULL));
+}
+
+bool cipher_enabled(void) {
+  return atomic_load_explicit(&cipher_on, memory_order_relaxed);
+}
+
+uint32_t cipher_overhead(void) {
+  return cipher_enabled() ? CIPHER_OVERHEAD : 0;
+}
+
+int cipher_seal(uint8_t *out, const uint8_t *aad, uint32_t aad_length,
+                const uint8_t *in, uint32_t length, uint64_t event_id,
+                uint32_t fragment) {
+  CipherContext *context = cipher_thread_context();
+  uint8_t *nonce = (out + length + CIPHER_TAG_SIZE);
+  uint8_t position[12];
+  int out_length;
+
+  if (!context || cipher_next_nonce(context, nonce))
+    return -1;
+
+  cipher_position(position, event_id, fragment);
+
+  // The ciphertext is written straight to its final location, so encryption
+  // doubles as the copy which assembles the value
+  if ((EVP_EncryptInit_ex(context->seal, NULL, NULL, NULL, nonce) != 1) ||
+      (EVP_EncryptUpdate(context->seal, NULL, &out_length, position,
+                         sizeof(position)) != 1) ||
+      (aad_length && (EVP_EncryptUpdate(context->seal, NULL, &out_length, aad,
+                                        (int)aad_length) != 1)) ||
+      (EVP_EncryptUpdate(context->seal, out, &out_length, in, (int)length) !=
+       1) ||
+      (EVP_EncryptFinal_ex(context->seal, (out + out_length), &out_length) !=
+       1) ||
+      (EVP_CIPHER_CTX_ctrl(context->seal, EVP_CTRL_GCM_GET_TAG,
+                           CIPHER_TAG_SIZE, (out + length)) != 1))
+    return -1;
+
+  // Success
+  return 0;
+}
+
+int cipher_open(uint8_t *out, const uint8_t *aad, uint32_t aad_length,
+                const uint8_t *in, uint32_t length, uint64_t event_id,
+                uint32_t fragment) {
+  CipherContext *context = cipher_thread_context();
+  uint8_t nonce[CIPHER_NONCE_SIZE];
+  uint8_t tag[CIPHER_TAG_SIZE];
+  uint8_t position[12];
+  int out_length;
+
+  if (!context)
+    return -1;
+
+  // Copied first, since out may overlap in
+  memcpy(tag, (in + length), CIPHER_TAG_SIZE);
+  memcpy(nonce, (in + length + CIPHER_TAG_SIZE), CIPHER_NONCE_SIZE);
+  cipher_position(position, event_id, fragment);
+
+  // The final step fails if the tag doesn't match, in which case the caller
+  // must discard whatever was written to out
+  if ((EVP_DecryptInit_ex(context->open, NULL, NULL, NULL, nonce) != 1) ||
+      (EVP_DecryptUpdate(context->open, NULL, &out_length, position,
+                         sizeof(position)) != 1) ||
+      (aad_length && (EVP_DecryptUpdate(context->open, NULL, &out_length, aad,
+                                        (int)aad_length) != 1)) ||
+      (EVP_DecryptUpdate(context->open, out, &out_length, in, (int)length) !=
+       1) ||
+      (EVP_CIPHER_CTX_ctrl(context->open, EVP_CTRL_GCM_SET_TAG,
+                           CIPHER_TAG_SIZE, tag) != 1) ||
+      (EVP_DecryptFinal_ex(context->open, (out + out_length), &out_length) !=
+       1))
+    return -1;
+
+  // Success
+  return 0;
+}
+
+void cipher_init(void) {
+  pthread_key_create(&cipher_context_key, cipher_context_destructor);
+  pthread_atfork(NULL, NULL, cipher_after_fork);
+}
+
+void cipher_after_fork(void) { atomic_fetch_add(&cipher_generation, 1); }
+
+void cipher_context_destructor(void *arg) {
+  CipherContext *context = (CipherContext *)arg;
+
+  EVP_CIPHER_CTX_free(context->seal);
+  EVP_CIPHER_CTX_free(context->open);
+  context->seal = NULL;
+  context->open = NULL;
+  context->generation = 0;
+}
+
+CipherContext *cipher_thread_context(void) {
+  CipherContext *context = &cipher_context;
+  uint32_t generation = atomic_load(&cipher_generation);
+
+  if (context->generation == generation)
+    return context;
+
+  // Register the exit destructor the first time this thread seals or opens
+  if (!context->registered) {
+    pthread_once(&cipher_once, cipher_init);
+    pthread_setspecific(cipher_context_key, context);
+    context->registered = true;
+  }
+
+  if (!context->seal)
+    context->seal = EVP_CIPHER_CTX_new();
+  if (!context->open)
+    context->open = EVP_CIPHER_CTX_new();
+  if (!context->seal || !context->open)
+    return NULL;
+
+  // GCM defaults to a 12-byte nonce, matching CIPHER_NONCE_SIZE
+  if ((EVP_EncryptInit_ex(context->seal, EVP_aes_256_gcm(), NULL, cipher_key,
+                          NULL) != 1) ||
+      (EVP_DecryptInit_ex(context->open, EVP_aes_256_gcm(), NULL, cipher_key,
+                          NULL) != 1))
+    return NULL;
+
+  // Nonces under a new key start from a new field
+  if (RAND_bytes(context->nonce_field, sizeof(context->nonce_field)) != 1)
+    return NULL;
+  context->nonce_count = 0;
+
+  context->generation = generation;
+  return context;
+}
+
+int cipher_next_nonce(CipherContext *context, uint8_t *nonce) {
+  uint32_t count;
+
+  if (context->nonce_count == UINT32_MAX) {
+    if (RAND_bytes(context->nonce_field, sizeof(context->nonce_field)) != 1)
+      return -1;
+    context->nonce_count = 0;
+  }
+
+  count = context->nonce_count++;
+  memcpy(nonce, context->nonce_field, sizeof(context->nonce_field));
+  for (uint32_t i = 0; i < 4; ++i)
+    nonce[(8 + i)] = (uint8_t)(count >> (24 - (8 * i)));
+
+  // Success
+  return 0;
+}
+
+void cipher_position(uint8_t *position, uint64_t event_id, uint32_t fragment) {
+  for (uint32_t i = 0; i < 8; ++i)
+    position[i] = (uint8_t)(event_id >> (56 - (8 * i)));
+
+  for (uint32_t i = 0; i < 4; ++i)
+    position[(8 + i)] = (uint8_t)(fragment >> (24 - (8 * i)));
+}
@@ -0,0 +1,97 @@
+/// @file cipher.h
+///
+/// Declarations for the optional at-rest encryption of event fragments. Each
+/// fragment is sealed with AES-256-GCM under the ship's key, and its event
+/// identifier and fragment number are authenticated along with it, so that a
+/// fragment moved to another position fails to open. OpenSSL selects the
+/// AES-NI/VAES and PCLMULQDQ code paths at run time where the CPU supports
+/// them.
+///
+/// Every seal uses a fresh nonce, stored after the authentication tag, so an
+/// identifier can be cleared and written again with different data, a commit
+/// can be retried, and a snapshot can be replaced, without ever reusing a
+/// nonce. Nonces follow the deterministic construction of SP 800-38D: a random
+/// 64-bit field drawn by each thread whenever it keys its contexts, then a
+/// 32-bit count of the thread's seals. A key should still be retired well
+/// before 2^32 threads have keyed contexts with it.
+///
+/// Documentation links:
+///   https://www.openssl.org/docs/man1.1.1/man3/EVP_EncryptInit.html
+///   https://nvlpubs.nist.gov/nistpubs/Legacy/SP/nistspecialpublication800-38d.pdf
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Size of an encryption key in bytes
+#define CIPHER_KEY_SIZE 32
+
+// Size of the nonce stored with each sealed fragment in bytes
+#define CIPHER_NONCE_SIZE 12
+
+// Size of the authentication tag appended to each sealed fragment in bytes
+#define CIPHER_TAG_SIZE 16
+
+// Bytes sealing adds to each fragment: the tag, then the nonce
+#define CIPHER_OVERHEAD (CIPHER_TAG_SIZE + CIPHER_NONCE_SIZE)
+
+//==============================================================================
+// Prototypes
+//==============================================================================
+
+/// Set the key used to seal and open event fragments, enabling encryption, or
+/// disable encryption. Must not be called while events are being written or
+/// read.
+///
+/// @param[in] key  CIPHER_KEY_SIZE bytes of key material, or NULL to disable
+///                 encryption.
+void cipher_set_key(const uint8_t *key);
+
+/// Check whether encryption is enabled.
+///
+/// @return  Whether event fragments are sealed.
+bool cipher_enabled(void);
+
+/// Get the number of bytes sealing adds to each fragment value.
+///
+/// @return  CIPHER_OVERHEAD if encryption is enabled, otherwise 0.
+uint32_t cipher_overhead(void);
+
+/// Encrypt and authenticate one event fragment under a fresh nonce. The
+/// ciphertext is written to out, followed by the authentication tag and the
+/// nonce.
+///
+/// @param[in] out         Pointer to the write location (at least length +
+///                        CIPHER_OVERHEAD bytes).
+/// @param[in] aad         Data authenticated but not encrypted (may be NULL).
+/// @param[in] aad_length  Length of the authenticated data in bytes.
+/// @param[in] in          The plaintext.
+/// @param[in] length      Length of the plaintext in bytes.
+/// @param[in] event_id    The unique event identifier.
+/// @param[in] fragment    The fragment number.
+///
+/// @return  0  Success.
+/// @return -1  Failure (including a failure to draw a random nonce field).
+int cipher_seal(uint8_t *out, const uint8_t *aad, uint32_t aad_length,
+                const uint8_t *in, uint32_t length, uint64_t event_id,
+                uint32_t fragment);
+
+/// Verify and decrypt one event fragment sealed by cipher_seal().
+///
+/// @param[in] out         Pointer to the write location (at least length
+///                        bytes).
+/// @param[in] aad         Data authenticated but not encrypted (may be NULL).
+/// @param[in] aad_length  Length of the authenticated data in bytes.
+/// @param[in] in          The ciphertext, followed by the authentication tag
+///                        and the nonce.
+/// @param[in] length      Length of the ciphertext (without the tag and the
+///                        nonce) in bytes.
+/// @param[in] event_id    The unique event identifier.
+/// @param[in] fragment    The fragment number.
+///
+/// @return  0  Success.
+/// @return -1  Failure (including a fragment which fails authentication).
+int cipher_open(uint8_t *out, const uint8_t *aad, uint32_t aad_length,
+                const uint8_t *in, uint32_t length, uint64_t event_id,
+                uint32_t fragment);
@@ -10,6 +10,23 @@
 #include "constants.h"
 #include "event.h"
 
+//==============================================================================
+// Prototypes
+//==============================================================================
+
+/// Default event allocation function.
+void *default_event_alloc(uint64_t size, void *context);
+
+/// Default event release function.
+void default_event_free(void *ptr, void *context);
+
+//==============================================================================
+// Variables
+//==============================================================================
+
+static EventAllocator event_allocator = {default_event_alloc,
+                                         default_event_free, NULL};
+
 //==============================================================================
 // Functions
 //==============================================================================
@@ -37,11 +54,13 @@ void fragment_event(Event *event, FragmentedEvent *f_event) {
 
   // Each fragment data array is just a pointer to an index in the existing raw
   // event data array
-  uint8_t **fragments = (uint8_t **)malloc(sizeof(uint8_t *) * num_fragments);
+  uint8_t **fragments =
+      (uint8_t **)alloc_event_data(sizeof(uint8_t *) * num_fragments);
   fragments[0] = event->data;
   for (uint32_t i = 1; i < num_fragments; ++i) {
     fragments[i] =
-        (event->data + payload_length + ((i - 1) * OPTIMAL_VALUE_SIZE));
+        (event->data + payload_length +
+         ((uint64_t)(i - 1) * OPTIMAL_VALUE_SIZE));
   }
 
   // Header encodes number of ADDITIONAL fragments
@@ -92,6 +111,9 @@ uint8_t build_header(uint8_t *header, uint32_t num_fragments) {
 uint8_t read_header(const uint8_t *header, uint32_t *num_fragments) {
   if (header[0] & EXTENDED_HEADER) {
     uint8_t header_bytes = (header[0] ^ EXTENDED_HEADER);
+
+    // Only the low bytes are stored, so the rest must be cleared first
+    *num_fragments = 0;
     memcpy((uint8_t *)num_fragments, (header + 1), header_bytes);
 
     return (header_bytes + 1);
@@ -101,8 +123,49 @@ uint8_t read_header(const uint8_t *header, uint32_t *num_fragments) {
   return 1;
 }
 
-void free_event(Event *event) { free((void *)event->data); }
+int parse_header(const uint8_t *value, uint32_t value_length,
+                 uint32_t *num_fragments) {
+  uint32_t header_length = 1;
+
+  if (!value_length)
+    return -1;
+
+  // A corrupt first byte could claim more bytes than exist, or than fit
+  if (value[0] & EXTENDED_HEADER)
+    header_length += (value[0] ^ EXTENDED_HEADER);
+  if ((header_length > MAX_HEADER_SIZE) || (header_length > value_length))
+    return -1;
+
+  return read_header(value, num_fragments);
+}
+
+void set_event_allocator(const EventAllocator *allocator) {
+  if (allocator) {
+    event_allocator = *allocator;
+  } else {
+    event_allocator.alloc = default_event_alloc;
+    event_allocator.free = default_event_free;
+    event_allocator.context = NULL;
+  }
+}
+
+void *alloc_event_data(uint64_t size) {
+  return event_allocator.alloc(size, event_allocator.context);
+}
+
+void free_event_data(void *ptr) {
+  if (ptr)
+    event_allocator.free(ptr, event_allocator.context);
+}
+
+void free_event(Event *event) { free_event_data((void *)event->data); }
 
 void free_fragmented_event(FragmentedEvent *event) {
-  free((void *)event->fragments);
+  free_event_data((void *)event->fragments);
 }
+
+void *default_event_alloc(uint64_t size, void *context) {
+  return malloc(size);
+}
+
+void default_event_free(void *ptr, void *context) { free(ptr); }
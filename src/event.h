@@ -31,6 +31,12 @@ typedef struct fragmented_event_t {
                                    // event array.
 } FragmentedEvent;
 
+typedef struct event_allocator_t {
+  void *(*alloc)(uint64_t size, void *context); // Allocate a buffer.
+  void (*free)(void *ptr, void *context);       // Release a buffer.
+  void *context;                                // Passed to alloc and free.
+} EventAllocator;
+
 //==============================================================================
 // Prototypes
 //==============================================================================
@@ -60,6 +66,41 @@ uint8_t build_header(uint8_t *header, uint32_t num_fragments);
 /// @return   The length of the header in bytes
 uint8_t read_header(const uint8_t *header, uint32_t *num_fragments);
 
+/// Read the total number of fragments for an event from the header of a stored
+/// first fragment, checking first that the header fits in both the value and
+/// MAX_HEADER_SIZE. Use this rather than read_header() on bytes read back from
+/// the database.
+///
+/// @param[in] value          Handle for the stored first fragment.
+/// @param[in] value_length   Length of the stored first fragment in bytes.
+/// @param[in] num_fragments  Address to write the number of fragments into.
+///
+/// @return   The length of the header in bytes.
+/// @return   -1 if the header is empty, too long or truncated.
+int parse_header(const uint8_t *value, uint32_t value_length,
+                 uint32_t *num_fragments);
+
+/// Set the allocator used for event data and fragment buffers, both when
+/// fragmenting events for writes and when reading events back. Buffers must be
+/// released with the allocator that allocated them, so this should be set
+/// before any events are allocated.
+///
+/// @param[in] allocator  The allocator (copied), or NULL for malloc()/free().
+void set_event_allocator(const EventAllocator *allocator);
+
+/// Allocate a buffer for event data using the current event allocator.
+///
+/// @param[in] size  Number of bytes to allocate.
+///
+/// @return  Pointer to the allocated buffer.
+/// @return  NULL  Failure.
+void *alloc_event_data(uint64_t size);
+
+/// Release a buffer from alloc_event_data().
+///
+/// @param[in] ptr  Pointer to the buffer.
+void free_event_data(void *ptr);
+
 /// Deallocate the heap memory used by an event.
 ///
 /// @param[in] event  The event to deallocate.
@@ -0,0 +1,158 @@
+/// @file event_batch.c
+///
+/// Definitions for structure-of-arrays event batches and the batch planner.
+
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "constants.h"
+#include "event.h"
+#include "event_batch.h"
+
+//==============================================================================
+// Functions
+//==============================================================================
+
+int event_batch_init(EventBatch *batch, uint32_t num_events) {
+  uint64_t n = num_events;
+  uint8_t *block;
+
+  // Every array lives in one allocation, ordered by alignment
+  block = malloc((n * sizeof(uint64_t)) + (n * sizeof(uint64_t)) +
+                 (n * sizeof(uint8_t *)) + ((n + 1) * sizeof(uint64_t)) +
+                 (n * sizeof(uint32_t)));
+  if (!block)
+    return -1;
+
+  batch->num_events = num_events;
+  batch->ids = (uint64_t *)block;
+  batch->data_lengths = (batch->ids + n);
+  batch->data = (uint8_t **)(batch->data_lengths + n);
+  batch->fragment_offsets = (uint64_t *)(batch->data + n);
+  batch->num_fragments = (uint32_t *)(batch->fragment_offsets + n + 1);
+
+  // Success
+  return 0;
+}
+
+int event_batch_from_events(EventBatch *batch, const Event *events,
+                            uint32_t num_events) {
+  if (event_batch_init(batch, num_events))
+    return -1;
+
+  for (uint32_t i = 0; i < num_events; ++i) {
+    batch->ids[i] = events[i].id;
+    batch->data_lengths[i] = events[i].data_length;
+    batch->data[i] = events[i].data;
+  }
+
+  // Success
+  return 0;
+}
+
+int event_batch_from_fragmented(EventBatch *batch,
+                                const FragmentedEvent *f_events,
+                                uint32_t num_events) {
+  if (event_batch_init(batch, num_events))
+    return -1;
+
+  // The first fragment points at the start of the raw event data, and every
+  // other fragment is exactly OPTIMAL_VALUE_SIZE bytes
+  for (uint32_t i = 0; i < num_events; ++i) {
+    batch->ids[i] = f_events[i].id;
+    batch->data_lengths[i] =
+        f_events[i].num_fragments
+            ? (((uint64_t)(f_events[i].num_fragments - 1) *
+                OPTIMAL_VALUE_SIZE) +
+               f_events[i].payload_length)
+            : 0;
+    batch->data[i] =
+        f_events[i].num_fragments ? f_events[i].fragments[0] : NULL;
+  }
+
+  // Success
+  return 0;
+}
+
+void event_batch_free(EventBatch *batch) {
+  free((void *)batch->ids);
+  batch->ids = NULL;
+  batch->num_events = 0;
+}
+
+int event_batch_plan(EventBatch *batch, uint32_t batch_size, BatchPlan *plan) {
+  uint32_t n = batch->num_events;
+  uint64_t offset = 0;
+  uint64_t bytes = 0;
+  uint32_t event = 0;
+
+  if (!batch_size)
+    return -1;
+
+  // Fragment counts depend only on each event's length, so this loop has no
+  // cross-iteration dependencies and vectorizes
+  for (uint32_t i = 0; i < n; ++i) {
+    batch->num_fragments[i] = (uint32_t)(
+        (batch->data_lengths[i] + OPTIMAL_VALUE_SIZE - 1) / OPTIMAL_VALUE_SIZE);
+  }
+
+  // Exclusive prefix sum of fragment counts
+  for (uint32_t i = 0; i < n; ++i) {
+    batch->fragment_offsets[i] = offset;
+    offset += batch->num_fragments[i];
+    bytes += batch->data_lengths[i];
+  }
+  batch->fragment_offsets[n] = offset;
+
+  plan->batch_size = batch_size;
+  plan->num_fragments = offset;
+  plan->num_bytes = bytes;
+  plan->num_txs = (uint32_t)((offset + batch_size - 1) / batch_size);
+  plan->tx_event = malloc(sizeof(uint32_t) * 2 * (plan->num_txs + 1));
+  if (!plan->tx_event)
+    return -1;
+  plan->tx_fragment = (plan->tx_event + plan->num_txs + 1);
+
+  // Transaction t starts at fragment (t * batch_size) of the batch, which lies
+  // in the last event whose first fragment is at or before it
+  for (uint32_t t = 0; t < plan->num_txs; ++t) {
+    uint64_t start = ((uint64_t)t * batch_size);
+
+    while (batch->fragment_offsets[event + 1] <= start)
+      ++event;
+
+    plan->tx_event[t] = event;
+    plan->tx_fragment[t] = (uint32_t)(start - batch->fragment_offsets[event]);
+  }
+
+  plan->tx_event[plan->num_txs] = n;
+  plan->tx_fragment[plan->num_txs] = 0;
+
+  // Success
+  return 0;
+}
+
+void batch_plan_free(BatchPlan *plan) {
+  free((void *)plan->tx_event);
+  plan->tx_event = NULL;
+  plan->tx_fragment = NULL;
+  plan->num_txs = 0;
+}
+
+const uint8_t *event_batch_fragment(const EventBatch *batch, uint32_t event,
+                                    uint32_t fragment, uint32_t *length) {
+  // The first fragment carries whatever doesn't divide evenly into
+  // OPTIMAL_VALUE_SIZE pieces, as in fragment_event()
+  uint64_t first =
+      (batch->data_lengths[event] -
+       ((uint64_t)(batch->num_fragments[event] - 1) * OPTIMAL_VALUE_SIZE));
+
+  if (!fragment) {
+    *length = (uint32_t)first;
+    return batch->data[event];
+  }
+
+  *length = OPTIMAL_VALUE_SIZE;
+  return (batch->data[event] + first +
+          ((uint64_t)(fragment - 1) * OPTIMAL_VALUE_SIZE));
+}
@@ -0,0 +1,108 @@
+/// @file event_batch.h
+///
+/// Declarations for structure-of-arrays event batches, and for the planner
+/// which splits a batch into FoundationDB transactions up front, so that each
+/// transaction can be built independently of the others (and in parallel).
+
+#pragma once
+
+#include <stdint.h>
+
+#include "event.h"
+
+//==============================================================================
+// Types
+//==============================================================================
+
+typedef struct event_batch_t {
+  uint32_t num_events;        // Number of events in the batch.
+  uint64_t *ids;              // Identifier of each event.
+  uint64_t *data_lengths;     // Length of each event's data in bytes.
+  uint8_t **data;             // Pointer to each event's data.
+  uint32_t *num_fragments;    // Fragments per event (set by the planner).
+  uint64_t *fragment_offsets; // Position of each event's first fragment in the
+                              // batch, plus the total (set by the planner).
+} EventBatch;
+
+typedef struct batch_plan_t {
+  uint32_t batch_size;    // Maximum fragments per transaction.
+  uint32_t num_txs;       // Number of transactions.
+  uint64_t num_fragments; // Number of fragments in the batch.
+  uint64_t num_bytes;     // Number of event data bytes in the batch.
+  uint32_t *tx_event;     // Event of each transaction's first fragment. Has
+                          // num_txs + 1 entries; the last is num_events.
+  uint32_t *tx_fragment;  // Fragment within that event. Has num_txs + 1
+                          // entries; the last is 0.
+} BatchPlan;
+
+//==============================================================================
+// Prototypes
+//==============================================================================
+
+/// Allocate the arrays of an event batch. The caller fills in the ids, data
+/// lengths and data pointers.
+///
+/// @param[in] batch       Handle for the batch.
+/// @param[in] num_events  Number of events in the batch.
+///
+/// @return  0  Success.
+/// @return -1  Failure.
+int event_batch_init(EventBatch *batch, uint32_t num_events);
+
+/// Build an event batch from an array of events. Event data is not copied.
+///
+/// @param[in] batch       Handle for the batch.
+/// @param[in] events      Array of events.
+/// @param[in] num_events  Number of events in the array.
+///
+/// @return  0  Success.
+/// @return -1  Failure.
+int event_batch_from_events(EventBatch *batch, const Event *events,
+                            uint32_t num_events);
+
+/// Build an event batch from an array of fragmented events. Event data is not
+/// copied.
+///
+/// @param[in] batch       Handle for the batch.
+/// @param[in] f_events    Array of fragmented events.
+/// @param[in] num_events  Number of events in the array.
+///
+/// @return  0  Success.
+/// @return -1  Failure.
+int event_batch_from_fragmented(EventBatch *batch,
+                                const FragmentedEvent *f_events,
+                                uint32_t num_events);
+
+/// Release the arrays of an event batch (but not the event data).
+///
+/// @param[in] batch  Handle for the batch.
+void event_batch_free(EventBatch *batch);
+
+/// Split a batch into transactions of at most batch_size fragments each, in
+/// fragment order. Fragmentation follows fragment_event(); empty events have no
+/// fragments and are skipped.
+///
+/// @param[in] batch       Handle for the batch.
+/// @param[in] batch_size  Maximum number of fragments per transaction.
+/// @param[in] plan        Handle for the plan to write into.
+///
+/// @return  0  Success.
+/// @return -1  Failure.
+int event_batch_plan(EventBatch *batch, uint32_t batch_size, BatchPlan *plan);
+
+/// Release the arrays of a batch plan.
+///
+/// @param[in] plan  Handle for the plan.
+void batch_plan_free(BatchPlan *plan);
+
+/// Get the payload of one fragment of a planned event. The header of the first
+/// fragment is not included.
+///
+/// @param[in] batch     Handle for the planned batch.
+/// @param[in] event     Index of the event in the batch.
+/// @param[in] fragment  Fragment number.
+/// @param[in] length    Address to write the payload length into.
+///
+/// @return  Pointer to the fragment payload.
+const uint8_t *event_batch_fragment(const EventBatch *batch, uint32_t event,
+                                    uint32_t fragment, uint32_t *length);
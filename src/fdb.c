@@ -8,6 +8,7 @@
 
 #include <foundationdb/fdb_c.h>
 #include <pthread.h>
+#include <stdatomic.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
@@ -15,13 +16,73 @@
 #include <string.h>
 #include <sys/stat.h>
 
+#include "archive.h"
+#include "cipher.h"
 #include "constants.h"
+#include "event_batch.h"
 #include "fdb.h"
+#include "fdb_faults.h"
+#include "fdb_merkle.h"
+#include "fdb_presence.h"
+#include "fdb_slow_log.h"
+#include "metrics.h"
+#include "placement.h"
+#include "read_plan.h"
+#include "shm_cache.h"
 
 // Approximate maximum number of range clears that fit in a FoundationDB
 // transaction
 #define CLEAR_BATCH_SIZE 75000
 
+// Events cleared per transaction when each clear first reads what is stored,
+// so that the serial reads stay well within the five second transaction limit
+#define CLEAR_READ_BATCH_SIZE 500
+
+// Maximum size of a stored event fragment value in bytes
+#define FRAGMENT_VALUE_MAX_SIZE                                                \
+  (MAX_HEADER_SIZE + OPTIMAL_VALUE_SIZE + CIPHER_OVERHEAD)
+
+// Maximum consecutive failed range reads before a read gives up
+#define READ_MAX_ATTEMPTS 10
+
+// Maximum range reads a set read keeps in flight at once
+#define READ_MAX_IN_FLIGHT 64
+
+//==============================================================================
+// Types
+//==============================================================================
+
+typedef struct batch_writer_t {
+  const EventBatch *batch; // Batch being written.
+  const BatchPlan *plan;   // Transaction plan for the batch.
+  atomic_uint next_tx;     // Next planned transaction to claim.
+  atomic_bool failed;      // Whether any transaction failed.
+} BatchWriter;
+
+typedef struct read_session_t {
+  bool pinned;          // Whether reads are pinned to one read version.
+  int64_t read_version; // The pinned read version, or 0 if not yet chosen.
+} ReadSession;
+
+typedef struct event_reader_t {
+  Event *event;            // Event being reassembled.
+  uint32_t num_fragments;  // Fragments in the event, or 0 before the header.
+  uint32_t next_fragment;  // Next fragment expected.
+  uint32_t payload_length; // Payload length of the first fragment.
+} EventReader;
+
+typedef struct read_cursor_t {
+  uint8_t last_key[FDB_KEY_MAX_LENGTH]; // Last key read, or the first key.
+  uint8_t end_key[FDB_KEY_MAX_LENGTH];  // Key one past the end of the range.
+  int last_length;                      // Length of last_key.
+  int end_length;                       // Length of end_key.
+  fdb_bool_t begin_or_equal;            // Whether last_key has been read.
+  bool done;                            // Whether the range is fully read.
+  uint32_t next;                        // Position in the plan order of the
+                                        // next requested event in the range.
+  FDBFuture *future;                    // Range read in flight, if any.
+} ReadCursor;
+
 //==============================================================================
 // Variables
 //==============================================================================
@@ -29,6 +90,8 @@
 FDBDatabase *fdb_database;
 pthread_t fdb_network_thread;
 uint32_t fdb_batch_size = 1;
+static KeyFormat fdb_key_format = KEY_FORMAT_FIXED;
+static bool fdb_pinned_reads = false;
 
 //==============================================================================
 // Prototypes
@@ -38,6 +101,149 @@ uint32_t fdb_batch_size = 1;
 /// in a separate process.
 void *network_thread_func(void *arg);
 
+/// Read an event in either key layout as part of a read session.
+///
+/// @param[in] event    Handle for the event. The event id must be set.
+/// @param[in] session  Handle for the read session.
+///
+/// @return  0  Success.
+/// @return -1  Failure.
+int read_event(Event *event, ReadSession *session);
+
+/// Read event fragments stored in a particular key layout from the database and
+/// combine them into one event. The read rolls over to a fresh transaction,
+/// continuing from the last key seen, if its transaction expires or hits a
+/// retryable error.
+///
+/// @param[in] event    Handle for the event. The event id must be set.
+/// @param[in] format   The key layout.
+/// @param[in] session  Handle for the read session.
+///
+/// @return  0  Success.
+/// @return  1  No fragments stored in this layout.
+/// @return -1  Failure.
+int read_event_format(Event *event, KeyFormat format, ReadSession *session);
+
+/// Read a set of events from the database, as fdb_read_event_set(), without
+/// looking in the shared-memory cache.
+///
+/// @param[in] events      Handle for the event array.
+/// @param[in] num_events  Number of events in array.
+/// @param[in] max_gap     Maximum number of unrequested identifiers to read
+///                        over when merging two ranges.
+///
+/// @return  0  Success.
+/// @return -1  Failure.
+int read_event_set(Event *events, uint32_t num_events, uint64_t max_gap);
+
+/// Start reassembling an event from its fragments.
+///
+/// @param[in] reader  Handle for the reader.
+/// @param[in] event   Handle for the event. The event id must be set.
+void event_reader_init(EventReader *reader, Event *event);
+
+/// Add the next fragment of an event. The first fragment allocates the event
+/// data.
+///
+/// @param[in] reader        Handle for the reader.
+/// @param[in] fragment      The fragment number.
+/// @param[in] value         The stored fragment value.
+/// @param[in] value_length  Length of the value in bytes.
+///
+/// @return  0  Success.
+/// @return -1  Failure (missing, extra, misordered or damaged fragment).
+int event_reader_add(EventReader *reader, uint32_t fragment,
+                     const uint8_t *value, uint32_t value_length);
+
+/// Check whether every fragment of an event has been added.
+///
+/// @param[in] reader  Handle for the reader.
+///
+/// @return  Whether the event is complete.
+bool event_reader_complete(const EventReader *reader);
+
+/// Read every range of a set read, scattering fragments to the events
+/// requested. Each round issues the next read of up to READ_MAX_IN_FLIGHT
+/// unfinished ranges, then collects them in order.
+///
+/// @param[in] tx       FoundationDB transaction handle.
+/// @param[in] plan     Handle for the read plan.
+/// @param[in] cursors  Array of range cursors, one per planned range.
+/// @param[in] readers  Array of event readers, in request order.
+/// @param[in] op       Handle for the slow-operation record of the read.
+///
+/// @return  0  Success.
+/// @return  Positive  FoundationDB error which interrupted the reads.
+/// @return -1  Failure.
+int read_set_round(FDBTransaction *tx, const ReadPlan *plan,
+                   ReadCursor *cursors, EventReader *readers, SlowOp *op);
+
+/// Read complete events from a range of ids in the current key layout into an
+/// archive segment, in batch-priority transactions.
+///
+/// @param[in] writer      Handle for the segment writer.
+/// @param[in] begin       First event id of the range.
+/// @param[in] end         Event id one past the end of the range.
+/// @param[in] max_events  Maximum number of events to add.
+/// @param[in] last_id     Pointer to the write location of the last id added.
+/// @param[in] num_events  Pointer to the write location of the number of
+///                        events added.
+///
+/// @return  0  Success.
+/// @return -1  Failure (including an incomplete event).
+int scan_archive_events(ArchiveWriter *writer, uint64_t begin, uint64_t end,
+                        uint32_t max_events, uint64_t *last_id,
+                        uint32_t *num_events);
+
+/// Clear a range of archived events from the cluster, in both key layouts, and
+/// move the archive watermark past it. With summaries enabled, the events are
+/// read again first, to subtract their digests, and are cleared in chunks of
+/// FDB_ARCHIVE_CLEAR_KVS fragments, each in its own transaction; the watermark
+/// moves with the last chunk.
+///
+/// @param[in] begin  First event id of the range.
+/// @param[in] end    Event id one past the end of the range.
+///
+/// @return  0  Success.
+/// @return -1  Failure.
+int clear_archived_events(uint64_t begin, uint64_t end);
+
+/// Set the read version of a transaction to the one its read session is
+/// pinned to, choosing it first if need be. Does nothing for unpinned
+/// sessions.
+///
+/// @param[in] tx       FoundationDB transaction handle.
+/// @param[in] session  Handle for the read session.
+///
+/// @return  0  Success.
+/// @return -1  Failure.
+int pin_read_version(FDBTransaction *tx, ReadSession *session);
+
+/// Prepare a transaction to resume a read after an error: a fresh transaction
+/// if its read version expired, otherwise a retry after FoundationDB's backoff
+/// if the error is retryable.
+///
+/// @param[in] tx       FoundationDB transaction handle.
+/// @param[in] session  Handle for the read session.
+/// @param[in] err      FoundationDB error code.
+///
+/// @return  0  Success.
+/// @return -1  Failure (the error is not retryable).
+int roll_over_read(FDBTransaction *tx, ReadSession *session, fdb_error_t err);
+
+/// Claim and commit planned transactions until none are left or one fails.
+///
+/// @param[in] writer  Handle for the shared batch writer state.
+///
+/// @return  0  Success.
+/// @return -1  Failure.
+int write_planned_transactions(BatchWriter *writer);
+
+/// Thread function which runs write_planned_transactions().
+///
+/// @param[in] arg  Handle for the shared batch writer state.
+void *batch_writer_thread_func(void *arg);
+
 /// Add a limited number of write operations for the fragments of an event to a
 /// FoundationDB transaction.
 ///
@@ -50,12 +256,187 @@ void *network_thread_func(void *arg);
 uint32_t add_event_set_transactions(FDBTransaction *tx, FragmentedEvent *event,
                                     uint32_t start_pos, uint32_t limit);
 
+/// Add the write operations for one planned transaction of an event batch to a
+/// FoundationDB transaction.
+///
+/// @param[in] tx         FoundationDB transaction handle.
+/// @param[in] batch      Handle for the planned event batch.
+/// @param[in] plan       Handle for the plan of the batch.
+/// @param[in] tx_index   Index of the planned transaction.
+/// @param[in] keys       Key arena for the transaction's keys (capacity of at
+///                       least batch_size keys).
+/// @param[in] bytes      Address to write the number of key + value bytes into.
+///
+/// @return  Number of event fragments added to transaction.
+uint32_t add_planned_set_transactions(FDBTransaction *tx,
+                                      const EventBatch *batch,
+                                      const BatchPlan *plan, uint32_t tx_index,
+                                      KeyArena *keys, uint64_t *bytes);
+
+/// Take the fragments stored under a run of an event's keys out of the
+/// summaries, before a transaction writes them again after an attempt whose
+/// commit may have landed. The attempt's digests are then subtracted before
+/// they are added back, so that retrying it doesn't count them twice.
+///
+/// @param[in] tx         FoundationDB transaction handle.
+/// @param[in] event_id   The unique event identifier.
+/// @param[in] start_pos  Position of the first fragment of the run.
+/// @param[in] end_pos    Position one past the last fragment of the run.
+///
+/// @return  0  Success.
+/// @return -1  Failure.
+/// @return  Otherwise, the FoundationDB error of the read, to be retried.
+fdb_error_t subtract_rewritten_fragments(FDBTransaction *tx, uint64_t event_id,
+                                         uint32_t start_pos, uint32_t end_pos);
+
+/// Take the fragments stored under the keys of one planned transaction of an
+/// event batch out of the summaries, as subtract_rewritten_fragments() does.
+///
+/// @param[in] tx        FoundationDB transaction handle.
+/// @param[in] batch     Handle for the planned event batch.
+/// @param[in] plan      Handle for the plan of the batch.
+/// @param[in] tx_index  Index of the planned transaction.
+///
+/// @return  0  Success.
+/// @return -1  Failure.
+/// @return  Otherwise, the FoundationDB error of a read, to be retried.
+fdb_error_t subtract_rewritten_planned(FDBTransaction *tx,
+                                       const EventBatch *batch,
+                                       const BatchPlan *plan,
+                                       uint32_t tx_index);
+
+/// Add the write operation for one event fragment to a FoundationDB
+/// transaction. The value is the header (if any) followed by the payload,
+/// sealed in the same pass as it is copied into place when encryption is
+/// enabled. If sealing fails, the transaction is cancelled so that its commit
+/// fails.
+///
+/// @param[in] tx              FoundationDB transaction handle.
+/// @param[in] key             The FoundationDB key.
+/// @param[in] key_length      Length of the key in bytes.
+/// @param[in] value           Scratch space for the value (at least
+///                            FRAGMENT_VALUE_MAX_SIZE bytes).
+/// @param[in] header          The event header (first fragment only).
+/// @param[in] header_length   Length of the header in bytes, or 0.
+/// @param[in] payload         The fragment payload.
+/// @param[in] payload_length  Length of the payload in bytes.
+/// @param[in] event_id        The unique event identifier.
+/// @param[in] fragment        The fragment number.
+/// @param[in] delta           Summary changes of the transaction, or NULL when
+///                            summaries aren't kept.
+///
+/// @return  Length of the value written in bytes.
+uint32_t add_fragment_set_transaction(FDBTransaction *tx, const uint8_t *key,
+                                      uint8_t key_length, uint8_t *value,
+                                      const uint8_t *header,
+                                      uint8_t header_length,
+                                      const uint8_t *payload,
+                                      uint32_t payload_length,
+                                      uint64_t event_id, uint32_t fragment,
+                                      MerkleDelta *delta);
+
+/// Copy the payload of one stored event fragment into the event, opening it
+/// in the same pass when encryption is enabled.
+///
+/// @param[in] out             Pointer to the write location for the payload.
+/// @param[in] value           The stored fragment value.
+/// @param[in] header_length   Length of the header at the start of the value.
+/// @param[in] payload_length  Length of the payload in bytes.
+/// @param[in] event_id        The unique event identifier.
+/// @param[in] fragment        The fragment number.
+///
+/// @return  0  Success.
+/// @return -1  Failure (the fragment failed authentication).
+int copy_fragment_payload(uint8_t *out, const uint8_t *value,
+                          uint8_t header_length, uint32_t payload_length,
+                          uint64_t event_id, uint32_t fragment);
+
+/// Encode the part of an event key which is common to all of its fragments.
+///
+/// @param[in] fdb_key  Pointer to the write location for the key.
+/// @param[in] format   The key layout.
+/// @param[in] key      The unique event identifier.
+///
+/// @return  Number of bytes written.
+uint8_t encode_event_key_prefix(uint8_t *fdb_key, KeyFormat format,
+                                uint64_t key);
+
+/// Encode the fragment number suffix of an event key.
+///
+/// @param[in] fdb_key   Pointer to the write location for the suffix.
+/// @param[in] format    The key layout.
+/// @param[in] fragment  The fragment number.
+///
+/// @return  Number of bytes written.
+uint8_t encode_event_key_fragment(uint8_t *fdb_key, KeyFormat format,
+                                  uint32_t fragment);
+
+/// Convert an integer between host and big-endian byte order (the conversion is
+/// its own inverse).
+///
+/// @param[in] value  The integer to convert.
+///
+/// @return  The converted integer.
+uint64_t to_big_endian_64(uint64_t value);
+uint32_t to_big_endian_32(uint32_t value);
+
+/// Synchronously commit a FoundationDB transaction.
+///
+/// @param[in] tx  Handle for the transaction containing writes/clears.
+///
+/// @return  The FoundationDB error of the commit, or 0.
+fdb_error_t commit_transaction(FDBTransaction *tx);
+
+/// Attempt to synchronously apply an event write or clear, recording the time
+/// spent in each phase of the commit to the slow-operation log. Faults are
+/// injected here, when enabled.
+///
+/// @param[in] tx  Handle for the transaction containing writes/clears.
+/// @param[in] op  Handle for the slow-operation record of the transaction.
+///
+/// @return  The FoundationDB error of the commit, or 0.
+fdb_error_t send_recorded_transaction(FDBTransaction *tx, SlowOp *op);
+
+/// Prepare to retry an event write or clear which failed, after FoundationDB's
+/// backoff if the error is retryable. The transaction is reset, so its writes
+/// must be added again.
+///
+/// @param[in] tx   Handle for the transaction.
+/// @param[in] err  The FoundationDB error of the commit.
+///
+/// @return  0  Success.
+/// @return -1  Failure (the error is not retryable, or the retry limit is
+///             reached).
+int retry_write(FDBTransaction *tx, fdb_error_t err);
+
+/// Compute the number of key + value bytes in a batch of event fragments.
+///
+/// @param[in] event      Fragmented event handle.
+/// @param[in] start_pos  Position of the first fragment in the batch.
+/// @param[in] num_kvp    Number of fragments in the batch.
+///
+/// @return  Number of bytes written by the batch.
+uint64_t batch_bytes(FragmentedEvent *event, uint32_t start_pos,
+                     uint32_t num_kvp);
+
 /// Add a clear operation for all fragments of an event to a FoundationDB
-/// transaction.
+/// transaction. With summaries enabled, the fragments are read first, so that
+/// the digests subtracted are those of what is stored, and with the present-id
+/// bitmap enabled, so is the event's chunk, unless the caller collects the
+/// event's bit to clear with the rest of its transaction's.
 ///
-/// @param[in] tx     FoundationDB transaction handle.
-/// @param[in] event  Fragmented event handle.
-void add_event_clear_transaction(FDBTransaction *tx, FragmentedEvent *event);
+/// @param[in] tx      FoundationDB transaction handle.
+/// @param[in] event   Fragmented event handle.
+/// @param[in] absent  Handle for the bitmap changes of the transaction, which
+///                    the caller emits with presence_delta_clear(), or NULL to
+///                    clear the event's bit at once.
+///
+/// @return  0  Success.
+/// @return -1  Failure.
+/// @return  Otherwise, the FoundationDB error of the read, to be retried.
+fdb_error_t add_event_clear_transaction(FDBTransaction *tx,
+                                        FragmentedEvent *event,
+                                        PresenceDelta *absent);
 
 /// Check if a FoundationDB API command returned an error. If so, print the
 /// error description and exit.
@@ -91,12 +472,24 @@ void fdb_init_database(void) {
 }
 
 void fdb_init_network_thread(void) {
+  pthread_attr_t attr;
+
+  // Pin the network thread if CPUs have been configured for it
+  if (placement_init_attr(THREAD_ROLE_NETWORK, &attr)) {
+    fprintf(stderr, "ERROR: could not apply network thread placement\n");
+    fdb_shutdown_database();
+    exit(-1);
+  }
+
   // Start the network thread
-  if (pthread_create(&fdb_network_thread, NULL, network_thread_func, NULL)) {
+  if (pthread_create(&fdb_network_thread, &attr, network_thread_func, NULL)) {
     perror("pthread_create() error");
+    pthread_attr_destroy(&attr);
     fdb_shutdown_database();
     exit(-1);
   }
+
+  pthread_attr_destroy(&attr);
 }
 
 void fdb_shutdown_database(void) {
@@ -143,45 +536,75 @@ int fdb_setup_transaction(FDBTransaction **tx) {
 }
 
 int fdb_send_transaction(FDBTransaction *tx) {
-  // Commit event batch transaction
-  FDBFuture *future = fdb_transaction_commit(tx);
+  if (fdb_check_error(commit_transaction(tx)))
+    return -1;
 
-  // Wait for the future to be ready
-  if (fdb_check_error(fdb_future_block_until_ready(future)))
-    goto tx_fail;
+  // Success
+  return 0;
+}
 
-  // Check that the future did not return any errors
-  if (fdb_check_error(fdb_future_get_error(future)))
-    goto tx_fail;
+int fdb_set_retry_policy(int64_t retry_limit, int64_t max_delay_ms) {
+  uint8_t limit[8], delay[8];
 
-  // Destroy the future
-  fdb_future_destroy(future);
+  // Integer options are passed as 64-bit little-endian values
+  for (uint32_t i = 0; i < 8; ++i) {
+    limit[i] = (uint8_t)((uint64_t)retry_limit >> (8 * i));
+    delay[i] = (uint8_t)((uint64_t)max_delay_ms >> (8 * i));
+  }
 
-  // Delete existing transaction object and create a new one
-  fdb_transaction_reset(tx);
+  if (fdb_check_error(fdb_database_set_option(
+          fdb_database, FDB_DB_OPTION_TRANSACTION_RETRY_LIMIT, limit, 8)) ||
+      fdb_check_error(fdb_database_set_option(
+          fdb_database, FDB_DB_OPTION_TRANSACTION_MAX_RETRY_DELAY, delay, 8)))
+    return -1;
 
   // Success
   return 0;
-
-// Failure
-tx_fail:
-  return -1;
 }
 
 int fdb_write_batch(FragmentedEvent *event, uint32_t *pos) {
   FDBTransaction *tx;
-  uint32_t num_out;
+  SlowOp op;
+  uint32_t num_out = 0;
+  uint32_t retries = 0;
+  uint64_t end_pos = ((uint64_t)*pos + fdb_batch_size);
+  bool landed = false;
+  fdb_error_t err;
+
+  if (end_pos > event->num_fragments)
+    end_pos = event->num_fragments;
 
   // Initialize transaction
   if (fdb_check_error(fdb_setup_transaction(&tx)))
     goto tx_fail;
 
-  // Add write events to transaction
-  num_out = add_event_set_transactions(tx, event, *pos, fdb_batch_size);
-
-  // Attempt to apply the transaction
-  if (fdb_check_error(fdb_send_transaction(tx)))
-    goto tx_fail;
+  do {
+    fdb_slow_log_begin(&op, SLOW_OP_WRITE, event->id, tx);
+    op.retries = retries++;
+
+    // An earlier attempt may have committed, and added to the summaries
+    err = 0;
+    if (landed && fdb_merkle_enabled())
+      err = subtract_rewritten_fragments(tx, event->id, *pos,
+                                         (uint32_t)end_pos);
+
+    // Add write events to transaction
+    if (!err) {
+      num_out = add_event_set_transactions(tx, event, *pos, fdb_batch_size);
+      op.num_kvs = num_out;
+      if (op.enabled)
+        op.num_bytes = batch_bytes(event, *pos, num_out);
+
+      // Attempt to apply the transaction
+      err = send_recorded_transaction(tx, &op);
+    }
+    if (err == FDB_ERROR_COMMIT_UNKNOWN_RESULT)
+      landed = true;
+    if ((err < 0) || (err && retry_write(tx, err))) {
+      fdb_transaction_destroy(tx);
+      goto tx_fail;
+    }
+  } while (err);
 
   // Clean up the transaction
   fdb_transaction_destroy(tx);
@@ -203,13 +626,20 @@ int fdb_write_event(Event *event) {
   // Write event fragments
   int err = fdb_write_fragmented_event(f_event);
 
+  if (!err)
+    shm_cache_put(event->id, event->data, event->data_length);
+
   // Success or failure
   return err;
 }
 
 int fdb_write_fragmented_event(FragmentedEvent *event) {
   FDBTransaction *tx;
+  SlowOp op;
   uint32_t i = 0;
+  uint32_t retries = 0;
+  bool landed = false;
+  fdb_error_t err;
 
   // Initialize transaction
   if (fdb_check_error(fdb_setup_transaction(&tx)))
@@ -217,10 +647,42 @@ int fdb_write_fragmented_event(FragmentedEvent *event) {
 
   // Write event fragments in maximal batches
   while (i < event->num_fragments) {
-    i += add_event_set_transactions(tx, event, i, fdb_batch_size);
+    uint64_t end_pos = ((uint64_t)i + fdb_batch_size);
 
-    if (fdb_check_error(fdb_send_transaction(tx)))
-      goto tx_fail;
+    fdb_slow_log_begin(&op, SLOW_OP_WRITE, event->id, tx);
+    op.retries = retries;
+
+    // An earlier attempt may have committed, and added to the summaries
+    err = 0;
+    if (landed && fdb_merkle_enabled())
+      err = subtract_rewritten_fragments(
+          tx, event->id, i,
+          (end_pos < event->num_fragments) ? (uint32_t)end_pos
+                                           : event->num_fragments);
+
+    if (!err) {
+      op.num_kvs = add_event_set_transactions(tx, event, i, fdb_batch_size);
+      if (op.enabled)
+        op.num_bytes = batch_bytes(event, i, op.num_kvs);
+
+      err = send_recorded_transaction(tx, &op);
+    }
+
+    // A failed batch is rebuilt from the same fragment
+    if (err) {
+      if (err == FDB_ERROR_COMMIT_UNKNOWN_RESULT)
+        landed = true;
+      if ((err < 0) || retry_write(tx, err)) {
+        fdb_transaction_destroy(tx);
+        goto tx_fail;
+      }
+      ++retries;
+      continue;
+    }
+
+    i += op.num_kvs;
+    retries = 0;
+    landed = false;
   }
 
   // Clean up the transaction
@@ -235,72 +697,94 @@ tx_fail:
 }
 
 int fdb_write_event_array(Event *events, uint32_t num_events) {
-  FragmentedEvent *f_events = malloc(sizeof(FragmentedEvent) * num_events);
-  for (uint32_t i = 0; i < num_events; i++) {
-    fragment_event(&events[i], &f_events[i]);
-  }
-  int err = fdb_write_fragmented_event_array(f_events, num_events);
+  EventBatch batch;
+  int err;
 
-  // Success
+  // Batches are fragmented on the fly, so there's no need to fragment first
+  if (event_batch_from_events(&batch, events, num_events))
+    return -1;
+
+  err = fdb_write_event_batch(&batch, 1);
+  event_batch_free(&batch);
+
+  // Success or failure
   return err;
 }
 
 int fdb_write_fragmented_event_array(FragmentedEvent *f_events,
                                      uint32_t num_events) {
-  FDBTransaction *tx;
-  uint32_t batch_filled = 0;
-  uint32_t frag_pos = 0;
-  uint32_t i = 0;
+  EventBatch batch;
+  int err;
 
-  // Initialize transaction
-  if (fdb_check_error(fdb_setup_transaction(&tx)))
-    goto tx_fail;
+  if (event_batch_from_fragmented(&batch, f_events, num_events))
+    return -1;
 
-  // For each event
-  while (i < num_events) {
-    // Add as many unwritten fragments from the current event as possible
-    // (method differs slightly depending on whether there are already other
-    // fragments in the batch)
-    if (!batch_filled) {
-      batch_filled = add_event_set_transactions(tx, (f_events + i), frag_pos,
-                                                fdb_batch_size);
-      frag_pos += batch_filled;
-    } else {
-      uint32_t num_kvp = add_event_set_transactions(
-          tx, (f_events + i), frag_pos, (fdb_batch_size - batch_filled));
-      batch_filled += num_kvp;
-      frag_pos += num_kvp;
-    }
-
-    // Increment event counter when all fragments from an event have been
-    // written
-    if (frag_pos == f_events[i].num_fragments) {
-      i += 1;
-      frag_pos = 0;
-    }
-
-    // Attempt to apply transaction when batch is filled
-    if (batch_filled == fdb_batch_size) {
-      if (fdb_check_error(fdb_send_transaction(tx)))
-        goto tx_fail;
+  err = fdb_write_event_batch(&batch, 1);
+  event_batch_free(&batch);
+
+  // Success or failure
+  return err;
+}
+
+int fdb_write_event_batch(EventBatch *batch, uint32_t num_threads) {
+  BatchPlan plan;
+  BatchWriter writer;
+  pthread_t *threads = NULL;
+  pthread_attr_t attr;
+  uint32_t num_started = 0;
+  int err;
+
+  if (!num_threads)
+    return -1;
 
-      batch_filled = 0;
+  // Decide every transaction boundary up front, so that each transaction can be
+  // built without reference to the ones before it
+  if (event_batch_plan(batch, fdb_batch_size, &plan))
+    return -1;
+
+  writer.batch = batch;
+  writer.plan = &plan;
+  atomic_init(&writer.next_tx, 0);
+  atomic_init(&writer.failed, false);
+
+  // The calling thread is one of the writers
+  if ((num_threads > 1) && (plan.num_txs > 1)) {
+    threads = malloc(sizeof(pthread_t) * (num_threads - 1));
+    if (!threads || placement_init_attr(THREAD_ROLE_WORKER, &attr)) {
+      free((void *)threads);
+      batch_plan_free(&plan);
+      return -1;
+    }
+
+    for (; num_started < (num_threads - 1); ++num_started) {
+      if (pthread_create((threads + num_started), &attr,
+                         batch_writer_thread_func, &writer)) {
+        perror("pthread_create() error");
+        break;
+      }
     }
+
+    pthread_attr_destroy(&attr);
   }
 
-  // Catch the final, non-full batch
-  if (fdb_check_error(fdb_send_transaction(tx)))
-    goto tx_fail;
+  err = write_planned_transactions(&writer);
 
-  // Clean up the transaction
-  fdb_transaction_destroy(tx);
+  for (uint32_t i = 0; i < num_started; ++i) {
+    pthread_join(threads[i], NULL);
+  }
+
+  free((void *)threads);
+  batch_plan_free(&plan);
+
+  if (err || atomic_load(&writer.failed))
+    return -1;
+
+  // Share the written events with other processes on the host
+  for (uint32_t i = 0; i < batch->num_events; ++i)
+    shm_cache_put(batch->ids[i], batch->data[i], batch->data_lengths[i]);
 
   // Success
   return 0;
-
-// Failure
-tx_fail:
-  return -1;
 }
 
 // With range reads, it's possible to remove headers completely from stored
@@ -319,185 +803,1358 @@ tx_fail:
 //    the data already available to the correct memory location
 //
 int fdb_read_event(Event *event) {
-  FDBFuture *future;
+  ReadSession session = {fdb_pinned_reads, 0};
+  int err;
+
+  if (!shm_cache_get(event))
+    return 0;
+
+  // Old events may have moved to the archive
+  err = archive_read_event(event);
+  if (err <= 0)
+    return err;
+
+  if (read_event(event, &session))
+    return -1;
+
+  shm_cache_put(event->id, event->data, event->data_length);
+
+  // Success
+  return 0;
+}
+
+int read_event(Event *event, ReadSession *session) {
+  KeyFormat format = fdb_key_format;
+  int err = read_event_format(event, format, session);
+
+  // Fall back to the other layout, in case the event predates (or is part way
+  // through) a key layout migration
+  if (err == 1)
+    err = read_event_format(event,
+                            ((format == KEY_FORMAT_FIXED) ? KEY_FORMAT_COMPACT
+                                                          : KEY_FORMAT_FIXED),
+                            session);
+
+  // Success or failure
+  return err ? -1 : 0;
+}
+
+int read_event_format(Event *event, KeyFormat format, ReadSession *session) {
+  FDBFuture *future = NULL;
   FDBTransaction *tx;
+  SlowOp op;
   const FDBKeyValue *out_kv;
-  fdb_bool_t out_more;
+  fdb_bool_t out_more = 1;
   int32_t out_count;
   uint32_t out_counted = 0;
-  uint32_t num_fragments = 0;
-  uint16_t payload_length;
-  uint8_t range_start_key[FDB_KEY_TOTAL_LENGTH];
-  uint8_t range_end_key[FDB_KEY_TOTAL_LENGTH];
-
-  // Setup keys for range read
-  fdb_build_event_key(range_start_key, event->id, 0);
-  fdb_build_event_key(range_end_key, (event->id + 1), 0);
+  uint32_t attempts = 0;
+  EventReader reader;
+  uint8_t last_key[FDB_KEY_MAX_LENGTH];
+  uint8_t range_end_key[FDB_KEY_MAX_LENGTH];
+  int last_length, end_length;
+  fdb_bool_t begin_or_equal = 0;
+  fdb_error_t err;
+
+  // Setup keys for range read. Reads continue after the last key seen, so
+  // that they can resume in a fresh transaction.
+  last_length = fdb_build_event_key_format(last_key, format, event->id, 0);
+  end_length =
+      fdb_build_event_key_format(range_end_key, format, (event->id + 1), 0);
+  event_reader_init(&reader, event);
 
   // Setup transaction
   if (fdb_check_error(fdb_setup_transaction(&tx))) {
     return -1;
   }
+  fdb_slow_log_begin(&op, SLOW_OP_READ, event->id, tx);
 
-  // Loop until FoundationDB says there is no more data
-  do {
-    out_more = 0;
+  if (pin_read_version(tx, session))
+    goto tx_fail;
 
-    // Read data range
-    future = fdb_transaction_get_range(
-        tx, range_start_key, FDB_KEY_TOTAL_LENGTH, 1, out_counted,
-        range_end_key, FDB_KEY_TOTAL_LENGTH, 0, 1, 0, 0,
-        FDB_STREAMING_MODE_WANT_ALL, 0, 0, 0);
-    if (fdb_check_error(fdb_future_block_until_ready(future)))
-      goto tx_fail;
-    if (fdb_check_error(fdb_future_get_error(future)))
-      goto tx_fail;
-    if (fdb_check_error(fdb_future_get_keyvalue_array(future, &out_kv,
-                                                      &out_count, &out_more)))
+  // Separate the read version request from the first range read when the
+  // operation is being tracked, so that its latency can be attributed
+  if (op.enabled) {
+    double t_grv = slow_log_time_ms();
+
+    future = fdb_transaction_get_read_version(tx);
+    if (fdb_check_error(fdb_future_block_until_ready(future)) ||
+        fdb_check_error(fdb_future_get_error(future)))
       goto tx_fail;
+    fdb_future_destroy(future);
+    future = NULL;
 
-    // Read header from very first batch
-    if (!num_fragments) {
-      // Get number of fragments and header length
-      uint8_t header_length =
-          read_header((const uint8_t *)out_kv[0].value, &num_fragments);
+    op.t_grv = (slow_log_time_ms() - t_grv);
+  }
 
-      // Use header length to calculate payload
-      payload_length = (out_kv[0].value_length - header_length);
+  // Loop until FoundationDB says there is no more data
+  while (out_more) {
+    double t_batch = slow_log_time_ms();
 
-      // Allocate memory for the event and copy the payload
-      event->data_length =
-          ((num_fragments * OPTIMAL_VALUE_SIZE) + payload_length);
-      event->data = malloc(sizeof(uint8_t) * event->data_length);
+    // Read data range
+    future = fdb_transaction_get_range(
+        tx, last_key, last_length, begin_or_equal, 1, range_end_key,
+        end_length, 0, 1, 0, 0, FDB_STREAMING_MODE_WANT_ALL, 0, 0, 0);
+    err = fdb_future_block_until_ready(future);
+    if (!err)
+      err = fdb_future_get_error(future);
+    if (!err)
+      err = fdb_fault_inject(FAULT_SITE_READ);
+
+    // Roll over to a fresh transaction and carry on from the last key seen,
+    // rather than starting the whole read again
+    if (err) {
+      fdb_future_destroy(future);
+      future = NULL;
+
+      if ((++attempts > READ_MAX_ATTEMPTS) ||
+          roll_over_read(tx, session, err))
+        goto tx_fail;
 
-      memcpy(event->data, (out_kv[0].value + header_length), payload_length);
+      continue;
+    }
 
-      // Header stores number of ADDITIONAL fragments
-      ++num_fragments;
+    if (fdb_check_error(fdb_future_get_keyvalue_array(future, &out_kv,
+                                                      &out_count, &out_more)))
+      goto tx_fail;
+    attempts = 0;
+
+    // Record range read batch statistics
+    t_batch = (slow_log_time_ms() - t_batch);
+    op.t_read += t_batch;
+    if (t_batch > op.t_read_max)
+      op.t_read_max = t_batch;
+    ++op.read_batches;
+    op.num_kvs += out_count;
+    for (int32_t i = 0; i < out_count; ++i)
+      op.num_bytes += (out_kv[i].key_length + out_kv[i].value_length);
+
+    // Report a missing event separately from a damaged one
+    if (!out_counted && !out_count) {
+      fdb_future_destroy(future);
+      fdb_transaction_destroy(tx);
+      fdb_slow_log_end(&op);
+      return 1;
     }
 
-    // Copy each fragment to final event memory (skipping the first fragment)
-    for (uint8_t i = (out_counted == 0); i < out_count; ++i) {
-      // Every fragment after the first should be EXACTLY the preset size
-      if (out_kv[i].value_length != OPTIMAL_VALUE_SIZE)
-        goto tx_fail;
+    // Reassemble the event, which must be the only thing in the range
+    for (int32_t i = 0; i < out_count; ++i) {
+      uint64_t event_id;
+      uint32_t fragment;
 
-      memcpy((event->data + payload_length + (OPTIMAL_VALUE_SIZE * (i - 1))),
-             out_kv[i].value, OPTIMAL_VALUE_SIZE);
+      if (fdb_parse_event_key(out_kv[i].key, out_kv[i].key_length, &event_id,
+                              &fragment) ||
+          (event_id != event->id) ||
+          event_reader_add(&reader, fragment, out_kv[i].value,
+                           out_kv[i].value_length))
+        goto tx_fail;
     }
 
     out_counted += out_count;
 
-    fdb_future_destroy(future);
-    continue;
+    // Event keys are never longer than FDB_KEY_MAX_LENGTH, as the range holds
+    // nothing else
+    if (out_count) {
+      last_length = out_kv[(out_count - 1)].key_length;
+      memcpy(last_key, out_kv[(out_count - 1)].key, last_length);
+      begin_or_equal = 1;
+    }
 
-  tx_fail:
     fdb_future_destroy(future);
-    fdb_transaction_destroy(tx);
-    free((void *)event->data);
-    return -1;
-
-  } while (out_more);
+    future = NULL;
+  }
 
   fdb_transaction_destroy(tx);
+  fdb_slow_log_end(&op);
 
   // Fail on mismatch between found keys and number of fragments recorded in
   // header
-  if (num_fragments != out_counted) {
-    free((void *)event->data);
+  if (!event_reader_complete(&reader)) {
+    free_event(event);
     return -1;
   }
 
   // Success
   return 0;
+
+// Failure
+tx_fail:
+  if (future)
+    fdb_future_destroy(future);
+  fdb_transaction_destroy(tx);
+  fdb_slow_log_end(&op);
+  free_event(event);
+  return -1;
 }
 
-int fdb_read_event_array(Event *events, uint32_t num_events) {
-  for (uint32_t i = 0; i < num_events; ++i) {
-    if (fdb_read_event(events + i)) {
-      for (uint32_t j = 0; j < i; ++j) {
-        free((void *)(events + j));
-      }
+int pin_read_version(FDBTransaction *tx, ReadSession *session) {
+  FDBFuture *future;
+  int64_t version;
 
-      return -1;
-    }
+  if (!session->pinned)
+    return 0;
+
+  if (session->read_version) {
+    fdb_transaction_set_read_version(tx, session->read_version);
+    return 0;
+  }
+
+  // Pin the session to the version of its first transaction
+  future = fdb_transaction_get_read_version(tx);
+  if (fdb_check_error(fdb_future_block_until_ready(future)) ||
+      fdb_check_error(fdb_future_get_error(future)) ||
+      fdb_check_error(fdb_future_get_int64(future, &version))) {
+    fdb_future_destroy(future);
+    return -1;
   }
+  fdb_future_destroy(future);
+
+  session->read_version = version;
 
   // Success
   return 0;
 }
 
-int fdb_clear_event(FragmentedEvent *event) {
-  FDBTransaction *tx;
+int roll_over_read(FDBTransaction *tx, ReadSession *session, fdb_error_t err) {
+  FDBFuture *future;
 
-  // Initialize transaction
-  if (fdb_check_error(fdb_setup_transaction(&tx)))
-    goto tx_fail;
+  // The read version has outlived the transaction lifetime, so reads carry on
+  // from a fresh one, to which the session is pinned from now on
+  if (err == FDB_ERROR_TRANSACTION_TOO_OLD) {
+    fdb_transaction_reset(tx);
+    session->read_version = 0;
+    metrics_add(METRIC_READ_ROLLOVERS, 1);
+    return pin_read_version(tx, session);
+  }
 
-  // Add a clear operation for the event
-  add_event_clear_transaction(tx, event);
+  // Let FoundationDB decide whether the error is retryable, and back off
+  future = fdb_transaction_on_error(tx, err);
+  if (fdb_check_error(fdb_future_block_until_ready(future)) ||
+      fdb_check_error(fdb_future_get_error(future))) {
+    fdb_future_destroy(future);
+    return -1;
+  }
+  fdb_future_destroy(future);
 
-  // Attempt to apply the transaction
-  if (fdb_send_transaction(tx))
-    goto tx_fail;
+  metrics_add(METRIC_READ_RETRIES, 1);
+  return pin_read_version(tx, session);
+}
 
-  // Clean up the transaction
-  fdb_transaction_destroy(tx);
+int fdb_read_event_array(Event *events, uint32_t num_events) {
+  // Only neighbouring events share a range read, so nothing is over-read
+  return fdb_read_event_set(events, num_events, 0);
+}
 
-  // Success
-  return 0;
+int fdb_read_event_set(Event *events, uint32_t num_events, uint64_t max_gap) {
+  Event *misses;
+  uint32_t *miss_index;
+  uint32_t num_misses = 0;
+  uint32_t num_checked = 0;
 
-// Failure
-tx_fail:
+  if (!shm_cache_enabled() && !archive_enabled())
+    return read_event_set(events, num_events, max_gap);
+
+  misses = malloc(sizeof(Event) * num_events);
+  miss_index = malloc(sizeof(uint32_t) * num_events);
+  if (!misses || !miss_index) {
+    free((void *)misses);
+    free((void *)miss_index);
+    return -1;
+  }
+
+  // Only the events missing from the cache and the archive are read from the
+  // cluster
+  for (; num_checked < num_events; ++num_checked) {
+    Event *event = (events + num_checked);
+    int err;
+
+    if (!shm_cache_get(event))
+      continue;
+
+    err = archive_read_event(event);
+    if (err < 0)
+      goto tx_fail;
+    if (!err)
+      continue;
+
+    misses[num_misses] = *event;
+    miss_index[num_misses++] = num_checked;
+  }
+
+  if (read_event_set(misses, num_misses, max_gap))
+    goto tx_fail;
+
+  for (uint32_t m = 0; m < num_misses; ++m) {
+    events[miss_index[m]] = misses[m];
+    shm_cache_put(misses[m].id, misses[m].data, misses[m].data_length);
+  }
+
+  free((void *)misses);
+  free((void *)miss_index);
+
+  // Success
+  return 0;
+
+// Failure
+tx_fail:
+  for (uint32_t m = 0, i = 0; i < num_checked; ++i) {
+    if ((m < num_misses) && (miss_index[m] == i))
+      ++m;
+    else
+      free_event(events + i);
+  }
+  free((void *)misses);
+  free((void *)miss_index);
+  return -1;
+}
+
+int read_event_set(Event *events, uint32_t num_events, uint64_t max_gap) {
+  ReadSession session = {fdb_pinned_reads, 0};
+  FDBTransaction *tx = NULL;
+  SlowOp op;
+  ReadPlan plan;
+  ReadCursor *cursors = NULL;
+  EventReader *readers = NULL;
+  uint64_t *ids;
+  uint32_t attempts = 0;
+  int err;
+
+  if (!num_events)
+    return 0;
+
+  // Plan the covering ranges
+  ids = malloc(sizeof(uint64_t) * num_events);
+  if (!ids)
+    return -1;
+  for (uint32_t i = 0; i < num_events; ++i)
+    ids[i] = events[i].id;
+  err = read_plan_build(&plan, ids, num_events, max_gap);
+  free((void *)ids);
+  if (err)
+    return -1;
+
+  cursors = calloc(plan.num_ranges, sizeof(ReadCursor));
+  readers = malloc(sizeof(EventReader) * num_events);
+  if (!cursors || !readers)
+    goto alloc_fail;
+
+  for (uint32_t i = 0; i < num_events; ++i)
+    event_reader_init((readers + i), (events + i));
+
+  for (uint32_t r = 0; r < plan.num_ranges; ++r) {
+    ReadCursor *cursor = (cursors + r);
+
+    cursor->last_length =
+        fdb_build_event_key(cursor->last_key, plan.range_begin[r], 0);
+    cursor->end_length =
+        fdb_build_event_key(cursor->end_key, (plan.range_end[r] + 1), 0);
+    cursor->next = plan.range_start[r];
+  }
+
+  // Setup transaction
+  if (fdb_check_error(fdb_setup_transaction(&tx)))
+    goto tx_fail;
+  fdb_slow_log_begin(&op, SLOW_OP_READ, events[plan.order[0]].id, tx);
+
+  if (pin_read_version(tx, &session))
+    goto tx_fail_logged;
+
+  // Read rounds of ranges until all are done, rolling over to a fresh
+  // transaction whenever one is interrupted
+  while ((err = read_set_round(tx, &plan, cursors, readers, &op))) {
+    if ((err < 0) || (++attempts > READ_MAX_ATTEMPTS) ||
+        roll_over_read(tx, &session, err))
+      goto tx_fail_logged;
+  }
+
+  fdb_transaction_destroy(tx);
+  tx = NULL;
+  fdb_slow_log_end(&op);
+
+  for (uint32_t k = 0; k < num_events; ++k) {
+    uint32_t i = plan.order[k];
+
+    // Repeated identifiers get a copy of the first one's data
+    if (k && (events[i].id == events[plan.order[(k - 1)]].id)) {
+      Event *first = (events + plan.order[(k - 1)]);
+
+      events[i].data_length = first->data_length;
+      events[i].data = alloc_event_data(first->data_length);
+      if (!events[i].data)
+        goto tx_fail;
+      memcpy(events[i].data, first->data, first->data_length);
+      continue;
+    }
+
+    if (event_reader_complete(readers + i))
+      continue;
+
+    // Nothing was found in the current key layout, so try the other one
+    if (!readers[i].next_fragment && !read_event((events + i), &session))
+      continue;
+
+    goto tx_fail;
+  }
+
+  read_plan_free(&plan);
+  free((void *)cursors);
+  free((void *)readers);
+
+  // Success
+  return 0;
+
+// Failure
+tx_fail_logged:
+  fdb_slow_log_end(&op);
+tx_fail:
+  if (tx)
+    fdb_transaction_destroy(tx);
+  for (uint32_t i = 0; i < num_events; ++i)
+    free_event(events + i);
+  // The events are still the caller's until their readers are initialized
+alloc_fail:
+  read_plan_free(&plan);
+  free((void *)cursors);
+  free((void *)readers);
   return -1;
 }
 
-int fdb_clear_event_array(FragmentedEvent *events, uint32_t num_events) {
-  FDBTransaction *tx;
+int read_set_round(FDBTransaction *tx, const ReadPlan *plan,
+                   ReadCursor *cursors, EventReader *readers, SlowOp *op) {
+  uint32_t issued[READ_MAX_IN_FLIGHT];
+  uint32_t num_issued;
+  double t_batch;
+  int result = 0;
+
+next_round:
+  num_issued = 0;
+  t_batch = slow_log_time_ms();
+
+  // Every range read is in flight before the first is waited on
+  for (uint32_t r = 0;
+       (r < plan->num_ranges) && (num_issued < READ_MAX_IN_FLIGHT); ++r) {
+    ReadCursor *cursor = (cursors + r);
+
+    if (cursor->done)
+      continue;
+
+    cursor->future = fdb_transaction_get_range(
+        tx, cursor->last_key, cursor->last_length, cursor->begin_or_equal, 1,
+        cursor->end_key, cursor->end_length, 0, 1, 0, 0,
+        FDB_STREAMING_MODE_WANT_ALL, 0, 0, 0);
+    issued[num_issued++] = r;
+  }
+
+  if (!num_issued)
+    return 0;
+
+  for (uint32_t n = 0; n < num_issued; ++n) {
+    ReadCursor *cursor = (cursors + issued[n]);
+    const FDBKeyValue *out_kv;
+    fdb_bool_t out_more;
+    int32_t out_count;
+    fdb_error_t err;
+
+    // After a failure, the remaining reads are only cleaned up
+    if (result) {
+      fdb_future_destroy(cursor->future);
+      cursor->future = NULL;
+      continue;
+    }
+
+    err = fdb_future_block_until_ready(cursor->future);
+    if (!err)
+      err = fdb_future_get_error(cursor->future);
+    if (!err)
+      err = fdb_fault_inject(FAULT_SITE_READ);
+    if (!err)
+      err = fdb_future_get_keyvalue_array(cursor->future, &out_kv, &out_count,
+                                          &out_more);
+    if (err) {
+      result = err;
+      fdb_future_destroy(cursor->future);
+      cursor->future = NULL;
+      continue;
+    }
+
+    ++op->read_batches;
+    op->num_kvs += out_count;
+
+    // Keys arrive in order, so the requested events are matched by walking
+    // the sorted request order alongside them. Events in gaps are skipped.
+    for (int32_t i = 0; i < out_count; ++i) {
+      uint64_t event_id;
+      uint32_t fragment;
+
+      op->num_bytes += (out_kv[i].key_length + out_kv[i].value_length);
+
+      if (fdb_parse_event_key(out_kv[i].key, out_kv[i].key_length, &event_id,
+                              &fragment)) {
+        result = -1;
+        break;
+      }
+
+      while ((cursor->next < plan->range_start[(issued[n] + 1)]) &&
+             (readers[plan->order[cursor->next]].event->id < event_id))
+        ++cursor->next;
+
+      if ((cursor->next < plan->range_start[(issued[n] + 1)]) &&
+          (readers[plan->order[cursor->next]].event->id == event_id) &&
+          event_reader_add((readers + plan->order[cursor->next]), fragment,
+                           out_kv[i].value, out_kv[i].value_length)) {
+        result = -1;
+        break;
+      }
+    }
+
+    if (out_count) {
+      cursor->last_length = out_kv[(out_count - 1)].key_length;
+      memcpy(cursor->last_key, out_kv[(out_count - 1)].key,
+             cursor->last_length);
+      cursor->begin_or_equal = 1;
+    }
+    cursor->done = !out_more;
+
+    fdb_future_destroy(cursor->future);
+    cursor->future = NULL;
+  }
+
+  t_batch = (slow_log_time_ms() - t_batch);
+  op->t_read += t_batch;
+  if (t_batch > op->t_read_max)
+    op->t_read_max = t_batch;
+
+  // Go round again while ranges remain
+  if (!result)
+    goto next_round;
+
+  return result;
+}
+
+void event_reader_init(EventReader *reader, Event *event) {
+  reader->event = event;
+  reader->num_fragments = 0;
+  reader->next_fragment = 0;
+  reader->payload_length = 0;
+  event->data = NULL;
+}
+
+int event_reader_add(EventReader *reader, uint32_t fragment,
+                     const uint8_t *value, uint32_t value_length) {
+  Event *event = reader->event;
+  uint32_t overhead = cipher_overhead();
+  uint8_t header_length = 0;
+  uint32_t length = OPTIMAL_VALUE_SIZE;
+  uint8_t *out;
+
+  // Fragments must arrive in order, without gaps
+  if (fragment != reader->next_fragment)
+    return -1;
+
+  if (!fragment) {
+    int parsed = parse_header(value, value_length, &reader->num_fragments);
+
+    // Get number of fragments and header length
+    if (parsed < 0)
+      return -1;
+    header_length = (uint8_t)parsed;
+
+    // Use header length to calculate payload
+    if (value_length < (header_length + overhead))
+      return -1;
+    length = (value_length - header_length - overhead);
+    reader->payload_length = length;
+
+    // Allocate memory for the event. The header stores number of ADDITIONAL
+    // fragments.
+    event->data_length =
+        (((uint64_t)reader->num_fragments * OPTIMAL_VALUE_SIZE) + length);
+    ++reader->num_fragments;
+    event->data = alloc_event_data(sizeof(uint8_t) * event->data_length);
+    if (!event->data)
+      return -1;
+
+    out = event->data;
+  } else {
+    // Every fragment after the first should be EXACTLY the preset size
+    if ((fragment >= reader->num_fragments) ||
+        (value_length != (OPTIMAL_VALUE_SIZE + overhead)))
+      return -1;
+
+    out = (event->data + reader->payload_length +
+           ((uint64_t)OPTIMAL_VALUE_SIZE * (fragment - 1)));
+  }
+
+  if (copy_fragment_payload(out, value, header_length, length, event->id,
+                            fragment))
+    return -1;
+
+  ++reader->next_fragment;
+
+  // Success
+  return 0;
+}
+
+bool event_reader_complete(const EventReader *reader) {
+  return (reader->num_fragments &&
+          (reader->next_fragment == reader->num_fragments));
+}
+
+int fdb_clear_event(FragmentedEvent *event) {
+  FDBTransaction *tx;
+  SlowOp op;
+  uint32_t retries = 0;
+  fdb_error_t err;
+
+  // Initialize transaction
+  if (fdb_check_error(fdb_setup_transaction(&tx)))
+    goto tx_fail;
+
+  do {
+    fdb_slow_log_begin(&op, SLOW_OP_CLEAR, event->id, tx);
+    op.retries = retries++;
+
+    // Add a clear operation for the event
+    err = add_event_clear_transaction(tx, event, NULL);
+    op.num_kvs = event->num_fragments;
+
+    // Attempt to apply the transaction
+    if (!err)
+      err = send_recorded_transaction(tx, &op);
+    if ((err < 0) || (err && retry_write(tx, err))) {
+      fdb_transaction_destroy(tx);
+      goto tx_fail;
+    }
+  } while (err);
+
+  // Clean up the transaction
+  fdb_transaction_destroy(tx);
+  shm_cache_invalidate(event->id);
+
+  // Success
+  return 0;
+
+// Failure
+tx_fail:
+  return -1;
+}
+
+int fdb_clear_event_array(FragmentedEvent *events, uint32_t num_events) {
+  FDBTransaction *tx;
+  SlowOp op;
+  PresenceDelta absent;
+  uint32_t batch_size = (fdb_merkle_enabled() || fdb_presence_enabled())
+                            ? CLEAR_READ_BATCH_SIZE
+                            : CLEAR_BATCH_SIZE;
+  fdb_error_t err;
+
+  // Initialize transaction
+  if (fdb_check_error(fdb_setup_transaction(&tx)))
+    goto tx_fail;
+
+  // Clear a batch of events per transaction. A failed batch is retried from
+  // its first event, as the transaction is reset.
+  for (uint32_t start = 0; start < num_events; start += batch_size) {
+    uint32_t end = ((num_events - start) < batch_size) ? num_events
+                                                       : (start + batch_size);
+    uint32_t retries = 0;
+
+    do {
+      fdb_slow_log_begin(&op, SLOW_OP_CLEAR, events[start].id, tx);
+      op.retries = retries++;
+      op.num_kvs = 0;
+
+      // Add a clear operation for each event of the batch, reading each chunk
+      // of the present-id bitmap once
+      presence_delta_init(&absent);
+      err = 0;
+      for (uint32_t i = start; !err && (i < end); ++i) {
+        err = add_event_clear_transaction(tx, (events + i), &absent);
+        op.num_kvs += events[i].num_fragments;
+      }
+      if (!err && fdb_presence_enabled())
+        err = presence_delta_clear(&absent, tx);
+
+      // Attempt to apply the transaction
+      if (!err)
+        err = send_recorded_transaction(tx, &op);
+      if ((err < 0) || (err && retry_write(tx, err))) {
+        fdb_transaction_destroy(tx);
+        goto tx_fail;
+      }
+    } while (err);
+
+    // The batch is gone, even if a later one fails
+    for (uint32_t i = start; i < end; ++i)
+      shm_cache_invalidate(events[i].id);
+  }
+
+  // Clean up the transaction
+  fdb_transaction_destroy(tx);
+
+  // Success
+  return 0;
+
+// Failure
+tx_fail:
+  return -1;
+}
+
+int fdb_clear_database(void) {
+  FDBTransaction *tx;
+  uint8_t start_key[1] = {0};
+  uint8_t end_key[1] = {0xFF};
+
+  // Initialize transaction
+  if (fdb_check_error(fdb_setup_transaction(&tx)))
+    goto tx_fail;
+
+  // Add clear operation to transaction
+  fdb_transaction_clear_range(tx, start_key, 1, end_key, 1);
+
+  // Catch the final, non-full batch
+  if (fdb_send_transaction(tx))
+    goto tx_fail;
+
+  // Clean up the transaction
+  fdb_transaction_destroy(tx);
+  shm_cache_invalidate_all();
+
+  // Success
+  return 0;
+
+// Failure
+tx_fail:
+  return -1;
+}
+
+void fdb_set_pinned_reads(bool pinned) { fdb_pinned_reads = pinned; }
+
+void fdb_set_key_format(KeyFormat format) { fdb_key_format = format; }
+
+KeyFormat fdb_get_key_format(void) { return fdb_key_format; }
+
+int fdb_load_key_format(void) {
+  uint64_t format;
+  int found = fdb_read_metadata_u64(FDB_KEY_FORMAT_METADATA, &format);
+
+  if (found < 0)
+    return -1;
+
+  // Databases written before the entry existed all use the fixed layout
+  fdb_key_format = (found || (format != KEY_FORMAT_COMPACT))
+                       ? KEY_FORMAT_FIXED
+                       : KEY_FORMAT_COMPACT;
+
+  // Success
+  return 0;
+}
+
+int64_t fdb_migrate_keys(KeyFormat format, uint32_t batch_kvs) {
+  FDBTransaction *tx;
+  FDBFuture *future = NULL;
+  const FDBKeyValue *out_kv;
+  fdb_bool_t out_more = 1;
+  int32_t out_count;
+  KeyFormat source = (format == KEY_FORMAT_FIXED) ? KEY_FORMAT_COMPACT
+                                                  : KEY_FORMAT_FIXED;
+  uint8_t begin_key[1] = {fdb_event_key_prefix(source)};
+  uint8_t end_key[1] = {(uint8_t)(fdb_event_key_prefix(source) + 1)};
+  uint8_t clear_end[(FDB_KEY_MAX_LENGTH + 1)];
+  uint8_t key[FDB_KEY_MAX_LENGTH];
+  uint64_t *ids;
+  uint32_t *fragments;
+  int64_t moved = 0;
+  int err;
+
+  if (!batch_kvs)
+    return -1;
+
+  ids = malloc(sizeof(uint64_t) * batch_kvs);
+  fragments = malloc(sizeof(uint32_t) * batch_kvs);
+  if (!ids || !fragments) {
+    free((void *)ids);
+    free((void *)fragments);
+    return -1;
+  }
+
+  // Write new events in the new layout from now on, so that the old layout
+  // only ever shrinks
+  if (fdb_write_metadata_u64(FDB_KEY_FORMAT_METADATA, format) ||
+      fdb_check_error(fdb_setup_transaction(&tx))) {
+    free((void *)ids);
+    free((void *)fragments);
+    return -1;
+  }
+  fdb_key_format = format;
+
+  while (out_more) {
+    int32_t num_move;
+
+    // Migration must never delay foreground transactions
+    fdb_check_error(fdb_transaction_set_option(tx, FDB_TR_OPTION_PRIORITY_BATCH,
+                                               NULL, 0));
+
+    // Moved key-value pairs are cleared, so every batch starts at the front of
+    // the old layout. Not a snapshot read, so that concurrent writers conflict.
+    future = fdb_transaction_get_range(
+        tx, begin_key, 1, 0, 1, end_key, 1, 0, 1, batch_kvs, 0,
+        FDB_STREAMING_MODE_EXACT, 0, 0, 0);
+    err = fdb_future_block_until_ready(future);
+    if (!err)
+      err = fdb_future_get_error(future);
+    if (!err)
+      err = fdb_future_get_keyvalue_array(future, &out_kv, &out_count,
+                                          &out_more);
+    if (err)
+      goto retry;
+
+    if (!out_count)
+      break;
+
+    // Parse every key up front; anything in the event key-space which isn't
+    // an event key stops the migration rather than being cleared
+    for (int32_t i = 0; i < out_count; ++i) {
+      if (fdb_parse_event_key(out_kv[i].key, out_kv[i].key_length,
+                              (ids + i), (fragments + i))) {
+        fprintf(stderr, "fdb_migrate_keys: unrecognized event key\n");
+        goto tx_fail;
+      }
+    }
+
+    // Move whole events only, since the trailing event may continue in the
+    // next batch, unless a single event fills the batch
+    num_move = out_count;
+    if (out_more) {
+      int32_t first_of_last = (out_count - 1);
+
+      while ((first_of_last > 0) &&
+             (ids[(first_of_last - 1)] == ids[(out_count - 1)]))
+        --first_of_last;
+      if (first_of_last > 0)
+        num_move = first_of_last;
+    }
+
+    for (int32_t i = 0; i < num_move; ++i) {
+      uint8_t key_length =
+          fdb_build_event_key_format(key, format, ids[i], fragments[i]);
+      fdb_transaction_set(tx, key, key_length, out_kv[i].value,
+                          out_kv[i].value_length);
+    }
+
+    // Clear up to and including the last moved key
+    memcpy(clear_end, out_kv[(num_move - 1)].key,
+           out_kv[(num_move - 1)].key_length);
+    clear_end[out_kv[(num_move - 1)].key_length] = 0x00;
+    fdb_transaction_clear_range(tx, begin_key, 1, clear_end,
+                                (out_kv[(num_move - 1)].key_length + 1));
+
+    out_more = 1;
+    fdb_future_destroy(future);
+    future = fdb_transaction_commit(tx);
+    err = fdb_future_block_until_ready(future);
+    if (!err)
+      err = fdb_future_get_error(future);
+    if (err)
+      goto retry;
+
+    moved += num_move;
+    fdb_future_destroy(future);
+    future = NULL;
+    fdb_transaction_reset(tx);
+    continue;
+
+  retry:
+    // Let FoundationDB decide whether the error is retryable, and back off
+    fdb_future_destroy(future);
+    future = fdb_transaction_on_error(tx, err);
+    if (fdb_check_error(fdb_future_block_until_ready(future)))
+      goto tx_fail;
+    if (fdb_check_error(fdb_future_get_error(future)))
+      goto tx_fail;
+    fdb_future_destroy(future);
+    future = NULL;
+    out_more = 1;
+  }
+
+  if (future)
+    fdb_future_destroy(future);
+  fdb_transaction_destroy(tx);
+  free((void *)ids);
+  free((void *)fragments);
+
+  // Success
+  return moved;
+
+// Failure
+tx_fail:
+  if (future)
+    fdb_future_destroy(future);
+  fdb_transaction_destroy(tx);
+  free((void *)ids);
+  free((void *)fragments);
+  return -1;
+}
+
+int64_t fdb_archive_events(const char *dir, uint64_t watermark,
+                           uint32_t max_events) {
+  ArchiveWriter writer;
+  char path[ARCHIVE_PATH_MAX];
+  uint64_t start = 0;
+  uint64_t last_id;
+  int64_t archived = 0;
+
+  if (!max_events)
+    return -1;
+
+  if (!archive_enabled() && archive_open(dir))
+    return -1;
+  if (fdb_read_metadata_u64(FDB_ARCHIVE_METADATA, &start) < 0)
+    return -1;
+
+  // Finish an export which stopped between writing a segment and clearing its
+  // events, so that no event is ever archived twice
+  if (!archive_last_id(&last_id) && (last_id >= start)) {
+    if (clear_archived_events(start, (last_id + 1)))
+      return -1;
+    start = (last_id + 1);
+  }
+
+  while (start < watermark) {
+    uint32_t num_events = 0;
+
+    if (archive_writer_open(&writer, dir))
+      return -1;
+
+    if (scan_archive_events(&writer, start, watermark, max_events, &last_id,
+                            &num_events)) {
+      archive_writer_abort(&writer);
+      return -1;
+    }
+
+    if (!num_events) {
+      archive_writer_abort(&writer);
+      break;
+    }
+
+    // The segment is durable and readable before its events are cleared
+    if (archive_writer_finish(&writer, path) || archive_add_segment(path) ||
+        clear_archived_events(start, (last_id + 1)))
+      return -1;
+
+    archived += num_events;
+    start = (last_id + 1);
+  }
+
+  // Success
+  return archived;
+}
+
+int scan_archive_events(ArchiveWriter *writer, uint64_t begin, uint64_t end,
+                        uint32_t max_events, uint64_t *last_id,
+                        uint32_t *num_events) {
+  ReadSession session = {false, 0};
+  FDBTransaction *tx;
+  FDBFuture *future = NULL;
+  const FDBKeyValue *out_kv;
+  fdb_bool_t out_more = 1;
+  int32_t out_count;
+  uint8_t begin_key[FDB_KEY_MAX_LENGTH];
+  uint8_t end_key[FDB_KEY_MAX_LENGTH];
+  int begin_length, end_length;
+  fdb_bool_t begin_or_equal = 0;
+  Event event = {0, 0, NULL};
+  EventReader reader;
+  bool reading = false;
+  uint32_t attempts = 0;
+  fdb_error_t err;
+
+  begin_length = fdb_build_event_key(begin_key, begin, 0);
+  end_length = fdb_build_event_key(end_key, end, 0);
+
+  if (fdb_check_error(fdb_setup_transaction(&tx)))
+    return -1;
+
+  while (out_more) {
+    // Archiving must never delay foreground transactions
+    fdb_check_error(fdb_transaction_set_option(tx, FDB_TR_OPTION_PRIORITY_BATCH,
+                                               NULL, 0));
+
+    future = fdb_transaction_get_range(
+        tx, begin_key, begin_length, begin_or_equal, 1, end_key, end_length, 0,
+        1, FDB_ARCHIVE_SCAN_KVS, 0, FDB_STREAMING_MODE_EXACT, 0, 0, 0);
+    err = fdb_future_block_until_ready(future);
+    if (!err)
+      err = fdb_future_get_error(future);
+    if (!err)
+      err = fdb_future_get_keyvalue_array(future, &out_kv, &out_count,
+                                          &out_more);
+
+    if (err) {
+      fdb_future_destroy(future);
+      future = NULL;
+
+      if ((++attempts > READ_MAX_ATTEMPTS) ||
+          roll_over_read(tx, &session, err))
+        goto tx_fail;
+
+      out_more = 1;
+      continue;
+    }
+    attempts = 0;
+
+    for (int32_t i = 0; i < out_count; ++i) {
+      uint64_t event_id;
+      uint32_t fragment;
+
+      if (fdb_parse_event_key(out_kv[i].key, out_kv[i].key_length, &event_id,
+                              &fragment))
+        goto tx_fail;
+
+      // Segments end on an event boundary
+      if (!fragment) {
+        if (reading)
+          goto tx_fail;
+        if (*num_events == max_events) {
+          out_more = 0;
+          break;
+        }
+
+        event.id = event_id;
+        event_reader_init(&reader, &event);
+        reading = true;
+      } else if (!reading || (event_id != event.id)) {
+        goto tx_fail;
+      }
+
+      if (event_reader_add(&reader, fragment, out_kv[i].value,
+                           out_kv[i].value_length))
+        goto tx_fail;
+
+      if (event_reader_complete(&reader)) {
+        reading = false;
+        err = archive_writer_add(writer, &event);
+        free_event(&event);
+        if (err)
+          goto tx_fail;
+
+        *last_id = event.id;
+        ++*num_events;
+      }
+    }
+
+    // Continue after the last key read, in a fresh transaction so that long
+    // exports never outlive one
+    if (out_more && out_count) {
+      begin_length = out_kv[(out_count - 1)].key_length;
+      memcpy(begin_key, out_kv[(out_count - 1)].key, begin_length);
+      begin_or_equal = 1;
+    }
+
+    fdb_future_destroy(future);
+    future = NULL;
+    fdb_transaction_reset(tx);
+  }
+
+  fdb_transaction_destroy(tx);
+
+  // An event cut off by the end of the range is incomplete
+  if (reading) {
+    free_event(&event);
+    return -1;
+  }
+
+  // Success
+  return 0;
+
+// Failure
+tx_fail:
+  if (future)
+    fdb_future_destroy(future);
+  fdb_transaction_destroy(tx);
+  if (reading)
+    free_event(&event);
+  return -1;
+}
+
+int clear_archived_events(uint64_t begin, uint64_t end) {
+  FDBTransaction *tx;
+  uint8_t begin_key[(FDB_KEY_MAX_LENGTH + 1)];
+  uint8_t end_key[FDB_KEY_MAX_LENGTH];
+  uint8_t next_key[(FDB_KEY_MAX_LENGTH + 1)];
+  KeyFormat formats[2] = {KEY_FORMAT_FIXED, KEY_FORMAT_COMPACT};
+  MerkleDelta delta;
+  fdb_error_t err;
+
+  if (fdb_check_error(fdb_setup_transaction(&tx)))
+    return -1;
+
+  for (uint32_t i = 0; i < 2; ++i) {
+    int begin_length =
+        fdb_build_event_key_format(begin_key, formats[i], begin, 0);
+    int end_length = fdb_build_event_key_format(end_key, formats[i], end, 0);
+    int next_length;
+    bool done = false;
+
+    // Archived events leave the summaries with the cluster, whether or not
+    // the segment was written by this run. Their fragments are read before
+    // they are cleared, so a segment is cleared a chunk per transaction.
+    while (!done) {
+      next_length = end_length;
+      memcpy(next_key, end_key, end_length);
+      merkle_delta_init(&delta);
+
+      err = 0;
+      if (fdb_merkle_enabled())
+        err = merkle_delta_subtract_chunk(
+            &delta, tx, begin_key, begin_length, end_key, end_length,
+            FDB_ARCHIVE_CLEAR_KVS, next_key, &next_length);
+
+      if (!err) {
+        done = ((next_length == end_length) &&
+                !memcmp(next_key, end_key, end_length));
+
+        fdb_transaction_clear_range(tx, begin_key, begin_length, next_key,
+                                    next_length);
+        merkle_delta_apply(&delta, tx);
+
+        // The watermark only moves once the whole segment is gone
+        if (done && (formats[i] == KEY_FORMAT_COMPACT))
+          fdb_set_metadata_u64(tx, FDB_ARCHIVE_METADATA, end);
+
+        err = commit_transaction(tx);
+      }
+
+      // A chunk which failed is read and cleared again from its start
+      if ((err < 0) || (err && retry_write(tx, err))) {
+        fdb_transaction_destroy(tx);
+        return -1;
+      }
+      if (err) {
+        done = false;
+        continue;
+      }
+
+      begin_length = next_length;
+      memcpy(begin_key, next_key, next_length);
+    }
+  }
+
+  fdb_transaction_destroy(tx);
+
+  // Success
+  return 0;
+}
+
+uint8_t fdb_event_key_prefix(KeyFormat format) {
+  return (format == KEY_FORMAT_COMPACT) ? FDB_COMPACT_EVENT_PREFIX
+                                        : FDB_EVENT_PREFIX;
+}
 
-  // Initialize transaction
-  if (fdb_check_error(fdb_setup_transaction(&tx)))
-    goto tx_fail;
+uint8_t fdb_build_event_key(uint8_t *fdb_key, uint64_t key, uint32_t fragment) {
+  return fdb_build_event_key_format(fdb_key, fdb_key_format, key, fragment);
+}
 
-  // Add a clear operation for the each event, attempt to apply full batches
-  for (uint32_t i = 0; i < num_events; ++i) {
+uint8_t fdb_build_event_key_format(uint8_t *fdb_key, KeyFormat format,
+                                   uint64_t key, uint32_t fragment) {
+  uint8_t prefix_length = encode_event_key_prefix(fdb_key, format, key);
 
-    add_event_clear_transaction(tx, (events + i));
+  return (prefix_length +
+          encode_event_key_fragment((fdb_key + prefix_length), format,
+                                    fragment));
+}
 
-    if (!(i % CLEAR_BATCH_SIZE)) {
-      if (fdb_send_transaction(tx))
-        goto tx_fail;
-    }
+int key_arena_init(KeyArena *arena, uint32_t capacity) {
+  // Arenas are initialized by the thread which fills them
+  arena->capacity = capacity;
+  arena->keys = placement_alloc_local((uint64_t)capacity * FDB_KEY_MAX_LENGTH);
+  arena->offsets =
+      placement_alloc_local(sizeof(uint32_t) * ((uint64_t)capacity + 1));
+  if (!arena->keys || !arena->offsets) {
+    key_arena_free(arena);
+    return -1;
   }
 
-  // Catch the final, non-full batch
-  if (fdb_send_transaction(tx))
-    goto tx_fail;
+  key_arena_reset(arena);
 
-  // Clean up the transaction
-  fdb_transaction_destroy(tx);
+  // Success
+  return 0;
+}
+
+void key_arena_reset(KeyArena *arena) {
+  arena->num_keys = 0;
+  arena->offsets[0] = 0;
+}
+
+void key_arena_free(KeyArena *arena) {
+  placement_free_local(arena->keys,
+                       ((uint64_t)arena->capacity * FDB_KEY_MAX_LENGTH));
+  placement_free_local(arena->offsets,
+                       (sizeof(uint32_t) * ((uint64_t)arena->capacity + 1)));
+  arena->keys = NULL;
+  arena->offsets = NULL;
+  arena->capacity = 0;
+}
+
+void fdb_append_event_keys(KeyArena *arena, uint64_t key,
+                           uint32_t first_fragment, uint32_t count) {
+  uint32_t start = arena->offsets[arena->num_keys];
+  uint8_t *fdb_key = (arena->keys + start);
+  uint8_t prefix_length;
+
+  if (!count)
+    return;
+
+  // Neighbouring keys share everything but the fragment suffix, so encode the
+  // prefix once and copy it forward
+  prefix_length = encode_event_key_prefix(fdb_key, fdb_key_format, key);
+
+  for (uint32_t i = 0; i < count; ++i) {
+    if (i)
+      memcpy(fdb_key, (arena->keys + start), prefix_length);
+
+    fdb_key += prefix_length;
+    fdb_key += encode_event_key_fragment(fdb_key, fdb_key_format,
+                                         (first_fragment + i));
+
+    arena->offsets[++arena->num_keys] = (uint32_t)(fdb_key - arena->keys);
+  }
+}
+
+uint8_t encode_event_key_prefix(uint8_t *fdb_key, KeyFormat format,
+                                uint64_t key) {
+  uint64_t key_be = to_big_endian_64(key);
+
+  // FoundationDB has a rule that keys beginning with 0xff access a special
+  // key-space, so every key begins with the layout's prefix byte (0x00 or
+  // 0x02), which also keeps the two layouts apart
+  fdb_key[0] = fdb_event_key_prefix(format);
+
+  // Big-endian integers sort in numeric order under FoundationDB's
+  // lexicographic key ordering
+  if (format == KEY_FORMAT_FIXED) {
+    memcpy((fdb_key + 1), &key_be, FDB_KEY_EVENT_LENGTH);
+    return (1 + FDB_KEY_EVENT_LENGTH);
+  }
+
+  // Leading zero bytes are dropped, and a length byte keeps shorter (smaller)
+  // identifiers ordered before longer ones
+  uint8_t length = key ? (uint8_t)((71 - __builtin_clzll(key)) / 8) : 0;
+  fdb_key[1] = length;
+  memcpy((fdb_key + 2), ((uint8_t *)&key_be + (8 - length)), length);
+  return (2 + length);
+}
+
+uint8_t encode_event_key_fragment(uint8_t *fdb_key, KeyFormat format,
+                                  uint32_t fragment) {
+  uint32_t fragment_be = to_big_endian_32(fragment);
+
+  if (format == KEY_FORMAT_FIXED) {
+    memcpy(fdb_key, &fragment_be, FDB_KEY_FRAGMENT_LENGTH);
+    return FDB_KEY_FRAGMENT_LENGTH;
+  }
+
+  // The first fragment, which most events consist of, costs a single byte
+  uint8_t length = fragment ? (uint8_t)((39 - __builtin_clz(fragment)) / 8) : 0;
+  fdb_key[0] = length;
+  memcpy((fdb_key + 1), ((uint8_t *)&fragment_be + (4 - length)), length);
+  return (1 + length);
+}
+
+uint64_t to_big_endian_64(uint64_t value) {
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+  return __builtin_bswap64(value);
+#else
+  return value;
+#endif
+}
+
+uint32_t to_big_endian_32(uint32_t value) {
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+  return __builtin_bswap32(value);
+#else
+  return value;
+#endif
+}
+
+int fdb_parse_event_key(const uint8_t *fdb_key, int key_length, uint64_t *key,
+                        uint32_t *fragment) {
+  uint64_t key_be = 0;
+  uint32_t fragment_be = 0;
+  uint8_t id_length, fragment_length;
+
+  if (key_length < 1)
+    return -1;
+
+  if (fdb_key[0] == FDB_EVENT_PREFIX) {
+    if (key_length != FDB_KEY_TOTAL_LENGTH)
+      return -1;
+
+    memcpy(&key_be, (fdb_key + 1), FDB_KEY_EVENT_LENGTH);
+    memcpy(&fragment_be, (fdb_key + 1 + FDB_KEY_EVENT_LENGTH),
+           FDB_KEY_FRAGMENT_LENGTH);
+  } else if (fdb_key[0] == FDB_COMPACT_EVENT_PREFIX) {
+    if (key_length < 3)
+      return -1;
+
+    id_length = fdb_key[1];
+    if ((id_length > FDB_KEY_EVENT_LENGTH) || (key_length < (3 + id_length)))
+      return -1;
+
+    fragment_length = fdb_key[(2 + id_length)];
+    if ((fragment_length > FDB_KEY_FRAGMENT_LENGTH) ||
+        (key_length != (3 + id_length + fragment_length)))
+      return -1;
+
+    memcpy(((uint8_t *)&key_be + (8 - id_length)), (fdb_key + 2), id_length);
+    memcpy(((uint8_t *)&fragment_be + (4 - fragment_length)),
+           (fdb_key + 3 + id_length), fragment_length);
+  } else {
+    return -1;
+  }
+
+  *key = to_big_endian_64(key_be);
+  *fragment = to_big_endian_32(fragment_be);
 
   // Success
   return 0;
+}
 
-// Failure
-tx_fail:
-  return -1;
+uint8_t fdb_build_metadata_key(uint8_t *fdb_key, const char *name) {
+  size_t name_length = strlen(name);
+
+  if (name_length > (FDB_METADATA_KEY_MAX_LENGTH - 1))
+    name_length = (FDB_METADATA_KEY_MAX_LENGTH - 1);
+
+  fdb_key[0] = FDB_METADATA_PREFIX;
+  memcpy((fdb_key + 1), name, name_length);
+
+  return (uint8_t)(name_length + 1);
 }
 
-int fdb_clear_database(void) {
+void fdb_set_metadata_u64(FDBTransaction *tx, const char *name,
+                          uint64_t value) {
+  uint8_t key[FDB_METADATA_KEY_MAX_LENGTH];
+  uint8_t key_length = fdb_build_metadata_key(key, name);
+  uint8_t encoded[sizeof(uint64_t)];
+
+  // Big-endian, so that values are human-readable in fdbcli
+  for (uint8_t i = 0; i < sizeof(uint64_t); ++i) {
+    encoded[i] = (uint8_t)(value >> (8 * (sizeof(uint64_t) - 1 - i)));
+  }
+
+  fdb_transaction_set(tx, key, key_length, encoded, sizeof(uint64_t));
+}
+
+int fdb_write_metadata_u64(const char *name, uint64_t value) {
   FDBTransaction *tx;
-  uint8_t start_key[1] = {0};
-  uint8_t end_key[1] = {0xFF};
 
   // Initialize transaction
   if (fdb_check_error(fdb_setup_transaction(&tx)))
     goto tx_fail;
 
-  // Add clear operation to transaction
-  fdb_transaction_clear_range(tx, start_key, 1, end_key, 1);
+  fdb_set_metadata_u64(tx, name, value);
 
-  // Catch the final, non-full batch
+  // Attempt to apply the transaction
   if (fdb_send_transaction(tx))
     goto tx_fail;
 
@@ -512,17 +2169,48 @@ tx_fail:
   return -1;
 }
 
-void fdb_build_event_key(uint8_t *fdb_key, uint64_t key, uint32_t fragment) {
-  // FoundationDB has a rule that keys beginning with 0xff access a special
-  // key-space, so need to prepend a null byte
-  fdb_key[0] = 0;
+int fdb_read_metadata_u64(const char *name, uint64_t *value) {
+  FDBTransaction *tx;
+  FDBFuture *future;
+  fdb_bool_t present;
+  const uint8_t *out_value;
+  int out_length;
+  uint8_t key[FDB_METADATA_KEY_MAX_LENGTH];
+  uint8_t key_length = fdb_build_metadata_key(key, name);
 
-  for (uint8_t i = 0; i < FDB_KEY_EVENT_LENGTH; ++i) {
-    fdb_key[(FDB_KEY_EVENT_LENGTH - i)] = ((uint8_t *)(&key))[i];
-  }
-  for (uint8_t i = 0; i < FDB_KEY_FRAGMENT_LENGTH; ++i) {
-    fdb_key[(FDB_KEY_TOTAL_LENGTH - (i + 1))] = ((uint8_t *)(&fragment))[i];
+  if (fdb_check_error(fdb_setup_transaction(&tx)))
+    return -1;
+
+  future = fdb_transaction_get(tx, key, key_length, 0);
+  if (fdb_check_error(fdb_future_block_until_ready(future)))
+    goto tx_fail;
+  if (fdb_check_error(fdb_future_get_error(future)))
+    goto tx_fail;
+  if (fdb_check_error(
+          fdb_future_get_value(future, &present, &out_value, &out_length)))
+    goto tx_fail;
+
+  if (present) {
+    if (out_length != sizeof(uint64_t))
+      goto tx_fail;
+
+    *value = 0;
+    for (uint8_t i = 0; i < sizeof(uint64_t); ++i) {
+      *value = ((*value << 8) | out_value[i]);
+    }
   }
+
+  fdb_future_destroy(future);
+  fdb_transaction_destroy(tx);
+
+  // Success (or not found)
+  return present ? 0 : 1;
+
+// Failure
+tx_fail:
+  fdb_future_destroy(future);
+  fdb_transaction_destroy(tx);
+  return -1;
 }
 
 fdb_error_t fdb_check_error(fdb_error_t err) {
@@ -546,50 +2234,518 @@ uint32_t add_event_set_transactions(FDBTransaction *tx, FragmentedEvent *event,
   uint32_t end_pos =
       (max_pos < event->num_fragments) ? max_pos : event->num_fragments;
   uint32_t num_kvp = end_pos - start_pos;
-  uint8_t key[FDB_KEY_TOTAL_LENGTH] = {0};
+  uint8_t key[FDB_KEY_MAX_LENGTH] = {0};
+  uint8_t key_length;
 
-  // Special rules for first fragment
-  if (!start_pos) {
-    // First fragment contains header and has an irregularly sized payload
-    uint32_t value_length = event->header_length + event->payload_length;
-    uint8_t value[value_length];
+  uint8_t value[FRAGMENT_VALUE_MAX_SIZE];
+  MerkleDelta delta;
+  MerkleDelta *summary = fdb_merkle_enabled() ? &delta : NULL;
+  PresenceDelta present;
 
-    memcpy(value, event->header, event->header_length);
-    memcpy((value + event->header_length), event->fragments[0],
-           event->payload_length);
+  merkle_delta_init(&delta);
 
-    fdb_build_event_key(key, event->id, 0);
+  // Special rules for first fragment
+  if (!start_pos) {
+    key_length = fdb_build_event_key(key, event->id, 0);
 
-    fdb_transaction_set(tx, key, FDB_KEY_TOTAL_LENGTH, value, value_length);
+    // First fragment contains header and has an irregularly sized payload
+    add_fragment_set_transaction(tx, key, key_length, value, event->header,
+                                 event->header_length, event->fragments[0],
+                                 event->payload_length, event->id, 0, summary);
 
     ++start_pos;
   }
 
   for (uint32_t i = start_pos; i < end_pos; ++i) {
     // Setup key for event fragment
-    fdb_build_event_key(key, event->id, i);
+    key_length = fdb_build_event_key(key, event->id, i);
 
     // Add write operation to transaction
-    fdb_transaction_set(tx, key, FDB_KEY_TOTAL_LENGTH, event->fragments[i],
-                        OPTIMAL_VALUE_SIZE);
+    add_fragment_set_transaction(tx, key, key_length, value, NULL, 0,
+                                 event->fragments[i], OPTIMAL_VALUE_SIZE,
+                                 event->id, i, summary);
+  }
+
+  if (summary)
+    merkle_delta_apply(summary, tx);
+
+  // The event is present once the transaction with its last fragment commits
+  if (fdb_presence_enabled() && num_kvp &&
+      (end_pos == event->num_fragments)) {
+    presence_delta_init(&present);
+    presence_delta_add(&present, tx, event->id);
+    presence_delta_apply(&present, tx);
   }
 
   return num_kvp;
 }
 
-void add_event_clear_transaction(FDBTransaction *tx, FragmentedEvent *event) {
-  uint8_t range_start_key[FDB_KEY_TOTAL_LENGTH] = {0};
-  uint8_t range_end_key[FDB_KEY_TOTAL_LENGTH] = {0};
+uint32_t add_planned_set_transactions(FDBTransaction *tx,
+                                      const EventBatch *batch,
+                                      const BatchPlan *plan, uint32_t tx_index,
+                                      KeyArena *keys, uint64_t *bytes) {
+  uint32_t event = plan->tx_event[tx_index];
+  uint32_t fragment = plan->tx_fragment[tx_index];
+  uint64_t start = ((uint64_t)tx_index * plan->batch_size);
+  uint64_t remaining = (plan->num_fragments - start);
+  uint32_t num_kvp =
+      (remaining < plan->batch_size) ? (uint32_t)remaining : plan->batch_size;
+  uint8_t value[FRAGMENT_VALUE_MAX_SIZE];
+  uint8_t header[MAX_HEADER_SIZE];
+  uint32_t encoded = 0;
+  MerkleDelta delta;
+  MerkleDelta *summary = fdb_merkle_enabled() ? &delta : NULL;
+  PresenceDelta present;
+  bool presence = fdb_presence_enabled();
+
+  *bytes = 0;
+  merkle_delta_init(&delta);
+  presence_delta_init(&present);
+  key_arena_reset(keys);
+
+  // Encode every key of the transaction into the arena, one run of fragments
+  // per event
+  while (encoded < num_kvp) {
+    uint32_t run = (batch->num_fragments[event] - fragment);
+
+    if (run > (num_kvp - encoded))
+      run = (num_kvp - encoded);
+
+    fdb_append_event_keys(keys, batch->ids[event], fragment, run);
+    encoded += run;
+    fragment += run;
+
+    // Step over finished (and empty) events
+    while ((encoded < num_kvp) && (fragment == batch->num_fragments[event])) {
+      ++event;
+      fragment = 0;
+    }
+  }
 
-  // Setup start key for range
-  fdb_build_event_key(range_start_key, event->id, 0);
+  // Then add the writes, pairing each key with its fragment
+  event = plan->tx_event[tx_index];
+  fragment = plan->tx_fragment[tx_index];
 
-  // Setup end key for range
-  fdb_build_event_key(range_end_key, event->id, event->num_fragments);
+  for (uint32_t i = 0; i < num_kvp; ++i) {
+    uint32_t key_length = (keys->offsets[(i + 1)] - keys->offsets[i]);
+    uint8_t header_length = 0;
+    const uint8_t *payload;
+    uint32_t length;
 
-  // Add clear operation to transaction
-  fdb_transaction_clear_range(tx, range_start_key, FDB_KEY_TOTAL_LENGTH,
-                              range_end_key, FDB_KEY_TOTAL_LENGTH);
+    while (fragment == batch->num_fragments[event]) {
+      ++event;
+      fragment = 0;
+    }
+
+    payload = event_batch_fragment(batch, event, fragment, &length);
+
+    // First fragment contains header and has an irregularly sized payload
+    if (!fragment)
+      header_length = build_header(header, (batch->num_fragments[event] - 1));
+
+    length = add_fragment_set_transaction(
+        tx, (keys->keys + keys->offsets[i]), (uint8_t)key_length, value, header,
+        header_length, payload, length, batch->ids[event], fragment, summary);
+    *bytes += (key_length + length);
+
+    // The event is present once the transaction with its last fragment commits
+    if (presence && ((fragment + 1) == batch->num_fragments[event]))
+      presence_delta_add(&present, tx, batch->ids[event]);
+    ++fragment;
+  }
+
+  if (summary)
+    merkle_delta_apply(summary, tx);
+  if (presence)
+    presence_delta_apply(&present, tx);
+
+  return num_kvp;
+}
+
+fdb_error_t subtract_rewritten_fragments(FDBTransaction *tx, uint64_t event_id,
+                                         uint32_t start_pos, uint32_t end_pos) {
+  uint8_t begin_key[FDB_KEY_MAX_LENGTH];
+  uint8_t end_key[FDB_KEY_MAX_LENGTH];
+  uint8_t begin_length = fdb_build_event_key(begin_key, event_id, start_pos);
+  uint8_t end_length = fdb_build_event_key(end_key, event_id, end_pos);
+  MerkleDelta delta;
+  fdb_error_t err;
+
+  merkle_delta_init(&delta);
+
+  err = merkle_delta_subtract_stored(&delta, tx, begin_key, begin_length,
+                                     end_key, end_length);
+  if (!err)
+    merkle_delta_apply(&delta, tx);
+
+  // Success or failure
+  return err;
+}
+
+fdb_error_t subtract_rewritten_planned(FDBTransaction *tx,
+                                       const EventBatch *batch,
+                                       const BatchPlan *plan,
+                                       uint32_t tx_index) {
+  uint32_t event = plan->tx_event[tx_index];
+  uint32_t fragment = plan->tx_fragment[tx_index];
+  uint64_t start = ((uint64_t)tx_index * plan->batch_size);
+  uint64_t remaining = (plan->num_fragments - start);
+  uint32_t num_kvp =
+      (remaining < plan->batch_size) ? (uint32_t)remaining : plan->batch_size;
+
+  // One run of fragments per event, as the transaction's keys are encoded
+  while (num_kvp) {
+    uint32_t run;
+    fdb_error_t err;
+
+    // Step over finished (and empty) events
+    while (fragment == batch->num_fragments[event]) {
+      ++event;
+      fragment = 0;
+    }
+
+    run = (batch->num_fragments[event] - fragment);
+    if (run > num_kvp)
+      run = num_kvp;
+
+    err = subtract_rewritten_fragments(tx, batch->ids[event], fragment,
+                                       (fragment + run));
+    if (err)
+      return err;
+
+    fragment += run;
+    num_kvp -= run;
+  }
+
+  // Success
+  return 0;
+}
+
+uint32_t add_fragment_set_transaction(FDBTransaction *tx, const uint8_t *key,
+                                      uint8_t key_length, uint8_t *value,
+                                      const uint8_t *header,
+                                      uint8_t header_length,
+                                      const uint8_t *payload,
+                                      uint32_t payload_length,
+                                      uint64_t event_id, uint32_t fragment,
+                                      MerkleDelta *delta) {
+  uint32_t value_length = (header_length + payload_length);
+
+  // Summaries are of plaintext, so that encrypted and plaintext copies compare
+  if (delta &&
+      merkle_delta_add(delta, tx, event_id, fragment, header, header_length,
+                       payload, payload_length, false)) {
+    fdb_transaction_cancel(tx);
+    return 0;
+  }
+
+  // Plaintext fragments without a header are written straight from the event
+  if (!cipher_enabled() && !header_length) {
+    fdb_transaction_set(tx, key, key_length, payload, payload_length);
+    return payload_length;
+  }
+
+  memcpy(value, header, header_length);
+
+  if (!cipher_enabled()) {
+    memcpy((value + header_length), payload, payload_length);
+  } else {
+    // The header stays readable for scrubbing and analysis, but is
+    // authenticated along with the payload
+    if (cipher_seal((value + header_length), value, header_length, payload,
+                    payload_length, event_id, fragment)) {
+      fdb_transaction_cancel(tx);
+      return 0;
+    }
+
+    value_length += CIPHER_OVERHEAD;
+  }
+
+  fdb_transaction_set(tx, key, key_length, value, value_length);
+  return value_length;
+}
+
+int copy_fragment_payload(uint8_t *out, const uint8_t *value,
+                          uint8_t header_length, uint32_t payload_length,
+                          uint64_t event_id, uint32_t fragment) {
+  if (cipher_enabled())
+    return cipher_open(out, value, header_length, (value + header_length),
+                       payload_length, event_id, fragment);
+
+  memcpy(out, (value + header_length), payload_length);
+
+  // Success
+  return 0;
+}
+
+int write_planned_transactions(BatchWriter *writer) {
+  const EventBatch *batch = writer->batch;
+  const BatchPlan *plan = writer->plan;
+  FDBTransaction *tx;
+  SlowOp op;
+  KeyArena keys;
+
+  // Every key of a transaction is encoded into one contiguous arena
+  if (key_arena_init(&keys, plan->batch_size))
+    goto tx_fail;
+
+  // Initialize transaction
+  if (fdb_check_error(fdb_setup_transaction(&tx))) {
+    key_arena_free(&keys);
+    goto tx_fail;
+  }
+
+  while (!atomic_load_explicit(&writer->failed, memory_order_relaxed)) {
+    uint32_t t = atomic_fetch_add(&writer->next_tx, 1);
+    uint32_t retries = 0;
+    bool landed = false;
+    fdb_error_t err;
+
+    if (t >= plan->num_txs)
+      break;
+
+    // Planned transactions are built from the plan alone, so a failed one is
+    // simply built again
+    do {
+      fdb_slow_log_begin(&op, SLOW_OP_WRITE, batch->ids[plan->tx_event[t]],
+                         tx);
+      op.retries = retries++;
+
+      // An earlier attempt may have committed, and added to the summaries
+      err = 0;
+      if (landed && fdb_merkle_enabled())
+        err = subtract_rewritten_planned(tx, batch, plan, t);
+
+      if (!err) {
+        op.num_kvs = add_planned_set_transactions(tx, batch, plan, t, &keys,
+                                                  &op.num_bytes);
+        err = send_recorded_transaction(tx, &op);
+      }
+      if (err == FDB_ERROR_COMMIT_UNKNOWN_RESULT)
+        landed = true;
+      if ((err < 0) || (err && retry_write(tx, err))) {
+        fdb_transaction_destroy(tx);
+        key_arena_free(&keys);
+        goto tx_fail;
+      }
+    } while (err);
+  }
+
+  // Clean up the transaction
+  fdb_transaction_destroy(tx);
+  key_arena_free(&keys);
+
+  // Success
+  return 0;
+
+// Failure
+tx_fail:
+  atomic_store(&writer->failed, true);
+  return -1;
+}
+
+void *batch_writer_thread_func(void *arg) {
+  write_planned_transactions((BatchWriter *)arg);
+  return NULL;
+}
+
+fdb_error_t commit_transaction(FDBTransaction *tx) {
+  FDBFuture *future = fdb_transaction_commit(tx);
+  fdb_error_t err;
+
+  // Wait for the future to be ready, and check that it did not return any
+  // errors
+  err = fdb_future_block_until_ready(future);
+  if (!err)
+    err = fdb_future_get_error(future);
+  fdb_future_destroy(future);
+
+  // Delete existing transaction object and create a new one
+  if (!err)
+    fdb_transaction_reset(tx);
+
+  return err;
+}
+
+fdb_error_t send_recorded_transaction(FDBTransaction *tx, SlowOp *op) {
+  FDBFuture *future;
+  double t_phase;
+  fdb_error_t injected = fdb_fault_inject(FAULT_SITE_COMMIT);
+  fdb_error_t err = 0;
+
+  // Injected faults stand in for the commit, except that a commit with an
+  // unknown result is applied first
+  if (injected && (injected != FDB_ERROR_COMMIT_UNKNOWN_RESULT)) {
+    if (op->enabled)
+      fdb_slow_log_end(op);
+    return injected;
+  }
+
+  if (!op->enabled) {
+    err = commit_transaction(tx);
+    return err ? err : injected;
+  }
+
+  // Commits implicitly fetch a read version, so fetch it explicitly first to
+  // separate the two phases
+  t_phase = slow_log_time_ms();
+  future = fdb_transaction_get_read_version(tx);
+  err = fdb_future_block_until_ready(future);
+  if (!err)
+    err = fdb_future_get_error(future);
+  fdb_future_destroy(future);
+  op->t_grv = (slow_log_time_ms() - t_phase);
+
+  if (!err) {
+    t_phase = slow_log_time_ms();
+    err = commit_transaction(tx);
+    op->t_commit = (slow_log_time_ms() - t_phase);
+  }
+
+  fdb_slow_log_end(op);
+
+  return err ? err : injected;
+}
+
+int retry_write(FDBTransaction *tx, fdb_error_t err) {
+  FDBFuture *future;
+
+  // Let FoundationDB decide whether the error is retryable, and back off
+  future = fdb_transaction_on_error(tx, err);
+  if (fdb_check_error(fdb_future_block_until_ready(future)) ||
+      fdb_check_error(fdb_future_get_error(future))) {
+    fdb_future_destroy(future);
+    return -1;
+  }
+  fdb_future_destroy(future);
+
+  metrics_add(METRIC_WRITE_RETRIES, 1);
+
+  // Success
+  return 0;
+}
+
+int fdb_wait_future(FDBTransaction *tx, FDBFuture *future, uint32_t *attempts,
+                    uint32_t max_attempts) {
+  fdb_error_t err = fdb_future_block_until_ready(future);
+
+  if (!err)
+    err = fdb_future_get_error(future);
+  if (!err)
+    return 0;
+
+  fdb_future_destroy(future);
+  if (++*attempts > max_attempts) {
+    fdb_check_error(err);
+    return -1;
+  }
+
+  // Let FoundationDB decide whether the error is retryable, and back off
+  future = fdb_transaction_on_error(tx, err);
+  err = fdb_future_block_until_ready(future);
+  if (!err)
+    err = fdb_future_get_error(future);
+  fdb_future_destroy(future);
+
+  return fdb_check_error(err) ? -1 : 1;
+}
+
+uint64_t batch_bytes(FragmentedEvent *event, uint32_t start_pos,
+                     uint32_t num_kvp) {
+  uint64_t end_pos = ((uint64_t)start_pos + num_kvp);
+  uint64_t bytes;
+
+  if (!num_kvp)
+    return 0;
+
+  // Sealed values carry an authentication tag
+  bytes = ((uint64_t)num_kvp * cipher_overhead());
+
+  // Compact keys are the prefix byte, then the identifier and the fragment
+  // number, each as a length byte and its bytes without leading zeros. Only
+  // the fragment number's length varies within an event: fragments in
+  // [2^(8(w-1)), 2^(8w)) take w bytes, and fragment 0 none
+  if (fdb_key_format == KEY_FORMAT_FIXED) {
+    bytes += ((uint64_t)num_kvp * FDB_KEY_TOTAL_LENGTH);
+  } else {
+    uint8_t id_length =
+        event->id ? (uint8_t)((71 - __builtin_clzll(event->id)) / 8) : 0;
+
+    bytes += ((uint64_t)num_kvp * (3 + id_length));
+    for (uint64_t w = 1, low = 1; w <= FDB_KEY_FRAGMENT_LENGTH;
+         ++w, low <<= 8) {
+      uint64_t high = (low << 8);
+      uint64_t first = (start_pos > low) ? start_pos : low;
+      uint64_t last = (end_pos < high) ? end_pos : high;
+
+      if (first < last)
+        bytes += ((last - first) * w);
+    }
+  }
+
+  // First fragment carries the header and an irregularly sized payload
+  if (!start_pos) {
+    bytes += (event->header_length + event->payload_length);
+    --num_kvp;
+  }
+
+  return (bytes + ((uint64_t)num_kvp * OPTIMAL_VALUE_SIZE));
+}
+
+fdb_error_t add_event_clear_transaction(FDBTransaction *tx,
+                                        FragmentedEvent *event,
+                                        PresenceDelta *absent) {
+  uint8_t range_start_key[2][FDB_KEY_MAX_LENGTH] = {{0}};
+  uint8_t range_end_key[2][FDB_KEY_MAX_LENGTH] = {{0}};
+  uint8_t start_length[2], end_length[2];
+  MerkleDelta delta;
+
+  // Both layouts are cleared, so that no stale copy survives a migration
+  for (KeyFormat format = KEY_FORMAT_FIXED; format <= KEY_FORMAT_COMPACT;
+       ++format) {
+    // Setup start key for range
+    start_length[format] = fdb_build_event_key_format(range_start_key[format],
+                                                      format, event->id, 0);
+
+    // Setup end key for range
+    end_length[format] = fdb_build_event_key_format(
+        range_end_key[format], format, event->id, event->num_fragments);
+  }
+
+  // Take the stored fragments out of the summaries, before they are cleared
+  if (fdb_merkle_enabled()) {
+    merkle_delta_init(&delta);
+
+    for (KeyFormat format = KEY_FORMAT_FIXED; format <= KEY_FORMAT_COMPACT;
+         ++format) {
+      fdb_error_t err = merkle_delta_subtract_stored(
+          &delta, tx, range_start_key[format], start_length[format],
+          range_end_key[format], end_length[format]);
+
+      if (err)
+        return err;
+    }
+
+    merkle_delta_apply(&delta, tx);
+  }
+
+  if (fdb_presence_enabled()) {
+    fdb_error_t err = absent ? presence_delta_remove(absent, tx, event->id)
+                             : presence_clear(tx, event->id);
+
+    if (err)
+      return err;
+  }
+
+  // Add clear operations to transaction
+  for (KeyFormat format = KEY_FORMAT_FIXED; format <= KEY_FORMAT_COMPACT;
+       ++format)
+    fdb_transaction_clear_range(tx, range_start_key[format],
+                                start_length[format], range_end_key[format],
+                                end_length[format]);
+
+  // Success
+  return 0;
 }
 
 void check_error_bail(fdb_error_t err) {
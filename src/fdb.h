@@ -15,15 +15,62 @@
 
 #include <foundationdb/fdb_c.h>
 #include <pthread.h>
+#include <stdbool.h>
 #include <stdint.h>
 
 #include "event.h"
+#include "event_batch.h"
 
+// Length of an event key in the fixed layout
 #define FDB_KEY_TOTAL_LENGTH                                                   \
   (1 + FDB_KEY_EVENT_LENGTH + FDB_KEY_FRAGMENT_LENGTH)
 #define FDB_KEY_EVENT_LENGTH 8
 #define FDB_KEY_FRAGMENT_LENGTH 4
 
+// Maximum length of an event key in any layout
+#define FDB_KEY_MAX_LENGTH                                                     \
+  (1 + (1 + FDB_KEY_EVENT_LENGTH) + (1 + FDB_KEY_FRAGMENT_LENGTH))
+
+// First byte of every key, which partitions the key-space
+#define FDB_EVENT_PREFIX 0x00
+#define FDB_METADATA_PREFIX 0x01
+#define FDB_COMPACT_EVENT_PREFIX 0x02
+#define FDB_BLOB_PREFIX 0x03
+#define FDB_MERKLE_PREFIX 0x04
+#define FDB_PRESENCE_PREFIX 0x05
+
+#define FDB_METADATA_KEY_MAX_LENGTH 64
+
+// Name of the metadata entry storing the key layout of new events
+#define FDB_KEY_FORMAT_METADATA "key_format"
+
+// Name of the metadata entry storing the id below which events are archived
+#define FDB_ARCHIVE_METADATA "archive_watermark"
+
+// Maximum key-value pairs read per archive export batch
+#define FDB_ARCHIVE_SCAN_KVS 1000
+
+// Maximum key-value pairs read and cleared per transaction when archived
+// events leave the cluster with summaries enabled
+#define FDB_ARCHIVE_CLEAR_KVS 1000
+
+//==============================================================================
+// Types
+//==============================================================================
+
+typedef enum key_format_t {
+  KEY_FORMAT_FIXED,   // Prefix, 8-byte event id, 4-byte fragment number.
+  KEY_FORMAT_COMPACT, // Prefix, then the event id and fragment number each as
+                      // a length byte followed by minimal big-endian bytes.
+} KeyFormat;
+
+typedef struct key_arena_t {
+  uint8_t *keys;     // Keys, packed back to back.
+  uint32_t *offsets; // Offset of each key, plus the end of the last key.
+  uint32_t num_keys; // Number of keys in the arena.
+  uint32_t capacity; // Maximum number of keys.
+} KeyArena;
+
 //==============================================================================
 // Variables
 //==============================================================================
@@ -39,7 +86,8 @@ extern pthread_t fdb_network_thread;
 void fdb_init_database(void);
 
 /// Initialize an asynchronous helper process for interacting with a
-/// FoundationDB cluster.
+/// FoundationDB cluster. The thread is pinned to the CPUs configured for
+/// THREAD_ROLE_NETWORK, if any (see placement.h).
 void fdb_init_network_thread(void);
 
 /// Shutdown the connection to a FoundationDB cluster.
@@ -57,6 +105,17 @@ int fdb_shutdown_network_thread(void);
 /// @return -1  Failure.
 int fdb_set_batch_size(uint32_t batch_size);
 
+/// Set how event writes and clears are retried after a retryable error. Must be
+/// called after fdb_init_database().
+///
+/// @param[in] retry_limit   Retries of a transaction before it fails, or -1
+///                          for no limit.
+/// @param[in] max_delay_ms  Longest backoff between retries in ms.
+///
+/// @return  0  Success.
+/// @return -1  Failure.
+int fdb_set_retry_policy(int64_t retry_limit, int64_t max_delay_ms);
+
 /// Setup a handle for a new FoundationDB transaction.
 ///
 /// @param[in] tx  Memory address to write the new transaction handle into.
@@ -119,7 +178,20 @@ int fdb_write_fragmented_event_array(FragmentedEvent *f_events,
 /// @return -1  Failure
 int fdb_write_event_array(Event *events, uint32_t num_events);
 
+/// Write a structure-of-arrays batch of events. The batch is first planned
+/// into transactions of the configured batch size, which are then built and
+/// committed by a pool of threads, including the calling thread.
+///
+/// @param[in] batch        Handle for the batch of events to write.
+/// @param[in] num_threads  Number of threads to write with.
+///
+/// @return  0  Success.
+/// @return -1  Failure.
+int fdb_write_event_batch(EventBatch *batch, uint32_t num_threads);
+
 /// Read event fragments from the database and combine them into one event.
+/// Reads longer than the transaction lifetime roll over to fresh transactions,
+/// continuing where they left off.
 ///
 /// @param[in] event  Handle for the event to write to.
 ///
@@ -127,7 +199,9 @@ int fdb_write_event_array(Event *events, uint32_t num_events);
 /// @return -1  Failure.
 int fdb_read_event(Event *event);
 
-/// Read an array of events from the database.
+/// Read an array of events from the database. When reads are pinned, every
+/// event is read at the same read version for as long as that version stays
+/// readable, and at one fresh version after that.
 ///
 /// @param[in] events       Handle for the event array.
 /// @param[in] num_events   Number of events in array.
@@ -136,6 +210,22 @@ int fdb_read_event(Event *event);
 /// @return -1  Failure.
 int fdb_read_event_array(Event *events, uint32_t num_events);
 
+/// Read a set of events, given in any order and possibly repeated, from the
+/// database. Nearby identifiers are read with one range read, and the range
+/// reads of a round are all in flight at once, so the set costs a few round
+/// trips rather than one per event. A range is only extended over a gap of
+/// unrequested identifiers up to max_gap wide, as their fragments are read and
+/// discarded.
+///
+/// @param[in] events      Handle for the event array. Event ids must be set.
+/// @param[in] num_events  Number of events in array.
+/// @param[in] max_gap     Maximum number of unrequested identifiers to read
+///                        over when merging two ranges.
+///
+/// @return  0  Success.
+/// @return -1  Failure.
+int fdb_read_event_set(Event *events, uint32_t num_events, uint64_t max_gap);
+
 /// Remove a single fragmented event from the database.
 ///
 /// @param[in] event  Handle for the event to remove.
@@ -144,7 +234,11 @@ int fdb_read_event_array(Event *events, uint32_t num_events);
 /// @return -1  Failure.
 int fdb_clear_event(FragmentedEvent *event);
 
-/// Remove an array of fragmented events from the database.
+/// Remove an array of fragmented events from the database, in batches of one
+/// transaction each, which are retried on retryable errors. Batches are
+/// smaller when summaries or the present-id bitmap are enabled, since each
+/// clear then reads first. On failure, the batches before the failed one stay
+/// cleared.
 ///
 /// @param[in] events       Handle for the array of events to remove.
 /// @param[in] num_events   Number of events in the array.
@@ -159,12 +253,182 @@ int fdb_clear_event_array(FragmentedEvent *events, uint32_t num_events);
 /// @return -1  Failure.
 int fdb_clear_database(void);
 
-/// Build the FoundationDB key for an event fragment.
+/// Set whether reads are pinned to a consistent read version. Pinned reads see
+/// a single snapshot of the database until its version expires, after which
+/// they move to a fresh version. Events never change once written, so only the
+/// set of events visible can differ between the two.
+///
+/// @param[in] pinned  Whether reads are pinned.
+void fdb_set_pinned_reads(bool pinned);
+
+/// Set the key layout used for new event keys in this process.
+///
+/// @param[in] format  The key layout.
+void fdb_set_key_format(KeyFormat format);
+
+/// Get the key layout used for new event keys in this process.
+///
+/// @return  The key layout.
+KeyFormat fdb_get_key_format(void);
+
+/// Load the key layout of the database from its metadata. Databases without
+/// the metadata entry use the fixed layout.
+///
+/// @return  0  Success.
+/// @return -1  Failure.
+int fdb_load_key_format(void);
+
+/// Move every event key-value pair into a new key layout, and record the new
+/// layout in the database metadata. New events are written in the new layout
+/// as soon as the migration starts, and events are readable in either layout
+/// throughout, except that events with more than batch_kvs fragments are moved
+/// in several transactions and may be briefly unreadable. Safe to rerun after
+/// an interruption.
+///
+/// @param[in] format     The key layout to migrate to.
+/// @param[in] batch_kvs  Maximum key-value pairs moved per transaction.
+///
+/// @return  Number of key-value pairs moved.
+/// @return -1  Failure.
+int64_t fdb_migrate_keys(KeyFormat format, uint32_t batch_kvs);
+
+/// Export the events below a watermark into archive segments in a directory,
+/// then clear them from the cluster, one segment at a time. Archived events
+/// stay readable through the read functions, which serve them from the mapped
+/// segments. The archive must either be closed or open on the same directory.
+/// Safe to rerun after an interruption: a segment written but not yet cleared
+/// from the cluster is cleared first.
+///
+/// @param[in] dir         Directory holding the segments.
+/// @param[in] watermark   Events with lower ids are archived.
+/// @param[in] max_events  Maximum number of events per segment.
+///
+/// @return  Number of events archived.
+/// @return -1  Failure.
+int64_t fdb_archive_events(const char *dir, uint64_t watermark,
+                           uint32_t max_events);
+
+/// Get the first byte of every event key in a key layout.
 ///
-/// @param[in] fdb_key   Pointer to the write location for the FoundationDB key.
+/// @param[in] format  The key layout.
+///
+/// @return  The key prefix.
+uint8_t fdb_event_key_prefix(KeyFormat format);
+
+/// Build the FoundationDB key for an event fragment in the current layout.
+///
+/// @param[in] fdb_key   Pointer to the write location for the FoundationDB key
+///                      (at least FDB_KEY_MAX_LENGTH bytes).
 /// @param[in] key       The unique event identifier.
 /// @param[in] fragment  The fragment number.
-void fdb_build_event_key(uint8_t *fdb_key, uint64_t key, uint32_t fragment);
+///
+/// @return  The length of the key in bytes.
+uint8_t fdb_build_event_key(uint8_t *fdb_key, uint64_t key, uint32_t fragment);
+
+/// Build the FoundationDB key for an event fragment in a given layout.
+///
+/// @param[in] fdb_key   Pointer to the write location for the FoundationDB key
+///                      (at least FDB_KEY_MAX_LENGTH bytes).
+/// @param[in] format    The key layout.
+/// @param[in] key       The unique event identifier.
+/// @param[in] fragment  The fragment number.
+///
+/// @return  The length of the key in bytes.
+uint8_t fdb_build_event_key_format(uint8_t *fdb_key, KeyFormat format,
+                                   uint64_t key, uint32_t fragment);
+
+/// Allocate a key arena on the NUMA node of the calling thread, which should be
+/// the one filling it.
+///
+/// @param[in] arena     Handle for the arena.
+/// @param[in] capacity  Maximum number of keys.
+///
+/// @return  0  Success.
+/// @return -1  Failure.
+int key_arena_init(KeyArena *arena, uint32_t capacity);
+
+/// Remove every key from a key arena.
+///
+/// @param[in] arena  Handle for the arena.
+void key_arena_reset(KeyArena *arena);
+
+/// Release the memory of a key arena.
+///
+/// @param[in] arena  Handle for the arena.
+void key_arena_free(KeyArena *arena);
+
+/// Append the FoundationDB keys for a run of consecutive fragments of an event
+/// to a key arena, in the current layout. The arena must have room for them.
+///
+/// @param[in] arena           Handle for the arena.
+/// @param[in] key             The unique event identifier.
+/// @param[in] first_fragment  The fragment number of the first key.
+/// @param[in] count           The number of keys to append.
+void fdb_append_event_keys(KeyArena *arena, uint64_t key,
+                           uint32_t first_fragment, uint32_t count);
+
+/// Parse the event identifier and fragment number out of a FoundationDB key in
+/// either layout.
+///
+/// @param[in] fdb_key     The FoundationDB key.
+/// @param[in] key_length  Length of the key in bytes.
+/// @param[in] key         Address to write the unique event identifier into.
+/// @param[in] fragment    Address to write the fragment number into.
+///
+/// @return  0  Success.
+/// @return -1  Failure (not an event key).
+int fdb_parse_event_key(const uint8_t *fdb_key, int key_length, uint64_t *key,
+                        uint32_t *fragment);
+
+/// Build the FoundationDB key for a named metadata entry.
+///
+/// @param[in] fdb_key  Pointer to the write location for the FoundationDB key
+///                     (at least FDB_METADATA_KEY_MAX_LENGTH bytes).
+/// @param[in] name     Name of the metadata entry.
+///
+/// @return  The length of the key in bytes.
+uint8_t fdb_build_metadata_key(uint8_t *fdb_key, const char *name);
+
+/// Add a write of a 64-bit metadata entry to a FoundationDB transaction.
+///
+/// @param[in] tx     FoundationDB transaction handle.
+/// @param[in] name   Name of the metadata entry.
+/// @param[in] value  Value to store.
+void fdb_set_metadata_u64(FDBTransaction *tx, const char *name,
+                          uint64_t value);
+
+/// Write a 64-bit metadata entry in its own transaction.
+///
+/// @param[in] name   Name of the metadata entry.
+/// @param[in] value  Value to store.
+///
+/// @return  0  Success.
+/// @return -1  Failure.
+int fdb_write_metadata_u64(const char *name, uint64_t value);
+
+/// Read a 64-bit metadata entry in its own transaction.
+///
+/// @param[in] name   Name of the metadata entry.
+/// @param[in] value  Address to write the value into.
+///
+/// @return  0  Success.
+/// @return  1  Entry not found (value is untouched).
+/// @return -1  Failure.
+int fdb_read_metadata_u64(const char *name, uint64_t *value);
+
+/// Wait for a future of a read, retrying its transaction with the FoundationDB
+/// back-off on retryable errors, up to a limited number of attempts.
+///
+/// @param[in] tx            FoundationDB transaction handle.
+/// @param[in] future        The future (destroyed on error).
+/// @param[in] attempts      Number of attempts so far, incremented on error.
+/// @param[in] max_attempts  Maximum number of attempts before giving up.
+///
+/// @return  0  The future is ready.
+/// @return  1  The transaction was reset and should be retried.
+/// @return -1  Failure.
+int fdb_wait_future(FDBTransaction *tx, FDBFuture *future, uint32_t *attempts,
+                    uint32_t max_attempts);
 
 /// Check if a FoundationDB API command returned an error. If so, print the
 /// error description.
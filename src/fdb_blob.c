@@ -0,0 +1,593 @@
+/// @file fdb_blob.c
+///
+/// Definitions for the snapshot blob store.
+
+#define _GNU_SOURCE
+
+#include <fcntl.h>
+#include <foundationdb/fdb_c.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "cipher.h"
+#include "constants.h"
+#include "event.h"
+#include "fdb.h"
+#include "fdb_blob.h"
+#include "placement.h"
+
+// Length of a blob chunk key: prefix, event id, chunk number
+#define BLOB_KEY_LENGTH (1 + FDB_KEY_EVENT_LENGTH + FDB_KEY_FRAGMENT_LENGTH)
+
+// Set in the fragment number chunks are sealed at, so that a chunk can't pass
+// for a fragment of the event with the same id
+#define BLOB_POSITION_FLAG 0x80000000u
+
+//==============================================================================
+// Types
+//==============================================================================
+
+typedef struct blob_transfer_t {
+  uint64_t event_id;       // Identifier of the last event in the snapshot.
+  FragmentedEvent *chunks; // Chunks of the snapshot, when uploading.
+  uint8_t *data;           // Snapshot file mapping, when downloading.
+  uint32_t first_length;   // Payload length of the first chunk.
+  uint32_t num_chunks;     // Number of chunks in the snapshot.
+  atomic_uint next_chunk;  // Next chunk not yet claimed by a thread.
+  atomic_bool failed;      // Set when any transaction fails.
+} BlobTransfer;
+
+//==============================================================================
+// Prototypes
+//==============================================================================
+
+/// Encode the key of a snapshot chunk.
+///
+/// @param[in] fdb_key   Pointer to the write location (of BLOB_KEY_LENGTH
+///                      bytes).
+/// @param[in] event_id  Identifier of the last event in the snapshot.
+/// @param[in] chunk     The chunk number.
+void build_blob_key(uint8_t *fdb_key, uint64_t event_id, uint32_t chunk);
+
+/// Run the transfer threads of an upload or download, including the calling
+/// thread, until every chunk is claimed.
+///
+/// @param[in] transfer     Handle for the transfer.
+/// @param[in] func         Thread function.
+/// @param[in] num_threads  Number of threads to transfer with.
+///
+/// @return  0  Success.
+/// @return -1  Failure.
+int run_blob_transfer(BlobTransfer *transfer, void *(*func)(void *),
+                      uint32_t num_threads);
+
+/// Upload groups of chunks until every chunk is claimed.
+///
+/// @param[in] arg  Handle for the transfer.
+///
+/// @return  NULL.
+void *blob_upload_thread_func(void *arg);
+
+/// Download groups of chunks until every chunk is claimed.
+///
+/// @param[in] arg  Handle for the transfer.
+///
+/// @return  NULL.
+void *blob_download_thread_func(void *arg);
+
+/// Upload one group of chunks in a single transaction.
+///
+/// @param[in] transfer  Handle for the transfer.
+/// @param[in] tx        FoundationDB transaction handle.
+/// @param[in] first     First chunk of the group.
+/// @param[in] last      One past the last chunk of the group.
+/// @param[in] value     Buffer for assembling chunk values (at least
+///                      MAX_HEADER_SIZE + OPTIMAL_VALUE_SIZE + CIPHER_OVERHEAD
+///                      bytes).
+///
+/// @return  0  Success.
+/// @return -1  Failure.
+int upload_blob_chunks(BlobTransfer *transfer, FDBTransaction *tx,
+                       uint32_t first, uint32_t last, uint8_t *value);
+
+/// Download one group of chunks into the snapshot file mapping.
+///
+/// @param[in] transfer  Handle for the transfer.
+/// @param[in] tx        FoundationDB transaction handle.
+/// @param[in] first     First chunk of the group (not the first chunk).
+/// @param[in] last      One past the last chunk of the group.
+///
+/// @return  0  Success.
+/// @return -1  Failure.
+int download_blob_chunks(BlobTransfer *transfer, FDBTransaction *tx,
+                         uint32_t first, uint32_t last);
+
+/// Copy the payload of one stored chunk into the snapshot file, opening it in
+/// the same pass when encryption is enabled.
+///
+/// @param[in] out            Pointer to the write location for the payload.
+/// @param[in] value          The stored chunk value.
+/// @param[in] header_length  Length of the header at the start of the value.
+/// @param[in] length         Length of the payload in bytes.
+/// @param[in] event_id       Identifier of the last event in the snapshot.
+/// @param[in] chunk          The chunk number.
+///
+/// @return  0  Success.
+/// @return -1  Failure (the chunk failed authentication).
+int copy_blob_chunk(uint8_t *out, const uint8_t *value, uint8_t header_length,
+                    uint32_t length, uint64_t event_id, uint32_t chunk);
+
+/// Read the first chunk of a snapshot, which gives its size.
+///
+/// @param[in] event_id  Identifier of the last event in the snapshot.
+/// @param[in] tx        FoundationDB transaction handle.
+/// @param[in] future    Pointer to the write location of the future holding
+///                      the chunk, to be destroyed by the caller.
+/// @param[in] value     Pointer to the write location of the chunk value.
+/// @param[in] length    Pointer to the write location of the value length.
+///
+/// @return  0  Success.
+/// @return -1  Failure (including a missing snapshot).
+int read_first_blob_chunk(uint64_t event_id, FDBTransaction *tx,
+                          FDBFuture **future, const uint8_t **value,
+                          int *length);
+
+/// Wait for a future, then discard it, returning its error.
+///
+/// @param[in] future  The future.
+///
+/// @return  FoundationDB error code.
+fdb_error_t wait_blob_future(FDBFuture *future);
+
+/// Prepare a transaction to be retried after an error.
+///
+/// @param[in] tx        FoundationDB transaction handle.
+/// @param[in] err       The error.
+/// @param[in] attempts  Pointer to the number of attempts so far.
+///
+/// @return  0  The transaction may be retried.
+/// @return -1  Failure.
+int retry_blob_transaction(FDBTransaction *tx, fdb_error_t err,
+                           uint32_t *attempts);
+
+//==============================================================================
+// Functions
+//==============================================================================
+
+int fdb_put_snapshot(const char *path, uint64_t event_id,
+                     uint32_t num_threads) {
+  BlobTransfer transfer;
+  FragmentedEvent chunks;
+  FDBTransaction *tx;
+  Event snapshot;
+  struct stat st;
+  uint8_t *data;
+  int fd;
+  int err;
+
+  if (!num_threads)
+    return -1;
+
+  fd = open(path, O_RDONLY);
+  if (fd < 0)
+    return -1;
+  if (fstat(fd, &st) || !st.st_size) {
+    close(fd);
+    return -1;
+  }
+
+  data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED)
+    return -1;
+  madvise(data, st.st_size, MADV_SEQUENTIAL);
+
+  // Chunks are laid out exactly like the fragments of an event
+  snapshot.id = event_id;
+  snapshot.data_length = st.st_size;
+  snapshot.data = data;
+  fragment_event(&snapshot, &chunks);
+
+  transfer.event_id = event_id;
+  transfer.chunks = &chunks;
+  transfer.data = NULL;
+  transfer.first_length = chunks.payload_length;
+  transfer.num_chunks = chunks.num_fragments;
+  atomic_init(&transfer.next_chunk, 0);
+  atomic_init(&transfer.failed, false);
+
+  // Remove any partial upload, so that no stale chunks are left behind
+  err = fdb_clear_snapshot(event_id);
+  if (!err)
+    err = run_blob_transfer(&transfer, blob_upload_thread_func, num_threads);
+
+  free_fragmented_event(&chunks);
+  munmap(data, st.st_size);
+
+  if (err)
+    return -1;
+
+  // Publish the snapshot only once every chunk is stored
+  if (fdb_check_error(fdb_setup_transaction(&tx)))
+    return -1;
+  fdb_set_metadata_u64(tx, FDB_SNAPSHOT_METADATA, event_id);
+  err = fdb_send_transaction(tx);
+  fdb_transaction_destroy(tx);
+
+  // Success or failure
+  return err;
+}
+
+int fdb_get_latest_snapshot(uint64_t *event_id) {
+  return fdb_read_metadata_u64(FDB_SNAPSHOT_METADATA, event_id);
+}
+
+int fdb_get_snapshot(uint64_t event_id, const char *path,
+                     uint32_t num_threads) {
+  BlobTransfer transfer;
+  FDBTransaction *tx;
+  FDBFuture *future = NULL;
+  const uint8_t *value;
+  int value_length;
+  uint32_t num_chunks;
+  int header_length;
+  uint64_t size;
+  uint8_t *data = MAP_FAILED;
+  int fd = -1;
+  int err = -1;
+
+  if (!num_threads)
+    return -1;
+
+  if (fdb_check_error(fdb_setup_transaction(&tx)))
+    return -1;
+
+  // The header of the first chunk gives the size of the file
+  if (read_first_blob_chunk(event_id, tx, &future, &value, &value_length))
+    goto tx_fail;
+
+  header_length = parse_header(value, (uint32_t)value_length, &num_chunks);
+  if ((header_length < 0) ||
+      ((uint32_t)value_length <= (header_length + cipher_overhead())))
+    goto tx_fail;
+
+  transfer.event_id = event_id;
+  transfer.chunks = NULL;
+  transfer.first_length = (value_length - header_length - cipher_overhead());
+  transfer.num_chunks = (num_chunks + 1);
+  atomic_init(&transfer.next_chunk, 1);
+  atomic_init(&transfer.failed, false);
+  size = (((uint64_t)num_chunks * OPTIMAL_VALUE_SIZE) + transfer.first_length);
+
+  // Chunks are written straight into the page cache of the file
+  fd = open(path, (O_RDWR | O_CREAT | O_TRUNC), 0644);
+  if ((fd < 0) || ftruncate(fd, (off_t)size))
+    goto tx_fail;
+  data = mmap(NULL, size, (PROT_READ | PROT_WRITE), MAP_SHARED, fd, 0);
+  if (data == MAP_FAILED)
+    goto tx_fail;
+  transfer.data = data;
+
+  if (copy_blob_chunk(data, value, header_length, transfer.first_length,
+                      event_id, 0))
+    goto tx_fail;
+
+  fdb_future_destroy(future);
+  future = NULL;
+
+  err = run_blob_transfer(&transfer, blob_download_thread_func, num_threads);
+
+// Success or failure
+tx_fail:
+  if (future)
+    fdb_future_destroy(future);
+  fdb_transaction_destroy(tx);
+  if (data != MAP_FAILED)
+    munmap(data, size);
+  if (fd >= 0)
+    close(fd);
+  if (err && (fd >= 0))
+    unlink(path);
+  return err;
+}
+
+int fdb_clear_snapshot(uint64_t event_id) {
+  FDBTransaction *tx;
+  uint8_t start_key[BLOB_KEY_LENGTH];
+  uint8_t end_key[BLOB_KEY_LENGTH];
+  int err;
+
+  build_blob_key(start_key, event_id, 0);
+  build_blob_key(end_key, event_id, UINT32_MAX);
+
+  if (fdb_check_error(fdb_setup_transaction(&tx)))
+    return -1;
+
+  // The end key is exclusive, but no snapshot has 2^32 chunks
+  fdb_transaction_clear_range(tx, start_key, BLOB_KEY_LENGTH, end_key,
+                              BLOB_KEY_LENGTH);
+  err = fdb_send_transaction(tx);
+  fdb_transaction_destroy(tx);
+
+  // Success or failure
+  return err;
+}
+
+void build_blob_key(uint8_t *fdb_key, uint64_t event_id, uint32_t chunk) {
+  fdb_key[0] = FDB_BLOB_PREFIX;
+
+  for (uint32_t i = 0; i < FDB_KEY_EVENT_LENGTH; ++i)
+    fdb_key[(1 + i)] = (uint8_t)(event_id >> (56 - (8 * i)));
+
+  for (uint32_t i = 0; i < FDB_KEY_FRAGMENT_LENGTH; ++i)
+    fdb_key[(1 + FDB_KEY_EVENT_LENGTH + i)] =
+        (uint8_t)(chunk >> (24 - (8 * i)));
+}
+
+int run_blob_transfer(BlobTransfer *transfer, void *(*func)(void *),
+                      uint32_t num_threads) {
+  pthread_t *threads = NULL;
+  pthread_attr_t attr;
+  uint32_t num_started = 0;
+
+  // The calling thread is one of the transfer threads
+  if (num_threads > 1) {
+    threads = malloc(sizeof(pthread_t) * (num_threads - 1));
+    if (!threads || placement_init_attr(THREAD_ROLE_WORKER, &attr)) {
+      free((void *)threads);
+      return -1;
+    }
+
+    for (; num_started < (num_threads - 1); ++num_started) {
+      if (pthread_create((threads + num_started), &attr, func, transfer)) {
+        perror("pthread_create() error");
+        break;
+      }
+    }
+
+    pthread_attr_destroy(&attr);
+  }
+
+  func(transfer);
+
+  for (uint32_t i = 0; i < num_started; ++i) {
+    pthread_join(threads[i], NULL);
+  }
+  free((void *)threads);
+
+  // Success or failure
+  return atomic_load(&transfer->failed) ? -1 : 0;
+}
+
+void *blob_upload_thread_func(void *arg) {
+  BlobTransfer *transfer = (BlobTransfer *)arg;
+  uint8_t value[(MAX_HEADER_SIZE + OPTIMAL_VALUE_SIZE + CIPHER_OVERHEAD)];
+  FDBTransaction *tx;
+
+  if (fdb_check_error(fdb_setup_transaction(&tx))) {
+    atomic_store(&transfer->failed, true);
+    return NULL;
+  }
+
+  while (!atomic_load(&transfer->failed)) {
+    uint32_t first =
+        atomic_fetch_add(&transfer->next_chunk, BLOB_CHUNKS_PER_TX);
+    uint32_t last = (first + BLOB_CHUNKS_PER_TX);
+
+    if (first >= transfer->num_chunks)
+      break;
+    if (last > transfer->num_chunks)
+      last = transfer->num_chunks;
+
+    if (upload_blob_chunks(transfer, tx, first, last, value))
+      atomic_store(&transfer->failed, true);
+  }
+
+  fdb_transaction_destroy(tx);
+  return NULL;
+}
+
+void *blob_download_thread_func(void *arg) {
+  BlobTransfer *transfer = (BlobTransfer *)arg;
+  FDBTransaction *tx;
+
+  if (fdb_check_error(fdb_setup_transaction(&tx))) {
+    atomic_store(&transfer->failed, true);
+    return NULL;
+  }
+
+  while (!atomic_load(&transfer->failed)) {
+    uint32_t first =
+        atomic_fetch_add(&transfer->next_chunk, BLOB_CHUNKS_PER_TX);
+    uint32_t last = (first + BLOB_CHUNKS_PER_TX);
+
+    if (first >= transfer->num_chunks)
+      break;
+    if (last > transfer->num_chunks)
+      last = transfer->num_chunks;
+
+    if (download_blob_chunks(transfer, tx, first, last))
+      atomic_store(&transfer->failed, true);
+  }
+
+  fdb_transaction_destroy(tx);
+  return NULL;
+}
+
+int upload_blob_chunks(BlobTransfer *transfer, FDBTransaction *tx,
+                       uint32_t first, uint32_t last, uint8_t *value) {
+  FragmentedEvent *chunks = transfer->chunks;
+  uint8_t key[BLOB_KEY_LENGTH];
+  uint32_t attempts = 0;
+  fdb_error_t err;
+
+  do {
+    for (uint32_t c = first; c < last; ++c) {
+      uint8_t header_length = c ? 0 : chunks->header_length;
+      uint32_t length = c ? OPTIMAL_VALUE_SIZE : transfer->first_length;
+      uint32_t value_length = (header_length + length);
+
+      build_blob_key(key, transfer->event_id, c);
+      memcpy(value, chunks->header, header_length);
+
+      if (!cipher_enabled()) {
+        memcpy((value + header_length), chunks->fragments[c], length);
+      } else {
+        if (cipher_seal((value + header_length), value, header_length,
+                        chunks->fragments[c], length, transfer->event_id,
+                        (c | BLOB_POSITION_FLAG)))
+          return -1;
+        value_length += CIPHER_OVERHEAD;
+      }
+
+      fdb_transaction_set(tx, key, BLOB_KEY_LENGTH, value, value_length);
+    }
+
+    err = wait_blob_future(fdb_transaction_commit(tx));
+    if (!err) {
+      fdb_transaction_reset(tx);
+      return 0;
+    }
+  } while (!retry_blob_transaction(tx, err, &attempts));
+
+  // Failure
+  return -1;
+}
+
+int download_blob_chunks(BlobTransfer *transfer, FDBTransaction *tx,
+                         uint32_t first, uint32_t last) {
+  uint8_t begin_key[BLOB_KEY_LENGTH];
+  uint8_t end_key[BLOB_KEY_LENGTH];
+  int value_length = (int)(OPTIMAL_VALUE_SIZE + cipher_overhead());
+  uint32_t next = first;
+  uint32_t attempts = 0;
+  fdb_bool_t out_more = 1;
+
+  build_blob_key(end_key, transfer->event_id, last);
+
+  // Each read starts at the next chunk still needed, so a retry carries on
+  // where the failed read left off
+  while (out_more && (next < last)) {
+    const FDBKeyValue *out_kv;
+    int32_t out_count;
+    FDBFuture *future;
+    fdb_error_t err;
+
+    build_blob_key(begin_key, transfer->event_id, next);
+    future = fdb_transaction_get_range(
+        tx, begin_key, BLOB_KEY_LENGTH, 0, 1, end_key, BLOB_KEY_LENGTH, 0, 1, 0,
+        0, FDB_STREAMING_MODE_WANT_ALL, 0, 0, 0);
+    err = fdb_future_block_until_ready(future);
+    if (!err)
+      err = fdb_future_get_error(future);
+    if (!err)
+      err = fdb_future_get_keyvalue_array(future, &out_kv, &out_count,
+                                          &out_more);
+
+    if (err) {
+      fdb_future_destroy(future);
+      if (retry_blob_transaction(tx, err, &attempts))
+        return -1;
+      out_more = 1;
+      continue;
+    }
+
+    for (int32_t i = 0; i < out_count; ++i) {
+      uint8_t expected[BLOB_KEY_LENGTH];
+      uint8_t *out = (transfer->data + transfer->first_length +
+                      ((uint64_t)(next - 1) * OPTIMAL_VALUE_SIZE));
+
+      // Chunks must arrive in order, without gaps, at the preset size
+      build_blob_key(expected, transfer->event_id, next);
+      if ((out_kv[i].key_length != BLOB_KEY_LENGTH) ||
+          memcmp(out_kv[i].key, expected, BLOB_KEY_LENGTH) ||
+          (out_kv[i].value_length != value_length) ||
+          copy_blob_chunk(out, out_kv[i].value, 0, OPTIMAL_VALUE_SIZE,
+                          transfer->event_id, next)) {
+        fdb_future_destroy(future);
+        return -1;
+      }
+
+      ++next;
+    }
+
+    fdb_future_destroy(future);
+  }
+
+  fdb_transaction_reset(tx);
+
+  // Success or failure
+  return (next == last) ? 0 : -1;
+}
+
+int copy_blob_chunk(uint8_t *out, const uint8_t *value, uint8_t header_length,
+                    uint32_t length, uint64_t event_id, uint32_t chunk) {
+  if (cipher_enabled())
+    return cipher_open(out, value, header_length, (value + header_length),
+                       length, event_id, (chunk | BLOB_POSITION_FLAG));
+
+  memcpy(out, (value + header_length), length);
+
+  // Success
+  return 0;
+}
+
+int read_first_blob_chunk(uint64_t event_id, FDBTransaction *tx,
+                          FDBFuture **future, const uint8_t **value,
+                          int *length) {
+  uint8_t key[BLOB_KEY_LENGTH];
+  fdb_bool_t present;
+  uint32_t attempts = 0;
+  fdb_error_t err;
+
+  build_blob_key(key, event_id, 0);
+
+  for (;;) {
+    *future = fdb_transaction_get(tx, key, BLOB_KEY_LENGTH, 0);
+    err = fdb_future_block_until_ready(*future);
+    if (!err)
+      err = fdb_future_get_error(*future);
+    if (!err)
+      err = fdb_future_get_value(*future, &present, value, length);
+    if (!err)
+      break;
+
+    fdb_future_destroy(*future);
+    *future = NULL;
+    if (retry_blob_transaction(tx, err, &attempts))
+      return -1;
+  }
+
+  // Success or failure (a missing snapshot)
+  return (present && *length) ? 0 : -1;
+}
+
+fdb_error_t wait_blob_future(FDBFuture *future) {
+  fdb_error_t err = fdb_future_block_until_ready(future);
+
+  if (!err)
+    err = fdb_future_get_error(future);
+  fdb_future_destroy(future);
+
+  return err;
+}
+
+int retry_blob_transaction(FDBTransaction *tx, fdb_error_t err,
+                           uint32_t *attempts) {
+  // on_error() resets the transaction, backing off if the error is retryable,
+  // and fails if it isn't
+  if ((++*attempts > BLOB_MAX_ATTEMPTS) ||
+      fdb_check_error(wait_blob_future(fdb_transaction_on_error(tx, err))))
+    return -1;
+
+  // Success
+  return 0;
+}
@@ -0,0 +1,76 @@
+/// @file fdb_blob.h
+///
+/// Declarations for the snapshot blob store, which keeps multi-GB snapshot
+/// files in the cluster alongside the event log, so that a ship can boot from
+/// the latest snapshot plus the suffix of the log without local state.
+///
+/// Snapshots are split into chunks with the same scheme as events: the first
+/// chunk carries a header with the number of additional chunks and the odd
+/// remainder, and every other chunk is exactly OPTIMAL_VALUE_SIZE bytes. Chunks
+/// are uploaded and downloaded by several threads in parallel transactions, and
+/// a snapshot only becomes visible to fdb_get_latest_snapshot() once every
+/// chunk is stored.
+///
+/// With encryption enabled, chunks are sealed like event fragments, each under
+/// a fresh nonce, so a snapshot regenerated with different content can be
+/// uploaded again under the same event id.
+///
+/// Documentation links:
+///   https://apple.github.io/foundationdb/known-limitations.html
+///   https://man7.org/linux/man-pages/man2/mmap.2.html
+
+#pragma once
+
+#include <stdint.h>
+
+// Name of the metadata entry storing the event id of the latest snapshot
+#define FDB_SNAPSHOT_METADATA "snapshot"
+
+// Number of chunks uploaded or downloaded per transaction
+#define BLOB_CHUNKS_PER_TX 100
+
+// Maximum attempts at one transaction before a transfer gives up
+#define BLOB_MAX_ATTEMPTS 10
+
+//==============================================================================
+// Prototypes
+//==============================================================================
+
+/// Upload a snapshot file and publish it as the latest snapshot. Any earlier or
+/// partial upload of the same snapshot is cleared first.
+///
+/// @param[in] path         Path of the snapshot file (must not be empty).
+/// @param[in] event_id     Identifier of the last event the snapshot covers.
+/// @param[in] num_threads  Number of threads to upload with.
+///
+/// @return  0  Success.
+/// @return -1  Failure.
+int fdb_put_snapshot(const char *path, uint64_t event_id, uint32_t num_threads);
+
+/// Get the event id of the latest published snapshot.
+///
+/// @param[in] event_id  Pointer to the write location of the event id.
+///
+/// @return  0  Success.
+/// @return  1  No snapshot has been published.
+/// @return -1  Failure.
+int fdb_get_latest_snapshot(uint64_t *event_id);
+
+/// Download a snapshot into a file, which is created or overwritten. The file
+/// is removed if the download fails.
+///
+/// @param[in] event_id     Identifier of the last event the snapshot covers.
+/// @param[in] path         Path of the file to write.
+/// @param[in] num_threads  Number of threads to download with.
+///
+/// @return  0  Success.
+/// @return -1  Failure.
+int fdb_get_snapshot(uint64_t event_id, const char *path, uint32_t num_threads);
+
+/// Remove a snapshot from the cluster.
+///
+/// @param[in] event_id  Identifier of the last event the snapshot covers.
+///
+/// @return  0  Success.
+/// @return -1  Failure.
+int fdb_clear_snapshot(uint64_t event_id);
@@ -0,0 +1,122 @@
+/// @file fdb_faults.c
+///
+/// Definitions for fault injection.
+
+#define _GNU_SOURCE
+
+#include <foundationdb/fdb_c.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "fdb_faults.h"
+#include "metrics.h"
+
+//==============================================================================
+// Variables
+//==============================================================================
+
+static atomic_bool fault_enabled = false;
+static FaultConfig fault_config;
+
+// Draws are numbered, so the sequence of faults depends only on the seed and
+// the order of the operations
+static atomic_uint_fast64_t fault_draws = 0;
+
+//==============================================================================
+// Prototypes
+//==============================================================================
+
+/// Draw a uniformly distributed number.
+///
+/// @return  A number in [0, 1).
+double fault_draw(void);
+
+/// Check that a share is a probability.
+///
+/// @param[in] share  The share.
+///
+/// @return  Whether it is in [0, 1].
+bool fault_share_valid(double share);
+
+//==============================================================================
+// Functions
+//==============================================================================
+
+int fdb_set_faults(const FaultConfig *config) {
+  if (!config) {
+    atomic_store(&fault_enabled, false);
+    return 0;
+  }
+
+  if (!fault_share_valid(config->not_committed) ||
+      !fault_share_valid(config->unknown_result) ||
+      !fault_share_valid(config->too_old) ||
+      !fault_share_valid(config->spike_rate) || (config->spike_ms < 0.0) ||
+      ((config->not_committed + config->unknown_result + config->too_old) >
+       1.0))
+    return -1;
+
+  fault_config = *config;
+  atomic_store(&fault_draws, 0);
+  atomic_store(&fault_enabled, true);
+
+  // Success
+  return 0;
+}
+
+fdb_error_t fdb_fault_inject(FaultSite site) {
+  fdb_error_t err = 0;
+  double draw;
+
+  if (!atomic_load_explicit(&fault_enabled, memory_order_relaxed))
+    return 0;
+
+  if (fault_draw() < fault_config.spike_rate) {
+    struct timespec stall;
+
+    stall.tv_sec = (time_t)(fault_config.spike_ms / 1000.0);
+    stall.tv_nsec = (long)((fault_config.spike_ms - (stall.tv_sec * 1000.0)) *
+                           1000000.0);
+    nanosleep(&stall, NULL);
+    metrics_add(METRIC_FAULT_SPIKES, 1);
+  }
+
+  // Reads can only expire; commits can also conflict or lose their proxy
+  draw = fault_draw();
+  if (site == FAULT_SITE_COMMIT) {
+    double unknown_below =
+        (fault_config.not_committed + fault_config.unknown_result);
+
+    if (draw < fault_config.not_committed)
+      err = FDB_ERROR_NOT_COMMITTED;
+    else if (draw < unknown_below)
+      err = FDB_ERROR_COMMIT_UNKNOWN_RESULT;
+    else if (draw < (unknown_below + fault_config.too_old))
+      err = FDB_ERROR_TRANSACTION_TOO_OLD;
+  } else if (draw < fault_config.too_old) {
+    err = FDB_ERROR_TRANSACTION_TOO_OLD;
+  }
+
+  if (err)
+    metrics_add(METRIC_FAULT_ERRORS, 1);
+
+  return err;
+}
+
+double fault_draw(void) {
+  uint64_t z = (fault_config.seed + ((atomic_fetch_add(&fault_draws, 1) + 1) *
+                                     0x9E3779B97F4A7C15ULL));
+
+  // splitmix64 of the draw number
+  z = ((z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL);
+  z = ((z ^ (z >> 27)) * 0x94D049BB133111EBULL);
+  z ^= (z >> 31);
+
+  return ((double)(z >> 11) / (double)(1ULL << 53));
+}
+
+bool fault_share_valid(double share) {
+  return (share >= 0.0) && (share <= 1.0);
+}
@@ -0,0 +1,82 @@
+/// @file fdb_faults.h
+///
+/// Declarations for fault injection, which makes a share of commits and range
+/// reads fail with FoundationDB's retryable errors, or stall, so that the
+/// throughput of the write and read paths can be measured while a cluster is
+/// recovering, and their retries and backoff tuned before an incident does.
+///
+/// Faults are injected into event writes, clears and reads, in the client, in
+/// place of the cluster's answer:
+///   - not_committed fails a commit without sending it, as after a conflict.
+///   - commit_unknown_result sends a commit, then reports that its outcome is
+///     unknown, as after losing the connection to a proxy. Event data is set
+///     at fixed keys, so rewriting it is harmless, but the Merkle summaries
+///     are atomic adds: with them enabled, the retry first subtracts what is
+///     stored under its keys, so that a commit which landed isn't counted
+///     twice.
+///   - transaction_too_old fails a commit or a range read, as after the read
+///     version expires.
+///   - Latency spikes stall a commit before it is sent, or a range read before
+///     its result is used.
+///
+/// FoundationDB's client buggify knobs inject faults too, but into internal
+/// code paths chosen at random, and only before the network is set up.
+///
+/// Documentation links:
+///   https://apple.github.io/foundationdb/api-error-codes.html
+///   https://apple.github.io/foundationdb/client-testing.html
+
+#pragma once
+
+#include <foundationdb/fdb_c.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+// FoundationDB's retryable errors
+#define FDB_ERROR_TRANSACTION_TOO_OLD 1007
+#define FDB_ERROR_NOT_COMMITTED 1020
+#define FDB_ERROR_COMMIT_UNKNOWN_RESULT 1021
+
+//==============================================================================
+// Types
+//==============================================================================
+
+typedef enum fault_site_t {
+  FAULT_SITE_COMMIT, // A commit, before it is sent.
+  FAULT_SITE_READ,   // A range read, before its result is used.
+} FaultSite;
+
+typedef struct fault_config_t {
+  double not_committed;  // Share of commits failing with not_committed.
+  double unknown_result; // Share of commits reporting commit_unknown_result.
+  double too_old;        // Share of commits and range reads failing with
+                         // transaction_too_old.
+  double spike_rate;     // Share of commits and range reads stalled.
+  double spike_ms;       // Length of each stall in ms.
+  uint64_t seed;         // Seed of the sequence of faults.
+} FaultConfig;
+
+//==============================================================================
+// Prototypes
+//==============================================================================
+
+/// Configure fault injection. Must not be called while any transaction is in
+/// progress.
+///
+/// @param[in] config  The shares of each fault, or NULL to stop injecting.
+///
+/// @return  0  Success.
+/// @return -1  Failure (a share is outside [0, 1], or the commit faults add up
+///             to more than 1).
+int fdb_set_faults(const FaultConfig *config);
+
+/// Draw the fault injected at a commit or range read, stalling first if a
+/// latency spike is drawn. Errors other than commit_unknown_result stand for
+/// the operation's own result, which must not be sent or used;
+/// commit_unknown_result is reported in place of the result of a successful
+/// commit.
+///
+/// @param[in] site  The kind of operation.
+///
+/// @return  The error injected, or 0.
+fdb_error_t fdb_fault_inject(FaultSite site);
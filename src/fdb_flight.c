@@ -0,0 +1,186 @@
+/// @file fdb_flight.c
+///
+/// Definitions for single-flight event reads.
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "event.h"
+#include "fdb.h"
+#include "fdb_flight.h"
+#include "metrics.h"
+
+//==============================================================================
+// Types
+//==============================================================================
+
+typedef struct flight_t {
+  uint64_t id;           // Event identifier being read.
+  SharedEvent *event;    // Result of the read, once done.
+  int result;            // Result code of the read, once done.
+  bool done;             // Whether the read has finished.
+  uint32_t refs;         // Number of threads referencing the flight.
+  struct flight_t *next; // Next flight in the same bucket.
+} Flight;
+
+typedef struct flight_bucket_t {
+  pthread_mutex_t lock; // Guards the bucket and its flights.
+  pthread_cond_t done;  // Signalled when a flight in the bucket finishes.
+  Flight *head;         // Flights in progress.
+} FlightBucket;
+
+//==============================================================================
+// Variables
+//==============================================================================
+
+static FlightBucket flight_buckets[FLIGHT_NUM_BUCKETS];
+static pthread_once_t flight_once = PTHREAD_ONCE_INIT;
+
+//==============================================================================
+// Prototypes
+//==============================================================================
+
+/// Initialize the bucket locks and condition variables.
+void flight_init(void);
+
+/// Read an event into a new shared event, on behalf of every thread joining
+/// the flight.
+///
+/// @param[in] id     The event identifier.
+/// @param[in] event  Pointer to the write location of the shared event.
+///
+/// @return  0  Success.
+/// @return -1  Failure.
+int flight_read(uint64_t id, SharedEvent **event);
+
+/// Drop a thread's reference to a flight, freeing it with the last one. The
+/// bucket lock must be held.
+///
+/// @param[in] flight  Handle for the flight.
+void flight_release(Flight *flight);
+
+//==============================================================================
+// Functions
+//==============================================================================
+
+int fdb_read_shared_event(uint64_t id, SharedEvent **event) {
+  FlightBucket *bucket;
+  Flight *flight;
+  Flight **link;
+  int result;
+
+  pthread_once(&flight_once, flight_init);
+  bucket = (flight_buckets + (id % FLIGHT_NUM_BUCKETS));
+
+  pthread_mutex_lock(&bucket->lock);
+
+  // Join a read of the same event in flight
+  for (flight = bucket->head; flight; flight = flight->next) {
+    if (flight->id != id)
+      continue;
+
+    ++flight->refs;
+    metrics_add(METRIC_READ_JOINED, 1);
+
+    while (!flight->done)
+      pthread_cond_wait(&bucket->done, &bucket->lock);
+
+    result = flight->result;
+    *event = flight->event;
+    flight_release(flight);
+    pthread_mutex_unlock(&bucket->lock);
+
+    return result;
+  }
+
+  // Otherwise lead a new one
+  flight = malloc(sizeof(Flight));
+  if (!flight) {
+    pthread_mutex_unlock(&bucket->lock);
+    return -1;
+  }
+  flight->id = id;
+  flight->event = NULL;
+  flight->result = -1;
+  flight->done = false;
+  flight->refs = 1;
+  flight->next = bucket->head;
+  bucket->head = flight;
+
+  pthread_mutex_unlock(&bucket->lock);
+
+  result = flight_read(id, event);
+
+  pthread_mutex_lock(&bucket->lock);
+
+  // Unlink the flight so that later reads start afresh, and hand a reference
+  // to the event to every thread which joined
+  for (link = &bucket->head; *link != flight; link = &(*link)->next)
+    ;
+  *link = flight->next;
+
+  if (!result)
+    atomic_fetch_add(&(*event)->refs, (flight->refs - 1));
+  flight->result = result;
+  flight->event = result ? NULL : *event;
+  flight->done = true;
+  flight_release(flight);
+
+  pthread_cond_broadcast(&bucket->done);
+  pthread_mutex_unlock(&bucket->lock);
+
+  return result;
+}
+
+void shared_event_retain(SharedEvent *event) {
+  atomic_fetch_add(&event->refs, 1);
+}
+
+void shared_event_release(SharedEvent *event) {
+  if (!event || (atomic_fetch_sub(&event->refs, 1) != 1))
+    return;
+
+  free_event_data((void *)event->data);
+  free((void *)event);
+}
+
+void flight_init(void) {
+  for (uint32_t i = 0; i < FLIGHT_NUM_BUCKETS; ++i) {
+    pthread_mutex_init(&flight_buckets[i].lock, NULL);
+    pthread_cond_init(&flight_buckets[i].done, NULL);
+    flight_buckets[i].head = NULL;
+  }
+}
+
+int flight_read(uint64_t id, SharedEvent **event) {
+  SharedEvent *shared;
+  Event read = {id, 0, NULL};
+
+  *event = NULL;
+
+  shared = malloc(sizeof(SharedEvent));
+  if (!shared)
+    return -1;
+
+  if (fdb_read_event(&read)) {
+    free((void *)shared);
+    return -1;
+  }
+
+  shared->id = id;
+  shared->data_length = read.data_length;
+  shared->data = read.data;
+  atomic_init(&shared->refs, 1);
+  *event = shared;
+
+  // Success
+  return 0;
+}
+
+void flight_release(Flight *flight) {
+  if (!--flight->refs)
+    free((void *)flight);
+}
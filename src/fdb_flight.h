@@ -0,0 +1,53 @@
+/// @file fdb_flight.h
+///
+/// Declarations for single-flight event reads. When several threads ask for
+/// the same event at once, as happens at the tail of the log and during
+/// catch-up, only the first makes the read; the rest wait for it and share the
+/// reassembled event, which is reference counted and released by its last
+/// holder. Only reads in flight are tracked, so a read which starts after
+/// another has finished makes its own round trip.
+
+#pragma once
+
+#include <stdatomic.h>
+#include <stdint.h>
+
+// Number of buckets in the table of reads in flight
+#define FLIGHT_NUM_BUCKETS 64
+
+//==============================================================================
+// Types
+//==============================================================================
+
+typedef struct shared_event_t {
+  uint64_t id;          // Event identifier.
+  uint64_t data_length; // Length of the event data in bytes.
+  uint8_t *data;        // Event data. Must not be modified.
+  atomic_uint refs;     // Number of holders of the event.
+} SharedEvent;
+
+//==============================================================================
+// Prototypes
+//==============================================================================
+
+/// Read an event, joining a read of the same event already in flight on
+/// another thread if there is one. Joined reads are counted in
+/// METRIC_READ_JOINED.
+///
+/// @param[in] id     The event identifier.
+/// @param[in] event  Pointer to the write location of the shared event, which
+///                   must be released with shared_event_release().
+///
+/// @return  0  Success.
+/// @return -1  Failure (of the shared read, for every thread which joined it).
+int fdb_read_shared_event(uint64_t id, SharedEvent **event);
+
+/// Take an extra reference to a shared event.
+///
+/// @param[in] event  Handle for the shared event.
+void shared_event_retain(SharedEvent *event);
+
+/// Release a reference to a shared event, freeing it with the last one.
+///
+/// @param[in] event  Handle for the shared event (may be NULL).
+void shared_event_release(SharedEvent *event);
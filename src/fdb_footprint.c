@@ -0,0 +1,420 @@
+/// @file fdb_footprint.c
+///
+/// Definitions for functions which measure the storage footprint of the event
+/// log.
+
+#include <foundationdb/fdb_c.h>
+#include <math.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "cipher.h"
+#include "constants.h"
+#include "event.h"
+#include "fdb.h"
+#include "fdb_footprint.h"
+
+//==============================================================================
+// Prototypes
+//==============================================================================
+
+/// Accumulate the footprint of every event fragment in a range of event ids,
+/// using one fresh snapshot read version per range read batch.
+///
+/// @param[in] begin_id  First event id in the range.
+/// @param[in] end_id    Event id one past the end of the range.
+/// @param[in] stats     Handle for the statistics to accumulate into.
+///
+/// @return  0  Success.
+/// @return -1  Failure.
+int analyze_key_range(uint64_t begin_id, uint64_t end_id,
+                      FootprintStats *stats);
+
+/// Find the first stored event in a range of event ids, with one key selector
+/// lookup rather than a read of every id.
+///
+/// @param[in] begin_id  First event id in the range.
+/// @param[in] end_id    Event id one past the end of the range.
+/// @param[in] event_id  Address to write the event id found into.
+///
+/// @return  0  Success.
+/// @return  1  No event is stored in the range.
+/// @return -1  Failure.
+int find_stored_event(uint64_t begin_id, uint64_t end_id, uint64_t *event_id);
+
+//==============================================================================
+// Functions
+//==============================================================================
+
+void footprint_init(FootprintStats *stats) {
+  memset(stats, 0, sizeof(FootprintStats));
+}
+
+void footprint_add_fragment(FootprintStats *stats, uint64_t event_id,
+                            uint32_t fragment, uint32_t key_length,
+                            const uint8_t *value, uint32_t value_length) {
+  uint32_t header_length = 0;
+  uint32_t tag_length;
+
+  // Fragments arrive in key order, so a new identifier closes the last event
+  if (stats->has_current && (stats->current_id != event_id))
+    footprint_finish(stats);
+
+  if (!stats->has_current) {
+    stats->has_current = true;
+    stats->current_id = event_id;
+    stats->current_kvs = 0;
+    stats->current_expected = 0;
+    stats->current_bytes = 0;
+  }
+
+  // First fragment contains the header, which stores the number of ADDITIONAL
+  // fragments
+  if (!fragment) {
+    uint32_t num_fragments;
+    int parsed = parse_header(value, value_length, &num_fragments);
+
+    // A corrupt header counts as payload, and the event as incomplete
+    if (parsed > 0) {
+      header_length = (uint32_t)parsed;
+      stats->current_expected = (num_fragments + 1);
+      stats->header_bytes += header_length;
+    }
+  }
+
+  // Authentication tags of sealed fragments are framing, like the header
+  tag_length = cipher_overhead();
+  if (tag_length > (value_length - header_length))
+    tag_length = (value_length - header_length);
+  stats->header_bytes += tag_length;
+
+  for (uint32_t i = header_length; i < value_length; ++i) {
+    ++stats->byte_counts[value[i]];
+  }
+
+  ++stats->num_kvs;
+  ++stats->current_kvs;
+  stats->key_bytes += key_length;
+  stats->payload_bytes += (value_length - header_length - tag_length);
+  stats->current_bytes += value_length;
+}
+
+void footprint_finish(FootprintStats *stats) {
+  uint32_t bucket = 0;
+
+  if (!stats->has_current)
+    return;
+
+  while (((stats->current_kvs >> 1) >> bucket) &&
+         (bucket < (FOOTPRINT_HISTOGRAM_BUCKETS - 1))) {
+    ++bucket;
+  }
+
+  ++stats->num_events;
+  ++stats->kv_histogram[bucket];
+
+  if (stats->current_kvs != stats->current_expected)
+    ++stats->torn_events;
+
+  if ((stats->current_kvs == 1) && (stats->current_expected == 1) &&
+      (stats->current_bytes < OPTIMAL_VALUE_SIZE)) {
+    ++stats->packable_events;
+    stats->packable_bytes += stats->current_bytes;
+  }
+
+  stats->has_current = false;
+}
+
+void footprint_report(const FootprintStats *stats, double kv_overhead,
+                      FootprintReport *report) {
+  double payload = (double)stats->payload_bytes;
+  double logical = (double)(stats->key_bytes + stats->header_bytes +
+                            stats->payload_bytes);
+  double per_kv = 0.0;
+  double entropy = 0.0;
+
+  memset(report, 0, sizeof(FootprintReport));
+  report->kv_overhead = kv_overhead;
+
+  if (!stats->num_kvs)
+    return;
+
+  per_kv = (((double)stats->key_bytes / stats->num_kvs) + kv_overhead);
+
+  report->fragment_utilization =
+      ((double)(stats->header_bytes + stats->payload_bytes) /
+       ((double)stats->num_kvs * OPTIMAL_VALUE_SIZE));
+  report->storage_bytes = (logical + (kv_overhead * stats->num_kvs));
+
+  if (payload > 0.0) {
+    report->logical_amplification = (logical / payload);
+    report->storage_amplification = (report->storage_bytes / payload);
+
+    for (uint32_t i = 0; i < 256; ++i) {
+      if (stats->byte_counts[i]) {
+        double p = ((double)stats->byte_counts[i] / payload);
+        entropy -= (p * log2(p));
+      }
+    }
+  }
+  report->payload_entropy = entropy;
+
+  // Packing: small single-fragment events share key-value pairs, each carrying
+  // a small index entry, instead of paying the per-KV cost individually
+  double packed_stream =
+      (double)(stats->packable_bytes +
+               (stats->packable_events * FOOTPRINT_PACKED_INDEX_SIZE));
+  double packed_kvs = ceil(packed_stream / OPTIMAL_VALUE_SIZE);
+  report->packed_bytes =
+      (report->storage_bytes - (stats->packable_events * per_kv) -
+       stats->packable_bytes + (packed_kvs * per_kv) + packed_stream);
+
+  // Compression: payloads shrink to their order-0 entropy. This is an
+  // estimate, not a bound: structured data can compress further.
+  report->compressed_bytes =
+      (report->storage_bytes - payload + (payload * entropy / 8.0));
+}
+
+void footprint_print(const FootprintStats *stats, const FootprintReport *report,
+                     FILE *stream) {
+  fprintf(stream, "    events  %llu\n", (unsigned long long)stats->num_events);
+  fprintf(stream, "       kvs  %llu\n", (unsigned long long)stats->num_kvs);
+  fprintf(stream, "      torn  %llu\n", (unsigned long long)stats->torn_events);
+  fprintf(stream, "   payload  %llu bytes\n",
+          (unsigned long long)stats->payload_bytes);
+  fprintf(stream, "      keys  %llu bytes\n",
+          (unsigned long long)stats->key_bytes);
+  fprintf(stream, "   headers  %llu bytes\n",
+          (unsigned long long)stats->header_bytes);
+  fprintf(stream, "  overhead  %.0f bytes (%.1f per kv, estimated)\n",
+          (report->kv_overhead * stats->num_kvs), report->kv_overhead);
+  fprintf(stream, "   on disk  %.0f bytes (estimated)\n",
+          report->storage_bytes);
+  fprintf(stream, "  frag use  %11.2f %%\n",
+          (100.0 * report->fragment_utilization));
+  fprintf(stream, " logical x  %11.3f\n", report->logical_amplification);
+  fprintf(stream, " storage x  %11.3f\n", report->storage_amplification);
+  fprintf(stream, "   entropy  %11.3f bits/byte\n", report->payload_entropy);
+
+  fprintf(stream, "\n  kvs/event histogram\n");
+  for (uint32_t i = 0; i < FOOTPRINT_HISTOGRAM_BUCKETS; ++i) {
+    if (stats->kv_histogram[i]) {
+      fprintf(stream, "  %10llu+  %llu\n", (unsigned long long)(1ULL << i),
+              (unsigned long long)stats->kv_histogram[i]);
+    }
+  }
+
+  if (report->storage_bytes > 0.0) {
+    fprintf(stream, "\n  projected savings\n");
+    fprintf(stream, "    packed  %.0f bytes (%.2f %% saved, %llu events)\n",
+            report->packed_bytes,
+            (100.0 * (1.0 - (report->packed_bytes / report->storage_bytes))),
+            (unsigned long long)stats->packable_events);
+    fprintf(stream, "compressed  %.0f bytes (%.2f %% saved)\n",
+            report->compressed_bytes,
+            (100.0 *
+             (1.0 - (report->compressed_bytes / report->storage_bytes))));
+  }
+}
+
+int fdb_analyze_range(uint64_t start_id, uint64_t end_id, uint64_t stride,
+                      FootprintStats *stats) {
+  if (end_id <= start_id)
+    return 0;
+
+  // Full scan: read the whole range in as few batches as possible
+  if (stride <= 1) {
+    if (analyze_key_range(start_id, end_id, stats))
+      return -1;
+
+    footprint_finish(stats);
+    return 0;
+  }
+
+  // Sampled scan: read the first stored event of every stride of ids. Empty
+  // strides are skipped by the lookup, so the walk is bounded by the events
+  // stored rather than by the width of the range
+  for (uint64_t id = start_id; id < end_id;) {
+    uint64_t found;
+    uint64_t next;
+    int err = find_stored_event(id, end_id, &found);
+
+    if (err < 0)
+      return -1;
+    if (err)
+      break;
+
+    if (analyze_key_range(found, (found + 1), stats))
+      return -1;
+
+    // Continue at the start of the next stride, guarding against overflow
+    next = (start_id + ((((found - start_id) / stride) + 1) * stride));
+    if (next <= found)
+      break;
+    id = next;
+  }
+
+  footprint_finish(stats);
+
+  // Success
+  return 0;
+}
+
+int fdb_estimate_range_size(uint64_t start_id, uint64_t end_id,
+                            int64_t *bytes) {
+  FDBTransaction *tx;
+  FDBFuture *future;
+  uint8_t begin_key[FDB_KEY_MAX_LENGTH];
+  uint8_t end_key[FDB_KEY_MAX_LENGTH];
+  uint8_t begin_length, end_length;
+
+  begin_length = fdb_build_event_key(begin_key, start_id, 0);
+  end_length = fdb_build_event_key(end_key, end_id, 0);
+
+  if (fdb_setup_transaction(&tx))
+    return -1;
+
+  future = fdb_transaction_get_estimated_range_size_bytes(
+      tx, begin_key, begin_length, end_key, end_length);
+  if (fdb_check_error(fdb_future_block_until_ready(future)))
+    goto tx_fail;
+  if (fdb_check_error(fdb_future_get_error(future)))
+    goto tx_fail;
+  if (fdb_check_error(fdb_future_get_int64(future, bytes)))
+    goto tx_fail;
+
+  fdb_future_destroy(future);
+  fdb_transaction_destroy(tx);
+
+  // Success
+  return 0;
+
+// Failure
+tx_fail:
+  fdb_future_destroy(future);
+  fdb_transaction_destroy(tx);
+  return -1;
+}
+
+int analyze_key_range(uint64_t begin_id, uint64_t end_id,
+                      FootprintStats *stats) {
+  FDBTransaction *tx;
+  FDBFuture *future;
+  const FDBKeyValue *out_kv;
+  fdb_bool_t out_more;
+  int32_t out_count;
+  fdb_bool_t begin_or_equal = 0;
+  uint8_t last_key[FDB_KEY_MAX_LENGTH];
+  uint8_t end_key[FDB_KEY_MAX_LENGTH];
+  int last_length, end_length;
+
+  last_length = fdb_build_event_key(last_key, begin_id, 0);
+  end_length = fdb_build_event_key(end_key, end_id, 0);
+
+  if (fdb_setup_transaction(&tx))
+    return -1;
+
+  // Loop until FoundationDB says there is no more data
+  do {
+    out_more = 0;
+
+    // Snapshot read, continuing after the last key seen
+    future = fdb_transaction_get_range(
+        tx, last_key, last_length, begin_or_equal, 1, end_key, end_length, 0,
+        1, 0, 0, FDB_STREAMING_MODE_WANT_ALL, 0, 1, 0);
+    if (fdb_check_error(fdb_future_block_until_ready(future)))
+      goto tx_fail;
+    if (fdb_check_error(fdb_future_get_error(future)))
+      goto tx_fail;
+    if (fdb_check_error(fdb_future_get_keyvalue_array(future, &out_kv,
+                                                      &out_count, &out_more)))
+      goto tx_fail;
+
+    for (int32_t i = 0; i < out_count; ++i) {
+      uint64_t event_id;
+      uint32_t fragment;
+
+      if (fdb_parse_event_key(out_kv[i].key, out_kv[i].key_length, &event_id,
+                              &fragment))
+        continue;
+
+      footprint_add_fragment(stats, event_id, fragment, out_kv[i].key_length,
+                             out_kv[i].value, out_kv[i].value_length);
+    }
+
+    if (out_count) {
+      // Event keys are never longer than FDB_KEY_MAX_LENGTH, as the range
+      // holds nothing else
+      last_length = out_kv[(out_count - 1)].key_length;
+      memcpy(last_key, out_kv[(out_count - 1)].key, last_length);
+      begin_or_equal = 1;
+    }
+
+    fdb_future_destroy(future);
+
+    // Start the next batch at a fresh read version, so that the scan is never
+    // limited by the transaction lifetime
+    fdb_transaction_reset(tx);
+  } while (out_more);
+
+  fdb_transaction_destroy(tx);
+
+  // Success
+  return 0;
+
+// Failure
+tx_fail:
+  fdb_future_destroy(future);
+  fdb_transaction_destroy(tx);
+  return -1;
+}
+
+int find_stored_event(uint64_t begin_id, uint64_t end_id, uint64_t *event_id) {
+  FDBTransaction *tx;
+  FDBFuture *future;
+  uint8_t begin_key[FDB_KEY_MAX_LENGTH];
+  uint8_t end_key[FDB_KEY_MAX_LENGTH];
+  uint8_t begin_length, end_length;
+  const uint8_t *key;
+  int key_length;
+  uint32_t fragment;
+  int found;
+
+  begin_length = fdb_build_event_key(begin_key, begin_id, 0);
+  end_length = fdb_build_event_key(end_key, end_id, 0);
+
+  if (fdb_setup_transaction(&tx))
+    return -1;
+
+  // Snapshot lookup of the first key at or after the start of the range
+  future = fdb_transaction_get_key(tx, begin_key, begin_length, 0, 1, 1);
+  if (fdb_check_error(fdb_future_block_until_ready(future)))
+    goto tx_fail;
+  if (fdb_check_error(fdb_future_get_error(future)))
+    goto tx_fail;
+  if (fdb_check_error(fdb_future_get_key(future, &key, &key_length)))
+    goto tx_fail;
+
+  // Keys past the range, or outside the event keys, end the walk
+  found = memcmp(key, end_key,
+                 (key_length < end_length) ? key_length : end_length);
+  if ((found > 0) || (!found && (key_length >= end_length)) ||
+      fdb_parse_event_key(key, key_length, event_id, &fragment))
+    found = 1;
+  else
+    found = 0;
+
+  fdb_future_destroy(future);
+  fdb_transaction_destroy(tx);
+
+  // Success
+  return found;
+
+// Failure
+tx_fail:
+  fdb_future_destroy(future);
+  fdb_transaction_destroy(tx);
+  return -1;
+}
@@ -0,0 +1,134 @@
+/// @file fdb_footprint.h
+///
+/// Declarations for functions which measure the storage footprint of the event
+/// log: payload bytes versus key and header bytes, key-value pairs per event,
+/// fragment utilization, and write amplification.
+///
+/// Documentation links:
+///   https://apple.github.io/foundationdb/api-c.html#c.fdb_transaction_get_estimated_range_size_bytes
+///   https://apple.github.io/foundationdb/known-limitations.html
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+// Number of buckets in the key-value pairs per event histogram. Bucket i counts
+// events with [2^i, 2^(i+1)) key-value pairs.
+#define FOOTPRINT_HISTOGRAM_BUCKETS 24
+
+// Rough estimate of the bytes the FoundationDB storage engine spends on each
+// key-value pair beyond the key and value themselves
+#define FOOTPRINT_DEFAULT_KV_OVERHEAD 40.0
+
+// Bytes needed to index one event inside a packed key-value pair
+#define FOOTPRINT_PACKED_INDEX_SIZE 8
+
+//==============================================================================
+// Types
+//==============================================================================
+
+typedef struct footprint_stats_t {
+  uint64_t num_events;        // Number of events seen.
+  uint64_t num_kvs;           // Number of key-value pairs seen.
+  uint64_t key_bytes;         // Total key bytes.
+  uint64_t header_bytes;      // Total first-fragment header and
+                              // authentication tag bytes.
+  uint64_t payload_bytes;     // Total event payload bytes.
+  uint64_t torn_events;       // Events with missing or extra fragments.
+  uint64_t packable_events;   // Single-fragment events smaller than a fragment.
+  uint64_t packable_bytes;    // Header + payload bytes of packable events.
+  uint64_t byte_counts[256];  // Frequency of each payload byte value.
+  uint64_t kv_histogram[FOOTPRINT_HISTOGRAM_BUCKETS]; // KVs per event.
+  bool has_current;           // Whether an event is being accumulated.
+  uint64_t current_id;        // Identifier of the event being accumulated.
+  uint32_t current_kvs;       // Key-value pairs seen for the current event.
+  uint32_t current_expected;  // Key-value pairs promised by its header.
+  uint64_t current_bytes;     // Header + payload bytes of the current event.
+} FootprintStats;
+
+typedef struct footprint_report_t {
+  double kv_overhead;           // Assumed per-KV storage engine overhead.
+  double fragment_utilization;  // Used share of OPTIMAL_VALUE_SIZE per KV.
+  double logical_amplification; // (keys + headers + payload) / payload.
+  double storage_amplification; // Logical bytes plus KV overhead / payload.
+  double storage_bytes;         // Estimated bytes on disk.
+  double payload_entropy;       // Order-0 entropy of payload (bits/byte).
+  double packed_bytes;          // Estimated bytes on disk if small events
+                                // were packed into shared key-value pairs.
+  double compressed_bytes;      // Estimated bytes on disk if payloads were
+                                // compressed to their order-0 entropy.
+} FootprintReport;
+
+//==============================================================================
+// Prototypes
+//==============================================================================
+
+/// Reset footprint statistics.
+///
+/// @param[in] stats  Handle for the statistics.
+void footprint_init(FootprintStats *stats);
+
+/// Account for one stored event fragment. Fragments must be supplied in key
+/// order.
+///
+/// @param[in] stats         Handle for the statistics.
+/// @param[in] event_id      Identifier of the event the fragment belongs to.
+/// @param[in] fragment      Fragment number.
+/// @param[in] key_length    Length of the fragment key in bytes.
+/// @param[in] value         Fragment value.
+/// @param[in] value_length  Length of the fragment value in bytes.
+void footprint_add_fragment(FootprintStats *stats, uint64_t event_id,
+                            uint32_t fragment, uint32_t key_length,
+                            const uint8_t *value, uint32_t value_length);
+
+/// Close out the event currently being accumulated.
+///
+/// @param[in] stats  Handle for the statistics.
+void footprint_finish(FootprintStats *stats);
+
+/// Derive amplification ratios and projected savings from statistics.
+///
+/// @param[in] stats        Handle for the statistics.
+/// @param[in] kv_overhead  Assumed storage engine overhead per key-value pair.
+/// @param[in] report       Handle for the report to write into.
+void footprint_report(const FootprintStats *stats, double kv_overhead,
+                      FootprintReport *report);
+
+/// Print statistics and the report derived from them.
+///
+/// @param[in] stats   Handle for the statistics.
+/// @param[in] report  Handle for the derived report.
+/// @param[in] stream  Output stream.
+void footprint_print(const FootprintStats *stats, const FootprintReport *report,
+                     FILE *stream);
+
+/// Scan a range of events in the database and accumulate their footprint.
+/// Reads are snapshot reads, and each batch uses a fresh read version so that
+/// arbitrarily long scans don't exceed the transaction lifetime. A sampled scan
+/// looks up the first stored event of each stride of ids, so it costs a few
+/// round trips per sampled event however wide the range is.
+///
+/// @param[in] start_id  First event identifier in the range.
+/// @param[in] end_id    Event identifier one past the end of the range.
+/// @param[in] stride    Scan every event (1), or only the first stored event
+///                      of every stride ids.
+/// @param[in] stats     Handle for the statistics to accumulate into.
+///
+/// @return  0  Success.
+/// @return -1  Failure.
+int fdb_analyze_range(uint64_t start_id, uint64_t end_id, uint64_t stride,
+                      FootprintStats *stats);
+
+/// Ask the cluster for its estimate of the bytes stored for a range of events,
+/// without reading them.
+///
+/// @param[in] start_id  First event identifier in the range.
+/// @param[in] end_id    Event identifier one past the end of the range.
+/// @param[in] bytes     Address to write the estimated size into.
+///
+/// @return  0  Success.
+/// @return -1  Failure.
+int fdb_estimate_range_size(uint64_t start_id, uint64_t end_id,
+                            int64_t *bytes);
@@ -0,0 +1,684 @@
+/// @file fdb_lazy.c
+///
+/// Definitions for lazy reads of events.
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <foundationdb/fdb_c.h>
+#include <linux/userfaultfd.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "archive.h"
+#include "cipher.h"
+#include "constants.h"
+#include "event.h"
+#include "fdb.h"
+#include "fdb_lazy.h"
+#include "metrics.h"
+#include "shm_cache.h"
+
+// Maximum attempts at one read before it gives up
+#define LAZY_MAX_ATTEMPTS 10
+
+//==============================================================================
+// Types
+//==============================================================================
+
+typedef struct lazy_mapping_t {
+  uint8_t *base;               // Start of the mapped range.
+  uint64_t mapped_length;      // Length of the range, in whole pages.
+  uint64_t id;                 // The unique event identifier.
+  uint64_t data_length;        // Length of the event data in bytes.
+  uint32_t first_length;       // Length of the payload of the first fragment.
+  KeyFormat format;            // Key layout the event is stored in.
+  uint8_t *filled;             // Bit of each page, set once it is filled.
+  uint64_t next_page;          // Page following the last fill.
+  uint64_t readahead;          // Number of pages of the last fill.
+  bool failed;                 // Whether a fill has failed.
+  struct lazy_mapping_t *next; // Next mapping in the registry.
+} LazyMapping;
+
+//==============================================================================
+// Variables
+//==============================================================================
+
+static pthread_once_t lazy_once = PTHREAD_ONCE_INIT;
+static int lazy_fd = -1;
+static uint64_t lazy_page_size;
+
+// Fills hold the registry lock, so a mapping can't be released mid-fill
+static pthread_mutex_t lazy_mutex = PTHREAD_MUTEX_INITIALIZER;
+static LazyMapping *lazy_mappings = NULL;
+
+// Buffer the handler thread assembles fills in
+static uint8_t *lazy_staging = NULL;
+
+//==============================================================================
+// Prototypes
+//==============================================================================
+
+/// Open a userfaultfd and start the thread handling its faults.
+void lazy_init(void);
+
+/// Serve the faults reported by the userfaultfd, one at a time.
+///
+/// @param[in] arg  Unused.
+///
+/// @return  NULL.
+void *lazy_handler(void *arg);
+
+/// Fill the pages around a faulting address.
+///
+/// @param[in] address  The faulting address.
+void serve_fault(uint64_t address);
+
+/// Fill consecutive pages of a mapping with the event data they hold.
+///
+/// @param[in] mapping  The mapping.
+/// @param[in] page     First page to fill.
+/// @param[in] count    Number of pages to fill.
+///
+/// @return  0  Success.
+/// @return -1  Failure.
+int fill_pages(LazyMapping *mapping, uint64_t page, uint64_t count);
+
+/// Copy part of the event data of a mapping into the staging buffer, reading
+/// the fragments which hold it.
+///
+/// @param[in] mapping  The mapping.
+/// @param[in] begin    Offset of the first byte of the part.
+/// @param[in] end      Offset one past the last byte of the part.
+///
+/// @return  0  Success.
+/// @return -1  Failure.
+int read_fragments(LazyMapping *mapping, uint64_t begin, uint64_t end);
+
+/// Read the first fragment of an event, in either key layout.
+///
+/// @param[in] event_id       The unique event identifier.
+/// @param[in] payload        Pointer to the write location of the payload
+///                           (of OPTIMAL_VALUE_SIZE bytes).
+/// @param[in] length         Address to write the payload length into.
+/// @param[in] num_fragments  Address to write the number of fragments into.
+/// @param[in] format         Address to write the key layout into.
+///
+/// @return  0  Success.
+/// @return -1  Failure (including a missing event).
+int read_first_fragment(uint64_t event_id, uint8_t *payload, uint32_t *length,
+                        uint32_t *num_fragments, KeyFormat *format);
+
+/// Get the payload of a stored fragment, opening it when encryption is
+/// enabled.
+///
+/// @param[in] payload        Pointer to the write location of the payload
+///                           (of OPTIMAL_VALUE_SIZE bytes).
+/// @param[in] event_id       The unique event identifier.
+/// @param[in] fragment       The fragment number.
+/// @param[in] value          The stored fragment value.
+/// @param[in] value_length   Length of the value in bytes.
+/// @param[in] length         Address to write the payload length into.
+/// @param[in] num_fragments  Address to write the number of fragments into
+///                           (first fragment only, may be NULL).
+///
+/// @return  0  Success.
+/// @return -1  Failure (including a malformed or unauthentic fragment).
+int open_fragment(uint8_t *payload, uint64_t event_id, uint32_t fragment,
+                  const uint8_t *value, uint32_t value_length,
+                  uint32_t *length, uint32_t *num_fragments);
+
+/// Find the mapping holding an address. The registry lock must be held.
+///
+/// @param[in] address  The address.
+///
+/// @return  The mapping, or NULL if none holds the address.
+LazyMapping *find_mapping(uint64_t address);
+
+/// Copy whole pages into a mapping, waking any thread faulting on them.
+///
+/// @param[in] mapping  The mapping.
+/// @param[in] page     First page to copy into.
+/// @param[in] count    Number of pages.
+/// @param[in] src      The page contents.
+///
+/// @return  0  Success.
+/// @return -1  Failure.
+int copy_pages(LazyMapping *mapping, uint64_t page, uint64_t count,
+               const uint8_t *src);
+
+//==============================================================================
+// Functions
+//==============================================================================
+
+void lazy_init(void) {
+  struct uffdio_api api = {.api = UFFD_API, .features = 0};
+  pthread_t thread;
+  int fd;
+
+  lazy_page_size = (uint64_t)sysconf(_SC_PAGESIZE);
+
+  // Handling faults in system calls too needs privileges, so settle for
+  // user-mode faults without them
+  fd = (int)syscall(SYS_userfaultfd, O_CLOEXEC);
+#ifdef UFFD_USER_MODE_ONLY
+  if ((fd < 0) && (errno == EPERM))
+    fd = (int)syscall(SYS_userfaultfd, (O_CLOEXEC | UFFD_USER_MODE_ONLY));
+#endif
+  if (fd < 0)
+    return;
+
+  if (ioctl(fd, UFFDIO_API, &api))
+    goto fail;
+
+  lazy_staging = mmap(NULL, LAZY_MAX_READAHEAD, (PROT_READ | PROT_WRITE),
+                      (MAP_PRIVATE | MAP_ANONYMOUS), -1, 0);
+  if (lazy_staging == MAP_FAILED)
+    goto fail;
+
+  lazy_fd = fd;
+  if (pthread_create(&thread, NULL, lazy_handler, NULL)) {
+    lazy_fd = -1;
+    munmap(lazy_staging, LAZY_MAX_READAHEAD);
+    goto fail;
+  }
+  pthread_detach(thread);
+
+  // Success
+  return;
+
+// Failure
+fail:
+  close(fd);
+}
+
+bool fdb_lazy_available(void) {
+  pthread_once(&lazy_once, lazy_init);
+
+  return (lazy_fd >= 0);
+}
+
+int fdb_read_event_lazy(Event *event) {
+  LazyMapping *mapping;
+  uint8_t payload[OPTIMAL_VALUE_SIZE];
+  struct uffdio_register reg;
+  uint32_t first_length, num_fragments;
+  uint64_t num_pages, prefill;
+  KeyFormat format;
+  int err;
+
+  if (!fdb_lazy_available())
+    return fdb_read_event(event);
+
+  if (!shm_cache_get(event))
+    return 0;
+
+  // Archived events are local already
+  err = archive_read_event(event);
+  if (err <= 0)
+    return err;
+
+  if (read_first_fragment(event->id, payload, &first_length, &num_fragments,
+                          &format))
+    return -1;
+
+  // Events of one fragment have been read in full
+  if (num_fragments == 1) {
+    event->data = alloc_event_data(first_length);
+    if (!event->data)
+      return -1;
+    memcpy(event->data, payload, first_length);
+    event->data_length = first_length;
+
+    // Success
+    return 0;
+  }
+
+  mapping = calloc(1, sizeof(LazyMapping));
+  if (!mapping)
+    return -1;
+
+  mapping->id = event->id;
+  mapping->data_length =
+      (first_length + ((uint64_t)(num_fragments - 1) * OPTIMAL_VALUE_SIZE));
+  mapping->first_length = first_length;
+  mapping->format = format;
+
+  num_pages = ((mapping->data_length + lazy_page_size - 1) / lazy_page_size);
+  mapping->mapped_length = (num_pages * lazy_page_size);
+  mapping->filled = calloc(((num_pages + 7) / 8), 1);
+  if (!mapping->filled)
+    goto fail;
+
+  mapping->base = mmap(NULL, mapping->mapped_length, (PROT_READ | PROT_WRITE),
+                       (MAP_PRIVATE | MAP_ANONYMOUS), -1, 0);
+  if (mapping->base == MAP_FAILED)
+    goto fail;
+
+  reg.range.start = (uint64_t)(uintptr_t)mapping->base;
+  reg.range.len = mapping->mapped_length;
+  reg.mode = UFFDIO_REGISTER_MODE_MISSING;
+  if (ioctl(lazy_fd, UFFDIO_REGISTER, &reg)) {
+    munmap(mapping->base, mapping->mapped_length);
+    goto fail;
+  }
+
+  // Fill the pages lying wholly within the first fragment, which is at hand,
+  // and carry on from there if the event is read in order
+  prefill = (first_length / lazy_page_size);
+  if (prefill) {
+    uint8_t *pages = aligned_alloc(lazy_page_size, (prefill * lazy_page_size));
+
+    if (pages) {
+      memcpy(pages, payload, (prefill * lazy_page_size));
+      if (copy_pages(mapping, 0, prefill, pages))
+        prefill = 0;
+      free((void *)pages);
+    } else {
+      prefill = 0;
+    }
+  }
+  for (uint64_t page = 0; page < prefill; ++page)
+    mapping->filled[(page / 8)] |= (uint8_t)(1U << (page % 8));
+  mapping->next_page = prefill;
+  mapping->readahead = 1;
+
+  pthread_mutex_lock(&lazy_mutex);
+  mapping->next = lazy_mappings;
+  lazy_mappings = mapping;
+  pthread_mutex_unlock(&lazy_mutex);
+
+  event->data = mapping->base;
+  event->data_length = mapping->data_length;
+
+  // Success
+  return 0;
+
+// Failure
+fail:
+  free((void *)mapping->filled);
+  free((void *)mapping);
+  return -1;
+}
+
+bool fdb_lazy_event_failed(const Event *event) {
+  LazyMapping *mapping;
+  bool failed = false;
+
+  pthread_mutex_lock(&lazy_mutex);
+  mapping = find_mapping((uint64_t)(uintptr_t)event->data);
+  if (mapping)
+    failed = mapping->failed;
+  pthread_mutex_unlock(&lazy_mutex);
+
+  return failed;
+}
+
+void fdb_release_lazy_event(Event *event) {
+  LazyMapping **link;
+  LazyMapping *mapping = NULL;
+  struct uffdio_range range;
+
+  pthread_mutex_lock(&lazy_mutex);
+  for (link = &lazy_mappings; *link; link = &(*link)->next) {
+    if ((*link)->base == event->data) {
+      mapping = *link;
+      *link = mapping->next;
+      break;
+    }
+  }
+  pthread_mutex_unlock(&lazy_mutex);
+
+  // Events read eagerly hold ordinary event data
+  if (mapping) {
+    range.start = (uint64_t)(uintptr_t)mapping->base;
+    range.len = mapping->mapped_length;
+    ioctl(lazy_fd, UFFDIO_UNREGISTER, &range);
+    munmap(mapping->base, mapping->mapped_length);
+
+    free((void *)mapping->filled);
+    free((void *)mapping);
+  } else {
+    free_event(event);
+  }
+
+  event->data = NULL;
+  event->data_length = 0;
+}
+
+void lazy_fragment_span(uint32_t first_length, uint64_t offset, uint64_t length,
+                        uint32_t *first_fragment, uint32_t *last_fragment) {
+  uint64_t last = (offset + length - 1);
+
+  *first_fragment =
+      (offset < first_length)
+          ? 0
+          : (uint32_t)(1 + ((offset - first_length) / OPTIMAL_VALUE_SIZE));
+  *last_fragment =
+      (last < first_length)
+          ? 0
+          : (uint32_t)(1 + ((last - first_length) / OPTIMAL_VALUE_SIZE));
+}
+
+uint64_t lazy_fragment_offset(uint32_t first_length, uint32_t fragment) {
+  return fragment ? (first_length +
+                     ((uint64_t)(fragment - 1) * OPTIMAL_VALUE_SIZE))
+                  : 0;
+}
+
+void *lazy_handler(void *arg) {
+  struct uffd_msg msg;
+
+  for (;;) {
+    ssize_t length = read(lazy_fd, &msg, sizeof(msg));
+
+    if (length != (ssize_t)sizeof(msg)) {
+      if ((length < 0) && (errno != EINTR) && (errno != EAGAIN))
+        break;
+      continue;
+    }
+
+    if (msg.event == UFFD_EVENT_PAGEFAULT)
+      serve_fault(msg.arg.pagefault.address);
+  }
+
+  return NULL;
+}
+
+void serve_fault(uint64_t address) {
+  LazyMapping *mapping;
+  uint64_t max_pages = (LAZY_MAX_READAHEAD / lazy_page_size);
+  uint64_t num_pages, page, count, readahead;
+
+  pthread_mutex_lock(&lazy_mutex);
+
+  // Mappings are unregistered before they leave the registry, which wakes
+  // any thread faulting on them
+  mapping = find_mapping(address);
+  if (!mapping) {
+    pthread_mutex_unlock(&lazy_mutex);
+    return;
+  }
+
+  metrics_add(METRIC_LAZY_FAULTS, 1);
+  num_pages = (mapping->mapped_length / lazy_page_size);
+  page = ((address - (uint64_t)(uintptr_t)mapping->base) / lazy_page_size);
+
+  // Several threads may fault on a page before it is filled, and the fill
+  // already woke them all; waking again is harmless
+  if (mapping->filled[(page / 8)] & (1U << (page % 8))) {
+    struct uffdio_range range;
+
+    range.start =
+        ((uint64_t)(uintptr_t)mapping->base + (page * lazy_page_size));
+    range.len = lazy_page_size;
+    ioctl(lazy_fd, UFFDIO_WAKE, &range);
+    pthread_mutex_unlock(&lazy_mutex);
+    return;
+  }
+
+  // Read further ahead for as long as faults continue where the last fill
+  // ended, stopping short of any page filled already
+  readahead = 1;
+  if (page == mapping->next_page)
+    readahead = ((2 * mapping->readahead) < max_pages)
+                    ? (2 * mapping->readahead)
+                    : max_pages;
+  for (count = 1; (count < readahead) && ((page + count) < num_pages) &&
+                  !(mapping->filled[((page + count) / 8)] &
+                    (1U << ((page + count) % 8)));
+       ++count)
+    ;
+
+  if (fill_pages(mapping, page, count)) {
+    struct uffdio_zeropage zero;
+
+    // The faulting thread can't be told, so the page reads as zeros
+    mapping->failed = true;
+    metrics_add(METRIC_LAZY_ERRORS, 1);
+    count = 1;
+
+    zero.range.start = ((uint64_t)(uintptr_t)mapping->base +
+                        (page * lazy_page_size));
+    zero.range.len = lazy_page_size;
+    zero.mode = 0;
+    ioctl(lazy_fd, UFFDIO_ZEROPAGE, &zero);
+  }
+
+  for (uint64_t i = page; i < (page + count); ++i)
+    mapping->filled[(i / 8)] |= (uint8_t)(1U << (i % 8));
+  mapping->next_page = (page + count);
+  mapping->readahead = count;
+
+  pthread_mutex_unlock(&lazy_mutex);
+}
+
+int fill_pages(LazyMapping *mapping, uint64_t page, uint64_t count) {
+  uint64_t begin = (page * lazy_page_size);
+  uint64_t end = ((page + count) * lazy_page_size);
+
+  // The last page runs past the end of the data
+  if (end > mapping->data_length) {
+    memset((lazy_staging + (mapping->data_length - begin)), 0,
+           (end - mapping->data_length));
+    end = mapping->data_length;
+  }
+
+  if (read_fragments(mapping, begin, end))
+    return -1;
+
+  // Counted first, as the copy wakes the faulting thread
+  metrics_add(METRIC_LAZY_BYTES, (count * lazy_page_size));
+
+  return copy_pages(mapping, page, count, lazy_staging);
+}
+
+int read_fragments(LazyMapping *mapping, uint64_t begin, uint64_t end) {
+  FDBTransaction *tx;
+  FDBFuture *future;
+  const FDBKeyValue *out_kv;
+  fdb_bool_t out_more = 1;
+  int32_t out_count;
+  fdb_bool_t begin_or_equal = 0;
+  uint8_t payload[OPTIMAL_VALUE_SIZE];
+  uint8_t last_key[FDB_KEY_MAX_LENGTH];
+  uint8_t end_key[FDB_KEY_MAX_LENGTH];
+  int last_length, end_length;
+  uint32_t first_fragment, last_fragment, next_fragment;
+  uint32_t attempts = 0;
+  int err;
+
+  lazy_fragment_span(mapping->first_length, begin, (end - begin),
+                     &first_fragment, &last_fragment);
+  next_fragment = first_fragment;
+
+  last_length = fdb_build_event_key_format(last_key, mapping->format,
+                                           mapping->id, first_fragment);
+  end_length = fdb_build_event_key_format(end_key, mapping->format,
+                                          mapping->id, (last_fragment + 1));
+
+  if (fdb_check_error(fdb_setup_transaction(&tx)))
+    return -1;
+
+  while (out_more) {
+    // Snapshot read, since events never change once written
+    future = fdb_transaction_get_range(
+        tx, last_key, last_length, begin_or_equal, 1, end_key, end_length, 0,
+        1, 0, 0, FDB_STREAMING_MODE_WANT_ALL, 0, 1, 0);
+    err = fdb_wait_future(tx, future, &attempts, LAZY_MAX_ATTEMPTS);
+    if (err > 0)
+      continue;
+    if (err || fdb_check_error(fdb_future_get_keyvalue_array(
+                   future, &out_kv, &out_count, &out_more))) {
+      if (!err)
+        fdb_future_destroy(future);
+      goto tx_fail;
+    }
+
+    for (int32_t i = 0; i < out_count; ++i) {
+      uint64_t event_id, offset, from, to;
+      uint32_t fragment, length;
+
+      if (fdb_parse_event_key(out_kv[i].key, out_kv[i].key_length, &event_id,
+                              &fragment) ||
+          (event_id != mapping->id) || (fragment != next_fragment) ||
+          open_fragment(payload, event_id, fragment, out_kv[i].value,
+                        out_kv[i].value_length, &length, NULL)) {
+        fdb_future_destroy(future);
+        goto tx_fail;
+      }
+
+      // Copy the part of the fragment within the range
+      offset = lazy_fragment_offset(mapping->first_length, fragment);
+      from = (offset > begin) ? offset : begin;
+      to = ((offset + length) < end) ? (offset + length) : end;
+      if (from < to)
+        memcpy((lazy_staging + (from - begin)), (payload + (from - offset)),
+               (to - from));
+
+      ++next_fragment;
+    }
+
+    if (out_count) {
+      last_length = out_kv[(out_count - 1)].key_length;
+      memcpy(last_key, out_kv[(out_count - 1)].key, last_length);
+      begin_or_equal = 1;
+    }
+
+    fdb_future_destroy(future);
+  }
+
+  fdb_transaction_destroy(tx);
+
+  // Fail on missing fragments, e.g. of an event cleared meanwhile
+  return (next_fragment == (last_fragment + 1)) ? 0 : -1;
+
+// Failure
+tx_fail:
+  fdb_transaction_destroy(tx);
+  return -1;
+}
+
+int read_first_fragment(uint64_t event_id, uint8_t *payload, uint32_t *length,
+                        uint32_t *num_fragments, KeyFormat *format) {
+  FDBTransaction *tx;
+  FDBFuture *future;
+  fdb_bool_t present = 0;
+  const uint8_t *value;
+  int value_length;
+  uint8_t key[FDB_KEY_MAX_LENGTH];
+  uint8_t key_length;
+  KeyFormat formats[2];
+  uint32_t attempts = 0;
+  int err = 0;
+
+  // Fall back to the other layout, in case the event predates (or is part way
+  // through) a key layout migration
+  formats[0] = fdb_get_key_format();
+  formats[1] =
+      (formats[0] == KEY_FORMAT_FIXED) ? KEY_FORMAT_COMPACT : KEY_FORMAT_FIXED;
+
+  if (fdb_check_error(fdb_setup_transaction(&tx)))
+    return -1;
+
+  for (uint32_t i = 0; !present && (i < 2); ++i) {
+    key_length = fdb_build_event_key_format(key, formats[i], event_id, 0);
+
+    do {
+      future = fdb_transaction_get(tx, key, key_length, 1);
+      err = fdb_wait_future(tx, future, &attempts, LAZY_MAX_ATTEMPTS);
+    } while (err > 0);
+
+    if (err || fdb_check_error(fdb_future_get_value(future, &present, &value,
+                                                    &value_length))) {
+      if (!err)
+        fdb_future_destroy(future);
+      fdb_transaction_destroy(tx);
+      return -1;
+    }
+
+    if (present) {
+      *format = formats[i];
+      err = open_fragment(payload, event_id, 0, value, (uint32_t)value_length,
+                          length, num_fragments);
+    }
+
+    fdb_future_destroy(future);
+  }
+
+  fdb_transaction_destroy(tx);
+
+  // Success or failure
+  return (present && !err) ? 0 : -1;
+}
+
+int open_fragment(uint8_t *payload, uint64_t event_id, uint32_t fragment,
+                  const uint8_t *value, uint32_t value_length,
+                  uint32_t *length, uint32_t *num_fragments) {
+  uint32_t overhead = cipher_overhead();
+  uint8_t header_length = 0;
+  uint32_t count;
+
+  if (!fragment) {
+    int parsed = parse_header(value, value_length, &count);
+
+    if (parsed < 0)
+      return -1;
+    header_length = (uint8_t)parsed;
+    if (value_length < (header_length + overhead))
+      return -1;
+
+    // The header stores the number of ADDITIONAL fragments
+    if (num_fragments)
+      *num_fragments = (count + 1);
+
+    *length = (value_length - header_length - overhead);
+    if (!*length || (*length > OPTIMAL_VALUE_SIZE))
+      return -1;
+  } else {
+    // Every fragment after the first should be EXACTLY the preset size
+    if (value_length != (OPTIMAL_VALUE_SIZE + overhead))
+      return -1;
+    *length = OPTIMAL_VALUE_SIZE;
+  }
+
+  if (cipher_enabled())
+    return cipher_open(payload, value, header_length, (value + header_length),
+                       *length, event_id, fragment);
+
+  memcpy(payload, (value + header_length), *length);
+
+  // Success
+  return 0;
+}
+
+LazyMapping *find_mapping(uint64_t address) {
+  for (LazyMapping *mapping = lazy_mappings; mapping; mapping = mapping->next) {
+    uint64_t base = (uint64_t)(uintptr_t)mapping->base;
+
+    if ((address >= base) && (address < (base + mapping->mapped_length)))
+      return mapping;
+  }
+
+  return NULL;
+}
+
+int copy_pages(LazyMapping *mapping, uint64_t page, uint64_t count,
+               const uint8_t *src) {
+  struct uffdio_copy copy;
+
+  copy.dst = ((uint64_t)(uintptr_t)mapping->base + (page * lazy_page_size));
+  copy.src = (uint64_t)(uintptr_t)src;
+  copy.len = (count * lazy_page_size);
+  copy.mode = 0;
+
+  return ioctl(lazy_fd, UFFDIO_COPY, &copy) ? -1 : 0;
+}
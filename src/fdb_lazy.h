@@ -0,0 +1,88 @@
+/// @file fdb_lazy.h
+///
+/// Declarations for lazy reads of events, which return the data of an event as
+/// an address range whose pages are only read from the cluster when they are
+/// first touched.
+///
+/// A lazy read costs one round trip, for the first fragment, which gives the
+/// length of the event. Its data is then mapped as anonymous memory registered
+/// with userfaultfd, and the pages lying wholly within the first fragment are
+/// filled straight away. A handler thread serves every other fault by
+/// range-reading only the fragments covering the faulting pages, and copying
+/// them in with UFFDIO_COPY, so untouched parts of an event are never read.
+/// Faults which continue where the last fill of an event ended double the
+/// number of pages filled, up to LAZY_MAX_READAHEAD bytes, so linear scans
+/// cost few round trips; any other fault fills a single page.
+///
+/// Fragments are read in transactions of their own as they are needed, which
+/// is safe since events never change once written. A fill which fails, e.g.
+/// because the event was cleared meanwhile, leaves its page reading as zeros
+/// and is reported by fdb_lazy_event_failed(). Events read from the cache or
+/// the archive, events of a single fragment, and every event when userfaultfd
+/// is unavailable, are read eagerly instead. When only user-mode faults may be
+/// handled, passing pages not yet touched to a system call fails with EFAULT.
+///
+/// Documentation links:
+///   https://docs.kernel.org/admin-guide/mm/userfaultfd.html
+///   https://man7.org/linux/man-pages/man2/userfaultfd.2.html
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "event.h"
+
+// Maximum number of bytes filled by a single fault
+#define LAZY_MAX_READAHEAD (1024 * 1024)
+
+//==============================================================================
+// Prototypes
+//==============================================================================
+
+/// Check whether events can be read lazily in this process, i.e. whether
+/// userfaultfd is available.
+///
+/// @return  Whether lazy reads are available.
+bool fdb_lazy_available(void);
+
+/// Read an event lazily. The data must be released with
+/// fdb_release_lazy_event(), never with free_event().
+///
+/// @param[in] event  Handle for the event to write to. The id must be set.
+///
+/// @return  0  Success.
+/// @return -1  Failure.
+int fdb_read_event_lazy(Event *event);
+
+/// Check whether a fill of a lazily read event has failed, so that some of its
+/// pages read as zeros.
+///
+/// @param[in] event  Handle for the lazily read event.
+///
+/// @return  Whether a fill has failed.
+bool fdb_lazy_event_failed(const Event *event);
+
+/// Release the data of a lazily read event. The data must no longer be in use
+/// by any thread.
+///
+/// @param[in] event  Handle for the lazily read event.
+void fdb_release_lazy_event(Event *event);
+
+/// Get the fragments holding part of the data of an event.
+///
+/// @param[in] first_length    Length of the payload of the first fragment.
+/// @param[in] offset          Offset of the first byte, in bytes.
+/// @param[in] length          Length of the part in bytes (greater than 0).
+/// @param[in] first_fragment  Address to write the first fragment number into.
+/// @param[in] last_fragment   Address to write the last fragment number into.
+void lazy_fragment_span(uint32_t first_length, uint64_t offset, uint64_t length,
+                        uint32_t *first_fragment, uint32_t *last_fragment);
+
+/// Get the offset within the data of an event of the payload of a fragment.
+///
+/// @param[in] first_length  Length of the payload of the first fragment.
+/// @param[in] fragment      The fragment number.
+///
+/// @return  Offset of the payload in bytes.
+uint64_t lazy_fragment_offset(uint32_t first_length, uint32_t fragment);
@@ -0,0 +1,847 @@
+/// @file fdb_merkle.c
+///
+/// Definitions for the Merkle summaries of the event log.
+
+#include <foundationdb/fdb_c.h>
+#include <openssl/evp.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <threads.h>
+
+#include "cipher.h"
+#include "constants.h"
+#include "event.h"
+#include "fdb.h"
+#include "fdb_merkle.h"
+
+// Length of a summary node key: prefix, level, big-endian index
+#define MERKLE_KEY_LENGTH 10
+
+// Nodes written per transaction by a rebuild
+#define MERKLE_REBUILD_NODES 1000
+
+// Key-value pairs read per batch by a scan
+#define MERKLE_SCAN_KVS 500
+
+// Maximum attempts at one read before it gives up
+#define MERKLE_MAX_ATTEMPTS 10
+
+//==============================================================================
+// Types
+//==============================================================================
+
+typedef struct merkle_context_t {
+  EVP_MD_CTX *digest; // Digest context.
+  bool registered;    // Whether the exit destructor is registered.
+} MerkleContext;
+
+//==============================================================================
+// Variables
+//==============================================================================
+
+static bool merkle_on = false;
+
+static pthread_once_t merkle_once = PTHREAD_ONCE_INIT;
+static pthread_key_t merkle_context_key;
+static thread_local MerkleContext merkle_context;
+
+//==============================================================================
+// Prototypes
+//==============================================================================
+
+/// Create the key used to release thread contexts at thread exit.
+void merkle_init(void);
+
+/// Release the calling thread's digest context at thread exit.
+///
+/// @param[in] arg  Handle for the thread's context.
+void merkle_context_destructor(void *arg);
+
+/// Build the key of a summary node.
+///
+/// @param[in] key    Pointer to the write location (of MERKLE_KEY_LENGTH
+///                   bytes).
+/// @param[in] level  Level of the node.
+/// @param[in] index  Index of the node within its level.
+void build_merkle_key(uint8_t *key, uint8_t level, uint64_t index);
+
+/// Add (or subtract) a digest to a little-endian sum, mod 2^128.
+///
+/// @param[in] sum       The sum.
+/// @param[in] digest    The digest.
+/// @param[in] subtract  Whether to subtract the digest.
+void merkle_sum_add(uint8_t *sum, const uint8_t *digest, bool subtract);
+
+/// Order summary nodes by level, then index.
+int compare_merkle_nodes(const void *a, const void *b);
+
+/// Read consecutive nodes of a finished in-memory summary.
+int read_tree_nodes(uint8_t level, uint64_t first, uint32_t count,
+                    uint8_t (*sums)[MERKLE_DIGEST_SIZE], void *context);
+
+/// Read consecutive nodes of the summaries stored in a cluster.
+int read_fdb_nodes(uint8_t level, uint64_t first, uint32_t count,
+                   uint8_t (*sums)[MERKLE_DIGEST_SIZE], void *context);
+
+/// Compare the children of a node in two copies of a log, descending into the
+/// ones which differ.
+///
+/// @param[in] a        The first copy.
+/// @param[in] b        The second copy.
+/// @param[in] level    Level of the node.
+/// @param[in] index    Index of the node within its level.
+/// @param[in] on_diff  Hook called for every differing bucket (may be NULL).
+/// @param[in] context  Passed through to the hook.
+///
+/// @return  Number of differing buckets.
+/// @return -1  Failure.
+int64_t diff_children(const MerkleSource *a, const MerkleSource *b,
+                      uint8_t level, uint64_t index, MerkleDiffFunc on_diff,
+                      void *context);
+
+/// Add one stored fragment to an in-memory summary, opening it first when
+/// encryption is enabled.
+///
+/// @param[in] tree          Handle for the summary.
+/// @param[in] event_id      The unique event identifier.
+/// @param[in] fragment      The fragment number.
+/// @param[in] value         The stored fragment value.
+/// @param[in] value_length  Length of the value in bytes.
+///
+/// @return  0  Success.
+/// @return -1  Failure (including a malformed or unauthentic fragment).
+int add_stored_fragment(MerkleTree *tree, uint64_t event_id, uint32_t fragment,
+                        const uint8_t *value, uint32_t value_length);
+
+/// Recover the plaintext of one stored fragment, opening it first when
+/// encryption is enabled.
+///
+/// @param[in] payload         Pointer to the write location of the payload (of
+///                            OPTIMAL_VALUE_SIZE bytes).
+/// @param[in] header_length   Pointer to the write location of the length of
+///                            the header, left at the start of the value.
+/// @param[in] payload_length  Pointer to the write location of the length of
+///                            the payload.
+/// @param[in] event_id        The unique event identifier.
+/// @param[in] fragment        The fragment number.
+/// @param[in] value           The stored fragment value.
+/// @param[in] value_length    Length of the value in bytes.
+///
+/// @return  0  Success.
+/// @return -1  Failure (including a malformed or unauthentic fragment).
+int open_stored_fragment(uint8_t *payload, uint8_t *header_length,
+                         uint32_t *payload_length, uint64_t event_id,
+                         uint32_t fragment, const uint8_t *value,
+                         uint32_t value_length);
+
+/// Subtract the digests of a batch of stored fragments.
+///
+/// @param[in] delta  Handle for the changes.
+/// @param[in] tx     FoundationDB transaction handle.
+/// @param[in] kvs    The stored event keys and fragment values.
+/// @param[in] count  Number of key-value pairs.
+///
+/// @return  0  Success.
+/// @return -1  Failure (including a malformed or unauthentic fragment).
+int subtract_stored_fragments(MerkleDelta *delta, FDBTransaction *tx,
+                              const FDBKeyValue *kvs, int32_t count);
+
+//==============================================================================
+// Functions
+//==============================================================================
+
+void fdb_set_merkle(bool enabled) { merkle_on = enabled; }
+
+bool fdb_merkle_enabled(void) { return merkle_on; }
+
+uint64_t merkle_node_index(uint8_t level, uint64_t event_id) {
+  uint32_t shift = (MERKLE_BUCKET_BITS + (level * MERKLE_FANOUT_BITS));
+
+  return (shift < 64) ? (event_id >> shift) : 0;
+}
+
+void merkle_init(void) {
+  pthread_key_create(&merkle_context_key, merkle_context_destructor);
+}
+
+void merkle_context_destructor(void *arg) {
+  MerkleContext *context = (MerkleContext *)arg;
+
+  EVP_MD_CTX_free(context->digest);
+  context->digest = NULL;
+}
+
+int merkle_digest(uint8_t *digest, uint64_t event_id, uint32_t fragment,
+                  const uint8_t *header, uint8_t header_length,
+                  const uint8_t *payload, uint32_t payload_length) {
+  MerkleContext *context = &merkle_context;
+  uint8_t position[12];
+  uint8_t hash[EVP_MAX_MD_SIZE];
+  unsigned int hash_length;
+
+  // Register the exit destructor the first time this thread hashes
+  if (!context->registered) {
+    pthread_once(&merkle_once, merkle_init);
+    pthread_setspecific(merkle_context_key, context);
+    context->registered = true;
+  }
+
+  if (!context->digest)
+    context->digest = EVP_MD_CTX_new();
+  if (!context->digest)
+    return -1;
+
+  // The position is hashed too, so that moved fragments change the sums
+  for (uint32_t i = 0; i < 8; ++i)
+    position[i] = (uint8_t)(event_id >> (56 - (8 * i)));
+  for (uint32_t i = 0; i < 4; ++i)
+    position[(8 + i)] = (uint8_t)(fragment >> (24 - (8 * i)));
+
+  if ((EVP_DigestInit_ex(context->digest, EVP_sha256(), NULL) != 1) ||
+      (EVP_DigestUpdate(context->digest, position, 12) != 1) ||
+      (header_length &&
+       (EVP_DigestUpdate(context->digest, header, header_length) != 1)) ||
+      (EVP_DigestUpdate(context->digest, payload, payload_length) != 1) ||
+      (EVP_DigestFinal_ex(context->digest, hash, &hash_length) != 1))
+    return -1;
+
+  memcpy(digest, hash, MERKLE_DIGEST_SIZE);
+
+  // Success
+  return 0;
+}
+
+void merkle_delta_init(MerkleDelta *delta) { delta->num_nodes = 0; }
+
+int merkle_delta_add(MerkleDelta *delta, FDBTransaction *tx, uint64_t event_id,
+                     uint32_t fragment, const uint8_t *header,
+                     uint8_t header_length, const uint8_t *payload,
+                     uint32_t payload_length, bool subtract) {
+  uint8_t digest[MERKLE_DIGEST_SIZE];
+
+  if (merkle_digest(digest, event_id, fragment, header, header_length, payload,
+                    payload_length))
+    return -1;
+
+  for (uint8_t level = 0; level < MERKLE_LEVELS; ++level) {
+    uint64_t index = merkle_node_index(level, event_id);
+    MerkleNode *node = NULL;
+
+    // Transactions touch few nodes, so a linear search is enough
+    for (uint32_t i = 0; i < delta->num_nodes; ++i) {
+      if ((delta->nodes[i].level == level) &&
+          (delta->nodes[i].index == index)) {
+        node = (delta->nodes + i);
+        break;
+      }
+    }
+
+    if (!node) {
+      if (delta->num_nodes == MERKLE_DELTA_NODES)
+        merkle_delta_apply(delta, tx);
+
+      node = (delta->nodes + delta->num_nodes++);
+      node->level = level;
+      node->index = index;
+      memset(node->sum, 0, MERKLE_DIGEST_SIZE);
+    }
+
+    merkle_sum_add(node->sum, digest, subtract);
+  }
+
+  // Success
+  return 0;
+}
+
+void merkle_delta_apply(MerkleDelta *delta, FDBTransaction *tx) {
+  uint8_t key[MERKLE_KEY_LENGTH];
+
+  for (uint32_t i = 0; i < delta->num_nodes; ++i) {
+    build_merkle_key(key, delta->nodes[i].level, delta->nodes[i].index);
+    fdb_transaction_atomic_op(tx, key, MERKLE_KEY_LENGTH, delta->nodes[i].sum,
+                              MERKLE_DIGEST_SIZE, FDB_MUTATION_TYPE_ADD);
+  }
+
+  delta->num_nodes = 0;
+}
+
+fdb_error_t merkle_delta_subtract_stored(MerkleDelta *delta, FDBTransaction *tx,
+                                         const uint8_t *begin_key,
+                                         int begin_length,
+                                         const uint8_t *end_key,
+                                         int end_length) {
+  FDBFuture *future;
+  const FDBKeyValue *out_kv;
+  fdb_bool_t out_more = 1;
+  int32_t out_count;
+  uint8_t last_key[FDB_KEY_MAX_LENGTH];
+  int last_length = begin_length;
+  fdb_bool_t begin_or_equal = 0;
+  fdb_error_t err;
+
+  memcpy(last_key, begin_key, begin_length);
+
+  for (int iteration = 1; out_more; ++iteration) {
+    // Not a snapshot read, so that a concurrent write of the range conflicts
+    future = fdb_transaction_get_range(
+        tx, last_key, last_length, begin_or_equal, 1, end_key, end_length, 0, 1,
+        0, 0, FDB_STREAMING_MODE_WANT_ALL, iteration, 0, 0);
+    err = fdb_future_block_until_ready(future);
+    if (!err)
+      err = fdb_future_get_error(future);
+    if (!err)
+      err = fdb_future_get_keyvalue_array(future, &out_kv, &out_count,
+                                          &out_more);
+    if (err) {
+      fdb_future_destroy(future);
+      return err;
+    }
+
+    if (subtract_stored_fragments(delta, tx, out_kv, out_count)) {
+      fdb_future_destroy(future);
+      return -1;
+    }
+
+    // Continue after the last key read
+    if (out_more && out_count) {
+      last_length = out_kv[(out_count - 1)].key_length;
+      memcpy(last_key, out_kv[(out_count - 1)].key, last_length);
+      begin_or_equal = 1;
+    }
+
+    fdb_future_destroy(future);
+  }
+
+  // Success
+  return 0;
+}
+
+fdb_error_t merkle_delta_subtract_chunk(MerkleDelta *delta, FDBTransaction *tx,
+                                        const uint8_t *begin_key,
+                                        int begin_length,
+                                        const uint8_t *end_key, int end_length,
+                                        int limit, uint8_t *next_key,
+                                        int *next_length) {
+  FDBFuture *future;
+  const FDBKeyValue *out_kv;
+  fdb_bool_t out_more;
+  int32_t out_count;
+  fdb_error_t err;
+
+  // Not a snapshot read, so that a concurrent write of the chunk conflicts
+  future = fdb_transaction_get_range(
+      tx, begin_key, begin_length, 0, 1, end_key, end_length, 0, 1, limit, 0,
+      FDB_STREAMING_MODE_EXACT, 0, 0, 0);
+  err = fdb_future_block_until_ready(future);
+  if (!err)
+    err = fdb_future_get_error(future);
+  if (!err)
+    err = fdb_future_get_keyvalue_array(future, &out_kv, &out_count, &out_more);
+  if (err) {
+    fdb_future_destroy(future);
+    return err;
+  }
+
+  if (subtract_stored_fragments(delta, tx, out_kv, out_count)) {
+    fdb_future_destroy(future);
+    return -1;
+  }
+
+  // The chunk ends just after the last key read, unless the range is done
+  if (out_more && out_count) {
+    *next_length = (out_kv[(out_count - 1)].key_length + 1);
+    memcpy(next_key, out_kv[(out_count - 1)].key, (*next_length - 1));
+    next_key[(*next_length - 1)] = 0;
+  } else {
+    *next_length = end_length;
+    memcpy(next_key, end_key, end_length);
+  }
+
+  fdb_future_destroy(future);
+
+  // Success
+  return 0;
+}
+
+void merkle_tree_init(MerkleTree *tree) {
+  tree->nodes = NULL;
+  tree->num_nodes = 0;
+  tree->capacity = 0;
+
+  for (uint8_t level = 0; level < MERKLE_LEVELS; ++level)
+    tree->last[level] = UINT32_MAX;
+}
+
+int merkle_tree_add_fragment(MerkleTree *tree, uint64_t event_id,
+                             uint32_t fragment, const uint8_t *header,
+                             uint8_t header_length, const uint8_t *payload,
+                             uint32_t payload_length) {
+  uint8_t digest[MERKLE_DIGEST_SIZE];
+
+  if (merkle_digest(digest, event_id, fragment, header, header_length, payload,
+                    payload_length))
+    return -1;
+
+  for (uint8_t level = 0; level < MERKLE_LEVELS; ++level) {
+    uint64_t index = merkle_node_index(level, event_id);
+    uint32_t last = tree->last[level];
+
+    // Events mostly arrive in id order, so most fragments add to the node last
+    // added to; any others are merged when the summary is finished
+    if ((last == UINT32_MAX) || (tree->nodes[last].index != index)) {
+      if (tree->num_nodes == tree->capacity) {
+        uint32_t capacity = tree->capacity ? (2 * tree->capacity) : 256;
+        MerkleNode *nodes =
+            realloc(tree->nodes, (sizeof(MerkleNode) * capacity));
+
+        if (!nodes)
+          return -1;
+
+        tree->nodes = nodes;
+        tree->capacity = capacity;
+      }
+
+      last = tree->num_nodes++;
+      tree->nodes[last].level = level;
+      tree->nodes[last].index = index;
+      memset(tree->nodes[last].sum, 0, MERKLE_DIGEST_SIZE);
+      tree->last[level] = last;
+    }
+
+    merkle_sum_add(tree->nodes[last].sum, digest, false);
+  }
+
+  // Success
+  return 0;
+}
+
+int merkle_tree_add_event(MerkleTree *tree, Event *event) {
+  FragmentedEvent f_event;
+  int err = 0;
+
+  fragment_event(event, &f_event);
+
+  for (uint32_t i = 0; !err && (i < f_event.num_fragments); ++i) {
+    if (!i)
+      err = merkle_tree_add_fragment(
+          tree, event->id, 0, f_event.header, f_event.header_length,
+          f_event.fragments[0], f_event.payload_length);
+    else
+      err = merkle_tree_add_fragment(tree, event->id, i, NULL, 0,
+                                     f_event.fragments[i], OPTIMAL_VALUE_SIZE);
+  }
+
+  free_fragmented_event(&f_event);
+
+  // Success or failure
+  return err;
+}
+
+void merkle_tree_finish(MerkleTree *tree) {
+  uint32_t num_nodes = 1;
+
+  for (uint8_t level = 0; level < MERKLE_LEVELS; ++level)
+    tree->last[level] = UINT32_MAX;
+
+  if (!tree->num_nodes)
+    return;
+
+  qsort(tree->nodes, tree->num_nodes, sizeof(MerkleNode), compare_merkle_nodes);
+
+  // Merge the nodes added to more than once
+  for (uint32_t i = 1; i < tree->num_nodes; ++i) {
+    MerkleNode *last = (tree->nodes + (num_nodes - 1));
+
+    if ((last->level == tree->nodes[i].level) &&
+        (last->index == tree->nodes[i].index))
+      merkle_sum_add(last->sum, tree->nodes[i].sum, false);
+    else
+      tree->nodes[num_nodes++] = tree->nodes[i];
+  }
+
+  tree->num_nodes = num_nodes;
+}
+
+void merkle_tree_free(MerkleTree *tree) {
+  free((void *)tree->nodes);
+  merkle_tree_init(tree);
+}
+
+void merkle_tree_source(MerkleTree *tree, MerkleSource *source) {
+  source->read = read_tree_nodes;
+  source->context = tree;
+}
+
+void fdb_merkle_source(FDBDatabase *database, MerkleSource *source) {
+  source->read = read_fdb_nodes;
+  source->context = database ? database : fdb_database;
+}
+
+int64_t merkle_diff(const MerkleSource *a, const MerkleSource *b,
+                    MerkleDiffFunc on_diff, void *context) {
+  uint8_t root_a[1][MERKLE_DIGEST_SIZE];
+  uint8_t root_b[1][MERKLE_DIGEST_SIZE];
+
+  if (a->read(MERKLE_ROOT_LEVEL, 0, 1, root_a, a->context) ||
+      b->read(MERKLE_ROOT_LEVEL, 0, 1, root_b, b->context))
+    return -1;
+
+  // Equal roots mean equal logs, in one read per copy
+  if (!memcmp(root_a[0], root_b[0], MERKLE_DIGEST_SIZE))
+    return 0;
+
+  return diff_children(a, b, MERKLE_ROOT_LEVEL, 0, on_diff, context);
+}
+
+int64_t diff_children(const MerkleSource *a, const MerkleSource *b,
+                      uint8_t level, uint64_t index, MerkleDiffFunc on_diff,
+                      void *context) {
+  uint8_t sums_a[MERKLE_FANOUT][MERKLE_DIGEST_SIZE];
+  uint8_t sums_b[MERKLE_FANOUT][MERKLE_DIGEST_SIZE];
+  uint64_t first = (index << MERKLE_FANOUT_BITS);
+  int64_t num_diffs = 0;
+
+  if (a->read((level - 1), first, MERKLE_FANOUT, sums_a, a->context) ||
+      b->read((level - 1), first, MERKLE_FANOUT, sums_b, b->context))
+    return -1;
+
+  for (uint32_t i = 0; i < MERKLE_FANOUT; ++i) {
+    uint64_t child = (first + i);
+    int64_t found;
+
+    if (!memcmp(sums_a[i], sums_b[i], MERKLE_DIGEST_SIZE))
+      continue;
+
+    // Differing leaves name the buckets worth reading in full
+    if (level == 1) {
+      if (on_diff)
+        on_diff((child << MERKLE_BUCKET_BITS),
+                ((child << MERKLE_BUCKET_BITS) + (MERKLE_BUCKET_IDS - 1)),
+                context);
+      ++num_diffs;
+      continue;
+    }
+
+    found = diff_children(a, b, (level - 1), child, on_diff, context);
+    if (found < 0)
+      return -1;
+    num_diffs += found;
+  }
+
+  return num_diffs;
+}
+
+int read_tree_nodes(uint8_t level, uint64_t first, uint32_t count,
+                    uint8_t (*sums)[MERKLE_DIGEST_SIZE], void *context) {
+  MerkleTree *tree = (MerkleTree *)context;
+  uint32_t low = 0;
+  uint32_t high = tree->num_nodes;
+
+  memset(sums, 0, ((uint64_t)count * MERKLE_DIGEST_SIZE));
+
+  // Find the first node at or after the first one wanted
+  while (low < high) {
+    uint32_t mid = (low + ((high - low) / 2));
+    const MerkleNode *node = (tree->nodes + mid);
+
+    if ((node->level < level) ||
+        ((node->level == level) && (node->index < first)))
+      low = (mid + 1);
+    else
+      high = mid;
+  }
+
+  for (; (low < tree->num_nodes) && (tree->nodes[low].level == level) &&
+         (tree->nodes[low].index < (first + count));
+       ++low)
+    memcpy(sums[(tree->nodes[low].index - first)], tree->nodes[low].sum,
+           MERKLE_DIGEST_SIZE);
+
+  // Success
+  return 0;
+}
+
+int read_fdb_nodes(uint8_t level, uint64_t first, uint32_t count,
+                   uint8_t (*sums)[MERKLE_DIGEST_SIZE], void *context) {
+  FDBTransaction *tx;
+  FDBFuture *future;
+  const FDBKeyValue *out_kv;
+  fdb_bool_t out_more;
+  int32_t out_count;
+  uint8_t begin_key[MERKLE_KEY_LENGTH];
+  uint8_t end_key[MERKLE_KEY_LENGTH];
+  uint32_t attempts = 0;
+  int err;
+
+  build_merkle_key(begin_key, level, first);
+  build_merkle_key(end_key, level, (first + count));
+
+  if (fdb_check_error(
+          fdb_database_create_transaction((FDBDatabase *)context, &tx)))
+    return -1;
+
+  do {
+    // Snapshot read, since summaries are only ever compared
+    future = fdb_transaction_get_range(
+        tx, begin_key, MERKLE_KEY_LENGTH, 0, 1, end_key, MERKLE_KEY_LENGTH, 0,
+        1, 0, 0, FDB_STREAMING_MODE_WANT_ALL, 0, 1, 0);
+    err = fdb_wait_future(tx, future, &attempts, MERKLE_MAX_ATTEMPTS);
+  } while (err > 0);
+
+  if (err || fdb_check_error(fdb_future_get_keyvalue_array(
+                 future, &out_kv, &out_count, &out_more))) {
+    if (!err)
+      fdb_future_destroy(future);
+    fdb_transaction_destroy(tx);
+    return -1;
+  }
+
+  memset(sums, 0, ((uint64_t)count * MERKLE_DIGEST_SIZE));
+
+  for (int32_t i = 0; i < out_count; ++i) {
+    uint64_t index = 0;
+
+    if ((out_kv[i].key_length != MERKLE_KEY_LENGTH) ||
+        (out_kv[i].value_length != MERKLE_DIGEST_SIZE))
+      continue;
+
+    for (uint32_t b = 2; b < MERKLE_KEY_LENGTH; ++b)
+      index = ((index << 8) | out_kv[i].key[b]);
+
+    memcpy(sums[(index - first)], out_kv[i].value, MERKLE_DIGEST_SIZE);
+  }
+
+  fdb_future_destroy(future);
+  fdb_transaction_destroy(tx);
+
+  // Success
+  return 0;
+}
+
+int fdb_merkle_scan(MerkleTree *tree) {
+  FDBTransaction *tx;
+  FDBFuture *future = NULL;
+  const FDBKeyValue *out_kv;
+  fdb_bool_t out_more = 1;
+  int32_t out_count;
+  fdb_bool_t begin_or_equal = 0;
+  uint8_t last_key[FDB_KEY_MAX_LENGTH];
+  int last_length;
+  uint8_t end_key[1] = {(fdb_event_key_prefix(fdb_get_key_format()) + 1)};
+  uint32_t attempts = 0;
+  int err;
+
+  last_length = fdb_build_event_key(last_key, 0, 0);
+
+  if (fdb_check_error(fdb_setup_transaction(&tx)))
+    return -1;
+
+  while (out_more) {
+    // Background work must never delay foreground transactions
+    fdb_check_error(fdb_transaction_set_option(tx, FDB_TR_OPTION_PRIORITY_BATCH,
+                                               NULL, 0));
+
+    // Snapshot read, continuing after the last key seen
+    future = fdb_transaction_get_range(
+        tx, last_key, last_length, begin_or_equal, 1, end_key, 1, 0, 1,
+        MERKLE_SCAN_KVS, 0, FDB_STREAMING_MODE_EXACT, 0, 1, 0);
+    err = fdb_wait_future(tx, future, &attempts, MERKLE_MAX_ATTEMPTS);
+    if (err > 0)
+      continue;
+    if (err || fdb_check_error(fdb_future_get_keyvalue_array(
+                   future, &out_kv, &out_count, &out_more))) {
+      if (!err)
+        fdb_future_destroy(future);
+      goto tx_fail;
+    }
+
+    for (int32_t i = 0; i < out_count; ++i) {
+      uint64_t event_id;
+      uint32_t fragment;
+
+      if (fdb_parse_event_key(out_kv[i].key, out_kv[i].key_length, &event_id,
+                              &fragment))
+        continue;
+
+      if (add_stored_fragment(tree, event_id, fragment, out_kv[i].value,
+                              out_kv[i].value_length)) {
+        fdb_future_destroy(future);
+        goto tx_fail;
+      }
+    }
+
+    if (out_count) {
+      last_length = out_kv[(out_count - 1)].key_length;
+      memcpy(last_key, out_kv[(out_count - 1)].key, last_length);
+      begin_or_equal = 1;
+    }
+
+    // A fresh transaction per batch, so that long scans never outlive one
+    fdb_future_destroy(future);
+    fdb_transaction_reset(tx);
+  }
+
+  fdb_transaction_destroy(tx);
+  merkle_tree_finish(tree);
+
+  // Success
+  return 0;
+
+// Failure
+tx_fail:
+  fdb_transaction_destroy(tx);
+  return -1;
+}
+
+int fdb_merkle_rebuild(void) {
+  FDBTransaction *tx;
+  MerkleTree tree;
+  uint8_t key[MERKLE_KEY_LENGTH];
+  uint8_t begin_key[1] = {FDB_MERKLE_PREFIX};
+  uint8_t end_key[1] = {(FDB_MERKLE_PREFIX + 1)};
+
+  merkle_tree_init(&tree);
+  if (fdb_merkle_scan(&tree))
+    goto fail;
+
+  if (fdb_check_error(fdb_setup_transaction(&tx)))
+    goto fail;
+
+  // The old summaries go in the same transaction as the first new nodes
+  fdb_transaction_clear_range(tx, begin_key, 1, end_key, 1);
+
+  for (uint32_t i = 0; i < tree.num_nodes; ++i) {
+    build_merkle_key(key, tree.nodes[i].level, tree.nodes[i].index);
+    fdb_transaction_set(tx, key, MERKLE_KEY_LENGTH, tree.nodes[i].sum,
+                        MERKLE_DIGEST_SIZE);
+
+    if (!((i + 1) % MERKLE_REBUILD_NODES) && fdb_send_transaction(tx)) {
+      fdb_transaction_destroy(tx);
+      goto fail;
+    }
+  }
+
+  if (fdb_send_transaction(tx)) {
+    fdb_transaction_destroy(tx);
+    goto fail;
+  }
+
+  fdb_transaction_destroy(tx);
+  merkle_tree_free(&tree);
+
+  // Success
+  return 0;
+
+// Failure
+fail:
+  merkle_tree_free(&tree);
+  return -1;
+}
+
+int add_stored_fragment(MerkleTree *tree, uint64_t event_id, uint32_t fragment,
+                        const uint8_t *value, uint32_t value_length) {
+  uint8_t payload[OPTIMAL_VALUE_SIZE];
+  uint8_t header_length;
+  uint32_t payload_length;
+
+  if (open_stored_fragment(payload, &header_length, &payload_length, event_id,
+                           fragment, value, value_length))
+    return -1;
+
+  return merkle_tree_add_fragment(tree, event_id, fragment, value,
+                                  header_length, payload, payload_length);
+}
+
+int open_stored_fragment(uint8_t *payload, uint8_t *header_length,
+                         uint32_t *payload_length, uint64_t event_id,
+                         uint32_t fragment, const uint8_t *value,
+                         uint32_t value_length) {
+  *header_length = 0;
+
+  if (!fragment) {
+    uint32_t num_fragments;
+    int parsed = parse_header(value, value_length, &num_fragments);
+
+    if (parsed < 0)
+      return -1;
+    *header_length = (uint8_t)parsed;
+  }
+
+  if ((value_length - *header_length) < cipher_overhead())
+    return -1;
+  *payload_length = (value_length - *header_length - cipher_overhead());
+  if (*payload_length > OPTIMAL_VALUE_SIZE)
+    return -1;
+
+  // Summaries are of plaintext, so that encrypted and plaintext copies compare
+  if (cipher_enabled()) {
+    if (cipher_open(payload, value, *header_length, (value + *header_length),
+                    *payload_length, event_id, fragment))
+      return -1;
+  } else {
+    memcpy(payload, (value + *header_length), *payload_length);
+  }
+
+  // Success
+  return 0;
+}
+
+int subtract_stored_fragments(MerkleDelta *delta, FDBTransaction *tx,
+                              const FDBKeyValue *kvs, int32_t count) {
+  uint8_t payload[OPTIMAL_VALUE_SIZE];
+
+  for (int32_t i = 0; i < count; ++i) {
+    uint64_t event_id;
+    uint32_t fragment;
+    uint8_t header_length;
+    uint32_t payload_length;
+
+    if (fdb_parse_event_key(kvs[i].key, kvs[i].key_length, &event_id,
+                            &fragment) ||
+        open_stored_fragment(payload, &header_length, &payload_length,
+                             event_id, fragment, kvs[i].value,
+                             kvs[i].value_length) ||
+        merkle_delta_add(delta, tx, event_id, fragment, kvs[i].value,
+                         header_length, payload, payload_length, true))
+      return -1;
+  }
+
+  // Success
+  return 0;
+}
+
+void build_merkle_key(uint8_t *key, uint8_t level, uint64_t index) {
+  key[0] = FDB_MERKLE_PREFIX;
+  key[1] = level;
+
+  for (uint32_t i = 0; i < 8; ++i)
+    key[(2 + i)] = (uint8_t)(index >> (56 - (8 * i)));
+}
+
+void merkle_sum_add(uint8_t *sum, const uint8_t *digest, bool subtract) {
+  uint32_t carry = subtract ? 1 : 0;
+
+  // Subtraction adds the two's complement: the inverted digest, plus one
+  for (uint32_t i = 0; i < MERKLE_DIGEST_SIZE; ++i) {
+    uint32_t byte = subtract ? (uint8_t)~digest[i] : digest[i];
+
+    carry += (sum[i] + byte);
+    sum[i] = (uint8_t)carry;
+    carry >>= 8;
+  }
+}
+
+int compare_merkle_nodes(const void *a, const void *b) {
+  const MerkleNode *node_a = (const MerkleNode *)a;
+  const MerkleNode *node_b = (const MerkleNode *)b;
+
+  if (node_a->level != node_b->level)
+    return (node_a->level < node_b->level) ? -1 : 1;
+  if (node_a->index != node_b->index)
+    return (node_a->index < node_b->index) ? -1 : 1;
+
+  return 0;
+}
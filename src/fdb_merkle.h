@@ -0,0 +1,303 @@
+/// @file fdb_merkle.h
+///
+/// Declarations for the Merkle summaries of the event log, which let two copies
+/// of a log be compared by reading a few summary nodes instead of every event.
+///
+/// Every stored fragment has a digest: the first MERKLE_DIGEST_SIZE bytes of
+/// the SHA-256 of its event id, fragment number and plaintext value. Leaves of
+/// the tree cover MERKLE_BUCKET_IDS consecutive event ids and hold the sum, mod
+/// 2^128, of the digests of their fragments, and every node above sums
+/// MERKLE_FANOUT nodes of the level below, up to a single root. Since the sums
+/// are additive, write transactions update every level with atomic add
+/// mutations, which neither read nor conflict, rather than rehashing children.
+/// Two copies are compared top-down, descending only into nodes which differ.
+///
+/// Summaries only describe the writes and clears made while they are enabled,
+/// so they must be enabled for every writer of a log from its first event, or
+/// rebuilt with fdb_merkle_rebuild(). Clears subtract the digests of the
+/// fragments they find stored, read in the clearing transaction, so clearing an
+/// absent event, or clearing one twice, leaves the summaries unchanged.
+///
+/// The summaries describe the events stored in the cluster only. Archiving an
+/// event takes it out of them when its segment is cleared from the cluster, so
+/// a copy of a log compares equal to the part which hasn't been archived yet.
+///
+/// Documentation links:
+///   https://apple.github.io/foundationdb/api-c.html#c.FDBMutationType
+///   https://www.openssl.org/docs/man1.1.1/man3/EVP_DigestInit.html
+
+#pragma once
+
+#include <foundationdb/fdb_c.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "event.h"
+
+// Size of a fragment digest, and of the sum held by a node, in bytes
+#define MERKLE_DIGEST_SIZE 16
+
+// Leaves cover 2^MERKLE_BUCKET_BITS consecutive event ids
+#define MERKLE_BUCKET_BITS 12
+#define MERKLE_BUCKET_IDS (1ULL << MERKLE_BUCKET_BITS)
+
+// Every node above the leaves sums 2^MERKLE_FANOUT_BITS nodes
+#define MERKLE_FANOUT_BITS 6
+#define MERKLE_FANOUT (1U << MERKLE_FANOUT_BITS)
+
+// Number of levels, enough for the root to cover every 64-bit event id
+#define MERKLE_LEVELS 10
+#define MERKLE_ROOT_LEVEL (MERKLE_LEVELS - 1)
+
+// Nodes a transaction accumulates before it emits their mutations
+#define MERKLE_DELTA_NODES 64
+
+//==============================================================================
+// Types
+//==============================================================================
+
+typedef struct merkle_node_t {
+  uint8_t level;                   // Level of the node (0 for leaves).
+  uint64_t index;                  // Index of the node within its level.
+  uint8_t sum[MERKLE_DIGEST_SIZE]; // Little-endian sum of fragment digests.
+} MerkleNode;
+
+typedef struct merkle_delta_t {
+  MerkleNode nodes[MERKLE_DELTA_NODES]; // Changes to nodes, not yet emitted.
+  uint32_t num_nodes;                   // Number of changed nodes.
+} MerkleDelta;
+
+typedef struct merkle_tree_t {
+  MerkleNode *nodes;            // Nodes, sorted by level and index once
+                                // finished.
+  uint32_t num_nodes;           // Number of nodes.
+  uint32_t capacity;            // Capacity of the node array.
+  uint32_t last[MERKLE_LEVELS]; // Node last added to at each level.
+} MerkleTree;
+
+/// Read consecutive nodes of one level from a copy of a log. Nodes which don't
+/// exist read as zero.
+///
+/// @return  0  Success.
+/// @return -1  Failure.
+typedef int (*MerkleReadFunc)(uint8_t level, uint64_t first, uint32_t count,
+                              uint8_t (*sums)[MERKLE_DIGEST_SIZE],
+                              void *context);
+
+/// Called for every leaf bucket whose events differ between two copies.
+typedef void (*MerkleDiffFunc)(uint64_t first_id, uint64_t last_id,
+                               void *context);
+
+typedef struct merkle_source_t {
+  MerkleReadFunc read; // Node reader of the copy.
+  void *context;       // Passed through to the reader.
+} MerkleSource;
+
+//==============================================================================
+// Prototypes
+//==============================================================================
+
+/// Enable or disable the upkeep of summaries by writes and clears. Must not be
+/// called while events are being written or cleared.
+///
+/// @param[in] enabled  Whether summaries are kept.
+void fdb_set_merkle(bool enabled);
+
+/// Check whether writes and clears keep the summaries.
+///
+/// @return  Whether summaries are kept.
+bool fdb_merkle_enabled(void);
+
+/// Get the index of the node covering an event at a level.
+///
+/// @param[in] level     Level of the node.
+/// @param[in] event_id  The unique event identifier.
+///
+/// @return  Index of the node within its level.
+uint64_t merkle_node_index(uint8_t level, uint64_t event_id);
+
+/// Compute the digest of one event fragment.
+///
+/// @param[in] digest          Pointer to the write location (of
+///                            MERKLE_DIGEST_SIZE bytes).
+/// @param[in] event_id        The unique event identifier.
+/// @param[in] fragment        The fragment number.
+/// @param[in] header          The event header (first fragment only).
+/// @param[in] header_length   Length of the header in bytes, or 0.
+/// @param[in] payload         The plaintext fragment payload.
+/// @param[in] payload_length  Length of the payload in bytes.
+///
+/// @return  0  Success.
+/// @return -1  Failure.
+int merkle_digest(uint8_t *digest, uint64_t event_id, uint32_t fragment,
+                  const uint8_t *header, uint8_t header_length,
+                  const uint8_t *payload, uint32_t payload_length);
+
+/// Start accumulating the summary changes of a transaction.
+///
+/// @param[in] delta  Handle for the changes.
+void merkle_delta_init(MerkleDelta *delta);
+
+/// Add or subtract the digest of one fragment to every level of the summaries.
+/// When the changes are full, they are first emitted into the transaction.
+///
+/// @param[in] delta           Handle for the changes.
+/// @param[in] tx              FoundationDB transaction handle.
+/// @param[in] event_id        The unique event identifier.
+/// @param[in] fragment        The fragment number.
+/// @param[in] header          The event header (first fragment only).
+/// @param[in] header_length   Length of the header in bytes, or 0.
+/// @param[in] payload         The plaintext fragment payload.
+/// @param[in] payload_length  Length of the payload in bytes.
+/// @param[in] subtract        Whether the fragment is being cleared.
+///
+/// @return  0  Success.
+/// @return -1  Failure.
+int merkle_delta_add(MerkleDelta *delta, FDBTransaction *tx, uint64_t event_id,
+                     uint32_t fragment, const uint8_t *header,
+                     uint8_t header_length, const uint8_t *payload,
+                     uint32_t payload_length, bool subtract);
+
+/// Emit the accumulated changes into a transaction as atomic add mutations,
+/// and start over.
+///
+/// @param[in] delta  Handle for the changes.
+/// @param[in] tx     FoundationDB transaction handle.
+void merkle_delta_apply(MerkleDelta *delta, FDBTransaction *tx);
+
+/// Subtract the digests of the fragments stored in a range of event keys,
+/// reading them in the transaction which is about to clear or overwrite them,
+/// so that the summaries follow what is stored rather than what the caller
+/// passes in. Must be called before the transaction's own writes to the range.
+///
+/// @param[in] delta         Handle for the changes.
+/// @param[in] tx            FoundationDB transaction handle.
+/// @param[in] begin_key     First key of the range.
+/// @param[in] begin_length  Length of the first key in bytes.
+/// @param[in] end_key       Key one past the end of the range.
+/// @param[in] end_length    Length of the end key in bytes.
+///
+/// @return  0  Success.
+/// @return -1  Failure (including a malformed or unauthentic fragment).
+/// @return  Otherwise, the FoundationDB error of the read, to be retried.
+fdb_error_t merkle_delta_subtract_stored(MerkleDelta *delta, FDBTransaction *tx,
+                                         const uint8_t *begin_key,
+                                         int begin_length,
+                                         const uint8_t *end_key,
+                                         int end_length);
+
+/// Subtract the digests of the fragments stored in the first chunk of a range
+/// of event keys, as merkle_delta_subtract_stored() does, reading at most a
+/// limited number of fragments, so that a large range can be cleared a chunk
+/// per transaction.
+///
+/// @param[in] delta         Handle for the changes.
+/// @param[in] tx            FoundationDB transaction handle.
+/// @param[in] begin_key     First key of the range.
+/// @param[in] begin_length  Length of the first key in bytes.
+/// @param[in] end_key       Key one past the end of the range.
+/// @param[in] end_length    Length of the end key in bytes.
+/// @param[in] limit         Maximum number of fragments to read.
+/// @param[in] next_key      Pointer to the write location of the key one past
+///                          the end of the chunk, which is the end key once
+///                          the range is done (of FDB_KEY_MAX_LENGTH + 1
+///                          bytes).
+/// @param[in] next_length   Pointer to the write location of the length of
+///                          that key in bytes.
+///
+/// @return  0  Success.
+/// @return -1  Failure (including a malformed or unauthentic fragment).
+/// @return  Otherwise, the FoundationDB error of the read, to be retried.
+fdb_error_t merkle_delta_subtract_chunk(MerkleDelta *delta, FDBTransaction *tx,
+                                        const uint8_t *begin_key,
+                                        int begin_length,
+                                        const uint8_t *end_key, int end_length,
+                                        int limit, uint8_t *next_key,
+                                        int *next_length);
+
+/// Start an in-memory summary, e.g. of a copy of a log kept outside a cluster.
+///
+/// @param[in] tree  Handle for the summary.
+void merkle_tree_init(MerkleTree *tree);
+
+/// Add one fragment to an in-memory summary.
+///
+/// @param[in] tree            Handle for the summary.
+/// @param[in] event_id        The unique event identifier.
+/// @param[in] fragment        The fragment number.
+/// @param[in] header          The event header (first fragment only).
+/// @param[in] header_length   Length of the header in bytes, or 0.
+/// @param[in] payload         The plaintext fragment payload.
+/// @param[in] payload_length  Length of the payload in bytes.
+///
+/// @return  0  Success.
+/// @return -1  Failure.
+int merkle_tree_add_fragment(MerkleTree *tree, uint64_t event_id,
+                             uint32_t fragment, const uint8_t *header,
+                             uint8_t header_length, const uint8_t *payload,
+                             uint32_t payload_length);
+
+/// Add every fragment of an event to an in-memory summary, fragmented as it
+/// would be written.
+///
+/// @param[in] tree   Handle for the summary.
+/// @param[in] event  The event.
+///
+/// @return  0  Success.
+/// @return -1  Failure.
+int merkle_tree_add_event(MerkleTree *tree, Event *event);
+
+/// Finish an in-memory summary, so that it can be read as a source. More
+/// fragments may be added afterwards, as long as it is finished again.
+///
+/// @param[in] tree  Handle for the summary.
+void merkle_tree_finish(MerkleTree *tree);
+
+/// Release an in-memory summary.
+///
+/// @param[in] tree  Handle for the summary.
+void merkle_tree_free(MerkleTree *tree);
+
+/// Get a source which reads a finished in-memory summary.
+///
+/// @param[in] tree    Handle for the summary.
+/// @param[in] source  Pointer to the write location of the source.
+void merkle_tree_source(MerkleTree *tree, MerkleSource *source);
+
+/// Get a source which reads the summaries stored in a cluster.
+///
+/// @param[in] database  Handle for the cluster, or NULL for the one opened by
+///                      fdb_init_database().
+/// @param[in] source    Pointer to the write location of the source.
+void fdb_merkle_source(FDBDatabase *database, MerkleSource *source);
+
+/// Compare two copies of a log top-down, reporting every leaf bucket whose
+/// events differ.
+///
+/// @param[in] a        The first copy.
+/// @param[in] b        The second copy.
+/// @param[in] on_diff  Hook called for every differing bucket (may be NULL).
+/// @param[in] context  Passed through to the hook.
+///
+/// @return  Number of differing buckets.
+/// @return -1  Failure.
+int64_t merkle_diff(const MerkleSource *a, const MerkleSource *b,
+                    MerkleDiffFunc on_diff, void *context);
+
+/// Summarise the events stored in the cluster, in the current key layout, by
+/// reading them at batch priority. Archived events aren't included, just as
+/// they aren't in the stored summaries.
+///
+/// @param[in] tree  Handle for an initialized summary to add to.
+///
+/// @return  0  Success.
+/// @return -1  Failure.
+int fdb_merkle_scan(MerkleTree *tree);
+
+/// Replace the stored summaries with a summary of the events stored in the
+/// cluster, e.g. after enabling summaries for an existing log. No events may
+/// be written or cleared meanwhile.
+///
+/// @return  0  Success.
+/// @return -1  Failure.
+int fdb_merkle_rebuild(void);
@@ -0,0 +1,614 @@
+/// @file fdb_presence.c
+///
+/// Definitions for the present-id bitmap of the event log.
+
+#include <foundationdb/fdb_c.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "constants.h"
+#include "event.h"
+#include "fdb.h"
+#include "fdb_presence.h"
+
+// Length of a chunk key: prefix, big-endian chunk index
+#define PRESENCE_KEY_LENGTH 9
+
+// Chunks written per transaction by a rebuild
+#define PRESENCE_REBUILD_CHUNKS 100
+
+// Key-value pairs read per batch by a rebuild
+#define PRESENCE_SCAN_KVS 500
+
+// Maximum attempts at one read before it gives up
+#define PRESENCE_MAX_ATTEMPTS 10
+
+//==============================================================================
+// Types
+//==============================================================================
+
+/// Visit part of the bitmap. When bits is NULL, every id of the part is
+/// absent; otherwise the part lies within one chunk, whose bitmap it is.
+///
+/// @return  0  Continue.
+/// @return  1  Stop.
+typedef int (*PresenceVisitFunc)(uint64_t begin, uint64_t end,
+                                 const uint8_t *bits, void *context);
+
+typedef struct presence_rebuild_t {
+  PresenceChunk *chunks;  // Chunks with present ids, in index order.
+  uint32_t num_chunks;    // Number of chunks.
+  uint32_t capacity;      // Capacity of the chunk array.
+  bool has_current;       // Whether an event is being checked.
+  uint64_t current_id;    // Identifier of the event being checked.
+  uint32_t expected;      // Fragments promised by its header (0 unknown).
+  uint32_t next_fragment; // Fragment number expected next.
+} PresenceRebuild;
+
+//==============================================================================
+// Variables
+//==============================================================================
+
+static bool presence_on = false;
+
+//==============================================================================
+// Prototypes
+//==============================================================================
+
+/// Find the changes to the chunk of an id, starting them if need be.
+///
+/// @param[in] delta     Handle for the changes.
+/// @param[in] event_id  The unique event identifier.
+///
+/// @return  Handle for the chunk's changes, or NULL if the changes are full.
+PresenceChunk *find_delta_chunk(PresenceDelta *delta, uint64_t event_id);
+
+/// Build the key of a bitmap chunk.
+///
+/// @param[in] key    Pointer to the write location (of PRESENCE_KEY_LENGTH
+///                   bytes).
+/// @param[in] index  Index of the chunk.
+void build_presence_key(uint8_t *key, uint64_t index);
+
+/// Visit the bitmap of a range of ids in order, reading only the stored
+/// chunks.
+///
+/// @param[in] begin    First event id of the range.
+/// @param[in] end      Event id one past the end of the range.
+/// @param[in] visit    Visitor called for each part of the range.
+/// @param[in] context  Passed through to the visitor.
+///
+/// @return  0  Success.
+/// @return -1  Failure.
+int visit_presence(uint64_t begin, uint64_t end, PresenceVisitFunc visit,
+                   void *context);
+
+/// Count the present ids of part of the bitmap, for fdb_count_present().
+int count_visit(uint64_t begin, uint64_t end, const uint8_t *bits,
+                void *context);
+
+/// Find the first absent id of part of the bitmap, for fdb_first_gap().
+int gap_visit(uint64_t begin, uint64_t end, const uint8_t *bits,
+              void *context);
+
+/// Check one stored fragment during a rebuild, marking its event present once
+/// every fragment has been seen.
+///
+/// @param[in] state         Rebuild state.
+/// @param[in] event_id      Identifier of the event the fragment belongs to.
+/// @param[in] fragment      Fragment number.
+/// @param[in] value         Fragment value.
+/// @param[in] value_length  Length of the fragment value in bytes.
+///
+/// @return  0  Success.
+/// @return -1  Failure.
+int rebuild_fragment(PresenceRebuild *state, uint64_t event_id,
+                     uint32_t fragment, const uint8_t *value,
+                     uint32_t value_length);
+
+/// Write the chunks found by a rebuild over the stored bitmap.
+///
+/// @param[in] state  Rebuild state.
+///
+/// @return  0  Success.
+/// @return -1  Failure.
+int write_rebuilt_chunks(const PresenceRebuild *state);
+
+//==============================================================================
+// Functions
+//==============================================================================
+
+void fdb_set_presence(bool enabled) { presence_on = enabled; }
+
+bool fdb_presence_enabled(void) { return presence_on; }
+
+void presence_delta_init(PresenceDelta *delta) { delta->num_chunks = 0; }
+
+void presence_delta_add(PresenceDelta *delta, FDBTransaction *tx,
+                        uint64_t event_id) {
+  uint32_t bit = (uint32_t)(event_id & (PRESENCE_CHUNK_IDS - 1));
+  PresenceChunk *chunk = find_delta_chunk(delta, event_id);
+
+  if (!chunk) {
+    presence_delta_apply(delta, tx);
+    chunk = find_delta_chunk(delta, event_id);
+  }
+
+  chunk->bits[(bit / 8)] |= (uint8_t)(1 << (bit % 8));
+}
+
+void presence_delta_apply(PresenceDelta *delta, FDBTransaction *tx) {
+  uint8_t key[PRESENCE_KEY_LENGTH];
+
+  // The parameter is a whole chunk, since shorter ones truncate the value
+  for (uint32_t i = 0; i < delta->num_chunks; ++i) {
+    build_presence_key(key, delta->chunks[i].index);
+    fdb_transaction_atomic_op(tx, key, PRESENCE_KEY_LENGTH,
+                              delta->chunks[i].bits, PRESENCE_CHUNK_SIZE,
+                              FDB_MUTATION_TYPE_BIT_OR);
+  }
+
+  delta->num_chunks = 0;
+}
+
+fdb_error_t presence_delta_remove(PresenceDelta *delta, FDBTransaction *tx,
+                                  uint64_t event_id) {
+  uint32_t bit = (uint32_t)(event_id & (PRESENCE_CHUNK_IDS - 1));
+  PresenceChunk *chunk = find_delta_chunk(delta, event_id);
+
+  if (!chunk) {
+    fdb_error_t err = presence_delta_clear(delta, tx);
+
+    if (err)
+      return err;
+    chunk = find_delta_chunk(delta, event_id);
+  }
+
+  chunk->bits[(bit / 8)] |= (uint8_t)(1 << (bit % 8));
+
+  // Success
+  return 0;
+}
+
+fdb_error_t presence_delta_clear(PresenceDelta *delta, FDBTransaction *tx) {
+  FDBFuture *future;
+  uint8_t key[PRESENCE_KEY_LENGTH];
+  uint8_t mask[PRESENCE_CHUNK_SIZE];
+  uint8_t empty[PRESENCE_CHUNK_SIZE] = {0};
+  fdb_bool_t present;
+  const uint8_t *value;
+  int value_length;
+  fdb_error_t err;
+
+  for (uint32_t i = 0; i < delta->num_chunks; ++i) {
+    build_presence_key(key, delta->chunks[i].index);
+
+    // An AND of a chunk which isn't stored would store the mask, marking every
+    // other id of the chunk present, so only stored chunks are changed. Not a
+    // snapshot read, so that a concurrent write to the chunk conflicts
+    present = 0;
+    future = fdb_transaction_get(tx, key, PRESENCE_KEY_LENGTH, 0);
+    err = fdb_future_block_until_ready(future);
+    if (!err)
+      err = fdb_future_get_error(future);
+    if (!err)
+      err = fdb_future_get_value(future, &present, &value, &value_length);
+    fdb_future_destroy(future);
+    if (err)
+      return err;
+    if (!present)
+      continue;
+
+    for (uint32_t b = 0; b < PRESENCE_CHUNK_SIZE; ++b)
+      mask[b] = (uint8_t)~delta->chunks[i].bits[b];
+
+    fdb_transaction_atomic_op(tx, key, PRESENCE_KEY_LENGTH, mask,
+                              PRESENCE_CHUNK_SIZE, FDB_MUTATION_TYPE_BIT_AND);
+
+    // Chunks without any present ids are never stored
+    fdb_transaction_atomic_op(tx, key, PRESENCE_KEY_LENGTH, empty,
+                              PRESENCE_CHUNK_SIZE,
+                              FDB_MUTATION_TYPE_COMPARE_AND_CLEAR);
+  }
+
+  delta->num_chunks = 0;
+
+  // Success
+  return 0;
+}
+
+fdb_error_t presence_clear(FDBTransaction *tx, uint64_t event_id) {
+  PresenceDelta absent;
+  fdb_error_t err;
+
+  presence_delta_init(&absent);
+
+  err = presence_delta_remove(&absent, tx, event_id);
+  if (!err)
+    err = presence_delta_clear(&absent, tx);
+
+  // Success or failure
+  return err;
+}
+
+uint32_t presence_count_bits(const uint8_t *bits, uint32_t begin,
+                             uint32_t end) {
+  uint32_t count = 0;
+
+  // Bit by bit up to a word boundary, then a word at a time
+  for (; (begin < end) && (begin % 64); ++begin)
+    count += ((bits[(begin / 8)] >> (begin % 8)) & 1);
+
+  for (; (begin + 64) <= end; begin += 64) {
+    uint64_t word;
+
+    memcpy(&word, (bits + (begin / 8)), sizeof(word));
+    count += (uint32_t)__builtin_popcountll(word);
+  }
+
+  for (; begin < end; ++begin)
+    count += ((bits[(begin / 8)] >> (begin % 8)) & 1);
+
+  return count;
+}
+
+uint32_t presence_first_clear(const uint8_t *bits, uint32_t begin,
+                              uint32_t end) {
+  for (; begin < end; ++begin) {
+    // Skip whole bytes of present ids
+    if (!(begin % 8) && ((begin + 8) <= end) && (bits[(begin / 8)] == 0xFF)) {
+      begin += 7;
+      continue;
+    }
+
+    if (!((bits[(begin / 8)] >> (begin % 8)) & 1))
+      return begin;
+  }
+
+  return end;
+}
+
+int fdb_event_present(uint64_t event_id) {
+  uint64_t count = 0;
+
+  if (visit_presence(event_id, (event_id + 1), count_visit, &count))
+    return -1;
+
+  return count ? 1 : 0;
+}
+
+int64_t fdb_count_present(uint64_t begin, uint64_t end) {
+  uint64_t count = 0;
+
+  if (visit_presence(begin, end, count_visit, &count))
+    return -1;
+
+  return (int64_t)count;
+}
+
+int fdb_first_gap(uint64_t begin, uint64_t end, uint64_t *gap) {
+  *gap = end;
+
+  if (visit_presence(begin, end, gap_visit, gap))
+    return -1;
+
+  return (*gap == end) ? 1 : 0;
+}
+
+int count_visit(uint64_t begin, uint64_t end, const uint8_t *bits,
+                void *context) {
+  uint64_t *count = (uint64_t *)context;
+  uint32_t first = (uint32_t)(begin & (PRESENCE_CHUNK_IDS - 1));
+
+  if (bits)
+    *count += presence_count_bits(bits, first, (first + (end - begin)));
+
+  return 0;
+}
+
+int gap_visit(uint64_t begin, uint64_t end, const uint8_t *bits,
+              void *context) {
+  uint64_t *gap = (uint64_t *)context;
+  uint32_t first = (uint32_t)(begin & (PRESENCE_CHUNK_IDS - 1));
+  uint32_t clear;
+
+  if (!bits) {
+    *gap = begin;
+    return 1;
+  }
+
+  clear = presence_first_clear(bits, first, (first + (end - begin)));
+  if (clear == (first + (end - begin)))
+    return 0;
+
+  *gap = (begin + (clear - first));
+  return 1;
+}
+
+int visit_presence(uint64_t begin, uint64_t end, PresenceVisitFunc visit,
+                   void *context) {
+  FDBTransaction *tx;
+  FDBFuture *future = NULL;
+  const FDBKeyValue *out_kv;
+  fdb_bool_t out_more = 1;
+  int32_t out_count;
+  uint8_t begin_key[PRESENCE_KEY_LENGTH];
+  uint8_t end_key[PRESENCE_KEY_LENGTH];
+  fdb_bool_t begin_or_equal = 0;
+  uint64_t next = begin;
+  uint32_t attempts = 0;
+  int err;
+
+  if (begin >= end)
+    return 0;
+
+  build_presence_key(begin_key, (begin >> PRESENCE_CHUNK_BITS));
+  build_presence_key(end_key, (((end - 1) >> PRESENCE_CHUNK_BITS) + 1));
+
+  if (fdb_check_error(fdb_setup_transaction(&tx)))
+    return -1;
+
+  while (out_more) {
+    // Snapshot read, continuing after the last chunk seen
+    future = fdb_transaction_get_range(
+        tx, begin_key, PRESENCE_KEY_LENGTH, begin_or_equal, 1, end_key,
+        PRESENCE_KEY_LENGTH, 0, 1, 0, 0, FDB_STREAMING_MODE_WANT_ALL, 0, 1, 0);
+    err = fdb_wait_future(tx, future, &attempts, PRESENCE_MAX_ATTEMPTS);
+    if (err > 0)
+      continue;
+    if (err || fdb_check_error(fdb_future_get_keyvalue_array(
+                   future, &out_kv, &out_count, &out_more))) {
+      if (!err)
+        fdb_future_destroy(future);
+      goto tx_fail;
+    }
+
+    for (int32_t i = 0; i < out_count; ++i) {
+      uint64_t index = 0;
+      uint64_t chunk_begin, chunk_end;
+
+      if ((out_kv[i].key_length != PRESENCE_KEY_LENGTH) ||
+          (out_kv[i].value_length != PRESENCE_CHUNK_SIZE))
+        continue;
+
+      for (uint32_t b = 1; b < PRESENCE_KEY_LENGTH; ++b)
+        index = ((index << 8) | out_kv[i].key[b]);
+
+      chunk_begin = (index << PRESENCE_CHUNK_BITS);
+      chunk_end = (chunk_begin + PRESENCE_CHUNK_IDS);
+      if (chunk_begin < begin)
+        chunk_begin = begin;
+      if (chunk_end > end)
+        chunk_end = end;
+
+      // Chunks which aren't stored hold no present ids
+      if (((next < chunk_begin) && visit(next, chunk_begin, NULL, context)) ||
+          visit(chunk_begin, chunk_end, out_kv[i].value, context)) {
+        fdb_future_destroy(future);
+        fdb_transaction_destroy(tx);
+        return 0;
+      }
+
+      next = chunk_end;
+    }
+
+    if (out_count) {
+      memcpy(begin_key, out_kv[(out_count - 1)].key, PRESENCE_KEY_LENGTH);
+      begin_or_equal = 1;
+    }
+
+    fdb_future_destroy(future);
+  }
+
+  fdb_transaction_destroy(tx);
+
+  if (next < end)
+    visit(next, end, NULL, context);
+
+  // Success
+  return 0;
+
+// Failure
+tx_fail:
+  fdb_transaction_destroy(tx);
+  return -1;
+}
+
+int fdb_presence_rebuild(void) {
+  FDBTransaction *tx;
+  FDBFuture *future = NULL;
+  const FDBKeyValue *out_kv;
+  fdb_bool_t out_more = 1;
+  int32_t out_count;
+  fdb_bool_t begin_or_equal = 0;
+  uint8_t last_key[FDB_KEY_MAX_LENGTH];
+  int last_length;
+  uint8_t end_key[1] = {(fdb_event_key_prefix(fdb_get_key_format()) + 1)};
+  PresenceRebuild state = {NULL, 0, 0, false, 0, 0, 0};
+  uint32_t attempts = 0;
+  int err;
+
+  last_length = fdb_build_event_key(last_key, 0, 0);
+
+  if (fdb_check_error(fdb_setup_transaction(&tx)))
+    return -1;
+
+  while (out_more) {
+    // Background work must never delay foreground transactions
+    fdb_check_error(fdb_transaction_set_option(tx, FDB_TR_OPTION_PRIORITY_BATCH,
+                                               NULL, 0));
+
+    future = fdb_transaction_get_range(
+        tx, last_key, last_length, begin_or_equal, 1, end_key, 1, 0, 1,
+        PRESENCE_SCAN_KVS, 0, FDB_STREAMING_MODE_EXACT, 0, 1, 0);
+    err = fdb_wait_future(tx, future, &attempts, PRESENCE_MAX_ATTEMPTS);
+    if (err > 0)
+      continue;
+    if (err || fdb_check_error(fdb_future_get_keyvalue_array(
+                   future, &out_kv, &out_count, &out_more))) {
+      if (!err)
+        fdb_future_destroy(future);
+      goto tx_fail;
+    }
+
+    for (int32_t i = 0; i < out_count; ++i) {
+      uint64_t event_id;
+      uint32_t fragment;
+
+      if (fdb_parse_event_key(out_kv[i].key, out_kv[i].key_length, &event_id,
+                              &fragment))
+        continue;
+
+      if (rebuild_fragment(&state, event_id, fragment, out_kv[i].value,
+                           out_kv[i].value_length)) {
+        fdb_future_destroy(future);
+        goto tx_fail;
+      }
+    }
+
+    if (out_count) {
+      last_length = out_kv[(out_count - 1)].key_length;
+      memcpy(last_key, out_kv[(out_count - 1)].key, last_length);
+      begin_or_equal = 1;
+    }
+
+    // A fresh transaction per batch, so that long scans never outlive one
+    fdb_future_destroy(future);
+    fdb_transaction_reset(tx);
+  }
+
+  fdb_transaction_destroy(tx);
+
+  err = write_rebuilt_chunks(&state);
+  free((void *)state.chunks);
+
+  // Success or failure
+  return err;
+
+// Failure
+tx_fail:
+  fdb_transaction_destroy(tx);
+  free((void *)state.chunks);
+  return -1;
+}
+
+int rebuild_fragment(PresenceRebuild *state, uint64_t event_id,
+                     uint32_t fragment, const uint8_t *value,
+                     uint32_t value_length) {
+  uint64_t index = (event_id >> PRESENCE_CHUNK_BITS);
+  uint32_t bit = (uint32_t)(event_id & (PRESENCE_CHUNK_IDS - 1));
+  PresenceChunk *chunk;
+
+  // Fragments arrive in key order, so a new identifier starts a new event
+  if (!state->has_current || (state->current_id != event_id)) {
+    state->has_current = true;
+    state->current_id = event_id;
+    state->expected = 0;
+    state->next_fragment = 0;
+  }
+
+  // Events missing any fragment aren't present
+  if (fragment != state->next_fragment)
+    return 0;
+  ++state->next_fragment;
+
+  if (!fragment) {
+    uint32_t num_fragments;
+
+    if (parse_header(value, value_length, &num_fragments) < 0)
+      return 0;
+    state->expected = (num_fragments + 1);
+  }
+
+  if (state->next_fragment != state->expected)
+    return 0;
+
+  // Events arrive in id order, so only the last chunk can hold this one
+  if (!state->num_chunks || (state->chunks[(state->num_chunks - 1)].index !=
+                             index)) {
+    if (state->num_chunks == state->capacity) {
+      uint32_t capacity = state->capacity ? (2 * state->capacity) : 16;
+      PresenceChunk *chunks =
+          realloc(state->chunks, (sizeof(PresenceChunk) * capacity));
+
+      if (!chunks)
+        return -1;
+
+      state->chunks = chunks;
+      state->capacity = capacity;
+    }
+
+    chunk = (state->chunks + state->num_chunks++);
+    chunk->index = index;
+    memset(chunk->bits, 0, PRESENCE_CHUNK_SIZE);
+  }
+
+  chunk = (state->chunks + (state->num_chunks - 1));
+  chunk->bits[(bit / 8)] |= (uint8_t)(1 << (bit % 8));
+
+  // Success
+  return 0;
+}
+
+int write_rebuilt_chunks(const PresenceRebuild *state) {
+  FDBTransaction *tx;
+  uint8_t key[PRESENCE_KEY_LENGTH];
+  uint8_t begin_key[1] = {FDB_PRESENCE_PREFIX};
+  uint8_t end_key[1] = {(FDB_PRESENCE_PREFIX + 1)};
+
+  if (fdb_check_error(fdb_setup_transaction(&tx)))
+    return -1;
+
+  // The old bitmap goes in the same transaction as the first new chunks
+  fdb_transaction_clear_range(tx, begin_key, 1, end_key, 1);
+
+  for (uint32_t i = 0; i < state->num_chunks; ++i) {
+    build_presence_key(key, state->chunks[i].index);
+    fdb_transaction_set(tx, key, PRESENCE_KEY_LENGTH, state->chunks[i].bits,
+                        PRESENCE_CHUNK_SIZE);
+
+    if (!((i + 1) % PRESENCE_REBUILD_CHUNKS) && fdb_send_transaction(tx))
+      goto tx_fail;
+  }
+
+  if (fdb_send_transaction(tx))
+    goto tx_fail;
+
+  fdb_transaction_destroy(tx);
+
+  // Success
+  return 0;
+
+// Failure
+tx_fail:
+  fdb_transaction_destroy(tx);
+  return -1;
+}
+
+PresenceChunk *find_delta_chunk(PresenceDelta *delta, uint64_t event_id) {
+  uint64_t index = (event_id >> PRESENCE_CHUNK_BITS);
+  PresenceChunk *chunk;
+
+  for (uint32_t i = 0; i < delta->num_chunks; ++i) {
+    if (delta->chunks[i].index == index)
+      return (delta->chunks + i);
+  }
+
+  if (delta->num_chunks == PRESENCE_DELTA_CHUNKS)
+    return NULL;
+
+  chunk = (delta->chunks + delta->num_chunks++);
+  chunk->index = index;
+  memset(chunk->bits, 0, PRESENCE_CHUNK_SIZE);
+
+  return chunk;
+}
+
+void build_presence_key(uint8_t *key, uint64_t index) {
+  key[0] = FDB_PRESENCE_PREFIX;
+
+  for (uint32_t i = 0; i < 8; ++i)
+    key[(1 + i)] = (uint8_t)(index >> (56 - (8 * i)));
+}
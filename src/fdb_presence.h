@@ -0,0 +1,179 @@
+/// @file fdb_presence.h
+///
+/// Declarations for the present-id bitmap of the event log, which answers
+/// whether events exist, how many exist in a range, and where the first gap in
+/// a range is, without reading any events.
+///
+/// The bitmap is split into chunks of PRESENCE_CHUNK_IDS consecutive ids, each
+/// stored as one key holding a plain bitmap, so a range of ids costs one range
+/// read of its chunks. As with roaring bitmaps, chunks without any present ids
+/// are never stored. An event's bit is set with an atomic OR mutation in the
+/// transaction which writes its last fragment, so a set bit means the whole
+/// event is committed. When the event is cleared, its bit is cleared with an
+/// atomic AND mutation, and the chunk with a compare-and-clear mutation once it
+/// is empty; the chunk is read first, since an AND of a missing key stores the
+/// mask, once per transaction for an array of clears. Archived events stay
+/// present.
+///
+/// The bitmap only describes the writes and clears made while it is enabled,
+/// so it must be enabled for every writer of a log from its first event, or
+/// rebuilt with fdb_presence_rebuild().
+///
+/// Documentation links:
+///   https://apple.github.io/foundationdb/api-c.html#c.FDBMutationType
+///   https://roaringbitmap.org/about/
+
+#pragma once
+
+#include <foundationdb/fdb_c.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+// Number of event ids covered by one chunk of the bitmap
+#define PRESENCE_CHUNK_BITS 13
+#define PRESENCE_CHUNK_IDS (1U << PRESENCE_CHUNK_BITS)
+#define PRESENCE_CHUNK_SIZE (PRESENCE_CHUNK_IDS / 8)
+
+// Chunks a transaction accumulates before it emits their mutations
+#define PRESENCE_DELTA_CHUNKS 4
+
+//==============================================================================
+// Types
+//==============================================================================
+
+typedef struct presence_chunk_t {
+  uint64_t index;                    // Index of the chunk.
+  uint8_t bits[PRESENCE_CHUNK_SIZE]; // Bit of each id, least significant first.
+} PresenceChunk;
+
+typedef struct presence_delta_t {
+  PresenceChunk chunks[PRESENCE_DELTA_CHUNKS]; // Bits to set, not yet emitted.
+  uint32_t num_chunks;                         // Number of changed chunks.
+} PresenceDelta;
+
+//==============================================================================
+// Prototypes
+//==============================================================================
+
+/// Enable or disable the upkeep of the bitmap by writes and clears. Must not be
+/// called while events are being written or cleared.
+///
+/// @param[in] enabled  Whether the bitmap is kept.
+void fdb_set_presence(bool enabled);
+
+/// Check whether writes and clears keep the bitmap.
+///
+/// @return  Whether the bitmap is kept.
+bool fdb_presence_enabled(void);
+
+/// Start accumulating the ids a transaction commits.
+///
+/// @param[in] delta  Handle for the changes.
+void presence_delta_init(PresenceDelta *delta);
+
+/// Mark an event as present once the transaction commits. When the changes are
+/// full, they are first emitted into the transaction.
+///
+/// @param[in] delta     Handle for the changes.
+/// @param[in] tx        FoundationDB transaction handle.
+/// @param[in] event_id  The unique event identifier.
+void presence_delta_add(PresenceDelta *delta, FDBTransaction *tx,
+                        uint64_t event_id);
+
+/// Emit the accumulated changes into a transaction as atomic OR mutations, and
+/// start over.
+///
+/// @param[in] delta  Handle for the changes.
+/// @param[in] tx     FoundationDB transaction handle.
+void presence_delta_apply(PresenceDelta *delta, FDBTransaction *tx);
+
+/// Mark an event as absent once the transaction commits. When the changes are
+/// full, they are first emitted into the transaction with
+/// presence_delta_clear().
+///
+/// @param[in] delta     Handle for the changes.
+/// @param[in] tx        FoundationDB transaction handle.
+/// @param[in] event_id  The unique event identifier.
+///
+/// @return  0  Success.
+/// @return  Otherwise, the FoundationDB error of the read, to be retried.
+fdb_error_t presence_delta_remove(PresenceDelta *delta, FDBTransaction *tx,
+                                  uint64_t event_id);
+
+/// Emit the accumulated changes into a transaction as clears, and start over.
+/// Each changed chunk is read once, and left alone if it isn't stored, so a
+/// transaction clearing many events of a chunk reads it only once.
+///
+/// @param[in] delta  Handle for the changes.
+/// @param[in] tx     FoundationDB transaction handle.
+///
+/// @return  0  Success.
+/// @return  Otherwise, the FoundationDB error of the read, to be retried.
+fdb_error_t presence_delta_clear(PresenceDelta *delta, FDBTransaction *tx);
+
+/// Mark a single event as absent once the transaction commits. Reads the
+/// event's chunk first, and leaves it alone if it isn't stored.
+///
+/// @param[in] tx        FoundationDB transaction handle.
+/// @param[in] event_id  The unique event identifier.
+///
+/// @return  0  Success.
+/// @return  Otherwise, the FoundationDB error of the read, to be retried.
+fdb_error_t presence_clear(FDBTransaction *tx, uint64_t event_id);
+
+/// Count the set bits of part of a chunk.
+///
+/// @param[in] bits   The chunk bitmap.
+/// @param[in] begin  First bit to count.
+/// @param[in] end    Bit one past the last to count.
+///
+/// @return  Number of set bits.
+uint32_t presence_count_bits(const uint8_t *bits, uint32_t begin, uint32_t end);
+
+/// Find the first clear bit of part of a chunk.
+///
+/// @param[in] bits   The chunk bitmap.
+/// @param[in] begin  First bit to search.
+/// @param[in] end    Bit one past the last to search.
+///
+/// @return  The first clear bit, or end if every bit is set.
+uint32_t presence_first_clear(const uint8_t *bits, uint32_t begin,
+                              uint32_t end);
+
+/// Check whether an event is present.
+///
+/// @param[in] event_id  The unique event identifier.
+///
+/// @return  1  The event is present.
+/// @return  0  The event is absent.
+/// @return -1  Failure.
+int fdb_event_present(uint64_t event_id);
+
+/// Count the events present in a range of ids.
+///
+/// @param[in] begin  First event id of the range.
+/// @param[in] end    Event id one past the end of the range.
+///
+/// @return  Number of present events.
+/// @return -1  Failure.
+int64_t fdb_count_present(uint64_t begin, uint64_t end);
+
+/// Find the first absent event in a range of ids.
+///
+/// @param[in] begin  First event id of the range.
+/// @param[in] end    Event id one past the end of the range.
+/// @param[in] gap    Pointer to the write location of the first absent id.
+///
+/// @return  0  Success.
+/// @return  1  Every event in the range is present.
+/// @return -1  Failure.
+int fdb_first_gap(uint64_t begin, uint64_t end, uint64_t *gap);
+
+/// Replace the stored bitmap with one of the complete events stored in the
+/// cluster, in the current key layout, e.g. after enabling the bitmap for an
+/// existing log. Archived events aren't included. No events may be written or
+/// cleared meanwhile.
+///
+/// @return  0  Success.
+/// @return -1  Failure.
+int fdb_presence_rebuild(void);
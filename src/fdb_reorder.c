@@ -0,0 +1,205 @@
+/// @file fdb_reorder.c
+///
+/// Definitions for the reorder buffer.
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "event.h"
+#include "fdb.h"
+#include "fdb_reorder.h"
+
+//==============================================================================
+// Prototypes
+//==============================================================================
+
+/// Commit runs until no run is complete, or a commit fails. The buffer lock
+/// must be held, and is released during commits.
+///
+/// @param[in] buffer  Handle for the buffer.
+///
+/// @return  0  Success.
+/// @return -1  Failure.
+int reorder_buffer_release(ReorderBuffer *buffer);
+
+//==============================================================================
+// Functions
+//==============================================================================
+
+int reorder_buffer_init(ReorderBuffer *buffer, uint64_t first_id,
+                        uint32_t window) {
+  memset(buffer, 0, sizeof(ReorderBuffer));
+  if (!window)
+    return -1;
+
+  buffer->slots = (Event *)malloc(sizeof(Event) * window);
+  buffer->filled = (bool *)calloc(window, sizeof(bool));
+  buffer->run = (Event *)malloc(sizeof(Event) * window);
+  if (!buffer->slots || !buffer->filled || !buffer->run)
+    goto fail;
+
+  if (pthread_mutex_init(&buffer->mutex, NULL))
+    goto fail;
+  if (pthread_cond_init(&buffer->changed, NULL)) {
+    pthread_mutex_destroy(&buffer->mutex);
+    goto fail;
+  }
+
+  buffer->window = window;
+  buffer->next_id = first_id;
+  buffer->watermark = first_id;
+
+  // Success
+  return 0;
+
+  // Failure
+fail:
+  free((void *)buffer->slots);
+  free((void *)buffer->filled);
+  free((void *)buffer->run);
+  memset(buffer, 0, sizeof(ReorderBuffer));
+  return -1;
+}
+
+void reorder_buffer_free(ReorderBuffer *buffer) {
+  if (!buffer->window)
+    return;
+
+  for (uint32_t i = 0; i < buffer->window; ++i) {
+    if (buffer->filled[i])
+      free_event(buffer->slots + i);
+  }
+
+  pthread_cond_destroy(&buffer->changed);
+  pthread_mutex_destroy(&buffer->mutex);
+  free((void *)buffer->slots);
+  free((void *)buffer->filled);
+  free((void *)buffer->run);
+  memset(buffer, 0, sizeof(ReorderBuffer));
+}
+
+int reorder_buffer_place(ReorderBuffer *buffer, Event *event) {
+  uint32_t slot = (uint32_t)(event->id % buffer->window);
+
+  if (event->id < buffer->next_id)
+    return -1;
+  if ((event->id - buffer->next_id) >= buffer->window)
+    return 1;
+  if (buffer->filled[slot])
+    return -1;
+
+  buffer->slots[slot] = *event;
+  buffer->filled[slot] = true;
+
+  // Success
+  return 0;
+}
+
+uint32_t reorder_buffer_take_run(ReorderBuffer *buffer) {
+  uint32_t num_events = 0;
+  uint32_t slot = (uint32_t)(buffer->next_id % buffer->window);
+
+  while ((num_events < buffer->window) && buffer->filled[slot]) {
+    buffer->run[num_events++] = buffer->slots[slot];
+    buffer->filled[slot] = false;
+    slot = ((slot + 1) == buffer->window) ? 0 : (slot + 1);
+  }
+  buffer->next_id += num_events;
+
+  return num_events;
+}
+
+int fdb_reorder_submit(ReorderBuffer *buffer, Event *event) {
+  Event copy;
+  int err = 0;
+
+  copy.id = event->id;
+  copy.data_length = event->data_length;
+  copy.data = alloc_event_data(event->data_length);
+  if (!copy.data)
+    return -1;
+  memcpy(copy.data, event->data, event->data_length);
+
+  pthread_mutex_lock(&buffer->mutex);
+
+  // Producers ahead of the window wait for the runs before them to be taken
+  while (!buffer->failed) {
+    err = reorder_buffer_place(buffer, &copy);
+    if (err != 1)
+      break;
+    pthread_cond_wait(&buffer->changed, &buffer->mutex);
+  }
+
+  if (buffer->failed || err) {
+    pthread_mutex_unlock(&buffer->mutex);
+    free_event(&copy);
+    return -1;
+  }
+
+  // The producer of the next id commits its run, unless another producer is
+  // committing, which then takes the run once its own is committed
+  if (!buffer->releasing && (event->id == buffer->next_id))
+    err = reorder_buffer_release(buffer);
+  pthread_mutex_unlock(&buffer->mutex);
+
+  // Success or failure
+  return err;
+}
+
+int reorder_buffer_release(ReorderBuffer *buffer) {
+  uint32_t num_events;
+  int err = 0;
+
+  buffer->releasing = true;
+
+  while (!err && (num_events = reorder_buffer_take_run(buffer))) {
+    uint64_t end = buffer->next_id;
+
+    // The window has moved, so waiting producers may fill the freed slots
+    pthread_cond_broadcast(&buffer->changed);
+    pthread_mutex_unlock(&buffer->mutex);
+
+    err = fdb_write_event_array(buffer->run, num_events);
+    for (uint32_t i = 0; i < num_events; ++i) {
+      free_event(buffer->run + i);
+    }
+
+    pthread_mutex_lock(&buffer->mutex);
+    if (err)
+      buffer->failed = true;
+    else
+      buffer->watermark = end;
+    pthread_cond_broadcast(&buffer->changed);
+  }
+
+  buffer->releasing = false;
+
+  // Success or failure
+  return err;
+}
+
+uint64_t reorder_buffer_watermark(ReorderBuffer *buffer) {
+  uint64_t watermark;
+
+  pthread_mutex_lock(&buffer->mutex);
+  watermark = buffer->watermark;
+  pthread_mutex_unlock(&buffer->mutex);
+
+  return watermark;
+}
+
+int reorder_buffer_wait(ReorderBuffer *buffer, uint64_t id) {
+  int err;
+
+  pthread_mutex_lock(&buffer->mutex);
+  while (!buffer->failed && (buffer->watermark <= id))
+    pthread_cond_wait(&buffer->changed, &buffer->mutex);
+  err = (buffer->watermark > id) ? 0 : -1;
+  pthread_mutex_unlock(&buffer->mutex);
+
+  // Success or failure
+  return err;
+}
@@ -0,0 +1,109 @@
+/// @file fdb_reorder.h
+///
+/// Declarations for the reorder buffer, which accepts events from parallel
+/// producers in any order and commits them in id order.
+///
+/// The buffer holds a window of ids starting at the next id to release. An
+/// event is copied into the slot of its id, and producers of ids beyond the
+/// window wait for it to advance. The producer which fills the next id takes
+/// the contiguous run of events from there and commits it with
+/// fdb_write_event_array(), and keeps committing the runs completed meanwhile,
+/// while the other producers only fill slots. Runs are committed one at a
+/// time, so the watermark below which every event is committed only advances.
+///
+/// A producer waiting beyond the window holds up the ids it submits after, so
+/// each producer must submit its ids less than a window out of order.
+///
+/// A failed commit stops the buffer: the watermark stays at the first event of
+/// the failed run, and every later submission and wait fails.
+
+#pragma once
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "event.h"
+
+//==============================================================================
+// Types
+//==============================================================================
+
+typedef struct reorder_buffer_t {
+  uint32_t window;        // Number of ids accepted from the next release.
+  Event *slots;           // Events waiting for release, at their id % window.
+  bool *filled;           // Whether each slot holds an event.
+  Event *run;             // The run being committed.
+  uint64_t next_id;       // Next id to release.
+  uint64_t watermark;     // Every id below it is committed.
+  bool releasing;         // Whether a producer is committing runs.
+  bool failed;            // Whether a commit failed.
+  pthread_mutex_t mutex;  // Guards the buffer.
+  pthread_cond_t changed; // Broadcast when runs are released or committed.
+} ReorderBuffer;
+
+//==============================================================================
+// Prototypes
+//==============================================================================
+
+/// Initialize a reorder buffer.
+///
+/// @param[in] buffer    Handle for the buffer.
+/// @param[in] first_id  Id of the first event to commit.
+/// @param[in] window    Number of ids accepted ahead of the next release.
+///
+/// @return  0  Success.
+/// @return -1  Failure.
+int reorder_buffer_init(ReorderBuffer *buffer, uint64_t first_id,
+                        uint32_t window);
+
+/// Release the memory of a reorder buffer, including any uncommitted events.
+/// No producers may be using it.
+///
+/// @param[in] buffer  Handle for the buffer.
+void reorder_buffer_free(ReorderBuffer *buffer);
+
+/// Place an event into the slot of its id. The buffer lock must be held.
+///
+/// @param[in] buffer  Handle for the buffer.
+/// @param[in] event   The event, whose data is owned by the buffer after.
+///
+/// @return  0  Success.
+/// @return  1  The id is beyond the window.
+/// @return -1  Failure (the id is released or already placed).
+int reorder_buffer_place(ReorderBuffer *buffer, Event *event);
+
+/// Move the contiguous run of events from the next id into the run array, and
+/// advance the next id past it. The buffer lock must be held.
+///
+/// @param[in] buffer  Handle for the buffer.
+///
+/// @return  Number of events in the run.
+uint32_t reorder_buffer_take_run(ReorderBuffer *buffer);
+
+/// Submit an event to be committed in id order. The event is copied, so it may
+/// be released as soon as this returns. Waits while its id is beyond the
+/// window, and commits the runs it completes.
+///
+/// @param[in] buffer  Handle for the buffer.
+/// @param[in] event   Handle for the event.
+///
+/// @return  0  Success.
+/// @return -1  Failure (including a repeated id, or a failed commit).
+int fdb_reorder_submit(ReorderBuffer *buffer, Event *event);
+
+/// Get the watermark below which every event is committed.
+///
+/// @param[in] buffer  Handle for the buffer.
+///
+/// @return  The watermark.
+uint64_t reorder_buffer_watermark(ReorderBuffer *buffer);
+
+/// Wait until the watermark passes an id.
+///
+/// @param[in] buffer  Handle for the buffer.
+/// @param[in] id      The event id.
+///
+/// @return  0  Success.
+/// @return -1  Failure (a commit failed before the id).
+int reorder_buffer_wait(ReorderBuffer *buffer, uint64_t id);
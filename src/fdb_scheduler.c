@@ -0,0 +1,616 @@
+/// @file fdb_scheduler.c
+///
+/// Definitions for the fair-share write scheduler.
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "event.h"
+#include "fdb.h"
+#include "fdb_scheduler.h"
+#include "metrics.h"
+#include "placement.h"
+
+// Microseconds the scheduler sleeps while every queued tenant is throttled
+#define SCHEDULER_THROTTLE_WAIT_US 1000
+
+//==============================================================================
+// Types
+//==============================================================================
+
+typedef struct tenant_request_t {
+  uint32_t remaining;  // Events not yet committed or failed.
+  bool failed;         // Whether any event failed.
+  pthread_cond_t done; // Signalled once no events remain.
+} TenantRequest;
+
+typedef struct tenant_write_t {
+  Event event;                 // Copy of the event.
+  uint64_t submitted_us;       // Time of the submission.
+  Tenant *tenant;              // The submitting tenant.
+  TenantRequest *request;      // The submission the event belongs to.
+  struct tenant_write_t *next; // Next write in the queue.
+} TenantWrite;
+
+typedef struct scheduler_batch_t {
+  TenantWrite **writes; // The writes in the batch.
+  Event *events;        // The events of the writes, for committing.
+  uint32_t num_writes;  // Number of writes in the batch.
+  uint32_t capacity;    // Maximum number of writes before growing.
+} SchedulerBatch;
+
+struct tenant_t {
+  TenantLimits limits;          // Rate, byte and share limits.
+  TenantStats stats;            // Counters and latency histogram.
+  TenantWrite *head;            // First queued write.
+  TenantWrite *tail;            // Last queued write.
+  uint64_t deficit;             // Bytes the tenant may add to batches.
+  double event_tokens;          // Events the tenant may take before throttling.
+  double byte_tokens;           // Bytes the tenant may take before throttling.
+  uint64_t refilled_us;         // Time the token buckets were last refilled.
+  uint64_t in_flight;           // Events taken into a batch, not committed.
+  bool active;                  // Whether the tenant is in the active list.
+  pthread_cond_t room;          // Broadcast when queued writes are taken or
+                                // committed.
+  struct tenant_t *next_active; // Next tenant in the active list.
+  struct tenant_t *prev;        // Previous tenant in the list of all tenants.
+  struct tenant_t *next;        // Next tenant in the list of all tenants.
+};
+
+//==============================================================================
+// Variables
+//==============================================================================
+
+static pthread_mutex_t scheduler_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t scheduler_changed = PTHREAD_COND_INITIALIZER;
+static pthread_t scheduler_thread;
+
+static bool scheduler_started = false;
+static bool scheduler_stopping = false;
+static uint64_t scheduler_quantum;
+static uint64_t scheduler_batch_bytes;
+
+// Every tenant, and the tenants with queued writes in round robin order
+static Tenant *scheduler_tenants;
+static Tenant *active_head;
+static Tenant *active_tail;
+static uint32_t num_active;
+
+//==============================================================================
+// Prototypes
+//==============================================================================
+
+/// Form and commit batches until stopped.
+///
+/// @param[in] arg  Unused.
+///
+/// @return  NULL.
+void *scheduler_loop(void *arg);
+
+/// Take queued writes into an empty batch by deficit round robin, until it is
+/// full or every queued tenant is throttled. The scheduler lock must be held.
+///
+/// @param[in] batch  Handle for the batch.
+void scheduler_form_batch(SchedulerBatch *batch);
+
+/// Make room for one more write in a batch.
+///
+/// @param[in] batch  Handle for the batch.
+///
+/// @return  0  Success.
+/// @return -1  Failure.
+int scheduler_grow_batch(SchedulerBatch *batch);
+
+/// Commit a batch, complete its writes, and empty it. The scheduler lock must
+/// be held, and is released during the commit.
+///
+/// @param[in] batch  Handle for the batch.
+void scheduler_commit_batch(SchedulerBatch *batch);
+
+/// Refill a tenant's token buckets, and check whether it is throttled.
+///
+/// @param[in] tenant  Handle for the tenant.
+/// @param[in] now_us  The current time.
+///
+/// @return  Whether the tenant exceeds a rate limit.
+bool tenant_throttled(Tenant *tenant, uint64_t now_us);
+
+/// Append a tenant to the active list.
+///
+/// @param[in] tenant  Handle for the tenant.
+void active_push(Tenant *tenant);
+
+/// Remove the first tenant of the active list.
+///
+/// @return  The tenant.
+Tenant *active_pop(void);
+
+/// Get the time on the monotonic clock.
+///
+/// @return  The time in microseconds.
+uint64_t scheduler_now_us(void);
+
+//==============================================================================
+// Functions
+//==============================================================================
+
+int fdb_start_scheduler(uint64_t quantum, uint64_t batch_bytes) {
+  pthread_attr_t attr;
+  int err;
+
+  pthread_mutex_lock(&scheduler_mutex);
+  if (scheduler_started) {
+    pthread_mutex_unlock(&scheduler_mutex);
+    return -1;
+  }
+
+  scheduler_quantum = quantum ? quantum : SCHEDULER_DEFAULT_QUANTUM;
+  scheduler_batch_bytes =
+      batch_bytes ? batch_bytes : SCHEDULER_DEFAULT_BATCH_BYTES;
+  scheduler_tenants = NULL;
+  active_head = NULL;
+  active_tail = NULL;
+  num_active = 0;
+
+  err = placement_init_attr(THREAD_ROLE_WORKER, &attr);
+  if (!err) {
+    err = pthread_create(&scheduler_thread, &attr, scheduler_loop, NULL);
+    pthread_attr_destroy(&attr);
+  }
+
+  if (err) {
+    pthread_mutex_unlock(&scheduler_mutex);
+    return -1;
+  }
+
+  scheduler_started = true;
+  pthread_mutex_unlock(&scheduler_mutex);
+
+  // Success
+  return 0;
+}
+
+int fdb_stop_scheduler(void) {
+  pthread_mutex_lock(&scheduler_mutex);
+  if (!scheduler_started || scheduler_stopping) {
+    pthread_mutex_unlock(&scheduler_mutex);
+    return -1;
+  }
+
+  // The scheduler empties every queue before it exits
+  scheduler_stopping = true;
+  pthread_cond_broadcast(&scheduler_changed);
+  pthread_mutex_unlock(&scheduler_mutex);
+
+  pthread_join(scheduler_thread, NULL);
+
+  pthread_mutex_lock(&scheduler_mutex);
+  while (scheduler_tenants) {
+    Tenant *tenant = scheduler_tenants;
+
+    scheduler_tenants = tenant->next;
+    pthread_cond_destroy(&tenant->room);
+    free((void *)tenant);
+  }
+  scheduler_started = false;
+  scheduler_stopping = false;
+  pthread_mutex_unlock(&scheduler_mutex);
+
+  // Success
+  return 0;
+}
+
+Tenant *scheduler_add_tenant(const TenantLimits *limits) {
+  Tenant *tenant = (Tenant *)calloc(1, sizeof(Tenant));
+
+  if (!tenant)
+    return NULL;
+  if (pthread_cond_init(&tenant->room, NULL)) {
+    free((void *)tenant);
+    return NULL;
+  }
+
+  pthread_mutex_lock(&scheduler_mutex);
+  if (!scheduler_started || scheduler_stopping) {
+    pthread_mutex_unlock(&scheduler_mutex);
+    pthread_cond_destroy(&tenant->room);
+    free((void *)tenant);
+    return NULL;
+  }
+
+  if (limits)
+    tenant->limits = *limits;
+
+  // A new tenant starts with a full burst
+  tenant->refilled_us = scheduler_now_us();
+  tenant->event_tokens =
+      (double)(tenant->limits.events_per_sec * SCHEDULER_BURST_MS) / 1000;
+  tenant->byte_tokens =
+      (double)(tenant->limits.bytes_per_sec * SCHEDULER_BURST_MS) / 1000;
+
+  tenant->next = scheduler_tenants;
+  if (scheduler_tenants)
+    scheduler_tenants->prev = tenant;
+  scheduler_tenants = tenant;
+  pthread_mutex_unlock(&scheduler_mutex);
+
+  return tenant;
+}
+
+void scheduler_remove_tenant(Tenant *tenant) {
+  pthread_mutex_lock(&scheduler_mutex);
+  while (tenant->head || tenant->in_flight)
+    pthread_cond_wait(&tenant->room, &scheduler_mutex);
+
+  if (tenant->prev)
+    tenant->prev->next = tenant->next;
+  else
+    scheduler_tenants = tenant->next;
+  if (tenant->next)
+    tenant->next->prev = tenant->prev;
+  pthread_mutex_unlock(&scheduler_mutex);
+
+  pthread_cond_destroy(&tenant->room);
+  free((void *)tenant);
+}
+
+void scheduler_set_limits(Tenant *tenant, const TenantLimits *limits) {
+  pthread_mutex_lock(&scheduler_mutex);
+  if (limits)
+    tenant->limits = *limits;
+  else
+    memset(&tenant->limits, 0, sizeof(TenantLimits));
+
+  // Queued writes may now fit
+  pthread_cond_broadcast(&tenant->room);
+  pthread_mutex_unlock(&scheduler_mutex);
+}
+
+void scheduler_tenant_stats(Tenant *tenant, TenantStats *stats) {
+  pthread_mutex_lock(&scheduler_mutex);
+  *stats = tenant->stats;
+  pthread_mutex_unlock(&scheduler_mutex);
+}
+
+int fdb_tenant_write(Tenant *tenant, Event *events, uint32_t num_events) {
+  TenantRequest request;
+  int err;
+
+  if (!num_events)
+    return 0;
+
+  request.remaining = num_events;
+  request.failed = false;
+  if (pthread_cond_init(&request.done, NULL))
+    return -1;
+
+  for (uint32_t i = 0; i < num_events; ++i) {
+    TenantWrite *write = (TenantWrite *)malloc(sizeof(TenantWrite));
+    uint64_t max_queued;
+
+    if (write) {
+      write->event.id = events[i].id;
+      write->event.data_length = events[i].data_length;
+      write->event.data = alloc_event_data(events[i].data_length);
+      if (!write->event.data) {
+        free((void *)write);
+        write = NULL;
+      }
+    }
+
+    // Events which can't be queued fail along with the rest of the array
+    if (!write) {
+      pthread_mutex_lock(&scheduler_mutex);
+      request.remaining -= (num_events - i);
+      request.failed = true;
+      pthread_mutex_unlock(&scheduler_mutex);
+      break;
+    }
+
+    memcpy(write->event.data, events[i].data, events[i].data_length);
+    write->tenant = tenant;
+    write->request = &request;
+    write->next = NULL;
+
+    pthread_mutex_lock(&scheduler_mutex);
+
+    // Only this tenant waits for room in its queue; one event larger than the
+    // limit is let in once the queue is empty
+    max_queued = tenant->limits.max_queued_bytes;
+    while (max_queued && tenant->stats.queued_bytes &&
+           ((tenant->stats.queued_bytes + write->event.data_length) >
+            max_queued)) {
+      pthread_cond_wait(&tenant->room, &scheduler_mutex);
+      max_queued = tenant->limits.max_queued_bytes;
+    }
+
+    write->submitted_us = scheduler_now_us();
+    if (tenant->tail)
+      tenant->tail->next = write;
+    else
+      tenant->head = write;
+    tenant->tail = write;
+    ++tenant->stats.queued_events;
+    tenant->stats.queued_bytes += write->event.data_length;
+
+    if (!tenant->active) {
+      active_push(tenant);
+      pthread_cond_signal(&scheduler_changed);
+    }
+    pthread_mutex_unlock(&scheduler_mutex);
+  }
+
+  pthread_mutex_lock(&scheduler_mutex);
+  while (request.remaining)
+    pthread_cond_wait(&request.done, &scheduler_mutex);
+  err = request.failed ? -1 : 0;
+  pthread_mutex_unlock(&scheduler_mutex);
+
+  pthread_cond_destroy(&request.done);
+
+  // Success or failure
+  return err;
+}
+
+void *scheduler_loop(void *arg) {
+  SchedulerBatch batch;
+
+  memset(&batch, 0, sizeof(SchedulerBatch));
+  pthread_mutex_lock(&scheduler_mutex);
+
+  for (;;) {
+    while (!num_active && !scheduler_stopping)
+      pthread_cond_wait(&scheduler_changed, &scheduler_mutex);
+    if (!num_active)
+      break;
+
+    scheduler_form_batch(&batch);
+    if (batch.num_writes) {
+      scheduler_commit_batch(&batch);
+    } else {
+      struct timespec wait;
+
+      // Every queued tenant is throttled (or the batch couldn't grow)
+      clock_gettime(CLOCK_REALTIME, &wait);
+      wait.tv_nsec += (SCHEDULER_THROTTLE_WAIT_US * 1000L);
+      if (wait.tv_nsec >= 1000000000L) {
+        ++wait.tv_sec;
+        wait.tv_nsec -= 1000000000L;
+      }
+      pthread_cond_timedwait(&scheduler_changed, &scheduler_mutex, &wait);
+    }
+  }
+
+  pthread_mutex_unlock(&scheduler_mutex);
+  free((void *)batch.writes);
+  free((void *)batch.events);
+
+  return NULL;
+}
+
+void scheduler_form_batch(SchedulerBatch *batch) {
+  uint64_t batch_bytes = 0;
+  uint64_t now_us = scheduler_now_us();
+  bool full = false;
+  bool progress = true;
+
+  // Each pass visits every active tenant once. Passes continue while the
+  // batch has room and some tenant may add to it, so deficits grow until
+  // even events larger than the quantum fit.
+  while (!full && progress && num_active) {
+    uint32_t num_visits = num_active;
+
+    progress = false;
+    for (uint32_t i = 0; (i < num_visits) && !full; ++i) {
+      Tenant *tenant = active_pop();
+      uint32_t weight = tenant->limits.weight ? tenant->limits.weight : 1;
+
+      if (tenant_throttled(tenant, now_us)) {
+        ++tenant->stats.throttled;
+        metrics_add(METRIC_SCHEDULER_THROTTLES, 1);
+        active_push(tenant);
+        continue;
+      }
+
+      progress = true;
+      tenant->deficit += (scheduler_quantum * weight);
+
+      while (tenant->head &&
+             (tenant->head->event.data_length <= tenant->deficit)) {
+        TenantWrite *write = tenant->head;
+        uint64_t length = write->event.data_length;
+
+        // An event larger than a batch goes into a batch of its own
+        if ((batch->num_writes &&
+             ((batch_bytes + length) > scheduler_batch_bytes)) ||
+            scheduler_grow_batch(batch)) {
+          full = true;
+          break;
+        }
+
+        tenant->head = write->next;
+        if (!tenant->head)
+          tenant->tail = NULL;
+        --tenant->stats.queued_events;
+        tenant->stats.queued_bytes -= length;
+        ++tenant->in_flight;
+        tenant->deficit -= length;
+        tenant->event_tokens -= 1;
+        tenant->byte_tokens -= (double)length;
+
+        batch->writes[batch->num_writes] = write;
+        batch->events[batch->num_writes] = write->event;
+        ++batch->num_writes;
+        batch_bytes += length;
+
+        if (tenant_throttled(tenant, now_us))
+          break;
+      }
+
+      // Idle tenants keep no deficit, so they can't save up for a burst
+      if (tenant->head)
+        active_push(tenant);
+      else
+        tenant->deficit = 0;
+      pthread_cond_broadcast(&tenant->room);
+    }
+  }
+}
+
+int scheduler_grow_batch(SchedulerBatch *batch) {
+  uint32_t capacity;
+  TenantWrite **writes;
+  Event *events;
+
+  if (batch->num_writes < batch->capacity)
+    return 0;
+
+  capacity = batch->capacity ? (2 * batch->capacity) : 256;
+  writes = (TenantWrite **)realloc(batch->writes,
+                                   (sizeof(TenantWrite *) * capacity));
+  if (!writes)
+    return -1;
+  batch->writes = writes;
+
+  events = (Event *)realloc(batch->events, (sizeof(Event) * capacity));
+  if (!events)
+    return -1;
+  batch->events = events;
+
+  batch->capacity = capacity;
+
+  // Success
+  return 0;
+}
+
+void scheduler_commit_batch(SchedulerBatch *batch) {
+  uint64_t now_us;
+  int err;
+
+  pthread_mutex_unlock(&scheduler_mutex);
+  err = fdb_write_event_array(batch->events, batch->num_writes);
+  metrics_add(METRIC_SCHEDULER_BATCHES, 1);
+  now_us = scheduler_now_us();
+  pthread_mutex_lock(&scheduler_mutex);
+
+  for (uint32_t i = 0; i < batch->num_writes; ++i) {
+    TenantWrite *write = batch->writes[i];
+    Tenant *tenant = write->tenant;
+    TenantRequest *request = write->request;
+    uint64_t latency_us = (now_us - write->submitted_us);
+
+    // Which events of a failed batch were committed is unknown, so they all
+    // count as failed
+    if (err) {
+      ++tenant->stats.errors;
+      request->failed = true;
+    } else {
+      ++tenant->stats.events;
+      tenant->stats.bytes += write->event.data_length;
+    }
+    ++tenant->stats.latency_histogram[tenant_latency_bucket(latency_us)];
+    if (latency_us > tenant->stats.max_latency_us)
+      tenant->stats.max_latency_us = latency_us;
+
+    --tenant->in_flight;
+    if (!tenant->in_flight)
+      pthread_cond_broadcast(&tenant->room);
+    if (!--request->remaining)
+      pthread_cond_signal(&request->done);
+
+    free_event(&write->event);
+    free((void *)write);
+  }
+  batch->num_writes = 0;
+}
+
+bool tenant_throttled(Tenant *tenant, uint64_t now_us) {
+  double elapsed = (double)(now_us - tenant->refilled_us) / 1000000;
+  double events_burst =
+      (double)(tenant->limits.events_per_sec * SCHEDULER_BURST_MS) / 1000;
+  double bytes_burst =
+      (double)(tenant->limits.bytes_per_sec * SCHEDULER_BURST_MS) / 1000;
+
+  tenant->refilled_us = now_us;
+  tenant->event_tokens += (elapsed * (double)tenant->limits.events_per_sec);
+  if (tenant->event_tokens > events_burst)
+    tenant->event_tokens = events_burst;
+  tenant->byte_tokens += (elapsed * (double)tenant->limits.bytes_per_sec);
+  if (tenant->byte_tokens > bytes_burst)
+    tenant->byte_tokens = bytes_burst;
+
+  // Buckets may go into debt for an event larger than a burst, which is then
+  // paid back before the tenant's next event
+  return ((tenant->limits.events_per_sec && (tenant->event_tokens <= 0)) ||
+          (tenant->limits.bytes_per_sec && (tenant->byte_tokens <= 0)));
+}
+
+void active_push(Tenant *tenant) {
+  tenant->active = true;
+  tenant->next_active = NULL;
+  if (active_tail)
+    active_tail->next_active = tenant;
+  else
+    active_head = tenant;
+  active_tail = tenant;
+  ++num_active;
+}
+
+Tenant *active_pop(void) {
+  Tenant *tenant = active_head;
+
+  active_head = tenant->next_active;
+  if (!active_head)
+    active_tail = NULL;
+  tenant->active = false;
+  --num_active;
+
+  return tenant;
+}
+
+uint64_t scheduler_now_us(void) {
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+
+  return (((uint64_t)now.tv_sec * 1000000) + ((uint64_t)now.tv_nsec / 1000));
+}
+
+uint32_t tenant_latency_bucket(uint64_t latency_us) {
+  uint32_t bucket = 0;
+
+  while (((latency_us >> 1) >> bucket) &&
+         (bucket < (TENANT_LATENCY_BUCKETS - 1))) {
+    ++bucket;
+  }
+
+  return bucket;
+}
+
+uint64_t tenant_latency_percentile(const TenantStats *stats,
+                                   double percentile) {
+  uint64_t total = 0;
+  uint64_t seen = 0;
+  double rank;
+
+  for (uint32_t i = 0; i < TENANT_LATENCY_BUCKETS; ++i) {
+    total += stats->latency_histogram[i];
+  }
+  if (!total)
+    return 0;
+
+  rank = ((percentile / 100) * (double)total);
+  for (uint32_t i = 0; i < TENANT_LATENCY_BUCKETS; ++i) {
+    seen += stats->latency_histogram[i];
+    if (seen && ((double)seen >= rank))
+      return (((uint64_t)1 << (i + 1)) - 1);
+  }
+
+  return stats->max_latency_us;
+}
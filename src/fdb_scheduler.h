@@ -0,0 +1,141 @@
+/// @file fdb_scheduler.h
+///
+/// Declarations for the fair-share write scheduler, which shares one database
+/// and network thread between many co-hosted ships (tenants).
+///
+/// Each tenant submits writes into its own queue. A scheduler thread forms
+/// each batch by deficit round robin: on every visit a tenant's deficit grows
+/// by the quantum times its weight, and its queued events are taken while
+/// their data fits the deficit, so every tenant gets its share of each batch
+/// however much the others have queued. Tenants may also be limited to rates
+/// of events and bytes per second, by token buckets holding
+/// SCHEDULER_BURST_MS of each rate, and to a number of queued bytes beyond
+/// which their submissions wait. Batches are committed with
+/// fdb_write_event_array().
+///
+/// Tenants share the event log's key space, so each must write its own ids.
+/// Per-tenant latency, from submission to commit, is kept in a histogram.
+///
+/// Documentation links:
+///   https://en.wikipedia.org/wiki/Deficit_round_robin
+///   https://en.wikipedia.org/wiki/Token_bucket
+
+#pragma once
+
+#include <stdint.h>
+
+#include "event.h"
+
+// Bytes a tenant of weight 1 may add to a batch per round, and bytes of event
+// data per batch, used when none are given
+#define SCHEDULER_DEFAULT_QUANTUM (64 * 1024)
+#define SCHEDULER_DEFAULT_BATCH_BYTES (4 * 1024 * 1024)
+
+// Milliseconds of its rates a tenant may spend at once after being idle
+#define SCHEDULER_BURST_MS 100
+
+// Number of buckets in the latency histogram. Bucket i counts latencies of
+// [2^i, 2^(i+1)) microseconds, bucket 0 also counts those under 1 microsecond,
+// and the last bucket also counts any longer.
+#define TENANT_LATENCY_BUCKETS 32
+
+//==============================================================================
+// Types
+//==============================================================================
+
+typedef struct tenant_limits_t {
+  uint32_t weight;           // Share of each batch, relative to other tenants
+                             // (0 is treated as 1).
+  uint64_t events_per_sec;   // Maximum events committed per second, or 0.
+  uint64_t bytes_per_sec;    // Maximum bytes committed per second, or 0.
+  uint64_t max_queued_bytes; // Bytes queued before submissions wait, or 0.
+} TenantLimits;
+
+typedef struct tenant_stats_t {
+  uint64_t events;         // Events committed.
+  uint64_t bytes;          // Bytes of event data committed.
+  uint64_t errors;         // Events whose commit failed.
+  uint64_t throttled;      // Rounds skipped for exceeding a rate limit.
+  uint64_t queued_events;  // Events waiting in the queue.
+  uint64_t queued_bytes;   // Bytes of event data waiting in the queue.
+  uint64_t max_latency_us; // Longest latency from submission to commit.
+  uint64_t latency_histogram[TENANT_LATENCY_BUCKETS]; // Latencies in
+                                                       // microseconds.
+} TenantStats;
+
+typedef struct tenant_t Tenant;
+
+//==============================================================================
+// Prototypes
+//==============================================================================
+
+/// Start the scheduler thread.
+///
+/// @param[in] quantum      Bytes a tenant of weight 1 may add to a batch per
+///                         round, or 0 for SCHEDULER_DEFAULT_QUANTUM.
+/// @param[in] batch_bytes  Bytes of event data per batch, or 0 for
+///                         SCHEDULER_DEFAULT_BATCH_BYTES.
+///
+/// @return  0  Success.
+/// @return -1  Failure (including a scheduler already started).
+int fdb_start_scheduler(uint64_t quantum, uint64_t batch_bytes);
+
+/// Commit every queued write, stop the scheduler thread, and release every
+/// tenant. No tenant may be writing.
+///
+/// @return  0  Success.
+/// @return -1  Failure (the scheduler isn't started).
+int fdb_stop_scheduler(void);
+
+/// Add a tenant to the started scheduler.
+///
+/// @param[in] limits  The tenant's limits, or NULL for none.
+///
+/// @return  Handle for the tenant, or NULL on failure.
+Tenant *scheduler_add_tenant(const TenantLimits *limits);
+
+/// Wait for a tenant's queued writes to commit, and remove it from the
+/// scheduler. The tenant may not be writing.
+///
+/// @param[in] tenant  Handle for the tenant.
+void scheduler_remove_tenant(Tenant *tenant);
+
+/// Change a tenant's limits.
+///
+/// @param[in] tenant  Handle for the tenant.
+/// @param[in] limits  The tenant's limits, or NULL for none.
+void scheduler_set_limits(Tenant *tenant, const TenantLimits *limits);
+
+/// Get a tenant's counters and latency histogram.
+///
+/// @param[in] tenant  Handle for the tenant.
+/// @param[in] stats   Pointer to the write location of the statistics.
+void scheduler_tenant_stats(Tenant *tenant, TenantStats *stats);
+
+/// Write an array of events as a tenant, and wait until they are committed.
+/// Events are copied when queued.
+///
+/// @param[in] tenant      Handle for the tenant.
+/// @param[in] events      Handle for the array of events to write.
+/// @param[in] num_events  Number of events in the array.
+///
+/// @return  0  Success.
+/// @return -1  Failure.
+int fdb_tenant_write(Tenant *tenant, Event *events, uint32_t num_events);
+
+/// Get the latency histogram bucket counting a latency.
+///
+/// @param[in] latency_us  The latency in microseconds.
+///
+/// @return  The bucket.
+uint32_t tenant_latency_bucket(uint64_t latency_us);
+
+/// Estimate a percentile of a latency histogram, as the upper bound of the
+/// bucket holding it.
+///
+/// @param[in] stats       The tenant's statistics.
+/// @param[in] percentile  The percentile, between 0 and 100.
+///
+/// @return  The latency in microseconds, or 0 without any latencies.
+uint64_t tenant_latency_percentile(const TenantStats *stats,
+                                   double percentile);
@@ -0,0 +1,378 @@
+/// @file fdb_scrub.c
+///
+/// Definitions for the background integrity scrubber.
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <foundationdb/fdb_c.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "cipher.h"
+#include "constants.h"
+#include "event.h"
+#include "fdb.h"
+#include "fdb_scrub.h"
+#include "fdb_slow_log.h"
+#include "metrics.h"
+#include "placement.h"
+
+// Longest time the scrubber thread sleeps before checking for a stop request
+#define SCRUB_SLEEP_SLICE_MS 100.0
+
+// Time to wait before retrying after a failed pass
+#define SCRUB_RETRY_DELAY_MS 1000.0
+
+//==============================================================================
+// Types
+//==============================================================================
+
+typedef struct scrub_state_t {
+  const ScrubConfig *config; // Scrubber configuration.
+  int64_t anomalies;         // Anomalies found so far in this pass.
+  bool has_current;          // Whether an event is being verified.
+  uint64_t current_id;       // Identifier of the event being verified.
+  uint32_t expected;         // Fragments promised by its header (0 unknown).
+  uint32_t next_fragment;    // Fragment number expected next.
+} ScrubState;
+
+//==============================================================================
+// Variables
+//==============================================================================
+
+static pthread_t scrub_thread;
+static ScrubConfig scrub_config;
+static atomic_bool scrub_running = false;
+static atomic_bool scrub_stopping = false;
+
+static const char *scrub_anomaly_names[] = {
+    "missing first fragment", "missing fragment", "extra fragment",
+    "bad header",             "bad fragment size", "bad checksum",
+};
+
+//==============================================================================
+// Prototypes
+//==============================================================================
+
+/// Scrub from the stored cursor to the end of the log, or until stopped.
+///
+/// @param[in] config  Scrubber configuration.
+/// @param[in] stop    Flag which requests an early stop (may be NULL).
+///
+/// @return  Number of anomalies found.
+/// @return -1  Failure.
+int64_t scrub_run(const ScrubConfig *config, atomic_bool *stop);
+
+/// Verify a single fragment against the event currently being verified.
+///
+/// @param[in] state         Scrubber state.
+/// @param[in] event_id      Identifier of the event the fragment belongs to.
+/// @param[in] fragment      Fragment number.
+/// @param[in] value         Fragment value.
+/// @param[in] value_length  Length of the fragment value in bytes.
+void scrub_fragment(ScrubState *state, uint64_t event_id, uint32_t fragment,
+                    const uint8_t *value, uint32_t value_length);
+
+/// Finish verifying the current event, checking that no fragments are missing
+/// from its tail.
+///
+/// @param[in] state  Scrubber state.
+void scrub_finish_event(ScrubState *state);
+
+/// Report an anomaly through the configured hook and the metrics counters.
+///
+/// @param[in] state     Scrubber state.
+/// @param[in] anomaly   Kind of anomaly.
+/// @param[in] event_id  Identifier of the affected event.
+/// @param[in] fragment  Affected fragment number.
+void scrub_report(ScrubState *state, ScrubAnomaly anomaly, uint64_t event_id,
+                  uint32_t fragment);
+
+/// Sleep, waking early if a stop is requested.
+///
+/// @param[in] ms    Time to sleep in milliseconds.
+/// @param[in] stop  Flag which requests an early stop (may be NULL).
+void scrub_sleep(double ms, atomic_bool *stop);
+
+/// Scrubber thread entry point.
+void *scrub_thread_func(void *arg);
+
+//==============================================================================
+// Functions
+//==============================================================================
+
+int fdb_scrub_start(const ScrubConfig *config) {
+  pthread_attr_t attr;
+  bool expected = false;
+
+  if (!atomic_compare_exchange_strong(&scrub_running, &expected, true))
+    return -1;
+
+  scrub_config = *config;
+  atomic_store(&scrub_stopping, false);
+
+  if (placement_init_attr(THREAD_ROLE_WORKER, &attr)) {
+    atomic_store(&scrub_running, false);
+    return -1;
+  }
+
+  if (pthread_create(&scrub_thread, &attr, scrub_thread_func, NULL)) {
+    perror("pthread_create() error");
+    pthread_attr_destroy(&attr);
+    atomic_store(&scrub_running, false);
+    return -1;
+  }
+
+  pthread_attr_destroy(&attr);
+
+  // Success
+  return 0;
+}
+
+int fdb_scrub_stop(void) {
+  if (!atomic_load(&scrub_running))
+    return -1;
+
+  atomic_store(&scrub_stopping, true);
+
+  if (pthread_join(scrub_thread, NULL)) {
+    perror("pthread_join() error");
+    return -1;
+  }
+
+  atomic_store(&scrub_running, false);
+
+  // Success
+  return 0;
+}
+
+int64_t fdb_scrub_pass(const ScrubConfig *config) {
+  return scrub_run(config, NULL);
+}
+
+int fdb_scrub_reset_cursor(void) {
+  return fdb_write_metadata_u64(SCRUB_CURSOR_METADATA, 0);
+}
+
+int64_t scrub_run(const ScrubConfig *config, atomic_bool *stop) {
+  FDBTransaction *tx;
+  FDBFuture *future = NULL;
+  const FDBKeyValue *out_kv;
+  fdb_bool_t out_more = 1;
+  int32_t out_count;
+  ScrubState state = {config, 0, false, 0, 0, 0};
+  uint64_t cursor = 0;
+  uint32_t batch_kvs = config->batch_kvs ? config->batch_kvs
+                                         : SCRUB_DEFAULT_BATCH_KVS;
+  fdb_bool_t begin_or_equal = 0;
+  uint8_t last_key[FDB_KEY_MAX_LENGTH];
+  int last_length;
+  uint8_t end_key[1] = {(fdb_event_key_prefix(fdb_get_key_format()) + 1)};
+  int err;
+
+  // Resume from the stored cursor
+  if (fdb_read_metadata_u64(SCRUB_CURSOR_METADATA, &cursor) < 0)
+    return -1;
+
+  last_length = fdb_build_event_key(last_key, cursor, 0);
+
+  if (fdb_check_error(fdb_setup_transaction(&tx)))
+    return -1;
+
+  while (out_more && !(stop && atomic_load(stop))) {
+    double t_batch = slow_log_time_ms();
+    uint64_t batch_bytes = 0;
+
+    // Background work must never delay foreground transactions
+    fdb_check_error(fdb_transaction_set_option(tx, FDB_TR_OPTION_PRIORITY_BATCH,
+                                               NULL, 0));
+
+    // Snapshot read, continuing after the last key seen
+    future = fdb_transaction_get_range(
+        tx, last_key, last_length, begin_or_equal, 1, end_key, 1, 0, 1,
+        batch_kvs, 0, FDB_STREAMING_MODE_EXACT, 0, 1, 0);
+    err = fdb_future_block_until_ready(future);
+    if (!err)
+      err = fdb_future_get_error(future);
+
+    // Let FoundationDB decide whether the error is retryable, and back off
+    if (err) {
+      fdb_future_destroy(future);
+      future = fdb_transaction_on_error(tx, err);
+      if (fdb_check_error(fdb_future_block_until_ready(future)))
+        goto tx_fail;
+      if (fdb_check_error(fdb_future_get_error(future)))
+        goto tx_fail;
+      fdb_future_destroy(future);
+      continue;
+    }
+
+    if (fdb_check_error(fdb_future_get_keyvalue_array(future, &out_kv,
+                                                      &out_count, &out_more)))
+      goto tx_fail;
+
+    for (int32_t i = 0; i < out_count; ++i) {
+      uint64_t event_id;
+      uint32_t fragment;
+
+      batch_bytes += (out_kv[i].key_length + out_kv[i].value_length);
+
+      if (fdb_parse_event_key(out_kv[i].key, out_kv[i].key_length, &event_id,
+                              &fragment))
+        continue;
+
+      scrub_fragment(&state, event_id, fragment, out_kv[i].value,
+                     out_kv[i].value_length);
+    }
+
+    if (out_count) {
+      last_length = out_kv[(out_count - 1)].key_length;
+      memcpy(last_key, out_kv[(out_count - 1)].key, last_length);
+      begin_or_equal = 1;
+    }
+
+    fdb_future_destroy(future);
+    future = NULL;
+    metrics_add(METRIC_SCRUB_BYTES, batch_bytes);
+
+    // Persist the cursor at the first event that isn't fully verified yet, or
+    // back at the start of the log when the pass is complete
+    if (!out_more) {
+      scrub_finish_event(&state);
+      fdb_set_metadata_u64(tx, SCRUB_CURSOR_METADATA, 0);
+    } else if (state.has_current) {
+      fdb_set_metadata_u64(tx, SCRUB_CURSOR_METADATA, state.current_id);
+    }
+
+    if (fdb_send_transaction(tx))
+      goto tx_fail;
+
+    // Rate limit: each batch takes at least as long as its bytes are allowed
+    if (config->bytes_per_sec) {
+      double t_allowed =
+          ((1000.0 * batch_bytes) / (double)config->bytes_per_sec);
+      double t_spent = (slow_log_time_ms() - t_batch);
+
+      if (t_allowed > t_spent)
+        scrub_sleep((t_allowed - t_spent), stop);
+    }
+  }
+
+  if (!out_more)
+    metrics_add(METRIC_SCRUB_PASSES, 1);
+
+  fdb_transaction_destroy(tx);
+
+  // Success
+  return state.anomalies;
+
+// Failure
+tx_fail:
+  if (future)
+    fdb_future_destroy(future);
+  fdb_transaction_destroy(tx);
+  metrics_add(METRIC_SCRUB_ERRORS, 1);
+  return -1;
+}
+
+void scrub_fragment(ScrubState *state, uint64_t event_id, uint32_t fragment,
+                    const uint8_t *value, uint32_t value_length) {
+  // Fragments arrive in key order, so a new identifier closes the last event
+  if (!state->has_current || (state->current_id != event_id)) {
+    scrub_finish_event(state);
+
+    state->has_current = true;
+    state->current_id = event_id;
+    state->expected = 0;
+    state->next_fragment = 0;
+
+    if (fragment)
+      scrub_report(state, SCRUB_MISSING_FIRST_FRAGMENT, event_id, 0);
+  }
+
+  if (!fragment) {
+    uint32_t num_fragments;
+    int header_length = parse_header(value, value_length, &num_fragments);
+
+    if (header_length < 0) {
+      scrub_report(state, SCRUB_BAD_HEADER, event_id, fragment);
+    } else {
+      state->expected = (num_fragments + 1);
+
+      if ((value_length - header_length) >
+          (OPTIMAL_VALUE_SIZE + cipher_overhead()))
+        scrub_report(state, SCRUB_BAD_FRAGMENT_SIZE, event_id, fragment);
+    }
+  } else {
+    if (fragment != state->next_fragment)
+      scrub_report(state, SCRUB_MISSING_FRAGMENT, event_id,
+                   state->next_fragment);
+
+    if (state->expected && (fragment >= state->expected))
+      scrub_report(state, SCRUB_EXTRA_FRAGMENT, event_id, fragment);
+
+    // Every fragment after the first should be EXACTLY the preset size
+    if (value_length != (OPTIMAL_VALUE_SIZE + cipher_overhead()))
+      scrub_report(state, SCRUB_BAD_FRAGMENT_SIZE, event_id, fragment);
+  }
+
+  if (state->config->checksum &&
+      state->config->checksum(event_id, fragment, value, value_length,
+                              state->config->context))
+    scrub_report(state, SCRUB_BAD_CHECKSUM, event_id, fragment);
+
+  state->next_fragment = (fragment + 1);
+}
+
+void scrub_finish_event(ScrubState *state) {
+  if (!state->has_current)
+    return;
+
+  if (state->expected && (state->next_fragment < state->expected))
+    scrub_report(state, SCRUB_MISSING_FRAGMENT, state->current_id,
+                  state->next_fragment);
+
+  metrics_add(METRIC_SCRUB_EVENTS, 1);
+  state->has_current = false;
+}
+
+void scrub_report(ScrubState *state, ScrubAnomaly anomaly, uint64_t event_id,
+                  uint32_t fragment) {
+  ++state->anomalies;
+  metrics_add(METRIC_SCRUB_ANOMALIES, 1);
+
+  if (state->config->on_anomaly) {
+    state->config->on_anomaly(anomaly, event_id, fragment,
+                              state->config->context);
+  } else {
+    fprintf(stderr, "scrub: %s at event %llu fragment %u\n",
+            scrub_anomaly_names[anomaly], (unsigned long long)event_id,
+            fragment);
+  }
+}
+
+void scrub_sleep(double ms, atomic_bool *stop) {
+  while ((ms > 0.0) && !(stop && atomic_load(stop))) {
+    double slice = (ms < SCRUB_SLEEP_SLICE_MS) ? ms : SCRUB_SLEEP_SLICE_MS;
+    struct timespec ts = {(time_t)(slice / 1000.0),
+                          (long)((slice - (1000.0 * (time_t)(slice / 1000.0))) *
+                                 1000000.0)};
+
+    nanosleep(&ts, NULL);
+    ms -= slice;
+  }
+}
+
+void *scrub_thread_func(void *arg) {
+  do {
+    if (scrub_run(&scrub_config, &scrub_stopping) < 0)
+      scrub_sleep(SCRUB_RETRY_DELAY_MS, &scrub_stopping);
+  } while (scrub_config.repeat && !atomic_load(&scrub_stopping));
+
+  return NULL;
+}
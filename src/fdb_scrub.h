@@ -0,0 +1,90 @@
+/// @file fdb_scrub.h
+///
+/// Declarations for the background integrity scrubber, which walks the event
+/// log at batch priority and verifies that every stored event is complete and
+/// well-formed, so that corruption is found before a reader trips over it.
+///
+/// Documentation links:
+///   https://apple.github.io/foundationdb/api-c.html#c.FDBTransactionOption
+///   https://apple.github.io/foundationdb/developer-guide.html#snapshot-reads
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Name of the metadata entry storing the next event the scrubber will verify
+#define SCRUB_CURSOR_METADATA "scrub_cursor"
+
+// Default maximum number of key-value pairs read per scrubber batch
+#define SCRUB_DEFAULT_BATCH_KVS 500
+
+//==============================================================================
+// Types
+//==============================================================================
+
+typedef enum scrub_anomaly_t {
+  SCRUB_MISSING_FIRST_FRAGMENT, // Event has fragments but no header fragment.
+  SCRUB_MISSING_FRAGMENT,       // Gap in the fragment numbers of an event.
+  SCRUB_EXTRA_FRAGMENT,         // More fragments than the header promises.
+  SCRUB_BAD_HEADER,             // Header fragment too short for its header.
+  SCRUB_BAD_FRAGMENT_SIZE,      // Fragment payload has the wrong length.
+  SCRUB_BAD_CHECKSUM,           // Fragment rejected by the checksum hook.
+} ScrubAnomaly;
+
+/// Optional hook which verifies the checksum of a single fragment.
+///
+/// @return  0  Fragment is valid.
+/// @return  1  Fragment is corrupt.
+typedef int (*ScrubChecksumFunc)(uint64_t event_id, uint32_t fragment,
+                                 const uint8_t *value, uint32_t value_length,
+                                 void *context);
+
+/// Optional hook which is called for every anomaly found. When absent,
+/// anomalies are printed to stderr.
+typedef void (*ScrubAnomalyFunc)(ScrubAnomaly anomaly, uint64_t event_id,
+                                 uint32_t fragment, void *context);
+
+typedef struct scrub_config_t {
+  uint64_t bytes_per_sec;       // Read rate limit (0 is unlimited).
+  uint32_t batch_kvs;           // Key-value pairs per batch (0 is the default).
+  bool repeat;                  // Start a new pass after finishing one.
+  ScrubChecksumFunc checksum;   // Optional per-fragment checksum hook.
+  ScrubAnomalyFunc on_anomaly;  // Optional anomaly reporting hook.
+  void *context;                // Passed through to the hooks.
+} ScrubConfig;
+
+//==============================================================================
+// Prototypes
+//==============================================================================
+
+/// Start the scrubber in a background thread. The scrubber resumes from the
+/// cursor stored in the database metadata.
+///
+/// @param[in] config  Scrubber configuration (copied).
+///
+/// @return  0  Success.
+/// @return -1  Failure (e.g. already running).
+int fdb_scrub_start(const ScrubConfig *config);
+
+/// Stop the background scrubber and wait for it to exit. The cursor is kept, so
+/// the next start resumes where this one stopped.
+///
+/// @return  0  Success.
+/// @return -1  Failure (e.g. not running).
+int fdb_scrub_stop(void);
+
+/// Synchronously scrub from the stored cursor to the end of the log, then reset
+/// the cursor to the start of the log.
+///
+/// @param[in] config  Scrubber configuration.
+///
+/// @return  Number of anomalies found.
+/// @return -1  Failure.
+int64_t fdb_scrub_pass(const ScrubConfig *config);
+
+/// Reset the stored cursor, so that the next pass starts at the first event.
+///
+/// @return  0  Success.
+/// @return -1  Failure.
+int fdb_scrub_reset_cursor(void);
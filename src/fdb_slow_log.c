@@ -0,0 +1,216 @@
+/// @file fdb_slow_log.c
+///
+/// Definitions for the slow-operation log.
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <foundationdb/fdb_c.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <threads.h>
+#include <time.h>
+
+#include "fdb.h"
+#include "fdb_slow_log.h"
+
+//==============================================================================
+// Variables
+//==============================================================================
+
+static pthread_mutex_t slow_log_lock = PTHREAD_MUTEX_INITIALIZER;
+static SlowOp *slow_log_records = NULL;
+static uint32_t slow_log_capacity = 0;
+static uint32_t slow_log_count = 0;
+static uint32_t slow_log_next = 0;
+static double slow_log_threshold = 0.0;
+// Read without the lock by every operation that begins, to decide whether to
+// sample it
+static _Atomic double slow_log_sample_rate = 0.0;
+static atomic_bool slow_log_enabled = false;
+static atomic_uint_fast64_t slow_log_sequence = 0;
+static thread_local uint64_t slow_log_rng = 0;
+
+static const char *slow_op_names[] = {"write", "read", "clear"};
+
+//==============================================================================
+// Prototypes
+//==============================================================================
+
+/// Decide whether an operation should be sampled.
+///
+/// @return  True if the operation should be recorded regardless of latency.
+bool slow_log_sample(void);
+
+//==============================================================================
+// Functions
+//==============================================================================
+
+int fdb_slow_log_configure(double threshold_ms, double sample_rate,
+                           uint32_t capacity) {
+  SlowOp *records = NULL;
+
+  if ((sample_rate < 0.0) || (sample_rate > 1.0) || (threshold_ms < 0.0))
+    return -1;
+
+  if (capacity) {
+    records = calloc(capacity, sizeof(SlowOp));
+    if (!records)
+      return -1;
+  }
+
+  pthread_mutex_lock(&slow_log_lock);
+  free((void *)slow_log_records);
+  slow_log_records = records;
+  slow_log_capacity = capacity;
+  slow_log_count = 0;
+  slow_log_next = 0;
+  slow_log_threshold = threshold_ms;
+  atomic_store(&slow_log_sample_rate, sample_rate);
+  atomic_store(&slow_log_enabled, (capacity != 0));
+  pthread_mutex_unlock(&slow_log_lock);
+
+  // Success
+  return 0;
+}
+
+void fdb_slow_log_begin(SlowOp *op, SlowOpType type, uint64_t event_id,
+                        FDBTransaction *tx) {
+  memset(op, 0, sizeof(SlowOp));
+  op->type = type;
+  op->event_id = event_id;
+  op->enabled = atomic_load_explicit(&slow_log_enabled, memory_order_relaxed);
+
+  if (!op->enabled)
+    return;
+
+  op->sampled = slow_log_sample();
+  op->t_start = slow_log_time_ms();
+
+  // Every tracked transaction gets an identifier so that slow operations can
+  // be matched against client trace logs and transaction profiling output
+  uint64_t seq = atomic_fetch_add(&slow_log_sequence, 1);
+  snprintf(op->debug_id, SLOW_LOG_DEBUG_ID_LENGTH, "seguro-%s-%llu-%llu",
+           slow_op_names[type], (unsigned long long)event_id,
+           (unsigned long long)seq);
+
+  if (!tx)
+    return;
+
+  fdb_check_error(fdb_transaction_set_option(
+      tx, FDB_TR_OPTION_DEBUG_TRANSACTION_IDENTIFIER,
+      (const uint8_t *)op->debug_id, (int)strlen(op->debug_id)));
+
+  // Transaction logging writes detailed client trace events, so it's only
+  // enabled for the sampled operations
+  if (op->sampled)
+    fdb_check_error(
+        fdb_transaction_set_option(tx, FDB_TR_OPTION_LOG_TRANSACTION, NULL, 0));
+}
+
+void fdb_slow_log_end(SlowOp *op) {
+  if (!op->enabled)
+    return;
+
+  op->t_total = (slow_log_time_ms() - op->t_start);
+
+  pthread_mutex_lock(&slow_log_lock);
+  if (slow_log_capacity &&
+      (op->sampled || (op->t_total >= slow_log_threshold))) {
+    slow_log_records[slow_log_next] = *op;
+    slow_log_next = ((slow_log_next + 1) % slow_log_capacity);
+    if (slow_log_count < slow_log_capacity)
+      ++slow_log_count;
+  }
+  pthread_mutex_unlock(&slow_log_lock);
+}
+
+uint32_t fdb_slow_log_read(SlowOp *out, uint32_t max) {
+  uint32_t n;
+
+  pthread_mutex_lock(&slow_log_lock);
+  n = (max < slow_log_count) ? max : slow_log_count;
+  for (uint32_t i = 0; i < n; ++i) {
+    uint32_t pos =
+        ((slow_log_next + slow_log_capacity - 1 - i) % slow_log_capacity);
+    out[i] = slow_log_records[pos];
+  }
+  pthread_mutex_unlock(&slow_log_lock);
+
+  return n;
+}
+
+void fdb_slow_log_print(FILE *stream) {
+  uint32_t n;
+  SlowOp *records;
+
+  pthread_mutex_lock(&slow_log_lock);
+  n = slow_log_count;
+  pthread_mutex_unlock(&slow_log_lock);
+
+  if (!n)
+    return;
+
+  records = malloc(sizeof(SlowOp) * n);
+  n = fdb_slow_log_read(records, n);
+
+  for (uint32_t i = 0; i < n; ++i) {
+    SlowOp *op = (records + i);
+
+    fprintf(stream, "\n   slow op  %s (%s)\n", slow_op_names[op->type],
+            (op->sampled ? "sampled" : "threshold"));
+    fprintf(stream, "  debug id  %s\n", op->debug_id);
+    fprintf(stream, "     event  %llu\n", (unsigned long long)op->event_id);
+    fprintf(stream, "       kvs  %u\n", op->num_kvs);
+    fprintf(stream, "     bytes  %llu\n", (unsigned long long)op->num_bytes);
+    fprintf(stream, "   retries  %u\n", op->retries);
+    fprintf(stream, "     total  %12f ms\n", op->t_total);
+    fprintf(stream, "       grv  %12f ms\n", op->t_grv);
+    fprintf(stream, "      read  %12f ms (%u batches, max %f ms)\n",
+            op->t_read, op->read_batches, op->t_read_max);
+    fprintf(stream, "    commit  %12f ms\n", op->t_commit);
+  }
+
+  free((void *)records);
+}
+
+void fdb_slow_log_reset(void) {
+  pthread_mutex_lock(&slow_log_lock);
+  slow_log_count = 0;
+  slow_log_next = 0;
+  pthread_mutex_unlock(&slow_log_lock);
+}
+
+double slow_log_time_ms(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ((ts.tv_sec * 1000.0) + (ts.tv_nsec / 1000000.0));
+}
+
+bool slow_log_sample(void) {
+  double rate =
+      atomic_load_explicit(&slow_log_sample_rate, memory_order_relaxed);
+
+  if (rate <= 0.0)
+    return false;
+
+  // Lazily seed a per-thread xorshift generator, so that sampling never
+  // contends on the global rand() state
+  if (!slow_log_rng) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    slow_log_rng =
+        ((((uint64_t)ts.tv_nsec << 32) ^ (uintptr_t)&slow_log_rng) | 1);
+  }
+
+  slow_log_rng ^= (slow_log_rng << 13);
+  slow_log_rng ^= (slow_log_rng >> 7);
+  slow_log_rng ^= (slow_log_rng << 17);
+
+  return ((double)(slow_log_rng >> 11) / (double)(1ULL << 53)) < rate;
+}
@@ -0,0 +1,102 @@
+/// @file fdb_slow_log.h
+///
+/// Declarations for the slow-operation log, which records the phase breakdown
+/// of FoundationDB operations that exceed a latency threshold, plus a random
+/// sample of operations that don't.
+///
+/// Documentation links:
+///   https://apple.github.io/foundationdb/api-c.html#c.FDBTransactionOption
+///   https://apple.github.io/foundationdb/client-testing.html
+
+#pragma once
+
+#include <foundationdb/fdb_c.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#define SLOW_LOG_DEBUG_ID_LENGTH 48
+
+//==============================================================================
+// Types
+//==============================================================================
+
+typedef enum slow_op_type_t {
+  SLOW_OP_WRITE,
+  SLOW_OP_READ,
+  SLOW_OP_CLEAR,
+} SlowOpType;
+
+typedef struct slow_op_t {
+  SlowOpType type;    // Kind of operation.
+  bool enabled;       // Whether the log was enabled when the op began.
+  bool sampled;       // Whether the op was chosen by random sampling.
+  uint64_t event_id;  // First event touched by the operation.
+  uint32_t num_kvs;   // Number of key-value pairs written or read.
+  uint64_t num_bytes; // Number of key + value bytes written or read.
+  uint32_t retries;   // Number of times the transaction was retried.
+  uint32_t read_batches; // Number of range read batches.
+  double t_start;        // Monotonic start time (ms).
+  double t_grv;          // Time spent getting a read version (ms).
+  double t_read;         // Total time spent in range read batches (ms).
+  double t_read_max;     // Slowest single range read batch (ms).
+  double t_commit;       // Time spent committing (ms).
+  double t_total;        // Wall-clock time of the whole operation (ms).
+  char debug_id[SLOW_LOG_DEBUG_ID_LENGTH]; // FDB debug transaction identifier.
+} SlowOp;
+
+//==============================================================================
+// Prototypes
+//==============================================================================
+
+/// Configure the slow-operation log. Any previously recorded operations are
+/// discarded.
+///
+/// @param[in] threshold_ms  Operations at least this slow are always recorded.
+/// @param[in] sample_rate   Fraction [0, 1] of other operations to record.
+/// @param[in] capacity      Number of records to keep (0 disables the log).
+///
+/// @return  0  Success.
+/// @return -1  Failure.
+int fdb_slow_log_configure(double threshold_ms, double sample_rate,
+                           uint32_t capacity);
+
+/// Begin tracking an operation. If the log is enabled, the transaction is
+/// tagged with a debug identifier, and sampled transactions are additionally
+/// flagged for FoundationDB client transaction logging.
+///
+/// Must be called again whenever the transaction is reset, since FoundationDB
+/// discards transaction options on reset.
+///
+/// @param[in] op        Handle for the operation record to initialize.
+/// @param[in] type      Kind of operation.
+/// @param[in] event_id  First event touched by the operation.
+/// @param[in] tx        Transaction used by the operation (may be NULL).
+void fdb_slow_log_begin(SlowOp *op, SlowOpType type, uint64_t event_id,
+                        FDBTransaction *tx);
+
+/// Finish tracking an operation, and record it if it was slow or sampled.
+///
+/// @param[in] op  Handle for the operation record.
+void fdb_slow_log_end(SlowOp *op);
+
+/// Copy the most recent records out of the slow-operation log, newest first.
+///
+/// @param[in] out  Array to write records into.
+/// @param[in] max  Capacity of the output array.
+///
+/// @return  Number of records written.
+uint32_t fdb_slow_log_read(SlowOp *out, uint32_t max);
+
+/// Print every record in the slow-operation log, newest first.
+///
+/// @param[in] stream  Output stream.
+void fdb_slow_log_print(FILE *stream);
+
+/// Discard all records in the slow-operation log.
+void fdb_slow_log_reset(void);
+
+/// Read the monotonic clock.
+///
+/// @return  Current monotonic time in milliseconds.
+double slow_log_time_ms(void);
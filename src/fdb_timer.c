@@ -4,12 +4,17 @@
 
 #include <foundationdb/fdb_c.h>
 #include <math.h>
+#include <pthread.h>
+#include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <threads.h>
 #include <time.h>
 
+#include "event_batch.h"
 #include "fdb.h"
+#include "fdb_slow_log.h"
 #include "fdb_timer.h"
 
 //==============================================================================
@@ -18,6 +23,8 @@
 
 extern uint32_t fdb_batch_size;
 thread_local FDBTimer timer_sync = {(clock_t)INT_MAX, (clock_t)0, 0.0};
+uint32_t fdb_async_in_flight = ASYNC_DEFAULT_IN_FLIGHT;
+static BatchHistogram timer_batches;
 
 //==============================================================================
 // Prototypes
@@ -31,12 +38,26 @@ thread_local FDBTimer timer_sync = {(clock_t)INT_MAX, (clock_t)0, 0.0};
 void write_callback(FDBFuture *future, void *t_start);
 
 /// Callback function for when an asynchronous FoundationDB transaction is
-/// applied successfully.
+/// applied, successfully or not. Releases the transaction and its in-flight
+/// slot.
 ///
 /// @param[in] future  Handle for the FoundationDB future.
 /// @param[in] cbd     Handle for an FDBCallbackData object.
 void write_callback_async(FDBFuture *future, void *cbd);
 
+/// Wait for an in-flight slot, and take it.
+///
+/// @param[in] engine  Handle for the engine.
+void async_engine_acquire(AsyncEngine *engine);
+
+/// Return an in-flight slot, recording the outcome of its transaction.
+///
+/// @param[in] engine   Handle for the engine.
+/// @param[in] failed   Whether the transaction failed.
+/// @param[in] t_batch  Wall-clock time of the transaction in ms, if it didn't
+///                     fail.
+void async_engine_release(AsyncEngine *engine, bool failed, double t_batch);
+
 /// Callback function for when the FoundationDB database is cleared.
 ///
 /// @param[in] future    Handle for the FoundationDB future.
@@ -52,14 +73,6 @@ void clear_callback_async(FDBFuture *future, void *settings);
 /// Resets the global benchmark timer.
 void reset_timer(void);
 
-/// Count the number of total fragments in an array of fragmented events.
-///
-/// @param[in]  events      Pointer to the array of FragmentedEvent objects.
-/// @param[in]  num_events  Number of events in the array.
-///
-/// @return  Number of total fragments.
-uint32_t total_fragments(FragmentedEvent *events, uint32_t num_events);
-
 //==============================================================================
 // Functions
 //==============================================================================
@@ -99,11 +112,19 @@ tx_fail:
 
 int fdb_timed_write_event_array(FragmentedEvent *events, uint32_t num_events) {
   FDBTransaction *tx;
+  SlowOp op;
   clock_t *start_t;
+  double t_commit;
   uint32_t batch_filled = 0;
   uint32_t frag_pos = 0;
   uint32_t i = 0;
 
+  batch_histogram_reset(&timer_batches);
+
+  // Nothing to time, and no event to label the final batch with
+  if (!num_events)
+    return 0;
+
   // Initialize transaction
   if (fdb_check_error(fdb_setup_transaction(&tx)))
     goto tx_fail;
@@ -114,12 +135,20 @@ int fdb_timed_write_event_array(FragmentedEvent *events, uint32_t num_events) {
     // (method differs slightly depending on whether there are already other
     // fragments in the batch)
     if (!batch_filled) {
+      fdb_slow_log_begin(&op, SLOW_OP_WRITE, events[i].id, tx);
+
       batch_filled = add_event_set_transactions(tx, (events + i), frag_pos,
                                                 fdb_batch_size);
+      op.num_kvs += batch_filled;
+      if (op.enabled)
+        op.num_bytes += batch_bytes((events + i), frag_pos, batch_filled);
       frag_pos += batch_filled;
     } else {
       uint32_t num_kvp = add_event_set_transactions(
           tx, (events + i), frag_pos, (fdb_batch_size - batch_filled));
+      op.num_kvs += num_kvp;
+      if (op.enabled)
+        op.num_bytes += batch_bytes((events + i), frag_pos, num_kvp);
       batch_filled += num_kvp;
       frag_pos += num_kvp;
     }
@@ -136,21 +165,32 @@ int fdb_timed_write_event_array(FragmentedEvent *events, uint32_t num_events) {
       // Start timer just before committing transaction
       start_t = malloc(sizeof(clock_t));
       *start_t = clock();
+      t_commit = slow_log_time_ms();
 
       if (fdb_check_error(fdb_send_timed_transaction(
               tx, (FDBCallback)&write_callback, (void *)start_t)))
         goto tx_fail;
 
+      op.t_commit = (slow_log_time_ms() - t_commit);
+      batch_histogram_add(&timer_batches, op.t_commit);
+      fdb_slow_log_end(&op);
+
       batch_filled = 0;
     }
   }
 
   // Catch the final, non-full batch
+  if (!batch_filled)
+    fdb_slow_log_begin(&op, SLOW_OP_WRITE, events[num_events - 1].id, tx);
   start_t = malloc(sizeof(clock_t));
   *start_t = clock();
+  t_commit = slow_log_time_ms();
   if (fdb_check_error(fdb_send_timed_transaction(
           tx, (FDBCallback)&write_callback, (void *)start_t)))
     goto tx_fail;
+  op.t_commit = (slow_log_time_ms() - t_commit);
+  batch_histogram_add(&timer_batches, op.t_commit);
+  fdb_slow_log_end(&op);
 
   // Clean up the transaction
   fdb_transaction_destroy(tx);
@@ -163,110 +203,148 @@ tx_fail:
   return -1;
 }
 
+int fdb_set_async_in_flight(uint32_t max_in_flight) {
+  if (!max_in_flight)
+    return -1;
+
+  fdb_async_in_flight = max_in_flight;
+
+  // Success
+  return 0;
+}
+
 int fdb_timed_write_event_array_async(FragmentedEvent *events,
                                       uint32_t num_events) {
-  uint32_t i = 0;
-  uint32_t b = 0;
-  uint32_t batch_filled = 0;
-  uint32_t frag_pos = 0;
-  uint32_t total_frags = total_fragments(events, num_events);
-  uint32_t num_batches = (uint32_t)ceil(total_frags / fdb_batch_size);
-  uint32_t txs_processing = num_batches;
-  FDBTransaction *txs[num_batches];
-  FDBFuture *futures[num_batches];
-  clock_t *timers[num_batches];
-  FDBTimer timer = {(clock_t)INT_MAX, (clock_t)0, 0.0};
-  FDBCallbackData *cbd = malloc(sizeof(FDBCallbackData));
-  clock_t thread_start = clock();
-
-  for (uint32_t j = 0; j < num_batches; j++)
-    if (fdb_check_error(fdb_setup_transaction(&txs[j]))) {
-      printf("tx_fail\n");
-      goto tx_fail;
-    }
+  EventBatch batch;
+  BatchPlan plan;
+  AsyncEngine engine;
+  KeyArena keys;
+  uint32_t num_batches;
+  uint32_t num_failed;
+  double thread_start = slow_log_time_ms();
+  double thread_total;
+  int err = 0;
+
+  engine.max_in_flight = fdb_async_in_flight;
+  engine.in_flight = 0;
+  engine.num_failed = 0;
+  batch_histogram_reset(&engine.histogram);
+  if (pthread_mutex_init(&engine.mutex, NULL))
+    goto tx_fail;
+  if (pthread_cond_init(&engine.completed, NULL)) {
+    pthread_mutex_destroy(&engine.mutex);
+    goto tx_fail;
+  }
 
-  while (i < num_events) {
-    if (batch_filled == 0) {
-      batch_filled = add_event_set_transactions(txs[b], (events + i), frag_pos,
-                                                fdb_batch_size);
-      frag_pos += batch_filled;
-    } else {
-      uint32_t num_kvp = add_event_set_transactions(
-          txs[b], (events + i), frag_pos, (fdb_batch_size - batch_filled));
-      batch_filled += num_kvp;
-      frag_pos += num_kvp;
-    }
+  // Plan every transaction before building any of them
+  if (event_batch_from_fragmented(&batch, events, num_events))
+    goto engine_fail;
+  if (event_batch_plan(&batch, fdb_batch_size, &plan))
+    goto batch_fail;
 
-    if (frag_pos == events[i].num_fragments) {
-      i++;
-      frag_pos = 0;
-    }
+  // Writes copy their keys when added, so one arena serves every transaction
+  if (key_arena_init(&keys, fdb_batch_size))
+    goto plan_fail;
 
-    if (batch_filled == fdb_batch_size) {
-      cbd = malloc(sizeof(FDBCallbackData));
-      timers[b] = malloc(sizeof(clock_t));
-      *(timers[b]) = clock();
-      cbd->start_t = timers[b];
-      cbd->tx = txs[b];
-      cbd->txs_processing = &txs_processing;
-      cbd->timer = &timer;
-      cbd->num_events = num_events;
-      cbd->num_frags = total_frags;
-      cbd->batch_size = fdb_batch_size;
-
-      futures[b] = fdb_transaction_commit(txs[b]);
-      if (fdb_check_error(fdb_future_set_callback(
-              futures[b], (FDBCallback)&write_callback_async, (void *)cbd)))
-        goto tx_fail;
+  num_batches = plan.num_txs;
 
-      batch_filled = 0;
+  // Each planned transaction is built and committed independently, once one
+  // of the in-flight slots is free
+  for (uint32_t b = 0; b < num_batches; ++b) {
+    FDBCallbackData *cbd;
+    FDBTransaction *tx;
+    FDBFuture *future;
+    uint64_t bytes;
+
+    async_engine_acquire(&engine);
 
-      if (b < (num_batches - 1))
-        b++;
+    if (fdb_check_error(fdb_setup_transaction(&tx))) {
+      async_engine_release(&engine, true, 0.0);
+      err = -1;
+      break;
     }
-  }
 
-  if (b < (num_batches - 1)) {
-    cbd = malloc(sizeof(FDBCallbackData));
-    timers[b] = malloc(sizeof(clock_t));
-    *(timers[b]) = clock();
-    cbd->start_t = timers[b];
-    cbd->tx = txs[b];
-    cbd->txs_processing = &txs_processing;
-    cbd->timer = &timer;
-    cbd->num_events = num_events;
-    cbd->num_frags = total_frags;
-    cbd->batch_size = fdb_batch_size;
-
-    futures[b] = fdb_transaction_commit(txs[b]);
+    add_planned_set_transactions(tx, &batch, &plan, b, &keys, &bytes);
+
+    cbd = (FDBCallbackData *)malloc(sizeof(FDBCallbackData));
+    if (!cbd) {
+      fdb_transaction_destroy(tx);
+      async_engine_release(&engine, true, 0.0);
+      err = -1;
+      break;
+    }
+    cbd->engine = &engine;
+    cbd->tx = tx;
+    cbd->t_start = slow_log_time_ms();
+
+    // The callback may run on this thread, if the commit is already done
+    future = fdb_transaction_commit(tx);
     if (fdb_check_error(fdb_future_set_callback(
-            futures[b], (FDBCallback)&write_callback_async, (void *)cbd)))
-      goto tx_fail;
+            future, (FDBCallback)&write_callback_async, (void *)cbd))) {
+      fdb_future_destroy(future);
+      fdb_transaction_destroy(tx);
+      free((void *)cbd);
+      async_engine_release(&engine, true, 0.0);
+      err = -1;
+      break;
+    }
   }
 
-  while (0 != txs_processing) {
-    // Wait for all txs to finish
+  // Wait for every transaction to complete, without spinning
+  pthread_mutex_lock(&engine.mutex);
+  while (engine.in_flight)
+    pthread_cond_wait(&engine.completed, &engine.mutex);
+  num_failed = engine.num_failed;
+  pthread_mutex_unlock(&engine.mutex);
+
+  thread_total = (slow_log_time_ms() - thread_start);
+  timer_batches = engine.histogram;
+
+  key_arena_free(&keys);
+  batch_plan_free(&plan);
+  event_batch_free(&batch);
+  pthread_cond_destroy(&engine.completed);
+  pthread_mutex_destroy(&engine.mutex);
+
+  if (err || num_failed) {
+    fprintf(stderr, "%u of %u async batches failed\n", num_failed,
+            num_batches);
+    goto tx_fail;
   }
 
-  clock_t thread_end = clock();
-  double thread_total =
-      ((((double)(thread_end - thread_start)) / CLOCKS_PER_SEC) * 1000.0);
-
   // Print times
-  printf("    thread  %12f ms\n", (thread_total));
-  printf(" avg/event  %12f ms\n", (thread_total / num_events));
-  printf(" max batch  %12f ms\n", (1000.0 * timer.t_max / CLOCKS_PER_SEC));
-  printf(" avg batch  %12f ms\n", (thread_total / num_batches));
-  printf(" min batch  %12f ms\n", (1000.0 * timer.t_min / CLOCKS_PER_SEC));
+  printf(" in flight  %u\n", engine.max_in_flight);
+  printf("    thread  %12f ms\n", thread_total);
+  printf(" avg/event  %12f ms\n",
+         num_events ? (thread_total / num_events) : 0.0);
+  printf(" max batch  %12f ms\n", engine.histogram.t_max);
+  printf(" p99 batch  %12f ms\n",
+         batch_histogram_percentile(&engine.histogram, 99));
+  printf(" p50 batch  %12f ms\n",
+         batch_histogram_percentile(&engine.histogram, 50));
+  printf(" avg batch  %12f ms\n",
+         engine.histogram.num_batches
+             ? (engine.histogram.t_total / engine.histogram.num_batches)
+             : 0.0);
+  printf(" min batch  %12f ms\n", engine.histogram.t_min);
 
   // Success
   return 0;
 
 // Failure
+plan_fail:
+  batch_plan_free(&plan);
+batch_fail:
+  event_batch_free(&batch);
+engine_fail:
+  pthread_cond_destroy(&engine.completed);
+  pthread_mutex_destroy(&engine.mutex);
 tx_fail:
   return -1;
 }
 
+const BatchHistogram *fdb_timer_batches(void) { return &timer_batches; }
+
 int fdb_clear_timed_database(uint32_t num_events, uint32_t num_fragments) {
   BenchmarkSettings *settings = malloc(sizeof(BenchmarkSettings));
   FDBTransaction *tx;
@@ -359,29 +437,81 @@ void write_callback(FDBFuture *future, void *param) {
 
 void write_callback_async(FDBFuture *future, void *param) {
   FDBCallbackData *cbd = (FDBCallbackData *)param;
-
-  clock_t t_start = *(cbd->start_t);
-  clock_t t_end = clock();
-  clock_t t_diff = (t_end - t_start);
-  FDBTimer *timer = cbd->timer;
-  double total_time = 1000.0 * t_diff / CLOCKS_PER_SEC;
-  if (t_diff < timer->t_min) {
-    timer->t_min = t_diff;
-  }
-  if (t_diff > timer->t_max) {
-    timer->t_max = t_diff;
-  }
-  timer->t_total += total_time;
+  AsyncEngine *engine = cbd->engine;
+  double t_batch = (slow_log_time_ms() - cbd->t_start);
+  fdb_error_t err = fdb_future_get_error(future);
 
   fdb_future_destroy(future);
-  (*cbd->txs_processing)--;
   fdb_transaction_destroy(cbd->tx);
+  free(param);
+
+  async_engine_release(engine, (err != 0), t_batch);
+}
 
-  uint32_t txp = *(cbd->txs_processing);
-  if (txp != 0) { // don't free last tx's cbd
-    free(cbd->start_t);
-    free(cbd);
+void async_engine_acquire(AsyncEngine *engine) {
+  pthread_mutex_lock(&engine->mutex);
+  while (engine->in_flight >= engine->max_in_flight)
+    pthread_cond_wait(&engine->completed, &engine->mutex);
+  ++engine->in_flight;
+  pthread_mutex_unlock(&engine->mutex);
+}
+
+void async_engine_release(AsyncEngine *engine, bool failed, double t_batch) {
+  pthread_mutex_lock(&engine->mutex);
+  if (failed)
+    ++engine->num_failed;
+  else
+    batch_histogram_add(&engine->histogram, t_batch);
+  --engine->in_flight;
+
+  // Only the committing thread waits, for a slot or for the last transaction
+  pthread_cond_signal(&engine->completed);
+  pthread_mutex_unlock(&engine->mutex);
+}
+
+void batch_histogram_reset(BatchHistogram *histogram) {
+  memset(histogram, 0, sizeof(BatchHistogram));
+  histogram->t_min = INFINITY;
+}
+
+void batch_histogram_add(BatchHistogram *histogram, double t_batch) {
+  uint64_t t_us = (t_batch > 0) ? (uint64_t)(t_batch * 1000.0) : 0;
+  uint32_t bucket = 0;
+
+  while (((t_us >> 1) >> bucket) && (bucket < (BATCH_HISTOGRAM_BUCKETS - 1))) {
+    ++bucket;
+  }
+
+  ++histogram->buckets[bucket];
+  ++histogram->num_batches;
+  histogram->t_total += t_batch;
+  if (t_batch < histogram->t_min)
+    histogram->t_min = t_batch;
+  if (t_batch > histogram->t_max)
+    histogram->t_max = t_batch;
+}
+
+double batch_histogram_percentile(const BatchHistogram *histogram,
+                                  double percentile) {
+  double rank = ((percentile / 100) * (double)histogram->num_batches);
+  uint64_t seen = 0;
+
+  if (!histogram->num_batches)
+    return 0.0;
+
+  // The fastest and slowest batches bound every bucket's estimate
+  for (uint32_t i = 0; i < BATCH_HISTOGRAM_BUCKETS; ++i) {
+    seen += histogram->buckets[i];
+    if (seen && ((double)seen >= rank)) {
+      double bound = ((double)(((uint64_t)1 << (i + 1)) - 1) / 1000.0);
+
+      if (bound < histogram->t_min)
+        return histogram->t_min;
+      return (bound < histogram->t_max) ? bound : histogram->t_max;
+    }
   }
+
+  return histogram->t_max;
 }
 
 void clear_callback(FDBFuture *future, void *param) {
@@ -406,11 +536,3 @@ void reset_timer(void) {
   timer_sync.t_max = (clock_t)0;
   timer_sync.t_total = 0.0;
 }
-
-uint32_t total_fragments(FragmentedEvent *events, uint32_t num_events) {
-  uint32_t sum = 0;
-  for (uint32_t i = 0; i < num_events; i++) {
-    sum += events[i].num_fragments;
-  }
-  return sum;
-}
\ No newline at end of file
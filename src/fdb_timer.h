@@ -6,8 +6,17 @@
 
 #include <foundationdb/fdb_c.h>
 #include <limits.h>
+#include <pthread.h>
 #include <time.h>
 
+// Transactions the asynchronous write benchmark commits at once by default
+#define ASYNC_DEFAULT_IN_FLIGHT 64
+
+// Number of buckets in the batch time histogram. Bucket i counts batches of
+// [2^i, 2^(i+1)) microseconds, bucket 0 also counts those under 1 microsecond,
+// and the last bucket also counts any longer.
+#define BATCH_HISTOGRAM_BUCKETS 32
+
 //==============================================================================
 // Types
 //==============================================================================
@@ -24,14 +33,27 @@ typedef struct fdb_timer_t {
   double t_total;
 } FDBTimer;
 
+typedef struct batch_histogram_t {
+  uint64_t buckets[BATCH_HISTOGRAM_BUCKETS]; // Batches per time bucket.
+  uint64_t num_batches;                      // Number of batches recorded.
+  double t_min;                              // Fastest batch in ms.
+  double t_max;                              // Slowest batch in ms.
+  double t_total;                            // Sum of batch times in ms.
+} BatchHistogram;
+
+typedef struct async_engine_t {
+  pthread_mutex_t mutex;    // Guards the engine.
+  pthread_cond_t completed; // Signalled when a transaction completes.
+  uint32_t max_in_flight;   // Transactions committed at once.
+  uint32_t in_flight;       // Transactions committing.
+  uint32_t num_failed;      // Transactions which failed.
+  BatchHistogram histogram; // Wall-clock time of each transaction.
+} AsyncEngine;
+
 typedef struct fdb_callback_data_t {
-  clock_t *start_t;
-  FDBTransaction *tx;
-  uint32_t *txs_processing;
-  FDBTimer *timer;
-  uint32_t num_events;
-  uint32_t num_frags;
-  uint32_t batch_size;
+  AsyncEngine *engine; // The engine which committed the transaction.
+  FDBTransaction *tx;  // The transaction.
+  double t_start;      // Time of the commit in ms.
 } FDBCallbackData;
 
 //==============================================================================
@@ -60,7 +82,18 @@ int fdb_send_timed_transaction(FDBTransaction *tx,
 /// @return -1  Failure
 int fdb_timed_write_event_array(FragmentedEvent *events, uint32_t num_events);
 
+/// Set the maximum number of transactions the asynchronous write benchmark
+/// commits at once.
+///
+/// @param[in] max_in_flight  The new maximum (must be greater than 0).
+///
+/// @return  0  Success.
+/// @return -1  Failure.
+int fdb_set_async_in_flight(uint32_t max_in_flight);
+
 /// Asynchronously write an array of fragmented events and time the process.
+/// Transactions are committed without waiting for each other, up to the
+/// in-flight limit, and the wall-clock time of each is recorded.
 ///
 /// @param[in] events      Handle for the array of events to write.
 /// @param[in] num_events  Number of events in the array.
@@ -70,6 +103,32 @@ int fdb_timed_write_event_array(FragmentedEvent *events, uint32_t num_events);
 int fdb_timed_write_event_array_async(FragmentedEvent *events,
                                       uint32_t num_events);
 
+/// Empty a batch time histogram.
+///
+/// @param[in] histogram  Handle for the histogram.
+void batch_histogram_reset(BatchHistogram *histogram);
+
+/// Record the time of a batch.
+///
+/// @param[in] histogram  Handle for the histogram.
+/// @param[in] t_batch    The batch time in ms.
+void batch_histogram_add(BatchHistogram *histogram, double t_batch);
+
+/// Estimate a percentile of the batch times, as the upper bound of the bucket
+/// holding it.
+///
+/// @param[in] histogram   Handle for the histogram.
+/// @param[in] percentile  The percentile, between 0 and 100.
+///
+/// @return  The batch time in ms, or 0 without any batches.
+double batch_histogram_percentile(const BatchHistogram *histogram,
+                                  double percentile);
+
+/// Get the batch times of the last timed write, synchronous or asynchronous.
+///
+/// @return  Handle for the histogram of its batch times.
+const BatchHistogram *fdb_timer_batches(void);
+
 /// Clears the database after the synchronous write benchmark finishes.
 ///
 /// @param[in] num_events     The number of events configured in the benchmark.
@@ -104,6 +163,33 @@ int fdb_clear_timed_database_async(uint32_t num_events, uint32_t num_fragments);
 uint32_t add_event_set_transactions(FDBTransaction *tx, FragmentedEvent *event,
                                     uint32_t start_pos, uint32_t limit);
 
+/// Add the write operations for one planned transaction of an event batch to a
+/// FoundationDB transaction.
+///
+/// @param[in] tx         FDBTransaction handle.
+/// @param[in] batch      Handle for the planned event batch.
+/// @param[in] plan       Handle for the plan of the batch.
+/// @param[in] tx_index   Index of the planned transaction.
+/// @param[in] keys       Key arena for the transaction's keys (capacity of at
+///                       least batch_size keys).
+/// @param[in] bytes      Address to write the number of key + value bytes into.
+///
+/// @return  Number of event fragments added to transaction.
+uint32_t add_planned_set_transactions(FDBTransaction *tx,
+                                      const EventBatch *batch,
+                                      const BatchPlan *plan, uint32_t tx_index,
+                                      KeyArena *keys, uint64_t *bytes);
+
+/// Compute the number of key + value bytes in a batch of event fragments.
+///
+/// @param[in] event      FragmentedEvent handle.
+/// @param[in] start_pos  Position of the first fragment in the batch.
+/// @param[in] num_kvp    Number of fragments in the batch.
+///
+/// @return  Number of bytes written by the batch.
+uint64_t batch_bytes(FragmentedEvent *event, uint32_t start_pos,
+                     uint32_t num_kvp);
+
 /// Check if a FoundationDB API command returned an error. If so, print the
 /// error description and exit.
 ///
@@ -0,0 +1,437 @@
+/// @file fdb_write_buffer.c
+///
+/// Definitions for writes of chosen durability and the client-side write
+/// buffer.
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "event.h"
+#include "fdb.h"
+#include "fdb_write_buffer.h"
+#include "metrics.h"
+#include "placement.h"
+
+//==============================================================================
+// Types
+//==============================================================================
+
+typedef struct write_queue_t {
+  Event *events;           // Copies of the buffered events.
+  Durability *durability;  // Durability of each event.
+  uint32_t num_events;     // Number of events in the queue.
+  uint32_t capacity;       // Maximum number of events before growing.
+  uint64_t num_bytes;      // Bytes of event data in the queue.
+  struct timespec expires; // When the flush of the first event is due.
+} WriteQueue;
+
+//==============================================================================
+// Variables
+//==============================================================================
+
+static pthread_once_t buffer_once = PTHREAD_ONCE_INIT;
+static pthread_mutex_t buffer_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t buffer_changed;
+static pthread_t buffer_thread;
+
+static bool buffer_started = false;
+static bool buffer_stopping = false;
+static uint64_t buffer_capacity;
+static uint32_t buffer_deadline_ms;
+
+// Events waiting for the flusher, and bytes either waiting or being flushed
+static WriteQueue buffer_queue;
+static uint64_t buffer_bytes;
+
+// Flush requests are numbered, and served once every event queued before them
+// is flushed
+static uint64_t buffer_requests;
+static uint64_t buffer_served;
+
+// Whether a buffered write failed since the last flush
+static bool buffer_failed;
+
+//==============================================================================
+// Prototypes
+//==============================================================================
+
+/// Create the condition variable, which measures deadlines on the monotonic
+/// clock.
+void buffer_init(void);
+
+/// Commit the buffer, one batch of queued events at a time, until stopped.
+///
+/// @param[in] arg  Unused.
+///
+/// @return  NULL.
+void *buffer_flusher(void *arg);
+
+/// Check whether the flusher should take the queued events. The buffer lock
+/// must be held.
+///
+/// @return  Whether the queued events should be flushed.
+bool buffer_flush_due(void);
+
+/// Copy an event into the buffer, waiting for room if it is buffered and
+/// dropping it if it is fired and forgotten. Writes it durably when the
+/// buffer isn't started.
+///
+/// @param[in] event       Handle for the event to write.
+/// @param[in] durability  The durability of the write (not durable).
+///
+/// @return  0  Success.
+/// @return -1  Failure.
+int buffer_event(Event *event, Durability durability);
+
+/// Append an event to a queue, growing it if needed.
+///
+/// @param[in] queue       The queue.
+/// @param[in] event       The event, whose data is owned by the queue after.
+/// @param[in] durability  The durability of the write.
+///
+/// @return  0  Success.
+/// @return -1  Failure.
+int write_queue_push(WriteQueue *queue, Event *event, Durability durability);
+
+/// Release the memory of a queue and its events.
+///
+/// @param[in] queue  The queue.
+void write_queue_free(WriteQueue *queue);
+
+//==============================================================================
+// Functions
+//==============================================================================
+
+void buffer_init(void) {
+  pthread_condattr_t attr;
+
+  pthread_condattr_init(&attr);
+  pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+  pthread_cond_init(&buffer_changed, &attr);
+  pthread_condattr_destroy(&attr);
+}
+
+int fdb_start_write_buffer(uint64_t capacity, uint32_t deadline_ms) {
+  pthread_attr_t attr;
+  int err;
+
+  pthread_once(&buffer_once, buffer_init);
+
+  pthread_mutex_lock(&buffer_mutex);
+  if (buffer_started) {
+    pthread_mutex_unlock(&buffer_mutex);
+    return -1;
+  }
+
+  buffer_capacity = capacity ? capacity : WRITE_BUFFER_DEFAULT_BYTES;
+  buffer_deadline_ms =
+      deadline_ms ? deadline_ms : WRITE_BUFFER_DEFAULT_DEADLINE_MS;
+  memset(&buffer_queue, 0, sizeof(WriteQueue));
+  buffer_bytes = 0;
+  buffer_requests = 0;
+  buffer_served = 0;
+  buffer_failed = false;
+
+  err = placement_init_attr(THREAD_ROLE_WORKER, &attr);
+  if (!err) {
+    err = pthread_create(&buffer_thread, &attr, buffer_flusher, NULL);
+    pthread_attr_destroy(&attr);
+  }
+
+  if (err) {
+    pthread_mutex_unlock(&buffer_mutex);
+    return -1;
+  }
+
+  buffer_started = true;
+  pthread_mutex_unlock(&buffer_mutex);
+
+  // Success
+  return 0;
+}
+
+int fdb_stop_write_buffer(void) {
+  int err;
+
+  pthread_mutex_lock(&buffer_mutex);
+  if (!buffer_started || buffer_stopping) {
+    pthread_mutex_unlock(&buffer_mutex);
+    return -1;
+  }
+
+  // No events are queued from here on, and the flusher empties the queue
+  // before it exits
+  buffer_stopping = true;
+  pthread_cond_broadcast(&buffer_changed);
+  pthread_mutex_unlock(&buffer_mutex);
+
+  pthread_join(buffer_thread, NULL);
+
+  pthread_mutex_lock(&buffer_mutex);
+  err = buffer_failed ? -1 : 0;
+  write_queue_free(&buffer_queue);
+  buffer_started = false;
+  buffer_stopping = false;
+
+  // Flushes waiting on the stopped flusher have nothing left to wait for
+  buffer_served = buffer_requests;
+  pthread_cond_broadcast(&buffer_changed);
+  pthread_mutex_unlock(&buffer_mutex);
+
+  // Success or failure
+  return err;
+}
+
+bool fdb_write_buffer_started(void) {
+  bool started;
+
+  pthread_mutex_lock(&buffer_mutex);
+  started = (buffer_started && !buffer_stopping);
+  pthread_mutex_unlock(&buffer_mutex);
+
+  return started;
+}
+
+int fdb_write_event_durability(Event *event, Durability durability) {
+  if (durability == DURABILITY_DURABLE)
+    return fdb_write_event(event);
+
+  return buffer_event(event, durability);
+}
+
+int fdb_write_event_array_durability(Event *events, uint32_t num_events,
+                                     Durability durability) {
+  int err = 0;
+
+  if (durability == DURABILITY_DURABLE)
+    return fdb_write_event_array(events, num_events);
+
+  for (uint32_t i = 0; i < num_events; ++i) {
+    if (buffer_event((events + i), durability))
+      err = -1;
+  }
+
+  // Success or failure
+  return err;
+}
+
+int fdb_flush_writes(void) {
+  uint64_t request;
+  int err;
+
+  pthread_mutex_lock(&buffer_mutex);
+  if (!buffer_started) {
+    pthread_mutex_unlock(&buffer_mutex);
+    return 0;
+  }
+
+  request = ++buffer_requests;
+  pthread_cond_broadcast(&buffer_changed);
+  while (buffer_served < request)
+    pthread_cond_wait(&buffer_changed, &buffer_mutex);
+
+  // Failures are reported once, to the first flush after them
+  err = buffer_failed ? -1 : 0;
+  buffer_failed = false;
+  pthread_mutex_unlock(&buffer_mutex);
+
+  // Success or failure
+  return err;
+}
+
+void *buffer_flusher(void *arg) {
+  WriteQueue batch;
+
+  memset(&batch, 0, sizeof(WriteQueue));
+  pthread_mutex_lock(&buffer_mutex);
+
+  for (;;) {
+    WriteQueue queued;
+    uint64_t requests;
+    uint32_t num_failed = 0;
+    int err;
+
+    while (!buffer_flush_due()) {
+      // Requests made while nothing is queued are served at once
+      if (!buffer_queue.num_events && (buffer_served < buffer_requests)) {
+        buffer_served = buffer_requests;
+        pthread_cond_broadcast(&buffer_changed);
+        continue;
+      }
+
+      if (!buffer_queue.num_events && buffer_stopping)
+        break;
+
+      if (buffer_queue.num_events)
+        pthread_cond_timedwait(&buffer_changed, &buffer_mutex,
+                               &buffer_queue.expires);
+      else
+        pthread_cond_wait(&buffer_changed, &buffer_mutex);
+    }
+
+    if (!buffer_queue.num_events)
+      break;
+
+    // Take every queued event, leaving the flushed batch's arrays for new
+    // events, so that writers never wait on a commit for room to queue
+    queued = buffer_queue;
+    buffer_queue = batch;
+    batch = queued;
+    requests = buffer_requests;
+    pthread_mutex_unlock(&buffer_mutex);
+
+    err = fdb_write_event_array(batch.events, batch.num_events);
+    metrics_add(METRIC_BUFFER_FLUSHES, 1);
+
+    pthread_mutex_lock(&buffer_mutex);
+
+    // Which events of a failed batch were committed is unknown, so they all
+    // count as failed
+    if (err) {
+      for (uint32_t i = 0; i < batch.num_events; ++i) {
+        if (batch.durability[i] == DURABILITY_BUFFERED)
+          buffer_failed = true;
+      }
+      num_failed = batch.num_events;
+      metrics_add(METRIC_BUFFER_ERRORS, num_failed);
+    }
+    metrics_add(METRIC_BUFFER_EVENTS, (batch.num_events - num_failed));
+
+    for (uint32_t i = 0; i < batch.num_events; ++i) {
+      free_event(batch.events + i);
+    }
+    buffer_bytes -= batch.num_bytes;
+    batch.num_events = 0;
+    batch.num_bytes = 0;
+
+    if (buffer_served < requests)
+      buffer_served = requests;
+    pthread_cond_broadcast(&buffer_changed);
+  }
+
+  pthread_mutex_unlock(&buffer_mutex);
+  write_queue_free(&batch);
+
+  return NULL;
+}
+
+bool buffer_flush_due(void) {
+  struct timespec now;
+
+  if (!buffer_queue.num_events)
+    return false;
+
+  // Flush early for stops and flushes, and once half the buffer is queued, so
+  // that writers fill the other half while the batch commits
+  if (buffer_stopping || (buffer_served < buffer_requests) ||
+      ((2 * buffer_queue.num_bytes) >= buffer_capacity))
+    return true;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+
+  return ((now.tv_sec > buffer_queue.expires.tv_sec) ||
+          ((now.tv_sec == buffer_queue.expires.tv_sec) &&
+           (now.tv_nsec >= buffer_queue.expires.tv_nsec)));
+}
+
+int buffer_event(Event *event, Durability durability) {
+  Event copy;
+
+  copy.id = event->id;
+  copy.data_length = event->data_length;
+  copy.data = alloc_event_data(event->data_length);
+  if (!copy.data)
+    return -1;
+  memcpy(copy.data, event->data, event->data_length);
+
+  pthread_mutex_lock(&buffer_mutex);
+
+  // Events larger than the whole buffer are let in once it is empty
+  while (buffer_started && !buffer_stopping && buffer_bytes &&
+         ((buffer_bytes + copy.data_length) > buffer_capacity)) {
+    if (durability == DURABILITY_FIRE_AND_FORGET) {
+      pthread_mutex_unlock(&buffer_mutex);
+      free_event(&copy);
+      metrics_add(METRIC_BUFFER_DROPPED, 1);
+      return 0;
+    }
+
+    pthread_cond_wait(&buffer_changed, &buffer_mutex);
+  }
+
+  if (!buffer_started || buffer_stopping) {
+    pthread_mutex_unlock(&buffer_mutex);
+    free_event(&copy);
+    return fdb_write_event(event);
+  }
+
+  if (write_queue_push(&buffer_queue, &copy, durability)) {
+    pthread_mutex_unlock(&buffer_mutex);
+    free_event(&copy);
+    return -1;
+  }
+  buffer_bytes += copy.data_length;
+
+  // The first event starts the deadline, and reaching half the buffer cuts it
+  // short
+  if (buffer_queue.num_events == 1) {
+    clock_gettime(CLOCK_MONOTONIC, &buffer_queue.expires);
+    buffer_queue.expires.tv_sec += (buffer_deadline_ms / 1000);
+    buffer_queue.expires.tv_nsec += ((buffer_deadline_ms % 1000) * 1000000L);
+    if (buffer_queue.expires.tv_nsec >= 1000000000L) {
+      ++buffer_queue.expires.tv_sec;
+      buffer_queue.expires.tv_nsec -= 1000000000L;
+    }
+    pthread_cond_broadcast(&buffer_changed);
+  } else if ((2 * buffer_queue.num_bytes) >= buffer_capacity) {
+    pthread_cond_broadcast(&buffer_changed);
+  }
+
+  pthread_mutex_unlock(&buffer_mutex);
+
+  // Success
+  return 0;
+}
+
+int write_queue_push(WriteQueue *queue, Event *event, Durability durability) {
+  if (queue->num_events == queue->capacity) {
+    uint32_t capacity = queue->capacity ? (2 * queue->capacity) : 64;
+    Event *events = realloc(queue->events, (sizeof(Event) * capacity));
+    Durability *levels;
+
+    if (!events)
+      return -1;
+    queue->events = events;
+
+    levels = realloc(queue->durability, (sizeof(Durability) * capacity));
+    if (!levels)
+      return -1;
+    queue->durability = levels;
+
+    queue->capacity = capacity;
+  }
+
+  queue->events[queue->num_events] = *event;
+  queue->durability[queue->num_events] = durability;
+  ++queue->num_events;
+  queue->num_bytes += event->data_length;
+
+  // Success
+  return 0;
+}
+
+void write_queue_free(WriteQueue *queue) {
+  for (uint32_t i = 0; i < queue->num_events; ++i) {
+    free_event(queue->events + i);
+  }
+
+  free((void *)queue->events);
+  free((void *)queue->durability);
+  memset(queue, 0, sizeof(WriteQueue));
+}
@@ -0,0 +1,92 @@
+/// @file fdb_write_buffer.h
+///
+/// Declarations for writes of chosen durability, and the client-side buffer
+/// which batches the writes that don't wait for their commit.
+///
+/// Durable writes block until their transaction commits, like every other
+/// write function. Buffered writes return once their events are copied into a
+/// bounded buffer, blocking only while it is full, and fire-and-forget writes
+/// never block, dropping their events when it is full. A flusher thread
+/// commits the buffer with fdb_write_event_array() once it is half full or
+/// its oldest event has waited for the deadline, so writes from every thread
+/// share transactions of the configured batch size.
+///
+/// Buffered writes which fail are reported by the next fdb_flush_writes(), as
+/// fsync() reports failed writes to files. Fire-and-forget writes are only
+/// counted, in METRIC_BUFFER_ERRORS and METRIC_BUFFER_DROPPED. Without a
+/// started buffer, every write is durable.
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "event.h"
+
+// Buffer capacity and flush deadline used when none are given
+#define WRITE_BUFFER_DEFAULT_BYTES (64 * 1024 * 1024)
+#define WRITE_BUFFER_DEFAULT_DEADLINE_MS 10
+
+//==============================================================================
+// Types
+//==============================================================================
+
+typedef enum durability_t {
+  DURABILITY_DURABLE,         // Return once the write is committed.
+  DURABILITY_BUFFERED,        // Return once the write is buffered; failures
+                              // are reported by fdb_flush_writes().
+  DURABILITY_FIRE_AND_FORGET, // Return at once; failures are only counted.
+} Durability;
+
+//==============================================================================
+// Prototypes
+//==============================================================================
+
+/// Start the write buffer and its flusher thread.
+///
+/// @param[in] capacity     Maximum bytes of event data buffered or being
+///                         flushed, or 0 for WRITE_BUFFER_DEFAULT_BYTES.
+/// @param[in] deadline_ms  Maximum time an event waits before its flush
+///                         starts, or 0 for WRITE_BUFFER_DEFAULT_DEADLINE_MS.
+///
+/// @return  0  Success.
+/// @return -1  Failure (including a buffer already started).
+int fdb_start_write_buffer(uint64_t capacity, uint32_t deadline_ms);
+
+/// Flush the write buffer and stop its flusher thread.
+///
+/// @return  0  Success.
+/// @return -1  Failure (a buffered write failed since the last flush).
+int fdb_stop_write_buffer(void);
+
+/// Check whether the write buffer is started.
+///
+/// @return  Whether the write buffer is started.
+bool fdb_write_buffer_started(void);
+
+/// Write an event with a chosen durability.
+///
+/// @param[in] event       Handle for the event to write.
+/// @param[in] durability  The durability of the write.
+///
+/// @return  0  Success.
+/// @return -1  Failure.
+int fdb_write_event_durability(Event *event, Durability durability);
+
+/// Write an array of events with a chosen durability. Events which aren't
+/// durable are copied, so the array may be released as soon as this returns.
+///
+/// @param[in] events      Handle for the array of events to write.
+/// @param[in] num_events  Number of events in the array.
+/// @param[in] durability  The durability of the writes.
+///
+/// @return  0  Success.
+/// @return -1  Failure.
+int fdb_write_event_array_durability(Event *events, uint32_t num_events,
+                                     Durability durability);
+
+/// Wait until every event buffered so far is committed, or has failed.
+///
+/// @return  0  Success.
+/// @return -1  Failure (a buffered write failed since the last flush).
+int fdb_flush_writes(void);
@@ -0,0 +1,69 @@
+/// @file metrics.c
+///
+/// Definitions for process-wide counters.
+
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "metrics.h"
+
+//==============================================================================
+// Variables
+//==============================================================================
+
+static atomic_uint_fast64_t metrics[NUM_METRICS];
+
+static const char *metric_names[NUM_METRICS] = {
+    [METRIC_SCRUB_PASSES] = "scrub passes",
+    [METRIC_SCRUB_EVENTS] = "scrub events",
+    [METRIC_SCRUB_BYTES] = "scrub bytes",
+    [METRIC_SCRUB_ANOMALIES] = "scrub anomalies",
+    [METRIC_SCRUB_ERRORS] = "scrub errors",
+    [METRIC_READ_ROLLOVERS] = "read rollovers",
+    [METRIC_READ_RETRIES] = "read retries",
+    [METRIC_READ_JOINED] = "joined reads",
+    [METRIC_CACHE_HITS] = "cache hits",
+    [METRIC_CACHE_MISSES] = "cache misses",
+    [METRIC_CACHE_EVICTIONS] = "cache evictions",
+    [METRIC_LAZY_FAULTS] = "lazy faults",
+    [METRIC_LAZY_BYTES] = "lazy bytes",
+    [METRIC_LAZY_ERRORS] = "lazy errors",
+    [METRIC_BUFFER_FLUSHES] = "buffer flushes",
+    [METRIC_BUFFER_EVENTS] = "buffered events",
+    [METRIC_BUFFER_ERRORS] = "buffer errors",
+    [METRIC_BUFFER_DROPPED] = "buffer drops",
+    [METRIC_SCHEDULER_BATCHES] = "scheduler batches",
+    [METRIC_SCHEDULER_THROTTLES] = "tenant throttles",
+    [METRIC_WRITE_RETRIES] = "write retries",
+    [METRIC_FAULT_ERRORS] = "injected errors",
+    [METRIC_FAULT_SPIKES] = "injected spikes",
+};
+
+//==============================================================================
+// Functions
+//==============================================================================
+
+void metrics_add(Metric metric, uint64_t value) {
+  atomic_fetch_add_explicit(&metrics[metric], value, memory_order_relaxed);
+}
+
+uint64_t metrics_get(Metric metric) {
+  return atomic_load_explicit(&metrics[metric], memory_order_relaxed);
+}
+
+void metrics_reset(void) {
+  for (uint32_t i = 0; i < NUM_METRICS; ++i) {
+    atomic_store_explicit(&metrics[i], 0, memory_order_relaxed);
+  }
+}
+
+void metrics_print(FILE *stream) {
+  for (uint32_t i = 0; i < NUM_METRICS; ++i) {
+    uint64_t value = metrics_get((Metric)i);
+
+    if (value)
+      fprintf(stream, "%20s  %llu\n", metric_names[i],
+              (unsigned long long)value);
+  }
+}
@@ -0,0 +1,65 @@
+/// @file metrics.h
+///
+/// Process-wide counters exposing the health and throughput of background and
+/// asynchronous Seguro operations, which have no caller to return errors to.
+
+#pragma once
+
+#include <stdint.h>
+#include <stdio.h>
+
+//==============================================================================
+// Types
+//==============================================================================
+
+typedef enum metric_t {
+  METRIC_SCRUB_PASSES,         // Completed scrubber passes over the log.
+  METRIC_SCRUB_EVENTS,         // Events verified by the scrubber.
+  METRIC_SCRUB_BYTES,          // Key + value bytes read by the scrubber.
+  METRIC_SCRUB_ANOMALIES,      // Anomalies found by the scrubber.
+  METRIC_SCRUB_ERRORS,         // Failed scrubber batches.
+  METRIC_READ_ROLLOVERS,       // Reads moved to a fresh transaction on expiry.
+  METRIC_READ_RETRIES,         // Reads retried after a retryable error.
+  METRIC_READ_JOINED,          // Reads which joined a read already in flight.
+  METRIC_CACHE_HITS,           // Events found in the shared-memory cache.
+  METRIC_CACHE_MISSES,         // Events missing from the shared-memory cache.
+  METRIC_CACHE_EVICTIONS,      // Events evicted from the shared-memory cache.
+  METRIC_LAZY_FAULTS,          // Page faults served for lazily read events.
+  METRIC_LAZY_BYTES,           // Bytes filled into lazily read events.
+  METRIC_LAZY_ERRORS,          // Failed fills of lazily read events.
+  METRIC_BUFFER_FLUSHES,       // Batches committed by the write buffer.
+  METRIC_BUFFER_EVENTS,        // Buffered events committed.
+  METRIC_BUFFER_ERRORS,        // Buffered events whose commit failed.
+  METRIC_BUFFER_DROPPED,       // Fire-and-forget events dropped when full.
+  METRIC_SCHEDULER_BATCHES,    // Batches committed by the tenant scheduler.
+  METRIC_SCHEDULER_THROTTLES,  // Tenant visits skipped for a rate limit.
+  METRIC_WRITE_RETRIES,        // Commits retried after a retryable error.
+  METRIC_FAULT_ERRORS,         // Errors injected into commits and reads.
+  METRIC_FAULT_SPIKES,         // Latency spikes injected.
+  NUM_METRICS,
+} Metric;
+
+//==============================================================================
+// Prototypes
+//==============================================================================
+
+/// Add to a counter.
+///
+/// @param[in] metric  The counter.
+/// @param[in] value   The amount to add.
+void metrics_add(Metric metric, uint64_t value);
+
+/// Read a counter.
+///
+/// @param[in] metric  The counter.
+///
+/// @return  The current value of the counter.
+uint64_t metrics_get(Metric metric);
+
+/// Reset all counters to zero.
+void metrics_reset(void);
+
+/// Print all non-zero counters.
+///
+/// @param[in] stream  Output stream.
+void metrics_print(FILE *stream);
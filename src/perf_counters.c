@@ -0,0 +1,208 @@
+/// @file perf_counters.c
+///
+/// Definitions for hardware and software performance counters.
+
+#define _GNU_SOURCE
+
+#include <dirent.h>
+#include <linux/perf_event.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "perf_counters.h"
+
+//==============================================================================
+// Variables
+//==============================================================================
+
+// Type and configuration of each counter
+static const uint32_t perf_types[NUM_PERF_COUNTERS] = {
+    [PERF_CYCLES] = PERF_TYPE_HARDWARE,
+    [PERF_INSTRUCTIONS] = PERF_TYPE_HARDWARE,
+    [PERF_LLC_MISSES] = PERF_TYPE_HARDWARE,
+    [PERF_BRANCH_MISSES] = PERF_TYPE_HARDWARE,
+    [PERF_CONTEXT_SWITCHES] = PERF_TYPE_SOFTWARE,
+    [PERF_PAGE_FAULTS] = PERF_TYPE_SOFTWARE,
+};
+
+static const uint64_t perf_configs[NUM_PERF_COUNTERS] = {
+    [PERF_CYCLES] = PERF_COUNT_HW_CPU_CYCLES,
+    [PERF_INSTRUCTIONS] = PERF_COUNT_HW_INSTRUCTIONS,
+    [PERF_LLC_MISSES] = PERF_COUNT_HW_CACHE_MISSES,
+    [PERF_BRANCH_MISSES] = PERF_COUNT_HW_BRANCH_MISSES,
+    [PERF_CONTEXT_SWITCHES] = PERF_COUNT_SW_CONTEXT_SWITCHES,
+    [PERF_PAGE_FAULTS] = PERF_COUNT_SW_PAGE_FAULTS,
+};
+
+// Report labels, in the width of the benchmark's other lines
+static const char *perf_names[NUM_PERF_COUNTERS] = {
+    [PERF_CYCLES] = "cycles",
+    [PERF_INSTRUCTIONS] = "instrs",
+    [PERF_LLC_MISSES] = "llc misses",
+    [PERF_BRANCH_MISSES] = "br misses",
+    [PERF_CONTEXT_SWITCHES] = "ctx switch",
+    [PERF_PAGE_FAULTS] = "faults",
+};
+
+//==============================================================================
+// Prototypes
+//==============================================================================
+
+/// Open one counter for one thread, counting user space only if the kernel
+/// doesn't allow counting it as well.
+///
+/// @param[in] counter  The counter.
+/// @param[in] tid      The thread id.
+///
+/// @return  The counter's file descriptor, or -1 on failure.
+int perf_counter_open(PerfCounter counter, pid_t tid);
+
+//==============================================================================
+// Functions
+//==============================================================================
+
+int perf_counters_open(PerfCounters *counters) {
+  DIR *tasks;
+  struct dirent *task;
+  bool any = false;
+
+  memset(counters, 0, sizeof(PerfCounters));
+
+  tasks = opendir("/proc/self/task");
+  if (!tasks)
+    return -1;
+
+  while ((task = readdir(tasks)) &&
+         (counters->num_threads < PERF_MAX_THREADS)) {
+    pid_t tid = (pid_t)atoi(task->d_name);
+    int *fds = counters->fds[counters->num_threads];
+
+    if (tid <= 0)
+      continue;
+
+    for (uint32_t i = 0; i < NUM_PERF_COUNTERS; ++i) {
+      fds[i] = perf_counter_open((PerfCounter)i, tid);
+      if (fds[i] >= 0) {
+        counters->available[i] = true;
+        any = true;
+      }
+    }
+    ++counters->num_threads;
+  }
+  closedir(tasks);
+
+  if (!any) {
+    perf_counters_close(counters);
+    return -1;
+  }
+
+  // Success
+  return 0;
+}
+
+void perf_counters_close(PerfCounters *counters) {
+  for (uint32_t t = 0; t < counters->num_threads; ++t) {
+    for (uint32_t i = 0; i < NUM_PERF_COUNTERS; ++i) {
+      if (counters->fds[t][i] >= 0)
+        close(counters->fds[t][i]);
+    }
+  }
+
+  memset(counters, 0, sizeof(PerfCounters));
+}
+
+void perf_counters_start(PerfCounters *counters) {
+  for (uint32_t t = 0; t < counters->num_threads; ++t) {
+    for (uint32_t i = 0; i < NUM_PERF_COUNTERS; ++i) {
+      if (counters->fds[t][i] >= 0) {
+        ioctl(counters->fds[t][i], PERF_EVENT_IOC_RESET, 0);
+        ioctl(counters->fds[t][i], PERF_EVENT_IOC_ENABLE, 0);
+      }
+    }
+  }
+}
+
+void perf_counters_stop(PerfCounters *counters) {
+  memset(counters->values, 0, sizeof(counters->values));
+
+  for (uint32_t t = 0; t < counters->num_threads; ++t) {
+    for (uint32_t i = 0; i < NUM_PERF_COUNTERS; ++i) {
+      // The count, time enabled and time running
+      uint64_t read_values[3];
+
+      if (counters->fds[t][i] < 0)
+        continue;
+
+      ioctl(counters->fds[t][i], PERF_EVENT_IOC_DISABLE, 0);
+      if (read(counters->fds[t][i], read_values, sizeof(read_values)) ==
+          (ssize_t)sizeof(read_values))
+        counters->values[i] += perf_counter_scale(
+            read_values[0], read_values[1], read_values[2]);
+    }
+  }
+}
+
+void perf_counters_print(const PerfCounters *counters, FILE *stream,
+                         uint64_t num_events, uint64_t num_bytes) {
+  double kbs = ((double)num_bytes / 1024.0);
+
+  for (uint32_t i = 0; i < NUM_PERF_COUNTERS; ++i) {
+    if (!counters->available[i])
+      continue;
+
+    fprintf(stream, "%10s  %12.1f /event  %12.1f /KB\n", perf_names[i],
+            (num_events ? ((double)counters->values[i] / num_events) : 0.0),
+            ((kbs > 0) ? ((double)counters->values[i] / kbs) : 0.0));
+  }
+
+  // Instructions per cycle tells compute-bound phases from stalled ones
+  if (counters->available[PERF_CYCLES] &&
+      counters->available[PERF_INSTRUCTIONS] && counters->values[PERF_CYCLES])
+    fprintf(stream, "%10s  %12.2f\n", "ipc",
+            ((double)counters->values[PERF_INSTRUCTIONS] /
+             (double)counters->values[PERF_CYCLES]));
+}
+
+uint64_t perf_counter_scale(uint64_t value, uint64_t enabled,
+                            uint64_t running) {
+  if (!running)
+    return 0;
+  if (running >= enabled)
+    return value;
+
+  return (uint64_t)((double)value * ((double)enabled / (double)running));
+}
+
+int perf_counter_open(PerfCounter counter, pid_t tid) {
+  struct perf_event_attr attr;
+  int fd;
+
+  memset(&attr, 0, sizeof(struct perf_event_attr));
+  attr.size = sizeof(struct perf_event_attr);
+  attr.type = perf_types[counter];
+  attr.config = perf_configs[counter];
+  attr.disabled = 1;
+  attr.inherit = 1;
+  attr.exclude_hv = 1;
+  attr.read_format =
+      (PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING);
+
+  fd = (int)syscall(SYS_perf_event_open, &attr, tid, -1, -1,
+                    PERF_FLAG_FD_CLOEXEC);
+  if (fd >= 0)
+    return fd;
+
+  // With perf_event_paranoid at 2, unprivileged users may only count user
+  // space
+  attr.exclude_kernel = 1;
+
+  return (int)syscall(SYS_perf_event_open, &attr, tid, -1, -1,
+                      PERF_FLAG_FD_CLOEXEC);
+}
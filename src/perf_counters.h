@@ -0,0 +1,94 @@
+/// @file perf_counters.h
+///
+/// Declarations for hardware and software performance counters, read with
+/// perf_event_open(2) around phases of the benchmarks, so that their times can
+/// be attributed to instructions, cache misses, branch misses, context
+/// switches or page faults.
+///
+/// Counters are opened for every thread of the process at the time, including
+/// the FoundationDB network thread, and inherited by threads created after.
+/// Counters the kernel or hypervisor doesn't provide (e.g. hardware counters
+/// in most virtual machines, or any with perf_event_paranoid at 3) are left
+/// out of the report. Counters multiplexed onto too few hardware registers are
+/// scaled up by the time they were enabled over the time they ran.
+///
+/// Documentation links:
+///   https://man7.org/linux/man-pages/man2/perf_event_open.2.html
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+// Maximum number of threads counted
+#define PERF_MAX_THREADS 64
+
+//==============================================================================
+// Types
+//==============================================================================
+
+typedef enum perf_counter_t {
+  PERF_CYCLES,           // CPU cycles.
+  PERF_INSTRUCTIONS,     // Instructions retired.
+  PERF_LLC_MISSES,       // Last-level cache misses.
+  PERF_BRANCH_MISSES,    // Mispredicted branches.
+  PERF_CONTEXT_SWITCHES, // Context switches.
+  PERF_PAGE_FAULTS,      // Page faults.
+  NUM_PERF_COUNTERS,
+} PerfCounter;
+
+typedef struct perf_counters_t {
+  int fds[PERF_MAX_THREADS][NUM_PERF_COUNTERS]; // Counter of each thread, or
+                                                // -1.
+  uint32_t num_threads;                         // Number of threads counted.
+  bool available[NUM_PERF_COUNTERS];            // Whether each counter opened.
+  uint64_t values[NUM_PERF_COUNTERS];           // Counts of the last phase.
+} PerfCounters;
+
+//==============================================================================
+// Prototypes
+//==============================================================================
+
+/// Open the counters for every thread of the process.
+///
+/// @param[in] counters  Handle for the counters.
+///
+/// @return  0  Success.
+/// @return -1  Failure (no counter is available).
+int perf_counters_open(PerfCounters *counters);
+
+/// Close the counters.
+///
+/// @param[in] counters  Handle for the counters.
+void perf_counters_close(PerfCounters *counters);
+
+/// Reset the counters and start counting a phase.
+///
+/// @param[in] counters  Handle for the counters.
+void perf_counters_start(PerfCounters *counters);
+
+/// Stop counting a phase, and read its counts into the values.
+///
+/// @param[in] counters  Handle for the counters.
+void perf_counters_stop(PerfCounters *counters);
+
+/// Print the available counts of the last phase, per event and per KB of
+/// event data.
+///
+/// @param[in] counters    Handle for the counters.
+/// @param[in] stream      Output stream.
+/// @param[in] num_events  Number of events processed by the phase.
+/// @param[in] num_bytes   Number of event data bytes processed by the phase.
+void perf_counters_print(const PerfCounters *counters, FILE *stream,
+                         uint64_t num_events, uint64_t num_bytes);
+
+/// Scale a count up from the time a counter ran to the time it was enabled.
+///
+/// @param[in] value    The count.
+/// @param[in] enabled  Time the counter was enabled in ns.
+/// @param[in] running  Time the counter was running in ns.
+///
+/// @return  The scaled count, or 0 if the counter never ran.
+uint64_t perf_counter_scale(uint64_t value, uint64_t enabled,
+                            uint64_t running);
@@ -0,0 +1,172 @@
+/// @file placement.c
+///
+/// Definitions for functions which place Seguro threads and their memory on
+/// particular CPUs.
+
+#define _GNU_SOURCE
+
+#include <linux/mempolicy.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "placement.h"
+
+//==============================================================================
+// Variables
+//==============================================================================
+
+static CpuList placement_cpus[NUM_THREAD_ROLES];
+static bool placement_pinned[NUM_THREAD_ROLES];
+
+//==============================================================================
+// Prototypes
+//==============================================================================
+
+/// Convert a CPU list into a cpu_set_t.
+///
+/// @param[in] cpus  The CPU list.
+/// @param[in] set   Handle for the CPU set to write into.
+void placement_to_cpu_set(const CpuList *cpus, cpu_set_t *set);
+
+//==============================================================================
+// Functions
+//==============================================================================
+
+int placement_parse_cpus(const char *str, CpuList *cpus) {
+  const char *pos = str;
+  int count = 0;
+
+  memset(cpus, 0, sizeof(CpuList));
+
+  while (*pos) {
+    char *end;
+    unsigned long first = strtoul(pos, &end, 10);
+    unsigned long last = first;
+
+    if (end == pos)
+      return -1;
+    pos = end;
+
+    if (*pos == '-') {
+      ++pos;
+      last = strtoul(pos, &end, 10);
+      if ((end == pos) || (last < first))
+        return -1;
+      pos = end;
+    }
+
+    if (last >= PLACEMENT_MAX_CPUS)
+      return -1;
+
+    for (unsigned long cpu = first; cpu <= last; ++cpu) {
+      if (!(cpus->mask[(cpu / 64)] & (1ULL << (cpu % 64)))) {
+        cpus->mask[(cpu / 64)] |= (1ULL << (cpu % 64));
+        ++count;
+      }
+    }
+
+    if (*pos == ',')
+      ++pos;
+    else if (*pos)
+      return -1;
+  }
+
+  return count;
+}
+
+int placement_set_cpus(ThreadRole role, const char *cpu_list) {
+  CpuList cpus;
+
+  if (!cpu_list || !*cpu_list) {
+    placement_pinned[role] = false;
+    return 0;
+  }
+
+  if (placement_parse_cpus(cpu_list, &cpus) < 1)
+    return -1;
+
+  placement_cpus[role] = cpus;
+  placement_pinned[role] = true;
+
+  // Success
+  return 0;
+}
+
+int placement_init_attr(ThreadRole role, pthread_attr_t *attr) {
+  cpu_set_t set;
+
+  if (pthread_attr_init(attr))
+    return -1;
+
+  if (!placement_pinned[role])
+    return 0;
+
+  placement_to_cpu_set((placement_cpus + role), &set);
+  if (pthread_attr_setaffinity_np(attr, sizeof(cpu_set_t), &set)) {
+    pthread_attr_destroy(attr);
+    return -1;
+  }
+
+  // Success
+  return 0;
+}
+
+int placement_apply(ThreadRole role) {
+  cpu_set_t set;
+
+  if (!placement_pinned[role])
+    return 0;
+
+  placement_to_cpu_set((placement_cpus + role), &set);
+  if (pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &set))
+    return -1;
+
+  // Success
+  return 0;
+}
+
+void *placement_alloc_local(size_t size) {
+  long page_size = sysconf(_SC_PAGESIZE);
+  uint8_t *ptr;
+
+  ptr = mmap(NULL, size, (PROT_READ | PROT_WRITE),
+             (MAP_PRIVATE | MAP_ANONYMOUS), -1, 0);
+  if (ptr == MAP_FAILED)
+    return NULL;
+
+  placement_bind_local(ptr, size);
+
+  // Fault every page in from this thread, so that the pages are placed now
+  // rather than by whichever thread happens to touch them first
+  for (size_t i = 0; i < size; i += page_size) {
+    ptr[i] = 0;
+  }
+
+  return ptr;
+}
+
+void placement_bind_local(void *ptr, size_t size) {
+  syscall(SYS_mbind, ptr, size, MPOL_LOCAL, NULL, 0, 0);
+}
+
+void placement_free_local(void *ptr, size_t size) {
+  if (ptr)
+    munmap(ptr, size);
+}
+
+void placement_to_cpu_set(const CpuList *cpus, cpu_set_t *set) {
+  CPU_ZERO(set);
+  for (uint32_t cpu = 0; (cpu < PLACEMENT_MAX_CPUS) && (cpu < CPU_SETSIZE);
+       ++cpu) {
+    if (cpus->mask[(cpu / 64)] & (1ULL << (cpu % 64)))
+      CPU_SET(cpu, set);
+  }
+}
@@ -0,0 +1,99 @@
+/// @file placement.h
+///
+/// Declarations for functions which place Seguro threads and their memory on
+/// particular CPUs, so that the FoundationDB network thread and Seguro's own
+/// threads don't float between cores and sockets alongside the host process.
+///
+/// Documentation links:
+///   https://man7.org/linux/man-pages/man3/pthread_attr_setaffinity_np.3.html
+///   https://www.kernel.org/doc/html/latest/admin-guide/mm/numa_memory_policy.html
+
+#pragma once
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define PLACEMENT_MAX_CPUS 1024
+
+//==============================================================================
+// Types
+//==============================================================================
+
+typedef enum thread_role_t {
+  THREAD_ROLE_NETWORK, // FoundationDB network thread (runs callbacks).
+  THREAD_ROLE_WORKER,  // Threads which build and submit transactions, and wait
+                       // on their futures.
+  NUM_THREAD_ROLES,
+} ThreadRole;
+
+typedef struct cpu_list_t {
+  uint64_t mask[(PLACEMENT_MAX_CPUS / 64)]; // Bit i set if CPU i is included.
+} CpuList;
+
+//==============================================================================
+// Prototypes
+//==============================================================================
+
+/// Parse a CPU list, e.g. "0-3,8,10-11".
+///
+/// @param[in] str   The string to parse.
+/// @param[in] cpus  Handle for the CPU list to write into.
+///
+/// @return  Number of CPUs in the list.
+/// @return -1  Failure (malformed list or CPU out of range).
+int placement_parse_cpus(const char *str, CpuList *cpus);
+
+/// Set the CPUs that threads with a given role should run on. Must be called
+/// before the threads are created (e.g. before fdb_init_network_thread()).
+///
+/// @param[in] role      Thread role.
+/// @param[in] cpu_list  CPU list, e.g. "0-3,8" (NULL or "" removes pinning).
+///
+/// @return  0  Success.
+/// @return -1  Failure.
+int placement_set_cpus(ThreadRole role, const char *cpu_list);
+
+/// Initialize thread creation attributes for a role, including its CPU
+/// affinity if one is configured. Destroy with pthread_attr_destroy().
+///
+/// @param[in] role  Thread role.
+/// @param[in] attr  Handle for the attributes to initialize.
+///
+/// @return  0  Success.
+/// @return -1  Failure.
+int placement_init_attr(ThreadRole role, pthread_attr_t *attr);
+
+/// Pin the calling thread to the CPUs configured for a role. Does nothing if no
+/// CPUs are configured for the role.
+///
+/// @param[in] role  Thread role.
+///
+/// @return  0  Success.
+/// @return -1  Failure.
+int placement_apply(ThreadRole role);
+
+/// Place the pages of a mapping on the NUMA node of whichever thread first
+/// touches each of them, even if the process has an interleaved or bound
+/// policy. Failure (e.g. no NUMA support in the kernel) leaves the default
+/// first-touch policy, which is equivalent.
+///
+/// @param[in] ptr   Start of the mapping (page aligned).
+/// @param[in] size  Number of bytes mapped.
+void placement_bind_local(void *ptr, size_t size);
+
+/// Allocate memory on the NUMA node of the calling thread. Pages are touched
+/// by the caller, so under the default first-touch policy they're placed on
+/// its node; call from the consuming thread after it has been pinned.
+///
+/// @param[in] size  Number of bytes to allocate.
+///
+/// @return  Pointer to the allocated memory.
+/// @return  NULL  Failure.
+void *placement_alloc_local(size_t size);
+
+/// Release memory from placement_alloc_local().
+///
+/// @param[in] ptr   Pointer to the allocated memory.
+/// @param[in] size  Number of bytes allocated.
+void placement_free_local(void *ptr, size_t size);
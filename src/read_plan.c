@@ -0,0 +1,116 @@
+/// @file read_plan.c
+///
+/// Definitions for the read planner.
+
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "read_plan.h"
+
+//==============================================================================
+// Types
+//==============================================================================
+
+typedef struct read_plan_entry_t {
+  uint64_t id;    // Event identifier.
+  uint32_t index; // Position of the identifier in the request.
+} ReadPlanEntry;
+
+//==============================================================================
+// Prototypes
+//==============================================================================
+
+/// Order plan entries by identifier, then by request position, so that
+/// repeated identifiers keep their request order.
+///
+/// @param[in] a  First entry.
+/// @param[in] b  Second entry.
+///
+/// @return  Negative, zero or positive, as for qsort().
+int compare_plan_entries(const void *a, const void *b);
+
+//==============================================================================
+// Functions
+//==============================================================================
+
+int read_plan_build(ReadPlan *plan, const uint64_t *ids, uint32_t num_ids,
+                    uint64_t max_gap) {
+  uint64_t n = num_ids;
+  ReadPlanEntry *entries;
+  uint8_t *block;
+
+  plan->num_ids = num_ids;
+  plan->num_ranges = 0;
+  plan->over_read_ids = 0;
+
+  // Every array lives in one allocation, sized for one range per identifier
+  // and ordered by alignment
+  block = malloc((2 * n * sizeof(uint64_t)) + (n * sizeof(uint32_t)) +
+                 ((n + 1) * sizeof(uint32_t)));
+  entries = malloc((n ? n : 1) * sizeof(ReadPlanEntry));
+  if (!block || !entries) {
+    free((void *)block);
+    free((void *)entries);
+    return -1;
+  }
+
+  plan->range_begin = (uint64_t *)block;
+  plan->range_end = (plan->range_begin + n);
+  plan->order = (uint32_t *)(plan->range_end + n);
+  plan->range_start = (plan->order + n);
+
+  for (uint32_t i = 0; i < num_ids; ++i) {
+    entries[i].id = ids[i];
+    entries[i].index = i;
+  }
+  qsort(entries, num_ids, sizeof(ReadPlanEntry), compare_plan_entries);
+
+  // Start a new range whenever the gap to the previous identifier is too wide
+  for (uint32_t i = 0; i < num_ids; ++i) {
+    uint64_t id = entries[i].id;
+
+    plan->order[i] = entries[i].index;
+
+    if (plan->num_ranges) {
+      uint64_t *last = (plan->range_end + (plan->num_ranges - 1));
+
+      // Repeated identifiers always share a range
+      if ((id == *last) || ((id - *last - 1) <= max_gap)) {
+        if (id != *last)
+          plan->over_read_ids += (id - *last - 1);
+        *last = id;
+        continue;
+      }
+    }
+
+    plan->range_start[plan->num_ranges] = i;
+    plan->range_begin[plan->num_ranges] = id;
+    plan->range_end[plan->num_ranges] = id;
+    ++plan->num_ranges;
+  }
+  plan->range_start[plan->num_ranges] = num_ids;
+
+  free((void *)entries);
+
+  // Success
+  return 0;
+}
+
+void read_plan_free(ReadPlan *plan) {
+  free((void *)plan->range_begin);
+  plan->range_begin = NULL;
+  plan->range_end = NULL;
+  plan->order = NULL;
+  plan->range_start = NULL;
+  plan->num_ranges = 0;
+}
+
+int compare_plan_entries(const void *a, const void *b) {
+  const ReadPlanEntry *x = (const ReadPlanEntry *)a;
+  const ReadPlanEntry *y = (const ReadPlanEntry *)b;
+
+  if (x->id != y->id)
+    return (x->id < y->id) ? -1 : 1;
+
+  return (x->index < y->index) ? -1 : (x->index > y->index);
+}
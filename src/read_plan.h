@@ -0,0 +1,49 @@
+/// @file read_plan.h
+///
+/// Declarations for the read planner, which turns a scattered set of event
+/// identifiers into a few covering ranges. Nearby identifiers are merged into
+/// one range when the gap between them is small enough, trading the bytes of
+/// the unrequested events in the gap for fewer range reads.
+
+#pragma once
+
+#include <stdint.h>
+
+//==============================================================================
+// Types
+//==============================================================================
+
+typedef struct read_plan_t {
+  uint32_t num_ids;       // Number of requested identifiers.
+  uint32_t num_ranges;    // Number of covering ranges.
+  uint32_t *order;        // Request indices, sorted by identifier.
+  uint32_t *range_start;  // Position in order of each range's first
+                          // identifier. Has num_ranges + 1 entries; the last
+                          // is num_ids.
+  uint64_t *range_begin;  // First identifier of each range.
+  uint64_t *range_end;    // Last identifier of each range.
+  uint64_t over_read_ids; // Unrequested identifiers covered by the ranges.
+} ReadPlan;
+
+//==============================================================================
+// Prototypes
+//==============================================================================
+
+/// Plan the range reads covering a set of event identifiers. Identifiers may
+/// be given in any order, and may repeat.
+///
+/// @param[in] plan     Handle for the plan to write into.
+/// @param[in] ids      Array of event identifiers.
+/// @param[in] num_ids  Number of identifiers in the array.
+/// @param[in] max_gap  Maximum number of unrequested identifiers between two
+///                     requested identifiers in the same range.
+///
+/// @return  0  Success.
+/// @return -1  Failure.
+int read_plan_build(ReadPlan *plan, const uint64_t *ids, uint32_t num_ids,
+                    uint64_t max_gap);
+
+/// Release the arrays of a read plan.
+///
+/// @param[in] plan  Handle for the plan.
+void read_plan_free(ReadPlan *plan);
@@ -0,0 +1,451 @@
+/// @file shm_cache.c
+///
+/// Definitions for the shared-memory event cache.
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "event.h"
+#include "metrics.h"
+#include "shm_cache.h"
+
+#define SHM_CACHE_MAGIC 0x5345475543414348ULL
+#define SHM_CACHE_VERSION 1
+
+// Alignment of each region of the segment
+#define SHM_CACHE_ALIGN 64
+
+// How long to wait for another process to finish creating the segment
+#define SHM_CACHE_OPEN_WAIT_MS 1000
+
+// Attempts to read an entry which keeps being written before giving up on it
+#define SHM_CACHE_READ_ATTEMPTS 4
+
+//==============================================================================
+// Types
+//==============================================================================
+
+typedef struct shm_cache_header_t {
+  _Atomic uint64_t magic; // SHM_CACHE_MAGIC once the segment is initialized.
+  uint32_t version;       // Layout version.
+  uint32_t num_entries;   // Number of entries.
+  uint32_t entry_size;    // Bytes of arena per entry.
+  uint32_t num_sets;      // Number of sets of SHM_CACHE_WAYS entries.
+} ShmCacheHeader;
+
+typedef struct shm_cache_entry_t {
+  _Alignas(SHM_CACHE_ALIGN) atomic_uint seq; // Sequence lock. Odd while the
+                                             // entry is being written.
+  atomic_uint referenced;                    // CLOCK reference bit.
+  atomic_uint valid;                         // Whether the entry holds data.
+  _Atomic uint64_t subspace;                 // Event log of the event.
+  _Atomic uint64_t id;                       // Event identifier.
+  _Atomic uint64_t length;                   // Length of the event data.
+} ShmCacheEntry;
+
+//==============================================================================
+// Variables
+//==============================================================================
+
+static uint8_t *cache_base = NULL;
+static uint64_t cache_size;
+static ShmCacheHeader *cache_header;
+static atomic_uint *cache_hands;
+static ShmCacheEntry *cache_entries;
+static uint8_t *cache_arena;
+static uint64_t cache_subspace;
+
+//==============================================================================
+// Prototypes
+//==============================================================================
+
+/// Compute the layout of a segment.
+///
+/// @param[in] num_entries  Number of entries.
+/// @param[in] entry_size   Bytes of arena per entry.
+/// @param[in] offsets      Pointer to the write location of the offsets of the
+///                         CLOCK hands, entries and arena (3 values).
+///
+/// @return  Size of the segment in bytes.
+uint64_t cache_layout(uint32_t num_entries, uint32_t entry_size,
+                      uint64_t *offsets);
+
+/// Wait for another process to finish creating a segment.
+///
+/// @param[in] fd    File descriptor of the segment.
+/// @param[in] size  Expected size of the segment in bytes.
+///
+/// @return  0  Success.
+/// @return -1  Failure (timed out, or the segment has another geometry).
+int cache_wait_created(int fd, uint64_t size);
+
+/// Get the set an event belongs in.
+///
+/// @param[in] id  The event identifier.
+///
+/// @return  Index of the first entry of the set.
+uint32_t cache_set(uint64_t id);
+
+/// Check whether an entry holds an event. The result is only a hint unless the
+/// entry is locked or its sequence is checked afterwards.
+///
+/// @param[in] entry  Handle for the entry.
+/// @param[in] id     The event identifier.
+///
+/// @return  Whether the entry holds the event.
+bool cache_entry_matches(ShmCacheEntry *entry, uint64_t id);
+
+/// Read an event from an entry, if the entry holds it.
+///
+/// @param[in] index  Index of the entry.
+/// @param[in] event  Handle for the event.
+///
+/// @return  0  Hit.
+/// @return  1  The entry holds another event.
+/// @return -1  A writer raced the read.
+int cache_read_entry(uint32_t index, Event *event);
+
+/// Take the write lock of an entry. Writers never wait for each other; if the
+/// entry is busy, the write is skipped.
+///
+/// @param[in] entry  Handle for the entry.
+/// @param[in] seq    Pointer to the write location of the locked sequence.
+///
+/// @return  Whether the lock was taken.
+bool cache_lock_entry(ShmCacheEntry *entry, uint32_t *seq);
+
+/// Release the write lock of an entry.
+///
+/// @param[in] entry  Handle for the entry.
+/// @param[in] seq    Locked sequence returned by cache_lock_entry().
+void cache_unlock_entry(ShmCacheEntry *entry, uint32_t seq);
+
+//==============================================================================
+// Functions
+//==============================================================================
+
+int shm_cache_open(const char *name, uint32_t num_entries, uint32_t entry_size,
+                   uint64_t subspace) {
+  uint64_t offsets[3];
+  uint64_t size;
+  bool created = true;
+  uint8_t *base;
+  int fd;
+
+  if (cache_base || !num_entries || (num_entries % SHM_CACHE_WAYS) ||
+      !entry_size)
+    return -1;
+
+  size = cache_layout(num_entries, entry_size, offsets);
+
+  // Whichever process gets to create the segment sizes and initializes it.
+  // Newly sized memory is zeroed, which leaves every entry empty.
+  fd = shm_open(name, (O_RDWR | O_CREAT | O_EXCL), 0600);
+  if ((fd < 0) && (errno == EEXIST)) {
+    created = false;
+    fd = shm_open(name, O_RDWR, 0600);
+  }
+  if (fd < 0)
+    return -1;
+
+  if (created ? ftruncate(fd, (off_t)size) : cache_wait_created(fd, size)) {
+    close(fd);
+    if (created)
+      shm_unlink(name);
+    return -1;
+  }
+
+  base = mmap(NULL, size, (PROT_READ | PROT_WRITE), MAP_SHARED, fd, 0);
+  close(fd);
+  if (base == MAP_FAILED)
+    return -1;
+
+  cache_header = (ShmCacheHeader *)base;
+  if (created) {
+    cache_header->version = SHM_CACHE_VERSION;
+    cache_header->num_entries = num_entries;
+    cache_header->entry_size = entry_size;
+    cache_header->num_sets = (num_entries / SHM_CACHE_WAYS);
+    atomic_store_explicit(&cache_header->magic, SHM_CACHE_MAGIC,
+                          memory_order_release);
+  } else {
+    struct timespec pause = {0, 1000000};
+
+    for (uint32_t i = 0;
+         (atomic_load_explicit(&cache_header->magic, memory_order_acquire) !=
+          SHM_CACHE_MAGIC) &&
+         (i < SHM_CACHE_OPEN_WAIT_MS);
+         ++i)
+      nanosleep(&pause, NULL);
+
+    if ((atomic_load_explicit(&cache_header->magic, memory_order_acquire) !=
+         SHM_CACHE_MAGIC) ||
+        (cache_header->version != SHM_CACHE_VERSION) ||
+        (cache_header->num_entries != num_entries) ||
+        (cache_header->entry_size != entry_size)) {
+      munmap(base, size);
+      return -1;
+    }
+  }
+
+  cache_hands = (atomic_uint *)(base + offsets[0]);
+  cache_entries = (ShmCacheEntry *)(base + offsets[1]);
+  cache_arena = (base + offsets[2]);
+  cache_subspace = subspace;
+  cache_size = size;
+  cache_base = base;
+
+  // Success
+  return 0;
+}
+
+void shm_cache_close(void) {
+  if (!cache_base)
+    return;
+
+  munmap(cache_base, cache_size);
+  cache_base = NULL;
+}
+
+int shm_cache_unlink(const char *name) { return shm_unlink(name) ? -1 : 0; }
+
+bool shm_cache_enabled(void) { return (cache_base != NULL); }
+
+int shm_cache_get(Event *event) {
+  uint32_t set;
+
+  if (!cache_base)
+    return 1;
+
+  set = cache_set(event->id);
+  for (uint32_t w = 0; w < SHM_CACHE_WAYS; ++w) {
+    for (uint32_t i = 0; i < SHM_CACHE_READ_ATTEMPTS; ++i) {
+      int result = cache_read_entry((set + w), event);
+
+      if (!result) {
+        metrics_add(METRIC_CACHE_HITS, 1);
+        return 0;
+      }
+      if (result > 0)
+        break;
+    }
+  }
+
+  metrics_add(METRIC_CACHE_MISSES, 1);
+  return 1;
+}
+
+void shm_cache_put(uint64_t id, const uint8_t *data, uint64_t length) {
+  ShmCacheEntry *victim = NULL;
+  uint32_t set;
+  uint32_t seq;
+
+  if (!cache_base || (length > cache_header->entry_size))
+    return;
+
+  set = cache_set(id);
+
+  // Overwrite the event if it's already cached, otherwise fill an empty entry
+  for (uint32_t w = 0; (w < SHM_CACHE_WAYS) && !victim; ++w)
+    if (cache_entry_matches((cache_entries + set + w), id))
+      victim = (cache_entries + set + w);
+  for (uint32_t w = 0; (w < SHM_CACHE_WAYS) && !victim; ++w)
+    if (!atomic_load_explicit(&cache_entries[(set + w)].valid,
+                              memory_order_relaxed))
+      victim = (cache_entries + set + w);
+
+  // Otherwise sweep the set's CLOCK hand, giving each recently read entry a
+  // second chance. Two turns always find a victim unless the set is being read
+  // as fast as it is swept, in which case the write is skipped.
+  for (uint32_t i = 0; (i < (2 * SHM_CACHE_WAYS)) && !victim; ++i) {
+    uint32_t w = (atomic_fetch_add_explicit((cache_hands + (set /
+                                                            SHM_CACHE_WAYS)),
+                                            1, memory_order_relaxed) %
+                  SHM_CACHE_WAYS);
+
+    if (!atomic_exchange_explicit(&cache_entries[(set + w)].referenced, 0,
+                                  memory_order_relaxed)) {
+      victim = (cache_entries + set + w);
+      metrics_add(METRIC_CACHE_EVICTIONS, 1);
+    }
+  }
+
+  if (!victim || !cache_lock_entry(victim, &seq))
+    return;
+
+  atomic_store_explicit(&victim->subspace, cache_subspace,
+                        memory_order_relaxed);
+  atomic_store_explicit(&victim->id, id, memory_order_relaxed);
+  atomic_store_explicit(&victim->length, length, memory_order_relaxed);
+  atomic_store_explicit(&victim->valid, 1, memory_order_relaxed);
+  atomic_store_explicit(&victim->referenced, 1, memory_order_relaxed);
+  memcpy((cache_arena +
+          ((uint64_t)(victim - cache_entries) * cache_header->entry_size)),
+         data, length);
+
+  cache_unlock_entry(victim, seq);
+}
+
+void shm_cache_invalidate(uint64_t id) {
+  uint32_t set;
+  uint32_t seq;
+
+  if (!cache_base)
+    return;
+
+  set = cache_set(id);
+  for (uint32_t w = 0; w < SHM_CACHE_WAYS; ++w) {
+    ShmCacheEntry *entry = (cache_entries + set + w);
+
+    if (!cache_entry_matches(entry, id) || !cache_lock_entry(entry, &seq))
+      continue;
+
+    if (cache_entry_matches(entry, id))
+      atomic_store_explicit(&entry->valid, 0, memory_order_relaxed);
+    cache_unlock_entry(entry, seq);
+  }
+}
+
+void shm_cache_invalidate_all(void) {
+  uint32_t seq;
+
+  if (!cache_base)
+    return;
+
+  for (uint32_t i = 0; i < cache_header->num_entries; ++i) {
+    ShmCacheEntry *entry = (cache_entries + i);
+
+    if (atomic_load_explicit(&entry->subspace, memory_order_relaxed) !=
+            cache_subspace ||
+        !cache_lock_entry(entry, &seq))
+      continue;
+
+    if (atomic_load_explicit(&entry->subspace, memory_order_relaxed) ==
+        cache_subspace)
+      atomic_store_explicit(&entry->valid, 0, memory_order_relaxed);
+    cache_unlock_entry(entry, seq);
+  }
+}
+
+uint64_t cache_layout(uint32_t num_entries, uint32_t entry_size,
+                      uint64_t *offsets) {
+  uint64_t header = ((sizeof(ShmCacheHeader) + SHM_CACHE_ALIGN - 1) /
+                     SHM_CACHE_ALIGN * SHM_CACHE_ALIGN);
+  uint64_t hands = (((num_entries / SHM_CACHE_WAYS) * sizeof(atomic_uint) +
+                     SHM_CACHE_ALIGN - 1) /
+                    SHM_CACHE_ALIGN * SHM_CACHE_ALIGN);
+
+  offsets[0] = header;
+  offsets[1] = (offsets[0] + hands);
+  offsets[2] = (offsets[1] + ((uint64_t)num_entries * sizeof(ShmCacheEntry)));
+
+  return (offsets[2] + ((uint64_t)num_entries * entry_size));
+}
+
+int cache_wait_created(int fd, uint64_t size) {
+  struct timespec pause = {0, 1000000};
+  struct stat st;
+
+  // The creator sizes the segment straight after creating it
+  for (uint32_t i = 0; i < SHM_CACHE_OPEN_WAIT_MS; ++i) {
+    if (fstat(fd, &st))
+      return -1;
+    if (st.st_size)
+      return ((uint64_t)st.st_size == size) ? 0 : -1;
+    nanosleep(&pause, NULL);
+  }
+
+  return -1;
+}
+
+uint32_t cache_set(uint64_t id) {
+  // splitmix64 finalizer, so that consecutive identifiers spread across sets
+  uint64_t x = (id ^ (cache_subspace * 0x9E3779B97F4A7C15ULL));
+
+  x = ((x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ULL);
+  x = ((x ^ (x >> 27)) * 0x94D049BB133111EBULL);
+  x ^= (x >> 31);
+
+  return (uint32_t)((x % cache_header->num_sets) * SHM_CACHE_WAYS);
+}
+
+bool cache_entry_matches(ShmCacheEntry *entry, uint64_t id) {
+  return (atomic_load_explicit(&entry->valid, memory_order_relaxed) &&
+          (atomic_load_explicit(&entry->id, memory_order_relaxed) == id) &&
+          (atomic_load_explicit(&entry->subspace, memory_order_relaxed) ==
+           cache_subspace));
+}
+
+int cache_read_entry(uint32_t index, Event *event) {
+  ShmCacheEntry *entry = (cache_entries + index);
+  uint32_t seq = atomic_load_explicit(&entry->seq, memory_order_acquire);
+  bool matches;
+  uint64_t length;
+  uint8_t *data;
+
+  if (seq & 1)
+    return -1;
+
+  matches = cache_entry_matches(entry, event->id);
+  length = atomic_load_explicit(&entry->length, memory_order_relaxed);
+
+  // A torn length is caught by the sequence check, but mustn't be used first
+  if (matches && (length <= cache_header->entry_size)) {
+    data = alloc_event_data(length ? length : 1);
+    if (!data)
+      return 1;
+    memcpy(data, (cache_arena + ((uint64_t)index * cache_header->entry_size)),
+           length);
+  } else {
+    data = NULL;
+  }
+
+  atomic_thread_fence(memory_order_acquire);
+  if (atomic_load_explicit(&entry->seq, memory_order_relaxed) != seq) {
+    free_event_data(data);
+    return -1;
+  }
+
+  if (!data)
+    return 1;
+
+  atomic_store_explicit(&entry->referenced, 1, memory_order_relaxed);
+  event->data_length = length;
+  event->data = data;
+
+  // Success
+  return 0;
+}
+
+bool cache_lock_entry(ShmCacheEntry *entry, uint32_t *seq) {
+  uint32_t expected = atomic_load_explicit(&entry->seq, memory_order_relaxed);
+
+  // A process which dies mid-write leaves the entry locked, which only costs
+  // that entry
+  if ((expected & 1) ||
+      !atomic_compare_exchange_strong_explicit(&entry->seq, &expected,
+                                               (expected + 1),
+                                               memory_order_relaxed,
+                                               memory_order_relaxed))
+    return false;
+
+  // Readers must see the odd sequence before any of the writes which follow
+  atomic_thread_fence(memory_order_release);
+
+  *seq = (expected + 1);
+  return true;
+}
+
+void cache_unlock_entry(ShmCacheEntry *entry, uint32_t seq) {
+  atomic_store_explicit(&entry->seq, (seq + 1), memory_order_release);
+}
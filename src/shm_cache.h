@@ -0,0 +1,91 @@
+/// @file shm_cache.h
+///
+/// Declarations for the shared-memory event cache. Every Seguro process on a
+/// host which opens the same segment shares one cache, so an event read or
+/// written by any of them is a memory lookup for the rest.
+///
+/// The segment holds a set-associative hash table of fixed-size entries, each
+/// with a slab of the arena for its data. Entries are guarded by sequence
+/// locks: readers never block, and retry if a writer raced them. Entries are
+/// evicted by CLOCK within their set. Events too large for an entry bypass
+/// the cache.
+///
+/// Entries are keyed by a subspace, identifying the event log, and the event
+/// identifier. Cached data is stored in the clear, so the segment is only
+/// accessible to its owner.
+///
+/// Documentation links:
+///   https://man7.org/linux/man-pages/man7/shm_overview.7.html
+///   https://www.kernel.org/doc/html/latest/locking/seqlock.html
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "event.h"
+
+// Number of entries in each set of the hash table
+#define SHM_CACHE_WAYS 8
+
+// Default name of the shared-memory segment
+#define SHM_CACHE_DEFAULT_NAME "/seguro-cache"
+
+//==============================================================================
+// Prototypes
+//==============================================================================
+
+/// Map a shared-memory cache segment, creating it if no process has yet.
+/// Every process must open the segment with the same geometry.
+///
+/// @param[in] name         Name of the segment, starting with '/'.
+/// @param[in] num_entries  Number of entries (a multiple of SHM_CACHE_WAYS).
+/// @param[in] entry_size   Maximum size of a cached event in bytes.
+/// @param[in] subspace     Identifier of the event log this process uses.
+///
+/// @return  0  Success.
+/// @return -1  Failure.
+int shm_cache_open(const char *name, uint32_t num_entries, uint32_t entry_size,
+                   uint64_t subspace);
+
+/// Unmap the cache segment. The segment itself persists until unlinked.
+void shm_cache_close(void);
+
+/// Remove a cache segment. Processes which have it mapped keep using it.
+///
+/// @param[in] name  Name of the segment.
+///
+/// @return  0  Success.
+/// @return -1  Failure.
+int shm_cache_unlink(const char *name);
+
+/// Check whether a cache segment is mapped.
+///
+/// @return  Whether the cache is in use.
+bool shm_cache_enabled(void);
+
+/// Look an event up in the cache. Hits and misses are counted in
+/// METRIC_CACHE_HITS and METRIC_CACHE_MISSES.
+///
+/// @param[in] event  Handle for the event. The event id must be set. On a hit,
+///                   the data is allocated with alloc_event_data().
+///
+/// @return  0  Hit.
+/// @return  1  Miss.
+int shm_cache_get(Event *event);
+
+/// Add an event to the cache, evicting another from its set if needed.
+/// Evictions are counted in METRIC_CACHE_EVICTIONS.
+///
+/// @param[in] id      The event identifier.
+/// @param[in] data    The event data.
+/// @param[in] length  Length of the event data in bytes.
+void shm_cache_put(uint64_t id, const uint8_t *data, uint64_t length);
+
+/// Remove an event from the cache.
+///
+/// @param[in] id  The event identifier.
+void shm_cache_invalidate(uint64_t id);
+
+/// Remove every event of this process's subspace from the cache.
+void shm_cache_invalidate_all(void);
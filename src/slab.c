@@ -0,0 +1,354 @@
+/// @file slab.c
+///
+/// Definitions for the slab allocator.
+
+#define _GNU_SOURCE
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <threads.h>
+#include <unistd.h>
+
+#include "event.h"
+#include "placement.h"
+#include "slab.h"
+
+#define SLAB_MAGIC 0x5345475552534C42ULL
+
+// Size class of allocations which have their own mapping
+#define SLAB_LARGE_CLASS UINT32_MAX
+
+// Number of objects moved between a thread cache and a shared free list at once
+#define SLAB_TRANSFER_SIZE (SLAB_CACHE_SIZE / 2)
+
+//==============================================================================
+// Types
+//==============================================================================
+
+typedef struct slab_chunk_t {
+  uint64_t magic;        // SLAB_MAGIC, to catch frees of foreign pointers.
+  uint32_t size_class;   // Size class index, or SLAB_LARGE_CLASS.
+  uint32_t huge;         // Whether the chunk is backed by reserved huge pages.
+  uint64_t mapping_size; // Size of the mapping starting at this header.
+} SlabChunk;
+
+typedef struct slab_object_t {
+  struct slab_object_t *next; // Next object in the free list.
+} SlabObject;
+
+typedef struct slab_class_t {
+  pthread_mutex_t lock; // Protects the fields below.
+  SlabObject *free;     // Shared free list.
+  uint8_t *next;        // Next never-allocated object in the current chunk.
+  uint8_t *end;         // End of the current chunk.
+} SlabClass;
+
+typedef struct slab_cache_t {
+  bool registered;                  // Whether the exit destructor is set.
+  uint32_t count[SLAB_NUM_CLASSES]; // Cached objects per size class.
+  void *objects[SLAB_NUM_CLASSES][SLAB_CACHE_SIZE]; // Cached objects.
+} SlabCache;
+
+//==============================================================================
+// Variables
+//==============================================================================
+
+static SlabClass slab_classes[SLAB_NUM_CLASSES];
+static pthread_once_t slab_once = PTHREAD_ONCE_INIT;
+static pthread_key_t slab_cache_key;
+static thread_local SlabCache slab_cache;
+
+static atomic_uint_fast64_t slab_huge_chunks = 0;
+static atomic_uint_fast64_t slab_normal_chunks = 0;
+static atomic_uint_fast64_t slab_large_allocs = 0;
+static atomic_uint_fast64_t slab_mapped_bytes = 0;
+
+//==============================================================================
+// Prototypes
+//==============================================================================
+
+/// Initialize the shared size classes (once per process).
+void slab_init(void);
+
+/// Map a SLAB_CHUNK_SIZE-aligned region and write its chunk header. Regions
+/// whose size is a multiple of SLAB_CHUNK_SIZE are backed by reserved huge
+/// pages if possible, and otherwise by normal pages marked as eligible for
+/// transparent huge pages.
+///
+/// @param[in] size        Size of the region (multiple of the page size).
+/// @param[in] size_class  Size class stored in the chunk header.
+///
+/// @return  Pointer to the chunk header.
+/// @return  NULL  Failure.
+SlabChunk *slab_map_chunk(size_t size, uint32_t size_class);
+
+/// Move objects from the shared free list of a size class into the calling
+/// thread's cache, mapping a new chunk if necessary.
+///
+/// @param[in] size_class  Size class index.
+///
+/// @return  0  Success.
+/// @return -1  Failure.
+int slab_refill(uint32_t size_class);
+
+/// Move the given number of objects from the calling thread's cache back to the
+/// shared free list of a size class.
+///
+/// @param[in] size_class  Size class index.
+/// @param[in] count       Number of objects to move.
+void slab_drain(uint32_t size_class, uint32_t count);
+
+/// Thread exit destructor which returns the exiting thread's cache.
+void slab_cache_destructor(void *arg);
+
+/// Event allocator adapters.
+void *slab_event_alloc(uint64_t size, void *context);
+void slab_event_free(void *ptr, void *context);
+
+//==============================================================================
+// Functions
+//==============================================================================
+
+void *slab_alloc(size_t size) {
+  uint32_t size_class;
+  uint32_t shift;
+
+  pthread_once(&slab_once, slab_init);
+
+  // Oversized allocations get a mapping of their own, which is rounded up to
+  // whole chunks (and so eligible for huge pages) once it's at least a chunk
+  if (size > (1UL << SLAB_MAX_SHIFT)) {
+    size_t total = (size + SLAB_HEADER_SIZE);
+    size_t unit = (total >= SLAB_CHUNK_SIZE) ? SLAB_CHUNK_SIZE
+                                             : (size_t)sysconf(_SC_PAGESIZE);
+    SlabChunk *chunk =
+        slab_map_chunk((((total + unit - 1) / unit) * unit), SLAB_LARGE_CLASS);
+    if (!chunk)
+      return NULL;
+
+    atomic_fetch_add(&slab_large_allocs, 1);
+    return ((uint8_t *)chunk + SLAB_HEADER_SIZE);
+  }
+
+  // Round up to the next power of two
+  shift = (size <= (1UL << SLAB_MIN_SHIFT))
+              ? SLAB_MIN_SHIFT
+              : (uint32_t)(64 - __builtin_clzll((uint64_t)size - 1));
+  size_class = (shift - SLAB_MIN_SHIFT);
+
+  if (!slab_cache.count[size_class] && slab_refill(size_class))
+    return NULL;
+
+  return slab_cache.objects[size_class][--slab_cache.count[size_class]];
+}
+
+void slab_free(void *ptr) {
+  SlabChunk *chunk;
+  uint32_t size_class;
+
+  if (!ptr)
+    return;
+
+  // Every allocation lies within the chunk starting at the aligned address
+  // below it, including large allocations (which start after the header)
+  chunk = (SlabChunk *)((uintptr_t)ptr & ~((uintptr_t)SLAB_CHUNK_SIZE - 1));
+  if (chunk->magic != SLAB_MAGIC) {
+    fprintf(stderr, "slab_free: %p was not allocated by slab_alloc\n", ptr);
+    abort();
+  }
+
+  if (chunk->size_class == SLAB_LARGE_CLASS) {
+    atomic_fetch_sub(&slab_large_allocs, 1);
+    atomic_fetch_sub(&slab_mapped_bytes, chunk->mapping_size);
+    munmap(chunk, chunk->mapping_size);
+    return;
+  }
+
+  // Keep the object in this thread's cache, making room if it's full
+  size_class = chunk->size_class;
+  if (slab_cache.count[size_class] == SLAB_CACHE_SIZE)
+    slab_drain(size_class, SLAB_TRANSFER_SIZE);
+
+  slab_cache.objects[size_class][slab_cache.count[size_class]++] = ptr;
+}
+
+size_t slab_usable_size(const void *ptr) {
+  const SlabChunk *chunk =
+      (const SlabChunk *)((uintptr_t)ptr & ~((uintptr_t)SLAB_CHUNK_SIZE - 1));
+
+  if (chunk->size_class == SLAB_LARGE_CLASS)
+    return (chunk->mapping_size - SLAB_HEADER_SIZE);
+
+  return (1UL << (chunk->size_class + SLAB_MIN_SHIFT));
+}
+
+void slab_thread_flush(void) {
+  for (uint32_t i = 0; i < SLAB_NUM_CLASSES; ++i) {
+    if (slab_cache.count[i])
+      slab_drain(i, slab_cache.count[i]);
+  }
+}
+
+void slab_stats(SlabStats *stats) {
+  stats->huge_chunks = atomic_load(&slab_huge_chunks);
+  stats->normal_chunks = atomic_load(&slab_normal_chunks);
+  stats->large_allocs = atomic_load(&slab_large_allocs);
+  stats->mapped_bytes = atomic_load(&slab_mapped_bytes);
+}
+
+void slab_init(void) {
+  for (uint32_t i = 0; i < SLAB_NUM_CLASSES; ++i) {
+    pthread_mutex_init(&slab_classes[i].lock, NULL);
+    slab_classes[i].free = NULL;
+    slab_classes[i].next = NULL;
+    slab_classes[i].end = NULL;
+  }
+
+  pthread_key_create(&slab_cache_key, slab_cache_destructor);
+}
+
+SlabChunk *slab_map_chunk(size_t size, uint32_t size_class) {
+  SlabChunk *chunk = NULL;
+  uint8_t *ptr;
+  bool huge = false;
+
+  // Reserved huge pages are naturally aligned to their size. This fails unless
+  // the administrator has reserved huge pages (vm.nr_hugepages).
+  if (!(size % SLAB_CHUNK_SIZE)) {
+    int flags = (MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB);
+#ifdef MAP_HUGE_2MB
+    flags |= MAP_HUGE_2MB;
+#endif
+    ptr = mmap(NULL, size, (PROT_READ | PROT_WRITE), flags, -1, 0);
+    if (ptr != MAP_FAILED) {
+      chunk = (SlabChunk *)ptr;
+      huge = true;
+    }
+  }
+
+  // Otherwise over-map normal pages and trim the mapping to an aligned region
+  if (!chunk) {
+    uintptr_t start, end;
+
+    ptr = mmap(NULL, (size + SLAB_CHUNK_SIZE), (PROT_READ | PROT_WRITE),
+               (MAP_PRIVATE | MAP_ANONYMOUS), -1, 0);
+    if (ptr == MAP_FAILED)
+      return NULL;
+
+    start = (((uintptr_t)ptr + SLAB_CHUNK_SIZE - 1) &
+             ~((uintptr_t)SLAB_CHUNK_SIZE - 1));
+    end = ((uintptr_t)ptr + size + SLAB_CHUNK_SIZE);
+    if (start > (uintptr_t)ptr)
+      munmap(ptr, (start - (uintptr_t)ptr));
+    if (end > (start + size))
+      munmap((void *)(start + size), (end - (start + size)));
+
+    chunk = (SlabChunk *)start;
+
+    // Ask for transparent huge pages instead. Failure (e.g. THP disabled)
+    // just leaves normal pages.
+    if (size >= SLAB_CHUNK_SIZE)
+      madvise(chunk, size, MADV_HUGEPAGE);
+  }
+
+  // Pages land on the node of the thread which first needs them, normally
+  // the one which mapped the chunk to serve its own allocation
+  placement_bind_local(chunk, size);
+
+  chunk->magic = SLAB_MAGIC;
+  chunk->size_class = size_class;
+  chunk->huge = huge;
+  chunk->mapping_size = size;
+
+  if (size_class != SLAB_LARGE_CLASS)
+    atomic_fetch_add((huge ? &slab_huge_chunks : &slab_normal_chunks), 1);
+  atomic_fetch_add(&slab_mapped_bytes, size);
+
+  return chunk;
+}
+
+int slab_refill(uint32_t size_class) {
+  SlabClass *sc = (slab_classes + size_class);
+  size_t object_size = (1UL << (size_class + SLAB_MIN_SHIFT));
+  uint32_t *count = (slab_cache.count + size_class);
+  void **objects = slab_cache.objects[size_class];
+
+  // Register the exit destructor the first time this thread caches anything
+  if (!slab_cache.registered) {
+    pthread_setspecific(slab_cache_key, &slab_cache);
+    slab_cache.registered = true;
+  }
+
+  pthread_mutex_lock(&sc->lock);
+
+  // Prefer recycled objects, then carve new objects out of the current chunk
+  while ((*count < SLAB_TRANSFER_SIZE) && sc->free) {
+    objects[(*count)++] = sc->free;
+    sc->free = sc->free->next;
+  }
+
+  while (*count < SLAB_TRANSFER_SIZE) {
+    if ((sc->next + object_size) > sc->end) {
+      // Stop at a partial refill rather than map a chunk unnecessarily
+      if (*count)
+        break;
+
+      SlabChunk *chunk = slab_map_chunk(SLAB_CHUNK_SIZE, size_class);
+      if (!chunk) {
+        pthread_mutex_unlock(&sc->lock);
+        return -1;
+      }
+
+      sc->next = ((uint8_t *)chunk + SLAB_HEADER_SIZE);
+      sc->end = ((uint8_t *)chunk + SLAB_CHUNK_SIZE);
+    }
+
+    objects[(*count)++] = sc->next;
+    sc->next += object_size;
+  }
+
+  pthread_mutex_unlock(&sc->lock);
+
+  // Success
+  return 0;
+}
+
+void slab_drain(uint32_t size_class, uint32_t count) {
+  SlabClass *sc = (slab_classes + size_class);
+  SlabObject *head = NULL;
+  SlabObject *tail = NULL;
+
+  // Link the objects together outside the lock
+  for (uint32_t i = 0; i < count; ++i) {
+    SlabObject *object =
+        slab_cache.objects[size_class][--slab_cache.count[size_class]];
+    object->next = head;
+    head = object;
+    if (!tail)
+      tail = object;
+  }
+
+  if (!head)
+    return;
+
+  pthread_mutex_lock(&sc->lock);
+  tail->next = sc->free;
+  sc->free = head;
+  pthread_mutex_unlock(&sc->lock);
+}
+
+void slab_cache_destructor(void *arg) { slab_thread_flush(); }
+
+void *slab_event_alloc(uint64_t size, void *context) {
+  return slab_alloc((size_t)size);
+}
+
+void slab_event_free(void *ptr, void *context) { slab_free(ptr); }
+
+const EventAllocator slab_event_allocator = {slab_event_alloc,
+                                             slab_event_free, NULL};
@@ -0,0 +1,89 @@
+/// @file slab.h
+///
+/// Declarations for a slab allocator for event data and fragment buffers.
+/// Memory is carved out of 2 MB chunks backed by huge pages where available,
+/// so that replays touching millions of events need neither millions of
+/// malloc() calls nor millions of TLB entries.
+///
+/// Documentation links:
+///   https://www.kernel.org/doc/html/latest/admin-guide/mm/hugetlbpage.html
+///   https://www.kernel.org/doc/html/latest/admin-guide/mm/transhuge.html
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "event.h"
+
+// Size and alignment of the chunks the slab allocator maps
+#define SLAB_CHUNK_SIZE (2 * 1024 * 1024)
+
+// Size of the header at the start of every chunk
+#define SLAB_HEADER_SIZE 64
+
+// Smallest size class is 2^SLAB_MIN_SHIFT bytes
+#define SLAB_MIN_SHIFT 6
+
+// Largest size class is 2^SLAB_MAX_SHIFT bytes. Larger allocations get their
+// own mapping.
+#define SLAB_MAX_SHIFT 18
+
+#define SLAB_NUM_CLASSES (SLAB_MAX_SHIFT - SLAB_MIN_SHIFT + 1)
+
+// Number of free objects each thread caches per size class
+#define SLAB_CACHE_SIZE 64
+
+//==============================================================================
+// Types
+//==============================================================================
+
+typedef struct slab_stats_t {
+  uint64_t huge_chunks;   // Chunks backed by reserved huge pages.
+  uint64_t normal_chunks; // Chunks backed by normal or transparent huge pages.
+  uint64_t large_allocs;  // Live allocations too large for a size class.
+  uint64_t mapped_bytes;  // Total bytes currently mapped.
+} SlabStats;
+
+//==============================================================================
+// Variables
+//==============================================================================
+
+// Event allocator which allocates from the slab allocator. Pass to
+// set_event_allocator() to use the slab allocator for event buffers.
+extern const EventAllocator slab_event_allocator;
+
+//==============================================================================
+// Prototypes
+//==============================================================================
+
+/// Allocate memory from the slab allocator. Allocations are 64-byte aligned.
+///
+/// @param[in] size  Number of bytes to allocate.
+///
+/// @return  Pointer to the allocated memory.
+/// @return  NULL  Failure.
+void *slab_alloc(size_t size);
+
+/// Release memory allocated by slab_alloc(). Small allocations are kept in the
+/// calling thread's cache, or returned to a shared free list when that cache is
+/// full; chunks are never returned to the operating system.
+///
+/// @param[in] ptr  Pointer to the memory (may be NULL).
+void slab_free(void *ptr);
+
+/// Get the number of usable bytes in an allocation.
+///
+/// @param[in] ptr  Pointer to memory allocated by slab_alloc().
+///
+/// @return  Usable size in bytes.
+size_t slab_usable_size(const void *ptr);
+
+/// Return every object cached by the calling thread to the shared free lists.
+/// Called automatically when a thread which used the allocator exits.
+void slab_thread_flush(void);
+
+/// Read the allocator statistics.
+///
+/// @param[in] stats  Handle for the statistics to write into.
+void slab_stats(SlabStats *stats);
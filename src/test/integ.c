@@ -2,17 +2,50 @@
 ///
 /// Integration tests for Seguro
 
+#define _POSIX_C_SOURCE 200809L
+
 #include <assert.h>
+#include <dirent.h>
 #include <limits.h>
 #include <math.h>
+#include <pthread.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#include <unistd.h>
 
+#include "../archive.h"
+#include "../cipher.h"
 #include "../constants.h"
 #include "../event.h"
+#include "../event_batch.h"
 #include "../fdb.h"
+#include "../fdb_blob.h"
+#include "../fdb_faults.h"
+#include "../fdb_flight.h"
+#include "../fdb_footprint.h"
+#include "../fdb_lazy.h"
+#include "../fdb_merkle.h"
+#include "../fdb_presence.h"
+#include "../fdb_reorder.h"
+#include "../fdb_scheduler.h"
+#include "../fdb_scrub.h"
+#include "../fdb_write_buffer.h"
+#include "../metrics.h"
+#include "../shm_cache.h"
+
+// Number of events, and of events per block, submitted by the reorder test
+#define REORDER_TEST_EVENTS 512
+#define REORDER_TEST_BLOCK 32
+
+//==============================================================================
+// Variables
+//==============================================================================
+
+static ReorderBuffer reorder_buffer;
+static Event *reorder_events;
 
 //==============================================================================
 // Prototypes
@@ -51,9 +84,97 @@ void test_write_event_array(void);
 /// their entirety.
 void test_write_fragmented_event_array(void);
 
+/// Test that a structure-of-arrays batch of events can be written to a
+/// FoundationDB cluster by several threads, and read back intact.
+void test_write_event_batch(void);
+
 /// Test that an event can be read from a FoundationDB cluster in its entirety.
 void test_read_event(void);
 
+/// Test that pinned reads of an event array, including an event which takes
+/// several range reads, return every event intact.
+void test_read_event_array_pinned(void);
+
+/// Test that a scattered set of events, with repeats, is read back in request
+/// order.
+void test_read_event_set(void);
+
+/// Test that concurrent reads of one event share a single read.
+void test_read_shared_event(void);
+
+/// Test that written events are served from the shared-memory cache, and that
+/// cleared events leave it.
+void test_shm_cache_reads(void);
+
+/// Test that a snapshot can be uploaded, published and downloaded intact, with
+/// and without encryption.
+void test_snapshot_blobs(void);
+
+/// Read a shared event on a test thread.
+///
+/// @param[in] arg  Pointer to the write location of the shared event.
+///
+/// @return  NULL, or arg on failure.
+void *read_shared_event_thread(void *arg);
+
+/// Test that the storage footprint of a range of events can be measured.
+void test_analyze_range(void);
+
+/// Test that the scrubber finds torn events and resumes from its cursor.
+void test_scrub(void);
+
+/// Test migrating event keys between the fixed and compact layouts.
+void test_migrate_keys(void);
+
+/// Test that archived events leave the cluster and are read from segments.
+void test_archive_events(void);
+
+/// Test that writes and clears keep the Merkle summaries in step with the
+/// stored events.
+void test_merkle_summaries(void);
+
+/// Test existence, count and gap queries on the present-id bitmap.
+void test_presence(void);
+
+/// Test that lazily read events fill on touch, reading ahead when linear.
+void test_lazy_read(void);
+
+/// Test that buffered and fire-and-forget writes are flushed by the buffer.
+void test_write_durability(void);
+
+/// Test that events submitted out of order by parallel producers are committed
+/// in id order.
+void test_reorder_buffer(void);
+
+/// Submit every fourth block of reorder test events, each block backwards.
+///
+/// @param[in] arg  Index of the first block.
+///
+/// @return  NULL, or the failed event.
+void *submit_reordered_thread(void *arg);
+
+/// Test that the scheduler keeps quiet tenants' latency below noisy ones', and
+/// throttles tenants to their rates.
+void test_scheduler(void);
+
+/// Write the noisy tenant's events on a test thread.
+///
+/// @param[in] arg  Handle for the tenant.
+///
+/// @return  NULL, or arg on failure.
+void *write_noisy_tenant_thread(void *arg);
+
+/// Test that encrypted events round-trip and that moved fragments are rejected.
+void test_encrypted_events(void);
+
+/// Test that writes and reads retry through injected faults, and that a retry
+/// limit stops them.
+void test_fault_injection(void);
+
+/// Record scrubber anomalies for test_scrub().
+void record_anomaly(ScrubAnomaly anomaly, uint64_t event_id, uint32_t fragment,
+                    void *context);
+
 /// Generate random, fake data for simulating events.
 ///
 /// @param[in] size   Number of bytes of data to generate.
@@ -78,6 +199,14 @@ uint32_t count_keys_in_database(FDBTransaction *tx);
 uint32_t count_event_fragments_in_database(FDBTransaction *tx,
                                            uint64_t event_id);
 
+/// Read the nonce a snapshot chunk was sealed under.
+///
+/// @param[in] event_id  Identifier of the snapshot.
+/// @param[in] chunk     The chunk number (not 0, whose header comes first).
+/// @param[in] nonce     Pointer to the write location (of CIPHER_NONCE_SIZE
+///                      bytes).
+void read_blob_nonce(uint64_t event_id, uint32_t chunk, uint8_t *nonce);
+
 /// Gracefully fail a test by cleaning up before exiting.
 void fail_test(void);
 
@@ -111,7 +240,25 @@ int main(int argc, char **argv) {
   test_write_fragmented_event();
   test_write_event_array();
   test_write_fragmented_event_array();
+  test_write_event_batch();
   test_read_event();
+  test_read_event_array_pinned();
+  test_read_event_set();
+  test_read_shared_event();
+  test_shm_cache_reads();
+  test_snapshot_blobs();
+  test_analyze_range();
+  test_scrub();
+  test_migrate_keys();
+  test_archive_events();
+  test_merkle_summaries();
+  test_presence();
+  test_lazy_read();
+  test_write_durability();
+  test_reorder_buffer();
+  test_scheduler();
+  test_encrypted_events();
+  test_fault_injection();
 
   // Success
   printf("\nIntegration tests completed successfully.\n");
@@ -268,14 +415,12 @@ void test_clear_event(void) {
 
   // Manually add keys for a dummy event to the database
   for (uint32_t i = 0; i < num_fragments; ++i) {
-    uint8_t key[FDB_KEY_TOTAL_LENGTH];
-
-    fdb_build_event_key(key, event_id, i);
+    uint8_t key[FDB_KEY_MAX_LENGTH];
+    uint8_t key_length = fdb_build_event_key(key, event_id, i);
 
     dummy_data[i] = generate_dummy_data(dummy_size);
 
-    fdb_transaction_set(tx, key, FDB_KEY_TOTAL_LENGTH, dummy_data[i],
-                        dummy_size);
+    fdb_transaction_set(tx, key, key_length, dummy_data[i], dummy_size);
   }
 
   if (fdb_send_transaction(tx))
@@ -342,11 +487,10 @@ void test_clear_event_array(void) {
 
   // Manually add keys for a dummy event to the database
   for (uint32_t i = 0; i < num_events; ++i) {
-    uint8_t key[FDB_KEY_TOTAL_LENGTH];
-    fdb_build_event_key(key, mock_f_events[i].id, 0);
+    uint8_t key[FDB_KEY_MAX_LENGTH];
+    uint8_t key_length = fdb_build_event_key(key, mock_f_events[i].id, 0);
 
-    fdb_transaction_set(tx, key, FDB_KEY_TOTAL_LENGTH,
-                        mock_f_events[i].fragments[0],
+    fdb_transaction_set(tx, key, key_length, mock_f_events[i].fragments[0],
                         mock_f_events[i].payload_length);
   }
 
@@ -416,13 +560,13 @@ void test_clear_database(void) {
 
   // Manually add keys for a dummy event to the database
   for (uint32_t i = 0; i < num_events; ++i) {
-    uint8_t key[FDB_KEY_TOTAL_LENGTH];
+    uint8_t key[FDB_KEY_MAX_LENGTH];
 
     for (uint8_t j = 0; j < num_fragments; ++j) {
-      fdb_build_event_key(key, mock_f_events[i].id, j);
+      uint8_t key_length = fdb_build_event_key(key, mock_f_events[i].id, j);
 
-      fdb_transaction_set(tx, key, FDB_KEY_TOTAL_LENGTH,
-                          mock_f_events[i].fragments[j], OPTIMAL_VALUE_SIZE);
+      fdb_transaction_set(tx, key, key_length, mock_f_events[i].fragments[j],
+                          OPTIMAL_VALUE_SIZE);
     }
   }
 
@@ -704,6 +848,62 @@ void test_write_fragmented_event_array(void) {
   printf("fdb_write_fragmented_event_array() test PASSED\n");
 }
 
+void test_write_event_batch(void) {
+  FDBTransaction *tx;
+  EventBatch batch;
+  Event return_event;
+  uint32_t num_events = 6;
+  uint64_t sizes[] = {1, OPTIMAL_VALUE_SIZE, (OPTIMAL_VALUE_SIZE + 1), 500,
+                      (25 * OPTIMAL_VALUE_SIZE), (3 * OPTIMAL_VALUE_SIZE - 7)};
+
+  printf("\nStarting fdb_write_event_batch() test...\n");
+
+  // Small batches, so that transactions split events and mix them together
+  fdb_set_batch_size(4);
+
+  // Setup events
+  if (event_batch_init(&batch, num_events))
+    fail_test();
+
+  for (uint32_t i = 0; i < num_events; ++i) {
+    batch.ids[i] = (100 + i);
+    batch.data_lengths[i] = sizes[i];
+    batch.data[i] = generate_dummy_data(sizes[i]);
+  }
+
+  // Setup transaction handle
+  if (fdb_check_error(fdb_setup_transaction(&tx)))
+    fail_test();
+
+  // Verify that database is empty before test
+  assert(count_keys_in_database(tx) == 0);
+  fdb_transaction_destroy(tx);
+
+  // Attempt to write events to FoundationDB cluster
+  assert(fdb_write_event_batch(&batch, 3) == 0);
+
+  // Verify that every event reads back intact
+  for (uint32_t i = 0; i < num_events; ++i) {
+    return_event.id = batch.ids[i];
+    assert(fdb_read_event(&return_event) == 0);
+    assert(return_event.data_length == sizes[i]);
+    assert(!memcmp(return_event.data, batch.data[i], sizes[i]));
+    free_event(&return_event);
+  }
+
+  // Release the dummy data memory
+  for (uint32_t i = 0; i < num_events; ++i) {
+    free((void *)batch.data[i]);
+  }
+  event_batch_free(&batch);
+
+  // Clear the database
+  fdb_clear_database();
+
+  // Success
+  printf("fdb_write_event_batch() test PASSED\n");
+}
+
 void test_read_event(void) {
   FDBTransaction *tx;
   Event mock_event, return_event;
@@ -757,111 +957,1534 @@ void test_read_event(void) {
   printf("fdb_read_event() test PASSED\n");
 }
 
-uint8_t *generate_dummy_data(uint64_t size) {
-  uint8_t *result = malloc(sizeof(uint8_t) * size);
+void test_read_event_array_pinned(void) {
+  Event mock_events[3];
+  Event read_events[3];
+  uint32_t data_sizes[3] = {5, (500 * OPTIMAL_VALUE_SIZE),
+                            ((2 * OPTIMAL_VALUE_SIZE) + 5)};
 
-  // Seed the random number generator
-  srand(clock());
+  printf("\nStarting pinned fdb_read_event_array() test...\n");
 
-  // Generate random byte data
-  for (uint64_t i = 0; i < size; ++i) {
-    result[i] = rand() % 256;
+  // Setup FoundationDB batch settings
+  fdb_set_batch_size(100);
+  metrics_reset();
+
+  // The large event takes several range read batches
+  for (uint8_t i = 0; i < 3; ++i) {
+    mock_events[i].id = i;
+    mock_events[i].data_length = data_sizes[i];
+    mock_events[i].data = generate_dummy_data(data_sizes[i]);
+    read_events[i].id = i;
   }
 
+  if (fdb_write_event_array(mock_events, 3))
+    fail_test();
+
+  fdb_set_pinned_reads(true);
+  if (fdb_read_event_array(read_events, 3))
+    fail_test();
+  fdb_set_pinned_reads(false);
+
+  for (uint8_t i = 0; i < 3; ++i) {
+    assert(read_events[i].data_length == data_sizes[i]);
+    assert(!memcmp(read_events[i].data, mock_events[i].data, data_sizes[i]));
+    free_event(read_events + i);
+  }
+  assert(metrics_get(METRIC_READ_ROLLOVERS) == 0);
+
+  // Missing events fail the whole array
+  read_events[0].id = 7;
+  assert(fdb_read_event_array(read_events, 1) == -1);
+
+  // Release the dummy data memory
+  for (uint8_t i = 0; i < 3; ++i) {
+    free_event(mock_events + i);
+  }
+
+  // Clear the database
+  fdb_clear_database();
+
   // Success
-  return result;
+  printf("pinned fdb_read_event_array() test PASSED\n");
 }
 
-/*
- * Found on the FDB forums:
- *
- * "The fdb_transaction_get_range() operation returns data one batch at a time,
- * meaning that you are supposed to check the value of out_more to know whether
- * you need to call it again to get more keys for the range. The
- * FDB_STREAMING_MODE_WANT_ALL streaming mode does not mean 'in a single
- * batch'; it should be understood as 'in as few batches as possible'. The other
- * streaming modes are for cases where the user plans to inspect data as it
- * arrives and stop iterating on some end condition, possibly well before the
- * end of the range.
- *
- * Consider the hypothetical case of 5000 keys in a given range. It's possible
- * that FDB will only return 3000 keys: what it considers to be the ideal batch
- * size for this get request. In this case, the user would need to check if
- * out_more is non-zero after the call, and call the fdb_transaction_get_range
- * again using the FDB_KEYSEL_FIRST_GREATER_THAN macro on the last key of the
- * previous batch. The user would need to repeat this until one such transaction
- * returned an out_more value of 0 - or more specifically, until one such
- * transaction failed to set out_more to 1."
- *
- * https://forums.foundationdb.org/t/why-can-i-only-range-read-2857-keys/1517/2
- *
- */
-uint32_t count_keys_in_database(FDBTransaction *tx) {
-  FDBFuture *future;
-  const FDBKeyValue *out_kv;
-  fdb_bool_t out_more;
-  uint32_t out_total = 0;
-  int32_t out_count;
-  uint8_t range_start_key = 0;
-  uint8_t range_end_key = 0xFF;
+void test_read_event_set(void) {
+  Event mock_events[6];
+  Event read_events[6];
+  uint64_t mock_ids[6] = {0, 2, 4, 5, 60, 90};
+  uint64_t ids[6] = {90, 2, 60, 4, 2, 5};
+  uint64_t gaps[2] = {0, 50};
 
-  // Loop until FoundationDB says there is no more data
-  do {
-    out_more = 0;
-    future = fdb_transaction_get_range(
-        tx, &range_start_key, 0, 0, (out_total + 1), &range_end_key, 1, 0, 1, 0,
-        0, FDB_STREAMING_MODE_WANT_ALL, 0, 0, 0);
+  printf("\nStarting fdb_read_event_set() test...\n");
 
-    if (fdb_check_error(fdb_future_block_until_ready(future)))
+  // Setup FoundationDB batch settings
+  fdb_set_batch_size(100);
+
+  // Events in the gaps between requested ones are read over and discarded
+  for (uint8_t i = 0; i < 6; ++i) {
+    mock_events[i].id = mock_ids[i];
+    mock_events[i].data_length = ((i * OPTIMAL_VALUE_SIZE) + 7);
+    mock_events[i].data = generate_dummy_data(mock_events[i].data_length);
+  }
+
+  if (fdb_write_event_array(mock_events, 6))
+    fail_test();
+
+  for (uint8_t g = 0; g < 2; ++g) {
+    for (uint8_t i = 0; i < 6; ++i)
+      read_events[i].id = ids[i];
+
+    if (fdb_read_event_set(read_events, 6, gaps[g]))
       fail_test();
-    if (fdb_check_error(fdb_future_get_error(future)))
+
+    for (uint8_t i = 0; i < 6; ++i) {
+      Event *mock = mock_events;
+
+      while (mock->id != ids[i])
+        ++mock;
+      assert(read_events[i].data_length == mock->data_length);
+      assert(!memcmp(read_events[i].data, mock->data, mock->data_length));
+      free_event(read_events + i);
+    }
+  }
+
+  // A missing event fails the whole set
+  read_events[0].id = 4;
+  read_events[1].id = 7;
+  assert(fdb_read_event_set(read_events, 2, 10) == -1);
+
+  // Release the dummy data memory
+  for (uint8_t i = 0; i < 6; ++i) {
+    free_event(mock_events + i);
+  }
+
+  // Clear the database
+  fdb_clear_database();
+
+  // Success
+  printf("fdb_read_event_set() test PASSED\n");
+}
+
+void test_read_shared_event(void) {
+  Event mock_event;
+  SharedEvent *shared[8];
+  pthread_t threads[8];
+
+  printf("\nStarting fdb_read_shared_event() test...\n");
+
+  // Setup FoundationDB batch settings
+  fdb_set_batch_size(100);
+  metrics_reset();
+
+  mock_event.id = 11;
+  mock_event.data_length = ((50 * OPTIMAL_VALUE_SIZE) + 3);
+  mock_event.data = generate_dummy_data(mock_event.data_length);
+
+  if (fdb_write_event(&mock_event))
+    fail_test();
+
+  // Threads which overlap share one event; the rest read their own
+  for (uint8_t i = 0; i < 8; ++i)
+    if (pthread_create((threads + i), NULL, read_shared_event_thread,
+                       (shared + i)))
       fail_test();
-    if (fdb_check_error(fdb_future_get_keyvalue_array(future, &out_kv,
-                                                      &out_count, &out_more)))
+
+  for (uint8_t i = 0; i < 8; ++i) {
+    void *err;
+
+    pthread_join(threads[i], &err);
+    if (err)
       fail_test();
+  }
 
-    out_total += out_count;
+  for (uint8_t i = 0; i < 8; ++i) {
+    assert(shared[i]->id == mock_event.id);
+    assert(shared[i]->data_length == mock_event.data_length);
+    assert(!memcmp(shared[i]->data, mock_event.data, mock_event.data_length));
+  }
 
-    fdb_future_destroy(future);
-  } while (out_more);
+  // Every joined read holds a reference to the same event
+  for (uint8_t i = 0; i < 8; ++i) {
+    uint32_t holders = 0;
 
-  return (uint32_t)out_total;
+    for (uint8_t j = 0; j < 8; ++j)
+      holders += (shared[j] == shared[i]);
+    assert(atomic_load(&shared[i]->refs) == holders);
+  }
+  assert(metrics_get(METRIC_READ_JOINED) < 8);
+
+  for (uint8_t i = 0; i < 8; ++i)
+    shared_event_release(shared[i]);
+
+  // Failed reads are reported to every thread
+  assert(fdb_read_shared_event(12, shared) == -1);
+
+  // Release the dummy data memory
+  free_event(&mock_event);
+
+  // Clear the database
+  fdb_clear_database();
+
+  // Success
+  printf("fdb_read_shared_event() test PASSED\n");
 }
 
-uint32_t count_event_fragments_in_database(FDBTransaction *tx,
-                                           uint64_t event_id) {
-  FDBFuture *future;
-  const FDBKeyValue *out_kv;
-  fdb_bool_t out_more;
-  uint32_t out_total = 0;
-  int32_t out_count;
-  uint8_t range_start_key[FDB_KEY_TOTAL_LENGTH];
-  uint8_t range_end_key[FDB_KEY_TOTAL_LENGTH];
+void test_shm_cache_reads(void) {
+  const char *name = "/seguro-integ-cache";
+  Event mock_events[3];
+  Event read_events[3];
+  FragmentedEvent f_event;
 
-  fdb_build_event_key(range_start_key, event_id, 0);
-  fdb_build_event_key(range_end_key, (event_id + 1), 0);
+  printf("\nStarting shared-memory cache read test...\n");
 
-  // Loop until FoundationDB says there is no more data
-  do {
-    out_more = 0;
-    future = fdb_transaction_get_range(
-        tx, range_start_key, FDB_KEY_TOTAL_LENGTH, 1, out_total, range_end_key,
-        FDB_KEY_TOTAL_LENGTH, 0, 1, 0, 0, FDB_STREAMING_MODE_WANT_ALL, 0, 0, 0);
+  shm_cache_unlink(name);
+  if (shm_cache_open(name, (4 * SHM_CACHE_WAYS), (2 * OPTIMAL_VALUE_SIZE), 1))
+    fail_test();
+  metrics_reset();
+
+  // The last event is too large to cache
+  for (uint8_t i = 0; i < 3; ++i) {
+    mock_events[i].id = (i + 30);
+    mock_events[i].data_length = ((i * OPTIMAL_VALUE_SIZE) + 9);
+    mock_events[i].data = generate_dummy_data(mock_events[i].data_length);
+    read_events[i].id = mock_events[i].id;
+  }
 
-    if (fdb_check_error(fdb_future_block_until_ready(future)))
+  if (fdb_write_event_array(mock_events, 3))
+    fail_test();
+
+  if (fdb_read_event_array(read_events, 3))
+    fail_test();
+  assert(metrics_get(METRIC_CACHE_HITS) == 2);
+  assert(metrics_get(METRIC_CACHE_MISSES) == 1);
+
+  for (uint8_t i = 0; i < 3; ++i) {
+    assert(read_events[i].data_length == mock_events[i].data_length);
+    assert(!memcmp(read_events[i].data, mock_events[i].data,
+                   mock_events[i].data_length));
+    free_event(read_events + i);
+  }
+
+  // A cleared event is no longer served from the cache
+  fragment_event(mock_events, &f_event);
+  if (fdb_clear_event(&f_event))
+    fail_test();
+  free_fragmented_event(&f_event);
+  assert(fdb_read_event(read_events) == -1);
+
+  shm_cache_close();
+  shm_cache_unlink(name);
+
+  // Release the dummy data memory
+  for (uint8_t i = 0; i < 3; ++i) {
+    free_event(mock_events + i);
+  }
+
+  // Clear the database
+  fdb_clear_database();
+
+  // Success
+  printf("shared-memory cache read test PASSED\n");
+}
+
+void test_snapshot_blobs(void) {
+  char in_path[] = "/tmp/seguro-snapshot-XXXXXX";
+  char out_path[] = "/tmp/seguro-restore-XXXXXX";
+  uint64_t size = ((250 * OPTIMAL_VALUE_SIZE) + 123);
+  uint8_t key[CIPHER_KEY_SIZE] = {7};
+  uint8_t *data = generate_dummy_data(size);
+  uint8_t *restored = malloc(size);
+  uint8_t nonce[CIPHER_NONCE_SIZE];
+  uint8_t renonce[CIPHER_NONCE_SIZE];
+  uint64_t event_id;
+  FILE *file;
+  int fd;
+
+  printf("\nStarting snapshot blob test...\n");
+
+  fd = mkstemp(in_path);
+  if ((fd < 0) || (write(fd, data, size) != (ssize_t)size))
+    fail_test();
+  close(fd);
+  fd = mkstemp(out_path);
+  if (fd < 0)
+    fail_test();
+  close(fd);
+
+  // Nothing is published until an upload completes
+  assert(fdb_get_latest_snapshot(&event_id) == 1);
+  assert(fdb_get_snapshot(5, out_path, 4) == -1);
+
+  for (uint8_t encrypted = 0; encrypted < 2; ++encrypted) {
+    cipher_set_key(encrypted ? key : NULL);
+
+    if (fdb_put_snapshot(in_path, (500 + encrypted), 4))
       fail_test();
-    if (fdb_check_error(fdb_future_get_error(future)))
+    assert(fdb_get_latest_snapshot(&event_id) == 0);
+    assert(event_id == (uint64_t)(500 + encrypted));
+
+    if (fdb_get_snapshot(event_id, out_path, 3))
       fail_test();
-    if (fdb_check_error(fdb_future_get_keyvalue_array(future, &out_kv,
-                                                      &out_count, &out_more)))
+
+    file = fopen(out_path, "rb");
+    if (!file || (fread(restored, 1, size, file) != size) ||
+        (fgetc(file) != EOF))
       fail_test();
+    fclose(file);
+    assert(!memcmp(restored, data, size));
+  }
 
-    out_total += out_count;
+  // A snapshot stored in the clear can't be opened with the key
+  assert(fdb_get_snapshot(500, out_path, 2) == -1);
 
-    fdb_future_destroy(future);
-  } while (out_more);
+  // A regenerated snapshot uploaded again under the same id is sealed under
+  // fresh nonces
+  read_blob_nonce(501, 1, nonce);
+  data[0] ^= 0xFF;
+  file = fopen(in_path, "r+b");
+  if (!file || (fwrite(data, 1, 1, file) != 1))
+    fail_test();
+  fclose(file);
+  if (fdb_put_snapshot(in_path, 501, 4) || fdb_get_snapshot(501, out_path, 3))
+    fail_test();
+  read_blob_nonce(501, 1, renonce);
+  assert(memcmp(nonce, renonce, CIPHER_NONCE_SIZE));
 
-  return (uint32_t)out_total;
+  file = fopen(out_path, "rb");
+  if (!file || (fread(restored, 1, size, file) != size))
+    fail_test();
+  fclose(file);
+  assert(!memcmp(restored, data, size));
+  cipher_set_key(NULL);
+
+  if (fdb_clear_snapshot(500) || fdb_clear_snapshot(501))
+    fail_test();
+  assert(fdb_get_snapshot(501, out_path, 2) == -1);
+
+  unlink(in_path);
+  unlink(out_path);
+  free((void *)data);
+  free((void *)restored);
+
+  // Clear the database
+  fdb_clear_database();
+
+  // Success
+  printf("snapshot blob test PASSED\n");
+}
+
+void *read_shared_event_thread(void *arg) {
+  return fdb_read_shared_event(11, (SharedEvent **)arg) ? arg : NULL;
+}
+
+void test_analyze_range(void) {
+  FootprintStats stats;
+  Event *mock_events;
+  uint32_t num_events = 4;
+  uint32_t data_size = ((2 * OPTIMAL_VALUE_SIZE) + 5);
+
+  printf("\nStarting fdb_analyze_range() test...\n");
+
+  // Setup FoundationDB batch settings
+  fdb_set_batch_size(100);
+
+  // Setup events, each with 3 fragments
+  mock_events = malloc(sizeof(Event) * num_events);
+  for (uint8_t i = 0; i < num_events; ++i) {
+    mock_events[i].id = i;
+    mock_events[i].data_length = data_size;
+    mock_events[i].data = generate_dummy_data(data_size);
+  }
+
+  // Write events to FoundationDB cluster
+  if (fdb_write_event_array(mock_events, num_events))
+    fail_test();
+
+  // Full scan
+  footprint_init(&stats);
+  if (fdb_analyze_range(0, num_events, 1, &stats))
+    fail_test();
+
+  assert(stats.num_events == num_events);
+  assert(stats.num_kvs == (3 * num_events));
+  assert(stats.payload_bytes == ((uint64_t)data_size * num_events));
+  assert(stats.key_bytes == (3 * num_events * FDB_KEY_TOTAL_LENGTH));
+  assert(stats.torn_events == 0);
+
+  // Sampled scan
+  footprint_init(&stats);
+  if (fdb_analyze_range(0, num_events, 2, &stats))
+    fail_test();
+
+  assert(stats.num_events == (num_events / 2));
+  assert(stats.num_kvs == (3 * (num_events / 2)));
+
+  // A sampled scan of the analyzer's default range only visits stored events
+  footprint_init(&stats);
+  if (fdb_analyze_range(0, UINT64_MAX, 2, &stats))
+    fail_test();
+
+  assert(stats.num_events == (num_events / 2));
+  footprint_init(&stats);
+  if (fdb_analyze_range(1, UINT64_MAX, 1000, &stats))
+    fail_test();
+
+  assert(stats.num_events == 1);
+  assert(stats.num_kvs == 3);
+
+  // Release the dummy data memory
+  for (uint8_t i = 0; i < num_events; ++i) {
+    free_event(mock_events + i);
+  }
+  free((void *)mock_events);
+
+  // Clear the database
+  fdb_clear_database();
+
+  // Success
+  printf("fdb_analyze_range() test PASSED\n");
+}
+
+void test_scrub(void) {
+  FDBTransaction *tx;
+  Event *mock_events;
+  ScrubConfig config = {0};
+  uint64_t found[2] = {0};
+  uint64_t cursor = 1;
+  uint32_t num_events = 4;
+  uint32_t data_size = ((2 * OPTIMAL_VALUE_SIZE) + 5);
+  uint8_t key[FDB_KEY_MAX_LENGTH];
+  uint8_t key_length;
+
+  printf("\nStarting fdb_scrub_pass() test...\n");
+
+  // Setup FoundationDB batch settings
+  fdb_set_batch_size(100);
+  metrics_reset();
+
+  // Setup events, each with 3 fragments
+  mock_events = malloc(sizeof(Event) * num_events);
+  for (uint8_t i = 0; i < num_events; ++i) {
+    mock_events[i].id = i;
+    mock_events[i].data_length = data_size;
+    mock_events[i].data = generate_dummy_data(data_size);
+  }
+
+  if (fdb_write_event_array(mock_events, num_events))
+    fail_test();
+
+  // A healthy log has no anomalies
+  config.batch_kvs = 2;
+  config.on_anomaly = record_anomaly;
+  config.context = found;
+  assert(fdb_scrub_pass(&config) == 0);
+  assert(metrics_get(METRIC_SCRUB_EVENTS) == num_events);
+  assert(metrics_get(METRIC_SCRUB_PASSES) == 1);
+
+  // Tear the middle fragment out of an event
+  if (fdb_check_error(fdb_setup_transaction(&tx)))
+    fail_test();
+  key_length = fdb_build_event_key(key, 2, 1);
+  fdb_transaction_clear(tx, key, key_length);
+  if (fdb_send_transaction(tx))
+    fail_test();
+  fdb_transaction_destroy(tx);
+
+  // Scrubber reports the torn event
+  assert(fdb_scrub_pass(&config) == 1);
+  assert(found[0] == 2);
+  assert(found[1] == 1);
+  assert(metrics_get(METRIC_SCRUB_ANOMALIES) == 1);
+
+  // Cursor is reset at the end of a pass
+  assert(fdb_read_metadata_u64(SCRUB_CURSOR_METADATA, &cursor) == 0);
+  assert(cursor == 0);
+
+  // Scrubbing resumes from a stored cursor, skipping the torn event
+  if (fdb_write_metadata_u64(SCRUB_CURSOR_METADATA, 3))
+    fail_test();
+  assert(fdb_scrub_pass(&config) == 0);
+
+  // Release the dummy data memory
+  for (uint8_t i = 0; i < num_events; ++i) {
+    free_event(mock_events + i);
+  }
+  free((void *)mock_events);
+
+  // Clear the database
+  fdb_clear_database();
+
+  // Success
+  printf("fdb_scrub_pass() test PASSED\n");
+}
+
+void test_migrate_keys(void) {
+  FDBTransaction *tx;
+  Event *mock_events;
+  Event read;
+  uint64_t format;
+  uint32_t num_events = 5;
+  uint32_t data_size = ((2 * OPTIMAL_VALUE_SIZE) + 5);
+
+  printf("\nStarting fdb_migrate_keys() test...\n");
+
+  // Setup FoundationDB batch settings
+  fdb_set_batch_size(100);
+
+  // Setup events, each with 3 fragments, written in the fixed layout
+  mock_events = malloc(sizeof(Event) * num_events);
+  for (uint8_t i = 0; i < num_events; ++i) {
+    mock_events[i].id = (i * 255);
+    mock_events[i].data_length = data_size;
+    mock_events[i].data = generate_dummy_data(data_size);
+  }
+
+  if (fdb_write_event_array(mock_events, num_events))
+    fail_test();
+
+  // Move every key in small batches, splitting events across transactions
+  assert(fdb_migrate_keys(KEY_FORMAT_COMPACT, 4) == (3 * num_events));
+  assert(fdb_get_key_format() == KEY_FORMAT_COMPACT);
+  assert(fdb_read_metadata_u64(FDB_KEY_FORMAT_METADATA, &format) == 0);
+  assert(format == KEY_FORMAT_COMPACT);
+
+  if (fdb_check_error(fdb_setup_transaction(&tx)))
+    fail_test();
+  assert(count_keys_in_database(tx) == ((3 * num_events) + 1));
+  for (uint8_t i = 0; i < num_events; ++i)
+    assert(count_event_fragments_in_database(tx, mock_events[i].id) == 3);
+  fdb_transaction_destroy(tx);
+
+  // Events read back unchanged, and a rerun has nothing left to move
+  for (uint8_t i = 0; i < num_events; ++i) {
+    read.id = mock_events[i].id;
+    if (fdb_read_event(&read))
+      fail_test();
+    assert(read.data_length == data_size);
+    assert(!memcmp(read.data, mock_events[i].data, data_size));
+    free_event(&read);
+  }
+  assert(fdb_migrate_keys(KEY_FORMAT_COMPACT, 4) == 0);
+
+  // Events in the old layout are still found after switching back
+  fdb_set_key_format(KEY_FORMAT_FIXED);
+  read.id = mock_events[0].id;
+  if (fdb_read_event(&read))
+    fail_test();
+  free_event(&read);
+
+  assert(fdb_migrate_keys(KEY_FORMAT_FIXED, 1000) == (3 * num_events));
+  if (fdb_load_key_format())
+    fail_test();
+  assert(fdb_get_key_format() == KEY_FORMAT_FIXED);
+
+  // Release the dummy data memory
+  for (uint8_t i = 0; i < num_events; ++i) {
+    free_event(mock_events + i);
+  }
+  free((void *)mock_events);
+
+  // Clear the database
+  fdb_clear_database();
+
+  // Success
+  printf("fdb_migrate_keys() test PASSED\n");
+}
+
+void test_archive_events(void) {
+  char dir[] = "/tmp/seguro-archive-XXXXXX";
+  char path[ARCHIVE_PATH_MAX];
+  FDBTransaction *tx;
+  DIR *handle;
+  struct dirent *entry;
+  Event *mock_events;
+  Event reads[6];
+  MerkleTree scanned;
+  MerkleSource stored, source_scanned;
+  uint64_t watermark;
+  uint32_t num_events = 6;
+  uint32_t data_size = ((2 * OPTIMAL_VALUE_SIZE) + 5);
+
+  printf("\nStarting fdb_archive_events() test...\n");
+
+  if (!mkdtemp(dir))
+    fail_test();
+
+  // Setup FoundationDB batch settings
+  fdb_set_batch_size(100);
+  fdb_set_merkle(true);
+  fdb_merkle_source(NULL, &stored);
+
+  // Setup events, each with 3 fragments
+  mock_events = malloc(sizeof(Event) * num_events);
+  for (uint8_t i = 0; i < num_events; ++i) {
+    mock_events[i].id = i;
+    mock_events[i].data_length = data_size;
+    mock_events[i].data = generate_dummy_data(data_size);
+  }
+
+  if (fdb_write_event_array(mock_events, num_events))
+    fail_test();
+
+  // Two segments of at most 3 events hold the first 4 events
+  assert(fdb_archive_events(dir, 4, 3) == 4);
+  assert(archive_enabled());
+  assert(fdb_read_metadata_u64(FDB_ARCHIVE_METADATA, &watermark) == 0);
+  assert(watermark == 4);
+
+  if (fdb_check_error(fdb_setup_transaction(&tx)))
+    fail_test();
+  // The remaining fragments, the watermark, and one summary node per level
+  assert(count_keys_in_database(tx) == ((3 * 2) + 1 + MERKLE_LEVELS));
+  for (uint8_t i = 0; i < 4; ++i)
+    assert(count_event_fragments_in_database(tx, mock_events[i].id) == 0);
+  fdb_transaction_destroy(tx);
+
+  // The archived events left the summaries along with the cluster
+  merkle_tree_init(&scanned);
+  assert(fdb_merkle_scan(&scanned) == 0);
+  merkle_tree_source(&scanned, &source_scanned);
+  assert(merkle_diff(&stored, &source_scanned, NULL, NULL) == 0);
+  merkle_tree_free(&scanned);
+  fdb_set_merkle(false);
+
+  // Archived and live events read back alike, one at a time or as a set
+  for (uint8_t i = 0; i < num_events; ++i) {
+    reads[i].id = (num_events - 1 - i);
+    if (fdb_read_event(reads + i))
+      fail_test();
+    assert(reads[i].data_length == data_size);
+    assert(!memcmp(reads[i].data, mock_events[reads[i].id].data, data_size));
+    free_event(reads + i);
+  }
+  if (fdb_read_event_set(reads, num_events, 0))
+    fail_test();
+  for (uint8_t i = 0; i < num_events; ++i) {
+    assert(!memcmp(reads[i].data, mock_events[reads[i].id].data, data_size));
+    free_event(reads + i);
+  }
+
+  // A rerun has nothing left to archive
+  assert(fdb_archive_events(dir, 4, 3) == 0);
+
+  // Release the segments and the dummy data memory
+  archive_close();
+  handle = opendir(dir);
+  if (!handle)
+    fail_test();
+  while ((entry = readdir(handle))) {
+    if (entry->d_name[0] == '.')
+      continue;
+    snprintf(path, sizeof(path), "%s/%s", dir, entry->d_name);
+    unlink(path);
+  }
+  closedir(handle);
+  rmdir(dir);
+
+  for (uint8_t i = 0; i < num_events; ++i) {
+    free_event(mock_events + i);
+  }
+  free((void *)mock_events);
+
+  // Clear the database
+  fdb_clear_database();
+
+  // Success
+  printf("fdb_archive_events() test PASSED\n");
+}
+
+void test_merkle_summaries(void) {
+  Event *mock_events;
+  Event extra;
+  FragmentedEvent f_event;
+  MerkleTree scanned, expected;
+  MerkleSource stored, source_scanned, source_expected;
+  uint32_t num_events = 5;
+  uint32_t data_size = ((2 * OPTIMAL_VALUE_SIZE) + 5);
+
+  printf("\nStarting Merkle summary test...\n");
+
+  fdb_set_merkle(true);
+  fdb_set_batch_size(4);
+  fdb_merkle_source(NULL, &stored);
+
+  // Setup events across two buckets, written in batches and one at a time
+  mock_events = malloc(sizeof(Event) * num_events);
+  merkle_tree_init(&expected);
+  for (uint8_t i = 0; i < num_events; ++i) {
+    mock_events[i].id = (i * 2000);
+    mock_events[i].data_length = (data_size - i);
+    mock_events[i].data = generate_dummy_data(data_size);
+    assert(merkle_tree_add_event(&expected, (mock_events + i)) == 0);
+  }
+  merkle_tree_finish(&expected);
+  merkle_tree_source(&expected, &source_expected);
+
+  if (fdb_write_event_array(mock_events, (num_events - 1)))
+    fail_test();
+  if (fdb_write_event(mock_events + (num_events - 1)))
+    fail_test();
+
+  // The stored summaries match both the stored events and a local copy
+  merkle_tree_init(&scanned);
+  assert(fdb_merkle_scan(&scanned) == 0);
+  merkle_tree_source(&scanned, &source_scanned);
+  assert(merkle_diff(&stored, &source_scanned, NULL, NULL) == 0);
+  assert(merkle_diff(&stored, &source_expected, NULL, NULL) == 0);
+  merkle_tree_free(&scanned);
+
+  // Clearing an event takes it out of its bucket only
+  fragment_event(mock_events, &f_event);
+  if (fdb_clear_event(&f_event))
+    fail_test();
+  assert(merkle_diff(&stored, &source_expected, NULL, NULL) == 1);
+
+  // Clears subtract what is stored rather than what they are passed, so
+  // clearing an event twice, or with the wrong data, keeps the summaries right
+  if (fdb_clear_event(&f_event))
+    fail_test();
+  free_fragmented_event(&f_event);
+  extra.id = mock_events[1].id;
+  extra.data_length = 100;
+  extra.data = generate_dummy_data(100);
+  fragment_event(&extra, &f_event);
+  if (fdb_clear_event(&f_event))
+    fail_test();
+  free_fragmented_event(&f_event);
+  free_event(&extra);
+
+  assert(fdb_merkle_scan(&scanned) == 0);
+  assert(merkle_diff(&stored, &source_scanned, NULL, NULL) == 0);
+  assert(merkle_diff(&stored, &source_expected, NULL, NULL) == 1);
+  merkle_tree_free(&scanned);
+
+  // Writes made without summaries are only picked up by a rebuild
+  fdb_set_merkle(false);
+  extra.id = 9000;
+  extra.data_length = 100;
+  extra.data = generate_dummy_data(100);
+  if (fdb_write_event(&extra))
+    fail_test();
+
+  assert(fdb_merkle_scan(&scanned) == 0);
+  assert(merkle_diff(&stored, &source_scanned, NULL, NULL) == 1);
+  merkle_tree_free(&scanned);
+
+  assert(fdb_merkle_rebuild() == 0);
+  assert(fdb_merkle_scan(&scanned) == 0);
+  assert(merkle_diff(&stored, &source_scanned, NULL, NULL) == 0);
+  merkle_tree_free(&scanned);
+  merkle_tree_free(&expected);
+
+  // Release the dummy data memory
+  free_event(&extra);
+  for (uint8_t i = 0; i < num_events; ++i) {
+    free_event(mock_events + i);
+  }
+  free((void *)mock_events);
+
+  // Clear the database
+  fdb_clear_database();
+
+  // Success
+  printf("Merkle summary test PASSED\n");
+}
+
+void test_presence(void) {
+  Event mock_events[11];
+  FragmentedEvent f_event;
+  FragmentedEvent f_events[11];
+  FDBTransaction *tx;
+  uint32_t num_events = 0;
+  uint32_t keys;
+  uint64_t gap;
+
+  printf("\nStarting present-id bitmap test...\n");
+
+  fdb_set_presence(true);
+  fdb_set_batch_size(4);
+
+  // Setup events 0-9 without 5, and one in a later chunk, some spanning
+  // several transactions
+  for (uint64_t id = 0; id < 10; ++id) {
+    if (id == 5)
+      continue;
+
+    mock_events[num_events].id = id;
+    mock_events[num_events].data_length = ((id * OPTIMAL_VALUE_SIZE) + 1);
+    mock_events[num_events].data =
+        generate_dummy_data(mock_events[num_events].data_length);
+    ++num_events;
+  }
+  mock_events[num_events].id = (3 * PRESENCE_CHUNK_IDS);
+  mock_events[num_events].data_length = 10;
+  mock_events[num_events].data = generate_dummy_data(10);
+  ++num_events;
+
+  if (fdb_write_event_array(mock_events, (num_events - 1)))
+    fail_test();
+  if (fdb_write_event(mock_events + (num_events - 1)))
+    fail_test();
+
+  for (int rebuilt = 0; rebuilt < 2; ++rebuilt) {
+    assert(fdb_event_present(3) == 1);
+    assert(fdb_event_present(5) == 0);
+    assert(fdb_event_present(3 * PRESENCE_CHUNK_IDS) == 1);
+    assert(fdb_count_present(0, 10) == 9);
+    assert(fdb_count_present(0, UINT64_MAX) == 10);
+    assert(fdb_count_present(6, (3 * PRESENCE_CHUNK_IDS)) == 4);
+
+    assert(fdb_first_gap(0, 10, &gap) == 0);
+    assert(gap == 5);
+    assert(fdb_first_gap(6, 10, &gap) == 1);
+    assert(fdb_first_gap(6, (3 * PRESENCE_CHUNK_IDS), &gap) == 0);
+    assert(gap == 10);
+
+    // The same answers come from a bitmap rebuilt from the stored events
+    fdb_set_presence(false);
+    assert(fdb_presence_rebuild() == 0);
+  }
+
+  // Clearing an event leaves a gap
+  fdb_set_presence(true);
+  fragment_event(mock_events, &f_event);
+  if (fdb_clear_event(&f_event))
+    fail_test();
+  free_fragmented_event(&f_event);
+  assert(fdb_event_present(0) == 0);
+  assert(fdb_first_gap(0, 10, &gap) == 0);
+  assert(gap == 0);
+
+  // Clearing an id of a chunk which isn't stored marks nothing present
+  fragment_event(mock_events + 1, &f_event);
+  f_event.id = ((5 * PRESENCE_CHUNK_IDS) + 1);
+  if (fdb_clear_event(&f_event))
+    fail_test();
+  free_fragmented_event(&f_event);
+  assert(fdb_count_present(0, UINT64_MAX) == 9);
+
+  // Clearing the last present id of a chunk removes the chunk
+  if (fdb_check_error(fdb_setup_transaction(&tx)))
+    fail_test();
+  keys = count_keys_in_database(tx);
+  fragment_event(mock_events + (num_events - 1), &f_event);
+  if (fdb_clear_event(&f_event))
+    fail_test();
+  free_fragmented_event(&f_event);
+  fdb_transaction_reset(tx);
+  assert(count_keys_in_database(tx) == (keys - 2));
+  fdb_transaction_destroy(tx);
+  assert(fdb_count_present(0, UINT64_MAX) == 8);
+
+  // Clearing the rest as an array removes the last chunk too
+  for (uint32_t i = 1; i < (num_events - 1); ++i)
+    fragment_event((mock_events + i), (f_events + i));
+  if (fdb_clear_event_array((f_events + 1), (num_events - 2)))
+    fail_test();
+  for (uint32_t i = 1; i < (num_events - 1); ++i)
+    free_fragmented_event(f_events + i);
+  assert(fdb_count_present(0, UINT64_MAX) == 0);
+  if (fdb_check_error(fdb_setup_transaction(&tx)))
+    fail_test();
+  assert(count_keys_in_database(tx) == 0);
+  fdb_transaction_destroy(tx);
+  fdb_set_presence(false);
+
+  // Release the dummy data memory
+  for (uint32_t i = 0; i < num_events; ++i) {
+    free_event(mock_events + i);
+  }
+
+  // Clear the database
+  fdb_clear_database();
+
+  // Success
+  printf("present-id bitmap test PASSED\n");
+}
+
+void test_lazy_read(void) {
+  Event mock_events[2];
+  Event read;
+  uint64_t faults = metrics_get(METRIC_LAZY_FAULTS);
+  uint64_t num_pages;
+  uint64_t middle;
+
+  printf("\nStarting lazy read test...\n");
+
+  // Setup a huge event, and one of a single fragment
+  fdb_set_batch_size(100);
+  mock_events[0].id = 1;
+  mock_events[0].data_length = ((100 * OPTIMAL_VALUE_SIZE) + 1234);
+  mock_events[0].data = generate_dummy_data(mock_events[0].data_length);
+  mock_events[1].id = 2;
+  mock_events[1].data_length = 100;
+  mock_events[1].data = generate_dummy_data(100);
+  if (fdb_write_event_array(mock_events, 2))
+    fail_test();
+
+  // A byte in the middle is filled on its own, then the rest in order
+  read.id = 1;
+  assert(fdb_read_event_lazy(&read) == 0);
+  assert(read.data_length == mock_events[0].data_length);
+  middle = (read.data_length / 2);
+  assert(read.data[middle] == mock_events[0].data[middle]);
+  assert(!memcmp(read.data, mock_events[0].data, read.data_length));
+  assert(!fdb_lazy_event_failed(&read));
+
+  // Linear reads fill ever more pages per fault
+  if (fdb_lazy_available()) {
+    num_pages = (read.data_length / (uint64_t)sysconf(_SC_PAGESIZE));
+    faults = (metrics_get(METRIC_LAZY_FAULTS) - faults);
+    assert(faults > 0);
+    assert(faults < (num_pages / 4));
+  }
+
+  fdb_release_lazy_event(&read);
+  assert(!read.data);
+
+  read.id = 2;
+  assert(fdb_read_event_lazy(&read) == 0);
+  assert(read.data_length == 100);
+  assert(!memcmp(read.data, mock_events[1].data, 100));
+  fdb_release_lazy_event(&read);
+
+  read.id = 3;
+  assert(fdb_read_event_lazy(&read) == -1);
+
+  // Release the dummy data memory
+  for (uint32_t i = 0; i < 2; ++i) {
+    free_event(mock_events + i);
+  }
+
+  // Clear the database
+  fdb_clear_database();
+
+  // Success
+  printf("lazy read test PASSED\n");
+}
+
+void test_write_durability(void) {
+  Event mock_events[40];
+  Event read;
+  int status;
+  uint64_t events = metrics_get(METRIC_BUFFER_EVENTS);
+  uint64_t dropped = metrics_get(METRIC_BUFFER_DROPPED);
+  struct timespec wait = {0, 200000000L};
+
+  printf("\nStarting write durability test...\n");
+
+  fdb_set_batch_size(100);
+  for (uint32_t i = 0; i < 40; ++i) {
+    mock_events[i].id = i;
+    mock_events[i].data_length = (OPTIMAL_VALUE_SIZE + i);
+    mock_events[i].data = generate_dummy_data(mock_events[i].data_length);
+  }
+
+  // Without a buffer, every write is durable
+  assert(fdb_write_event_durability(mock_events, DURABILITY_BUFFERED) == 0);
+  read.id = 0;
+  assert(fdb_read_event(&read) == 0);
+  free_event(&read);
+
+  // Buffered writes block while a buffer of four events is full, and are all
+  // committed by a flush
+  assert(fdb_start_write_buffer((4 * (OPTIMAL_VALUE_SIZE + 40)), 1000) == 0);
+  assert(fdb_start_write_buffer(0, 0) == -1);
+  assert(fdb_write_event_array_durability((mock_events + 1), 19,
+                                          DURABILITY_BUFFERED) == 0);
+  assert(fdb_flush_writes() == 0);
+  assert(metrics_get(METRIC_BUFFER_EVENTS) == (events + 19));
+  for (uint64_t id = 1; id < 20; ++id) {
+    read.id = id;
+    assert(fdb_read_event(&read) == 0);
+    assert(!memcmp(read.data, mock_events[id].data, read.data_length));
+    free_event(&read);
+  }
+
+  // Fire-and-forget writes are dropped rather than wait, and a lone write is
+  // flushed by its deadline
+  assert(fdb_write_event_array_durability((mock_events + 20), 19,
+                                          DURABILITY_FIRE_AND_FORGET) == 0);
+  assert(fdb_flush_writes() == 0);
+  assert((metrics_get(METRIC_BUFFER_EVENTS) +
+          metrics_get(METRIC_BUFFER_DROPPED)) == (events + dropped + 38));
+
+  assert(fdb_write_event_durability((mock_events + 39),
+                                    DURABILITY_BUFFERED) == 0);
+  read.id = 39;
+  status = fdb_read_event(&read);
+  for (uint32_t i = 0; (i < 10) && status; ++i) {
+    nanosleep(&wait, NULL);
+    status = fdb_read_event(&read);
+  }
+  assert(status == 0);
+  free_event(&read);
+
+  assert(fdb_stop_write_buffer() == 0);
+  assert(!fdb_write_buffer_started());
+
+  // Release the dummy data memory
+  for (uint32_t i = 0; i < 40; ++i) {
+    free_event(mock_events + i);
+  }
+
+  // Clear the database
+  fdb_clear_database();
+
+  // Success
+  printf("write durability test PASSED\n");
+}
+
+void test_reorder_buffer(void) {
+  pthread_t threads[4];
+  Event read;
+
+  printf("\nStarting reorder buffer test...\n");
+
+  fdb_set_batch_size(100);
+  reorder_events = malloc(sizeof(Event) * REORDER_TEST_EVENTS);
+  for (uint32_t i = 0; i < REORDER_TEST_EVENTS; ++i) {
+    reorder_events[i].id = i;
+    reorder_events[i].data_length = (i % 5) ? 100 : (OPTIMAL_VALUE_SIZE + i);
+    reorder_events[i].data =
+        generate_dummy_data(reorder_events[i].data_length);
+  }
+
+  // The window covers two blocks, so producers a block ahead of it wait
+  if (reorder_buffer_init(&reorder_buffer, 0, (2 * REORDER_TEST_BLOCK)))
+    fail_test();
+
+  for (uintptr_t i = 0; i < 4; ++i)
+    if (pthread_create((threads + i), NULL, submit_reordered_thread,
+                       (void *)i))
+      fail_test();
+
+  for (uint8_t i = 0; i < 4; ++i) {
+    void *err;
+
+    pthread_join(threads[i], &err);
+    if (err)
+      fail_test();
+  }
+
+  // Every event is committed once the producers return
+  assert(reorder_buffer_wait(&reorder_buffer, (REORDER_TEST_EVENTS - 1)) == 0);
+  assert(reorder_buffer_watermark(&reorder_buffer) == REORDER_TEST_EVENTS);
+  for (uint64_t id = 0; id < REORDER_TEST_EVENTS; id += 37) {
+    read.id = id;
+    assert(fdb_read_event(&read) == 0);
+    assert(read.data_length == reorder_events[id].data_length);
+    assert(!memcmp(read.data, reorder_events[id].data, read.data_length));
+    free_event(&read);
+  }
+
+  // Committed ids are refused
+  assert(fdb_reorder_submit(&reorder_buffer, reorder_events) == -1);
+  reorder_buffer_free(&reorder_buffer);
+
+  // Release the dummy data memory
+  for (uint32_t i = 0; i < REORDER_TEST_EVENTS; ++i) {
+    free_event(reorder_events + i);
+  }
+  free(reorder_events);
+
+  // Clear the database
+  fdb_clear_database();
+
+  // Success
+  printf("reorder buffer test PASSED\n");
+}
+
+void *submit_reordered_thread(void *arg) {
+  uint32_t num_blocks = (REORDER_TEST_EVENTS / REORDER_TEST_BLOCK);
+
+  for (uint32_t block = (uintptr_t)arg; block < num_blocks; block += 4) {
+    for (uint32_t i = REORDER_TEST_BLOCK; i > 0; --i) {
+      Event *event = (reorder_events + (block * REORDER_TEST_BLOCK) + i - 1);
+
+      if (fdb_reorder_submit(&reorder_buffer, event))
+        return (void *)event;
+    }
+  }
+
+  return NULL;
+}
+
+void test_scheduler(void) {
+  TenantLimits limits = {0};
+  TenantStats noisy_stats, quiet_stats, limited_stats;
+  Tenant *noisy, *quiet, *limited;
+  Event mock_events[60];
+  pthread_t thread;
+  struct timespec start, end;
+  uint64_t elapsed_ms;
+  void *err;
+
+  printf("\nStarting tenant scheduler test...\n");
+
+  fdb_set_batch_size(100);
+  if (fdb_start_scheduler((16 * 1024), (64 * 1024)))
+    fail_test();
+  assert(fdb_start_scheduler(0, 0) == -1);
+
+  noisy = scheduler_add_tenant(NULL);
+  quiet = scheduler_add_tenant(NULL);
+  limits.events_per_sec = 200;
+  limited = scheduler_add_tenant(&limits);
+  if (!noisy || !quiet || !limited)
+    fail_test();
+
+  // A quiet tenant's writes join the next batch however much a noisy tenant
+  // has queued
+  if (pthread_create(&thread, NULL, write_noisy_tenant_thread, noisy))
+    fail_test();
+  for (uint32_t i = 0; i < 5; ++i) {
+    mock_events[i].id = (1000 + i);
+    mock_events[i].data_length = 1000;
+    mock_events[i].data = generate_dummy_data(mock_events[i].data_length);
+    assert(fdb_tenant_write(quiet, (mock_events + i), 1) == 0);
+    free_event(mock_events + i);
+  }
+  pthread_join(thread, &err);
+  if (err)
+    fail_test();
+
+  scheduler_tenant_stats(noisy, &noisy_stats);
+  scheduler_tenant_stats(quiet, &quiet_stats);
+  assert((noisy_stats.events == 400) && (quiet_stats.events == 5));
+  assert((noisy_stats.errors == 0) && (quiet_stats.errors == 0));
+  assert(quiet_stats.queued_events == 0);
+  assert(quiet_stats.max_latency_us <= noisy_stats.max_latency_us);
+
+  // A tenant limited to 200 events per second bursts 20 at once, so 60 take
+  // at least 200 ms
+  for (uint32_t i = 0; i < 60; ++i) {
+    mock_events[i].id = (2000 + i);
+    mock_events[i].data_length = 100;
+    mock_events[i].data = generate_dummy_data(mock_events[i].data_length);
+  }
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  assert(fdb_tenant_write(limited, mock_events, 60) == 0);
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  elapsed_ms = (uint64_t)(((end.tv_sec - start.tv_sec) * 1000) +
+                          ((end.tv_nsec - start.tv_nsec) / 1000000));
+  assert(elapsed_ms >= 150);
+
+  scheduler_tenant_stats(limited, &limited_stats);
+  assert((limited_stats.events == 60) && (limited_stats.throttled > 0));
+
+  for (uint64_t id = 0; id < 400; id += 57) {
+    Event read = {.id = id};
+
+    assert(fdb_read_event(&read) == 0);
+    assert(read.data_length == 1000);
+    free_event(&read);
+  }
+
+  scheduler_remove_tenant(limited);
+  assert(fdb_stop_scheduler() == 0);
+  assert(fdb_stop_scheduler() == -1);
+
+  // Release the dummy data memory
+  for (uint32_t i = 0; i < 60; ++i) {
+    free_event(mock_events + i);
+  }
+
+  // Clear the database
+  fdb_clear_database();
+
+  // Success
+  printf("tenant scheduler test PASSED\n");
+}
+
+void *write_noisy_tenant_thread(void *arg) {
+  Event *events = malloc(sizeof(Event) * 400);
+  int err;
+
+  for (uint32_t i = 0; i < 400; ++i) {
+    events[i].id = i;
+    events[i].data_length = 1000;
+    events[i].data = generate_dummy_data(events[i].data_length);
+  }
+
+  err = fdb_tenant_write((Tenant *)arg, events, 400);
+
+  for (uint32_t i = 0; i < 400; ++i) {
+    free_event(events + i);
+  }
+  free(events);
+
+  return err ? arg : NULL;
+}
+
+void test_encrypted_events(void) {
+  FDBTransaction *tx;
+  FDBFuture *future;
+  Event mock_events[2];
+  Event read;
+  FragmentedEvent f_event;
+  fdb_bool_t present;
+  const uint8_t *value;
+  int value_length;
+  uint8_t cipher_key[CIPHER_KEY_SIZE] = {1, 2, 3, 4, 5, 6, 7, 8};
+  uint8_t nonce[CIPHER_NONCE_SIZE];
+  uint8_t key[FDB_KEY_MAX_LENGTH];
+  uint8_t key_length;
+  uint32_t data_size = ((2 * OPTIMAL_VALUE_SIZE) + 5);
+
+  printf("\nStarting encrypted event test...\n");
+
+  // Setup FoundationDB batch settings
+  fdb_set_batch_size(100);
+  cipher_set_key(cipher_key);
+
+  // Setup events, each with 3 fragments
+  for (uint8_t i = 0; i < 2; ++i) {
+    mock_events[i].id = i;
+    mock_events[i].data_length = data_size;
+    mock_events[i].data = generate_dummy_data(data_size);
+  }
+
+  if (fdb_write_event_array(mock_events, 2))
+    fail_test();
+
+  // Events read back unchanged
+  for (uint8_t i = 0; i < 2; ++i) {
+    read.id = mock_events[i].id;
+    if (fdb_read_event(&read))
+      fail_test();
+    assert(read.data_length == data_size);
+    assert(!memcmp(read.data, mock_events[i].data, data_size));
+    free_event(&read);
+  }
+
+  // Stored fragments are sealed, not plaintext
+  if (fdb_check_error(fdb_setup_transaction(&tx)))
+    fail_test();
+  key_length = fdb_build_event_key(key, 1, 2);
+  future = fdb_transaction_get(tx, key, key_length, 0);
+  if (fdb_check_error(fdb_future_block_until_ready(future)))
+    fail_test();
+  if (fdb_check_error(
+          fdb_future_get_value(future, &present, &value, &value_length)))
+    fail_test();
+  assert(present);
+  assert(value_length == (OPTIMAL_VALUE_SIZE + CIPHER_OVERHEAD));
+  assert(memcmp(value, (mock_events[1].data + OPTIMAL_VALUE_SIZE + 5),
+                OPTIMAL_VALUE_SIZE));
+  memcpy(nonce, (value + OPTIMAL_VALUE_SIZE + CIPHER_TAG_SIZE),
+         CIPHER_NONCE_SIZE);
+
+  // A fragment moved into another event fails authentication
+  key_length = fdb_build_event_key(key, 0, 2);
+  fdb_transaction_set(tx, key, key_length, value, value_length);
+  fdb_future_destroy(future);
+  if (fdb_send_transaction(tx))
+    fail_test();
+  fdb_transaction_destroy(tx);
+
+  read.id = 0;
+  assert(fdb_read_event(&read) == -1);
+
+  // A cleared id written again with different data gets fresh nonces
+  fragment_event((mock_events + 1), &f_event);
+  if (fdb_clear_event(&f_event))
+    fail_test();
+  free_fragmented_event(&f_event);
+  mock_events[1].data[0] ^= 0xFF;
+  if (fdb_write_event(mock_events + 1))
+    fail_test();
+
+  read.id = 1;
+  if (fdb_read_event(&read))
+    fail_test();
+  assert(read.data_length == data_size);
+  assert(!memcmp(read.data, mock_events[1].data, data_size));
+  free_event(&read);
+
+  if (fdb_check_error(fdb_setup_transaction(&tx)))
+    fail_test();
+  key_length = fdb_build_event_key(key, 1, 2);
+  future = fdb_transaction_get(tx, key, key_length, 0);
+  if (fdb_check_error(fdb_future_block_until_ready(future)))
+    fail_test();
+  if (fdb_check_error(
+          fdb_future_get_value(future, &present, &value, &value_length)))
+    fail_test();
+  assert(present);
+  assert(memcmp((value + OPTIMAL_VALUE_SIZE + CIPHER_TAG_SIZE), nonce,
+                CIPHER_NONCE_SIZE));
+  fdb_future_destroy(future);
+  fdb_transaction_destroy(tx);
+
+  cipher_set_key(NULL);
+
+  // Release the dummy data memory
+  for (uint8_t i = 0; i < 2; ++i) {
+    free_event(mock_events + i);
+  }
+
+  // Clear the database
+  fdb_clear_database();
+
+  // Success
+  printf("encrypted event test PASSED\n");
+}
+
+void test_fault_injection(void) {
+  FaultConfig faults = {.not_committed = 0.2,
+                        .unknown_result = 0.1,
+                        .too_old = 0.1,
+                        .spike_rate = 0.05,
+                        .spike_ms = 1.0,
+                        .seed = 7};
+  FaultConfig failing = {.not_committed = 1.0};
+  Event mock_events[50];
+  Event read;
+  FragmentedEvent f_event;
+  FragmentedEvent f_events[2];
+  MerkleTree scanned, expected;
+  MerkleSource stored, source_scanned, source_expected;
+  uint32_t data_size = (OPTIMAL_VALUE_SIZE + 100);
+
+  printf("\nStarting fault injection test...\n");
+
+  // Setup FoundationDB batch settings, so each event takes 2 transactions
+  fdb_set_batch_size(1);
+  metrics_reset();
+
+  for (uint8_t i = 0; i < 50; ++i) {
+    mock_events[i].id = i;
+    mock_events[i].data_length = data_size;
+    mock_events[i].data = generate_dummy_data(data_size);
+  }
+
+  // Writes and reads carry on through the faults, with summaries kept
+  fdb_set_merkle(true);
+  fdb_merkle_source(NULL, &stored);
+  assert(fdb_set_faults(&faults) == 0);
+  if (fdb_write_event_array(mock_events, 25))
+    fail_test();
+  for (uint8_t i = 25; i < 50; ++i) {
+    if (fdb_write_event(mock_events + i))
+      fail_test();
+  }
+  for (uint8_t i = 0; i < 50; ++i) {
+    read.id = i;
+    if (fdb_read_event(&read))
+      fail_test();
+    assert(read.data_length == data_size);
+    assert(!memcmp(read.data, mock_events[i].data, data_size));
+    free_event(&read);
+  }
+
+  // Commits with an unknown result landed, yet their retries counted every
+  // fragment once, whether written or cleared, one event or an array at a time
+  for (uint8_t i = 0; i < 50; i += 10) {
+    fragment_event(mock_events + i, &f_event);
+    if (fdb_clear_event(&f_event))
+      fail_test();
+    free_fragmented_event(&f_event);
+
+    fragment_event(mock_events + (i + 5), f_events);
+    fragment_event(mock_events + (i + 6), (f_events + 1));
+    if (fdb_clear_event_array(f_events, 2))
+      fail_test();
+    free_fragmented_event(f_events);
+    free_fragmented_event(f_events + 1);
+  }
+  merkle_tree_init(&expected);
+  for (uint8_t i = 0; i < 50; ++i) {
+    if ((i % 5) && ((i % 10) != 6))
+      assert(merkle_tree_add_event(&expected, (mock_events + i)) == 0);
+  }
+  merkle_tree_finish(&expected);
+  merkle_tree_source(&expected, &source_expected);
+  merkle_tree_init(&scanned);
+  assert(fdb_merkle_scan(&scanned) == 0);
+  merkle_tree_source(&scanned, &source_scanned);
+  assert(merkle_diff(&stored, &source_scanned, NULL, NULL) == 0);
+  assert(merkle_diff(&stored, &source_expected, NULL, NULL) == 0);
+  merkle_tree_free(&scanned);
+  merkle_tree_free(&expected);
+  fdb_set_merkle(false);
+
+  assert(metrics_get(METRIC_FAULT_ERRORS) > 0);
+  assert(metrics_get(METRIC_FAULT_SPIKES) > 0);
+  assert(metrics_get(METRIC_WRITE_RETRIES) > 0);
+  assert((metrics_get(METRIC_READ_ROLLOVERS) +
+          metrics_get(METRIC_READ_RETRIES)) > 0);
+
+  // Invalid shares are rejected, and leave the faults unchanged
+  failing.too_old = 0.5;
+  assert(fdb_set_faults(&failing) == -1);
+  failing.too_old = 0.0;
+
+  // Writes give up once the retry limit is reached
+  assert(fdb_set_retry_policy(3, 10) == 0);
+  assert(fdb_set_faults(&failing) == 0);
+  assert(fdb_write_event(mock_events) == -1);
+  assert(fdb_set_faults(NULL) == 0);
+  assert(fdb_set_retry_policy(-1, 1000) == 0);
+
+  // Release the dummy data memory
+  for (uint8_t i = 0; i < 50; ++i) {
+    free_event(mock_events + i);
+  }
+
+  // Clear the database
+  fdb_clear_database();
+
+  // Success
+  printf("fault injection test PASSED\n");
+}
+
+void record_anomaly(ScrubAnomaly anomaly, uint64_t event_id, uint32_t fragment,
+                    void *context) {
+  uint64_t *found = (uint64_t *)context;
+
+  assert(anomaly == SCRUB_MISSING_FRAGMENT);
+  found[0] = event_id;
+  found[1] = fragment;
+}
+
+uint8_t *generate_dummy_data(uint64_t size) {
+  uint8_t *result = malloc(sizeof(uint8_t) * size);
+
+  // Seed the random number generator
+  srand(clock());
+
+  // Generate random byte data
+  for (uint64_t i = 0; i < size; ++i) {
+    result[i] = rand() % 256;
+  }
+
+  // Success
+  return result;
+}
+
+/*
+ * Found on the FDB forums:
+ *
+ * "The fdb_transaction_get_range() operation returns data one batch at a time,
+ * meaning that you are supposed to check the value of out_more to know whether
+ * you need to call it again to get more keys for the range. The
+ * FDB_STREAMING_MODE_WANT_ALL streaming mode does not mean 'in a single
+ * batch'; it should be understood as 'in as few batches as possible'. The other
+ * streaming modes are for cases where the user plans to inspect data as it
+ * arrives and stop iterating on some end condition, possibly well before the
+ * end of the range.
+ *
+ * Consider the hypothetical case of 5000 keys in a given range. It's possible
+ * that FDB will only return 3000 keys: what it considers to be the ideal batch
+ * size for this get request. In this case, the user would need to check if
+ * out_more is non-zero after the call, and call the fdb_transaction_get_range
+ * again using the FDB_KEYSEL_FIRST_GREATER_THAN macro on the last key of the
+ * previous batch. The user would need to repeat this until one such transaction
+ * returned an out_more value of 0 - or more specifically, until one such
+ * transaction failed to set out_more to 1."
+ *
+ * https://forums.foundationdb.org/t/why-can-i-only-range-read-2857-keys/1517/2
+ *
+ */
+uint32_t count_keys_in_database(FDBTransaction *tx) {
+  FDBFuture *future;
+  const FDBKeyValue *out_kv;
+  fdb_bool_t out_more;
+  uint32_t out_total = 0;
+  int32_t out_count;
+  uint8_t range_start_key = 0;
+  uint8_t range_end_key = 0xFF;
+
+  // Loop until FoundationDB says there is no more data
+  do {
+    out_more = 0;
+    future = fdb_transaction_get_range(
+        tx, &range_start_key, 0, 0, (out_total + 1), &range_end_key, 1, 0, 1, 0,
+        0, FDB_STREAMING_MODE_WANT_ALL, 0, 0, 0);
+
+    if (fdb_check_error(fdb_future_block_until_ready(future)))
+      fail_test();
+    if (fdb_check_error(fdb_future_get_error(future)))
+      fail_test();
+    if (fdb_check_error(fdb_future_get_keyvalue_array(future, &out_kv,
+                                                      &out_count, &out_more)))
+      fail_test();
+
+    out_total += out_count;
+
+    fdb_future_destroy(future);
+  } while (out_more);
+
+  return (uint32_t)out_total;
+}
+
+uint32_t count_event_fragments_in_database(FDBTransaction *tx,
+                                           uint64_t event_id) {
+  FDBFuture *future;
+  const FDBKeyValue *out_kv;
+  fdb_bool_t out_more;
+  uint32_t out_total = 0;
+  int32_t out_count;
+  uint8_t range_start_key[FDB_KEY_MAX_LENGTH];
+  uint8_t range_end_key[FDB_KEY_MAX_LENGTH];
+  uint8_t start_length, end_length;
+
+  start_length = fdb_build_event_key(range_start_key, event_id, 0);
+  end_length = fdb_build_event_key(range_end_key, (event_id + 1), 0);
+
+  // Loop until FoundationDB says there is no more data
+  do {
+    out_more = 0;
+    future = fdb_transaction_get_range(
+        tx, range_start_key, start_length, 1, out_total, range_end_key,
+        end_length, 0, 1, 0, 0, FDB_STREAMING_MODE_WANT_ALL, 0, 0, 0);
+
+    if (fdb_check_error(fdb_future_block_until_ready(future)))
+      fail_test();
+    if (fdb_check_error(fdb_future_get_error(future)))
+      fail_test();
+    if (fdb_check_error(fdb_future_get_keyvalue_array(future, &out_kv,
+                                                      &out_count, &out_more)))
+      fail_test();
+
+    out_total += out_count;
+
+    fdb_future_destroy(future);
+  } while (out_more);
+
+  return (uint32_t)out_total;
+}
+
+void read_blob_nonce(uint64_t event_id, uint32_t chunk, uint8_t *nonce) {
+  FDBTransaction *tx;
+  FDBFuture *future;
+  fdb_bool_t present;
+  const uint8_t *value;
+  int value_length;
+  uint8_t key[(1 + FDB_KEY_EVENT_LENGTH + FDB_KEY_FRAGMENT_LENGTH)];
+
+  // Prefix, then the event id and chunk number, big-endian
+  key[0] = FDB_BLOB_PREFIX;
+  for (uint32_t i = 0; i < FDB_KEY_EVENT_LENGTH; ++i)
+    key[(1 + i)] = (uint8_t)(event_id >> (56 - (8 * i)));
+  for (uint32_t i = 0; i < FDB_KEY_FRAGMENT_LENGTH; ++i)
+    key[(1 + FDB_KEY_EVENT_LENGTH + i)] = (uint8_t)(chunk >> (24 - (8 * i)));
+
+  if (fdb_check_error(fdb_setup_transaction(&tx)))
+    fail_test();
+  future = fdb_transaction_get(tx, key, sizeof(key), 0);
+  if (fdb_check_error(fdb_future_block_until_ready(future)) ||
+      fdb_check_error(
+          fdb_future_get_value(future, &present, &value, &value_length)))
+    fail_test();
+  assert(present && (value_length == (OPTIMAL_VALUE_SIZE + CIPHER_OVERHEAD)));
+
+  memcpy(nonce, (value + OPTIMAL_VALUE_SIZE + CIPHER_TAG_SIZE),
+         CIPHER_NONCE_SIZE);
+
+  fdb_future_destroy(future);
+  fdb_transaction_destroy(tx);
 }
 
 void fail_test(void) {
@@ -2,13 +2,40 @@
 ///
 /// Unit tests for Seguro
 
+#define _POSIX_C_SOURCE 200809L
+
 #include <assert.h>
+#include <math.h>
+#include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
 
+#include "../archive.h"
+#include "../baseline.h"
+#include "../cipher.h"
 #include "../constants.h"
 #include "../event.h"
+#include "../event_batch.h"
+#include "../fdb.h"
+#include "../fdb_faults.h"
+#include "../fdb_footprint.h"
+#include "../fdb_lazy.h"
+#include "../fdb_merkle.h"
+#include "../fdb_presence.h"
+#include "../fdb_reorder.h"
+#include "../fdb_scheduler.h"
+#include "../fdb_slow_log.h"
+#include "../fdb_timer.h"
+#include "../metrics.h"
+#include "../perf_counters.h"
+#include "../placement.h"
+#include "../read_plan.h"
+#include "../shm_cache.h"
+#include "../slab.h"
 
 //==============================================================================
 // Prototypes
@@ -36,6 +63,76 @@ void test_build_header(void);
 /// Test reading information from event headers.
 void test_read_header(void);
 
+/// Test bounds-checked reading of stored event headers.
+void test_parse_header(void);
+
+/// Test planning event batches into transactions.
+void test_batch_plan(void);
+
+/// Test single and bulk event key encoding.
+void test_event_keys(void);
+
+/// Test storage footprint accounting.
+void test_footprint(void);
+
+/// Test the slow-operation log.
+void test_slow_log(void);
+
+/// Test CPU list parsing for thread placement.
+void test_placement(void);
+
+/// Test the slab allocator.
+void test_slab(void);
+
+/// Test sealing and opening event fragments.
+void test_cipher(void);
+
+/// Test planning the range reads of a scattered set of event identifiers.
+void test_read_plan(void);
+
+/// Test the shared-memory event cache, across processes.
+void test_shm_cache(void);
+
+/// Test writing, mapping and reading archive segments.
+void test_archive(void);
+
+/// Test building and comparing in-memory Merkle summaries.
+void test_merkle(void);
+
+/// Test counting and searching the bits of present-id bitmap chunks.
+void test_presence_bits(void);
+
+/// Test mapping parts of lazily read events to the fragments holding them.
+void test_lazy_span(void);
+
+/// Test that the reorder buffer releases contiguous runs in id order.
+void test_reorder_runs(void);
+
+/// Test that tenant latencies are bucketed and their percentiles estimated.
+void test_tenant_latency(void);
+
+/// Test that the async benchmark's batch times are bucketed and summarized.
+void test_batch_histogram(void);
+
+/// Test that performance counts are scaled for multiplexing, and that phases
+/// can be counted wherever counters are available.
+void test_perf_counters(void);
+
+/// Test the baseline store, and the bootstrap comparison of runs.
+void test_baseline(void);
+
+/// Test that faults are injected in their configured shares.
+void test_fault_shares(void);
+
+/// Record the buckets reported by merkle_diff().
+void record_merkle_diff(uint64_t first_id, uint64_t last_id, void *context);
+
+/// Test that operations above the threshold are recorded, newest first.
+void test_slow_log_threshold(void);
+
+/// Test that the slow-operation log keeps only the most recent records.
+void test_slow_log_capacity(void);
+
 //==============================================================================
 // Functions
 //=============================================================================
@@ -53,6 +150,25 @@ int main(int argc, char **argv) {
   // Run tests
   test_fragment_event();
   test_headers();
+  test_batch_plan();
+  test_event_keys();
+  test_footprint();
+  test_slow_log();
+  test_placement();
+  test_slab();
+  test_cipher();
+  test_read_plan();
+  test_shm_cache();
+  test_archive();
+  test_merkle();
+  test_presence_bits();
+  test_lazy_span();
+  test_reorder_runs();
+  test_tenant_latency();
+  test_batch_histogram();
+  test_perf_counters();
+  test_baseline();
+  test_fault_shares();
 
   // Success
   printf("\nUnit tests completed successfully.\n");
@@ -163,6 +279,7 @@ void test_headers(void) {
 
   test_build_header();
   test_read_header();
+  test_parse_header();
 
   printf("Completed event header tests.\n");
 }
@@ -297,5 +414,1324 @@ void test_read_header(void) {
   assert(header_length == 4);
   assert(num_fragments == 0);
 
+  // Short headers don't depend on what the count held before
+  build_header(header, 128);
+  num_fragments = UINT32_MAX;
+  header_length = read_header(header, &num_fragments);
+  assert(header_length == 2);
+  assert(num_fragments == 128);
+
+  printf(" PASSED\n");
+}
+
+void test_parse_header(void) {
+  uint8_t value[8] = {0};
+  uint32_t num_fragments = 0;
+
+  printf("\tparsing stored headers... ");
+
+  // Headers which fit the value
+  build_header(value, 127);
+  assert(parse_header(value, 1, &num_fragments) == 1);
+  assert(num_fragments == 127);
+  build_header(value, 65536);
+  assert(parse_header(value, 8, &num_fragments) == 4);
+  assert(num_fragments == 65536);
+
+  // Empty values
+  assert(parse_header(value, 0, &num_fragments) == -1);
+
+  // Headers which claim more bytes than the value holds
+  build_header(value, 256);
+  assert(parse_header(value, 2, &num_fragments) == -1);
+
+  // Headers which claim more bytes than MAX_HEADER_SIZE
+  value[0] = (EXTENDED_HEADER | 0x7F);
+  assert(parse_header(value, 8, &num_fragments) == -1);
+  value[0] = (EXTENDED_HEADER | MAX_HEADER_SIZE);
+  assert(parse_header(value, 8, &num_fragments) == -1);
+
+  printf(" PASSED\n");
+}
+
+void test_footprint(void) {
+  FootprintStats stats;
+  FootprintReport report;
+  uint8_t small[10] = {0};
+  uint8_t large[OPTIMAL_VALUE_SIZE] = {0};
+
+  printf("\nStarting storage footprint tests...\n");
+  printf("\tfootprint accounting... ");
+
+  footprint_init(&stats);
+
+  // Single-fragment event: 1-byte header + 9 bytes of payload
+  build_header(small, 0);
+  footprint_add_fragment(&stats, 1, 0, 13, small, 10);
+
+  // Three-fragment event: header + 100 payload bytes, then two full fragments
+  build_header(large, 2);
+  footprint_add_fragment(&stats, 2, 0, 13, large, 101);
+  footprint_add_fragment(&stats, 2, 1, 13, large, OPTIMAL_VALUE_SIZE);
+  footprint_add_fragment(&stats, 2, 2, 13, large, OPTIMAL_VALUE_SIZE);
+
+  // Torn event: header promises 2 fragments, only 1 stored
+  build_header(small, 1);
+  footprint_add_fragment(&stats, 3, 0, 13, small, 10);
+  footprint_finish(&stats);
+
+  assert(stats.num_events == 3);
+  assert(stats.num_kvs == 5);
+  assert(stats.key_bytes == (5 * 13));
+  assert(stats.header_bytes == 3);
+  assert(stats.payload_bytes == (9 + 100 + (2 * OPTIMAL_VALUE_SIZE) + 9));
+  assert(stats.torn_events == 1);
+  assert(stats.packable_events == 1);
+  assert(stats.packable_bytes == 10);
+  assert(stats.kv_histogram[0] == 2);
+  assert(stats.kv_histogram[1] == 1);
+
+  // Report ratios
+  footprint_report(&stats, 0.0, &report);
+  assert(report.logical_amplification > 1.0);
+  assert(report.storage_amplification == report.logical_amplification);
+  assert(report.fragment_utilization > 0.0);
+  assert(report.fragment_utilization <= 1.0);
+  // A lone small event gains nothing from packing but pays for its index
+  assert(report.packed_bytes ==
+         (report.storage_bytes + FOOTPRINT_PACKED_INDEX_SIZE));
+  assert(report.compressed_bytes <= report.storage_bytes);
+
+  footprint_report(&stats, 40.0, &report);
+  assert(report.storage_amplification > report.logical_amplification);
+
+  printf(" PASSED\n");
+  printf("Completed storage footprint tests.\n");
+}
+
+void test_slow_log(void) {
+  printf("\nStarting slow-operation log tests...\n");
+
+  test_slow_log_threshold();
+  test_slow_log_capacity();
+
+  printf("Completed slow-operation log tests.\n");
+}
+
+void test_slow_log_threshold(void) {
+  SlowOp op;
+  SlowOp records[4];
+
+  printf("\tthreshold recording... ");
+
+  // Disabled log records nothing
+  assert(!fdb_slow_log_configure(0.0, 0.0, 0));
+  fdb_slow_log_begin(&op, SLOW_OP_WRITE, 1, NULL);
+  assert(!op.enabled);
+  fdb_slow_log_end(&op);
+  assert(fdb_slow_log_read(records, 4) == 0);
+
+  // Invalid sample rates are rejected
+  assert(fdb_slow_log_configure(0.0, 1.5, 4));
+
+  // Zero threshold records everything
+  assert(!fdb_slow_log_configure(0.0, 0.0, 4));
+  fdb_slow_log_begin(&op, SLOW_OP_WRITE, 1, NULL);
+  op.num_kvs = 3;
+  fdb_slow_log_end(&op);
+  fdb_slow_log_begin(&op, SLOW_OP_READ, 2, NULL);
+  fdb_slow_log_end(&op);
+
+  assert(fdb_slow_log_read(records, 4) == 2);
+  assert(records[0].type == SLOW_OP_READ);
+  assert(records[0].event_id == 2);
+  assert(records[1].type == SLOW_OP_WRITE);
+  assert(records[1].event_id == 1);
+  assert(records[1].num_kvs == 3);
+  assert(records[0].debug_id[0] != 0);
+
+  // Unreachable threshold records nothing unless sampled
+  assert(!fdb_slow_log_configure(1000000.0, 0.0, 4));
+  fdb_slow_log_begin(&op, SLOW_OP_WRITE, 1, NULL);
+  fdb_slow_log_end(&op);
+  assert(fdb_slow_log_read(records, 4) == 0);
+
+  assert(!fdb_slow_log_configure(1000000.0, 1.0, 4));
+  fdb_slow_log_begin(&op, SLOW_OP_WRITE, 1, NULL);
+  fdb_slow_log_end(&op);
+  assert(fdb_slow_log_read(records, 4) == 1);
+  assert(records[0].sampled);
+
+  fdb_slow_log_configure(0.0, 0.0, 0);
+
+  printf(" PASSED\n");
+}
+
+void test_slow_log_capacity(void) {
+  SlowOp op;
+  SlowOp records[4];
+
+  printf("\tcapacity limit... ");
+
+  assert(!fdb_slow_log_configure(0.0, 0.0, 3));
+  for (uint64_t i = 0; i < 5; ++i) {
+    fdb_slow_log_begin(&op, SLOW_OP_WRITE, i, NULL);
+    fdb_slow_log_end(&op);
+  }
+
+  assert(fdb_slow_log_read(records, 4) == 3);
+  assert(records[0].event_id == 4);
+  assert(records[1].event_id == 3);
+  assert(records[2].event_id == 2);
+
+  fdb_slow_log_reset();
+  assert(fdb_slow_log_read(records, 4) == 0);
+
+  fdb_slow_log_configure(0.0, 0.0, 0);
+
+  printf(" PASSED\n");
+}
+
+void test_placement(void) {
+  CpuList cpus;
+  uint8_t *local;
+
+  printf("\nStarting thread placement tests...\n");
+  printf("\tparsing cpu lists... ");
+
+  assert(placement_parse_cpus("0", &cpus) == 1);
+  assert(cpus.mask[0] == 1);
+
+  assert(placement_parse_cpus("0-3,8", &cpus) == 5);
+  assert(cpus.mask[0] == 0x10F);
+
+  assert(placement_parse_cpus("64,65-66,65", &cpus) == 3);
+  assert(cpus.mask[0] == 0);
+  assert(cpus.mask[1] == 7);
+
+  assert(placement_parse_cpus("3-1", &cpus) == -1);
+  assert(placement_parse_cpus("1,,2", &cpus) == -1);
+  assert(placement_parse_cpus("a", &cpus) == -1);
+  assert(placement_parse_cpus("1-", &cpus) == -1);
+  assert(placement_parse_cpus("99999", &cpus) == -1);
+
+  assert(placement_set_cpus(THREAD_ROLE_WORKER, "x") == -1);
+  assert(placement_set_cpus(THREAD_ROLE_WORKER, NULL) == 0);
+  assert(placement_apply(THREAD_ROLE_WORKER) == 0);
+
+  printf(" PASSED\n");
+  printf("\tlocal allocation... ");
+
+  local = placement_alloc_local(3 * 4096 + 1);
+  assert(local);
+  local[(3 * 4096)] = 1;
+  placement_free_local(local, (3 * 4096 + 1));
+
+  printf(" PASSED\n");
+  printf("Completed thread placement tests.\n");
+}
+
+void test_slab(void) {
+  void *ptrs[(SLAB_CACHE_SIZE * 3)];
+  uint8_t *large;
+  SlabStats stats;
+  Event event;
+  FragmentedEvent f_event;
+
+  printf("\nStarting slab allocator tests...\n");
+  printf("\tsize classes... ");
+
+  // Every allocation is aligned and gets at least the requested size
+  for (size_t size = 1; size <= (1UL << SLAB_MAX_SHIFT); size = (size * 3)) {
+    uint8_t *ptr = slab_alloc(size);
+    assert(ptr);
+    assert(!((uintptr_t)ptr % 64));
+    assert(slab_usable_size(ptr) >= size);
+    assert(slab_usable_size(ptr) < (size * 2) || (size <= 64));
+    ptr[0] = 1;
+    ptr[(size - 1)] = 1;
+    slab_free(ptr);
+  }
+
+  printf(" PASSED\n");
+  printf("\tfree list reuse... ");
+
+  // Allocate past the thread cache so that objects round-trip through the
+  // shared free list, and check that freed objects are handed out again
+  for (uint32_t i = 0; i < (SLAB_CACHE_SIZE * 3); ++i) {
+    ptrs[i] = slab_alloc(100);
+    assert(ptrs[i]);
+    for (uint32_t j = 0; j < i; ++j)
+      assert(ptrs[i] != ptrs[j]);
+  }
+  for (uint32_t i = 0; i < (SLAB_CACHE_SIZE * 3); ++i)
+    slab_free(ptrs[i]);
+  slab_thread_flush();
+
+  void *reused = slab_alloc(128);
+  bool found = false;
+  for (uint32_t i = 0; i < (SLAB_CACHE_SIZE * 3); ++i)
+    found = (found || (reused == ptrs[i]));
+  assert(found);
+  slab_free(reused);
+
+  printf(" PASSED\n");
+  printf("\tlarge allocations... ");
+
+  large = slab_alloc((3 * SLAB_CHUNK_SIZE) + 1);
+  assert(large);
+  large[(3 * SLAB_CHUNK_SIZE)] = 1;
+  assert(slab_usable_size(large) >= ((3 * SLAB_CHUNK_SIZE) + 1));
+  slab_free(large);
+
+  large = slab_alloc((1UL << SLAB_MAX_SHIFT) + 1);
+  assert(large);
+  slab_free(large);
+
+  slab_stats(&stats);
+  assert(stats.large_allocs == 0);
+  assert((stats.huge_chunks + stats.normal_chunks) > 0);
+
+  printf(" PASSED\n");
+  printf("\tevent allocator... ");
+
+  set_event_allocator(&slab_event_allocator);
+
+  event.id = 1;
+  event.data_length = ((2 * OPTIMAL_VALUE_SIZE) + 1);
+  event.data = alloc_event_data(event.data_length);
+  assert(event.data);
+  for (uint64_t i = 0; i < event.data_length; ++i)
+    event.data[i] = (uint8_t)i;
+
+  fragment_event(&event, &f_event);
+  assert(f_event.num_fragments == 3);
+  assert(slab_usable_size(f_event.fragments) >= (3 * sizeof(uint8_t *)));
+  free_fragmented_event(&f_event);
+  free_event(&event);
+
+  set_event_allocator(NULL);
+
+  printf(" PASSED\n");
+  printf("Completed slab allocator tests.\n");
+}
+
+void test_batch_plan(void) {
+  EventBatch batch;
+  BatchPlan plan;
+  uint8_t data[(3 * OPTIMAL_VALUE_SIZE)];
+  uint64_t lengths[] = {1, OPTIMAL_VALUE_SIZE, (OPTIMAL_VALUE_SIZE + 1), 0,
+                        (3 * OPTIMAL_VALUE_SIZE)};
+  const uint8_t *fragment;
+  uint32_t length;
+
+  printf("\nStarting batch planner tests...\n");
+  printf("\tplanning transactions... ");
+
+  assert(event_batch_init(&batch, 5) == 0);
+  for (uint32_t i = 0; i < 5; ++i) {
+    batch.ids[i] = i;
+    batch.data_lengths[i] = lengths[i];
+    batch.data[i] = data;
+  }
+
+  // Fragments per event: 1, 1, 2, 0, 3
+  assert(event_batch_plan(&batch, 3, &plan) == 0);
+  assert(plan.num_fragments == 7);
+  assert(plan.num_txs == 3);
+  assert(batch.fragment_offsets[5] == 7);
+
+  // Transactions start at fragments 0, 3 and 6 of the batch, and the empty
+  // event never starts one
+  assert((plan.tx_event[0] == 0) && (plan.tx_fragment[0] == 0));
+  assert((plan.tx_event[1] == 2) && (plan.tx_fragment[1] == 1));
+  assert((plan.tx_event[2] == 4) && (plan.tx_fragment[2] == 2));
+  assert((plan.tx_event[3] == 5) && (plan.tx_fragment[3] == 0));
+  batch_plan_free(&plan);
+
+  assert(event_batch_plan(&batch, 7, &plan) == 0);
+  assert(plan.num_txs == 1);
+  batch_plan_free(&plan);
+
+  assert(event_batch_plan(&batch, 0, &plan) == -1);
+
+  printf(" PASSED\n");
+  printf("\tfragment payloads... ");
+
+  assert(event_batch_plan(&batch, 1, &plan) == 0);
+
+  fragment = event_batch_fragment(&batch, 2, 0, &length);
+  assert((fragment == data) && (length == 1));
+  fragment = event_batch_fragment(&batch, 2, 1, &length);
+  assert((fragment == (data + 1)) && (length == OPTIMAL_VALUE_SIZE));
+
+  fragment = event_batch_fragment(&batch, 4, 0, &length);
+  assert((fragment == data) && (length == OPTIMAL_VALUE_SIZE));
+  fragment = event_batch_fragment(&batch, 4, 2, &length);
+  assert(fragment == (data + (2 * OPTIMAL_VALUE_SIZE)));
+
+  batch_plan_free(&plan);
+  event_batch_free(&batch);
+
+  printf(" PASSED\n");
+  printf("Completed batch planner tests.\n");
+}
+
+void test_event_keys(void) {
+  uint8_t key[FDB_KEY_MAX_LENGTH];
+  uint8_t prev[FDB_KEY_MAX_LENGTH];
+  uint8_t expected[FDB_KEY_TOTAL_LENGTH] = {
+      FDB_EVENT_PREFIX, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06,
+      0x07,             0x08, 0x0A, 0x0B, 0x0C, 0x0D};
+  uint8_t compact[6] = {FDB_COMPACT_EVENT_PREFIX, 0x02, 0x01, 0x00, 0x01, 0x2A};
+  uint64_t ids[7] = {0, 1, 255, 256, 65535, 65536, UINT64_MAX};
+  uint32_t fragments[5] = {0, 1, 255, 256, UINT32_MAX};
+  uint32_t batches[4][2] = {{0, 3}, {250, 10}, {65530, 10}, {16777210, 10}};
+  FragmentedEvent f_event = {0};
+  KeyArena arena;
+  uint64_t event_id;
+  uint32_t fragment;
+  uint8_t length, prev_length = 0;
+
+  printf("\nStarting event key tests...\n");
+  printf("\tfixed keys... ");
+
+  // Identifiers and fragments are stored big-endian
+  length = fdb_build_event_key_format(key, KEY_FORMAT_FIXED,
+                                      0x0102030405060708ULL, 0x0A0B0C0D);
+  assert(length == FDB_KEY_TOTAL_LENGTH);
+  assert(!memcmp(key, expected, FDB_KEY_TOTAL_LENGTH));
+
+  assert(fdb_parse_event_key(key, FDB_KEY_TOTAL_LENGTH, &event_id,
+                             &fragment) == 0);
+  assert(event_id == 0x0102030405060708ULL);
+  assert(fragment == 0x0A0B0C0D);
+  assert(fdb_parse_event_key(key, (FDB_KEY_TOTAL_LENGTH - 1), &event_id,
+                             &fragment) == -1);
+
+  printf(" PASSED\n");
+  printf("\tcompact keys... ");
+
+  // Leading zero bytes are dropped from both fields
+  assert(fdb_build_event_key_format(key, KEY_FORMAT_COMPACT, 0, 0) == 3);
+  length = fdb_build_event_key_format(key, KEY_FORMAT_COMPACT, 256, 42);
+  assert(length == 6);
+  assert(!memcmp(key, compact, length));
+  assert(fdb_build_event_key_format(key, KEY_FORMAT_COMPACT, UINT64_MAX,
+                                    UINT32_MAX) == FDB_KEY_MAX_LENGTH);
+
+  // Keys sort by identifier and then by fragment, across length boundaries,
+  // and parse back to what they were built from
+  for (uint32_t i = 0; i < 7; ++i) {
+    for (uint32_t j = 0; j < 5; ++j) {
+      length = fdb_build_event_key_format(key, KEY_FORMAT_COMPACT, ids[i],
+                                          fragments[j]);
+      assert(fdb_parse_event_key(key, length, &event_id, &fragment) == 0);
+      assert(event_id == ids[i]);
+      assert(fragment == fragments[j]);
+
+      if (prev_length) {
+        int cmp = memcmp(prev, key,
+                         (prev_length < length) ? prev_length : length);
+        assert((cmp < 0) || ((cmp == 0) && (prev_length < length)));
+      }
+
+      memcpy(prev, key, length);
+      prev_length = length;
+    }
+  }
+
+  // Truncated keys and oversized length bytes are rejected
+  length = fdb_build_event_key_format(key, KEY_FORMAT_COMPACT, 256, 42);
+  assert(fdb_parse_event_key(key, (length - 1), &event_id, &fragment) == -1);
+  key[1] = 9;
+  assert(fdb_parse_event_key(key, length, &event_id, &fragment) == -1);
+
+  printf(" PASSED\n");
+  printf("\tbulk keys... ");
+
+  // Runs crossing a byte boundary in the fragment match the single encoder,
+  // and sort in fragment order
+  assert(key_arena_init(&arena, 10) == 0);
+  for (KeyFormat format = KEY_FORMAT_FIXED; format <= KEY_FORMAT_COMPACT;
+       ++format) {
+    fdb_set_key_format(format);
+    key_arena_reset(&arena);
+    fdb_append_event_keys(&arena, 42, 254, 5);
+    fdb_append_event_keys(&arena, 43, 0, 0);
+    fdb_append_event_keys(&arena, 43, 0, 1);
+    assert(arena.num_keys == 6);
+
+    for (uint32_t i = 0; i < 6; ++i) {
+      uint64_t id = (i < 5) ? 42 : 43;
+      uint32_t frag = (i < 5) ? (254 + i) : 0;
+
+      length = fdb_build_event_key(key, id, frag);
+      assert((arena.offsets[(i + 1)] - arena.offsets[i]) == length);
+      assert(!memcmp((arena.keys + arena.offsets[i]), key, length));
+      if (i)
+        assert(memcmp((arena.keys + arena.offsets[(i - 1)]), key,
+                      (arena.offsets[i] - arena.offsets[(i - 1)])) < 0);
+    }
+  }
+  fdb_set_key_format(KEY_FORMAT_FIXED);
+  key_arena_free(&arena);
+
+  printf(" PASSED\n");
+  printf("\tbatch bytes... ");
+
+  // Batch sizes are computed without building keys, but must match them
+  f_event.header_length = 1;
+  f_event.payload_length = 7;
+  for (KeyFormat format = KEY_FORMAT_FIXED; format <= KEY_FORMAT_COMPACT;
+       ++format) {
+    fdb_set_key_format(format);
+
+    for (uint32_t i = 0; i < 4; ++i) {
+      uint64_t bytes = 0;
+
+      f_event.id = ids[i + 2];
+      for (uint32_t j = 0; j < batches[i][1]; ++j) {
+        fragment = (batches[i][0] + j);
+        bytes += fdb_build_event_key(key, f_event.id, fragment);
+        bytes += fragment ? OPTIMAL_VALUE_SIZE : 8;
+      }
+      assert(batch_bytes(&f_event, batches[i][0], batches[i][1]) == bytes);
+    }
+  }
+  fdb_set_key_format(KEY_FORMAT_FIXED);
+
+  printf(" PASSED\n");
+  printf("Completed event key tests.\n");
+}
+
+void test_cipher(void) {
+  uint8_t key[CIPHER_KEY_SIZE];
+  uint8_t header[2] = {0x81, 0x07};
+  uint8_t plain[OPTIMAL_VALUE_SIZE];
+  uint8_t sealed[(OPTIMAL_VALUE_SIZE + CIPHER_OVERHEAD)];
+  uint8_t opened[OPTIMAL_VALUE_SIZE];
+  uint8_t first[(OPTIMAL_VALUE_SIZE + CIPHER_OVERHEAD)];
+  uint8_t child_nonce[CIPHER_NONCE_SIZE];
+  int fds[2];
+  int status;
+  pid_t child;
+
+  printf("\nStarting fragment encryption tests...\n");
+  printf("\tround trip... ");
+
+  assert(!cipher_enabled());
+  assert(cipher_overhead() == 0);
+
+  for (uint32_t i = 0; i < CIPHER_KEY_SIZE; ++i)
+    key[i] = (uint8_t)i;
+  for (uint32_t i = 0; i < OPTIMAL_VALUE_SIZE; ++i)
+    plain[i] = (uint8_t)(i * 7);
+
+  cipher_set_key(key);
+  assert(cipher_enabled());
+  assert(cipher_overhead() == CIPHER_OVERHEAD);
+
+  assert(cipher_seal(sealed, header, 2, plain, OPTIMAL_VALUE_SIZE, 42, 3) == 0);
+  assert(memcmp(sealed, plain, OPTIMAL_VALUE_SIZE));
+  assert(cipher_open(opened, header, 2, sealed, OPTIMAL_VALUE_SIZE, 42, 3) ==
+         0);
+  assert(!memcmp(opened, plain, OPTIMAL_VALUE_SIZE));
+
+  // Every seal gets its own nonce, so the same fragment sealed again, as when
+  // an id is cleared and rewritten, never reuses one
+  assert(cipher_seal(first, header, 2, plain, OPTIMAL_VALUE_SIZE, 42, 3) == 0);
+  assert(memcmp(first, sealed, OPTIMAL_VALUE_SIZE));
+  assert(memcmp((first + OPTIMAL_VALUE_SIZE + CIPHER_TAG_SIZE),
+                (sealed + OPTIMAL_VALUE_SIZE + CIPHER_TAG_SIZE),
+                CIPHER_NONCE_SIZE));
+  assert(cipher_open(opened, header, 2, first, OPTIMAL_VALUE_SIZE, 42, 3) ==
+         0);
+  assert(!memcmp(opened, plain, OPTIMAL_VALUE_SIZE));
+
+  // A forked child doesn't carry on from its parent's nonces
+  assert(pipe(fds) == 0);
+  child = fork();
+  assert(child >= 0);
+  if (!child) {
+    if (cipher_seal(first, header, 2, plain, OPTIMAL_VALUE_SIZE, 42, 3) ||
+        (write(fds[1], (first + OPTIMAL_VALUE_SIZE + CIPHER_TAG_SIZE),
+               CIPHER_NONCE_SIZE) != CIPHER_NONCE_SIZE))
+      _exit(1);
+    _exit(0);
+  }
+  assert(waitpid(child, &status, 0) == child);
+  assert(WIFEXITED(status) && !WEXITSTATUS(status));
+  assert(read(fds[0], child_nonce, CIPHER_NONCE_SIZE) == CIPHER_NONCE_SIZE);
+  close(fds[0]);
+  close(fds[1]);
+  assert(cipher_seal(first, header, 2, plain, OPTIMAL_VALUE_SIZE, 42, 3) == 0);
+  assert(memcmp((first + OPTIMAL_VALUE_SIZE + CIPHER_TAG_SIZE), child_nonce,
+                CIPHER_NONCE_SIZE));
+
+  printf(" PASSED\n");
+  printf("\tauthentication... ");
+
+  // Fragments moved to another event or position, altered headers and
+  // altered payloads are all rejected
+  assert(cipher_open(opened, header, 2, sealed, OPTIMAL_VALUE_SIZE, 43, 3) ==
+         -1);
+  assert(cipher_open(opened, header, 2, sealed, OPTIMAL_VALUE_SIZE, 42, 4) ==
+         -1);
+  header[1] = 0x08;
+  assert(cipher_open(opened, header, 2, sealed, OPTIMAL_VALUE_SIZE, 42, 3) ==
+         -1);
+  header[1] = 0x07;
+  sealed[100] ^= 1;
+  assert(cipher_open(opened, header, 2, sealed, OPTIMAL_VALUE_SIZE, 42, 3) ==
+         -1);
+  sealed[100] ^= 1;
+
+  // A different key can't open the fragment
+  key[0] ^= 1;
+  cipher_set_key(key);
+  assert(cipher_open(opened, header, 2, sealed, OPTIMAL_VALUE_SIZE, 42, 3) ==
+         -1);
+
+  cipher_set_key(NULL);
+  assert(!cipher_enabled());
+
+  printf(" PASSED\n");
+  printf("Completed fragment encryption tests.\n");
+}
+
+void test_read_plan(void) {
+  ReadPlan plan;
+  uint64_t ids[7] = {40, 3, 5, 41, 3, 20, 4};
+
+  printf("\nStarting read planner tests...\n");
+  printf("\tcontiguous ranges... ");
+
+  // Without a gap, only neighbouring identifiers share a range
+  assert(read_plan_build(&plan, ids, 7, 0) == 0);
+  assert(plan.num_ids == 7);
+  assert(plan.num_ranges == 3);
+  assert(plan.range_begin[0] == 3 && plan.range_end[0] == 5);
+  assert(plan.range_begin[1] == 20 && plan.range_end[1] == 20);
+  assert(plan.range_begin[2] == 40 && plan.range_end[2] == 41);
+  assert(plan.range_start[0] == 0);
+  assert(plan.range_start[1] == 4);
+  assert(plan.range_start[2] == 5);
+  assert(plan.range_start[3] == 7);
+  assert(plan.over_read_ids == 0);
+
+  // Repeated identifiers keep their request order
+  assert(plan.order[0] == 1 && plan.order[1] == 4);
+  assert(plan.order[2] == 6 && plan.order[3] == 2);
+  assert(plan.order[4] == 5);
+  assert(plan.order[5] == 0 && plan.order[6] == 3);
+  read_plan_free(&plan);
+
+  printf(" PASSED\n");
+  printf("\tmerging over gaps... ");
+
+  // A gap of 14 merges 5 into 20, but not 20 into 40
+  assert(read_plan_build(&plan, ids, 7, 14) == 0);
+  assert(plan.num_ranges == 2);
+  assert(plan.range_begin[0] == 3 && plan.range_end[0] == 20);
+  assert(plan.range_begin[1] == 40 && plan.range_end[1] == 41);
+  assert(plan.over_read_ids == 14);
+  read_plan_free(&plan);
+
+  assert(read_plan_build(&plan, ids, 7, UINT64_MAX) == 0);
+  assert(plan.num_ranges == 1);
+  assert(plan.over_read_ids == 33);
+  read_plan_free(&plan);
+
+  // An empty set needs no reads
+  assert(read_plan_build(&plan, ids, 0, 0) == 0);
+  assert(plan.num_ranges == 0);
+  assert(plan.range_start[0] == 0);
+  read_plan_free(&plan);
+
+  printf(" PASSED\n");
+  printf("Completed read planner tests.\n");
+}
+
+void test_shm_cache(void) {
+  const char *name = "/seguro-unit-cache";
+  uint8_t data[300];
+  Event event = {1, 0, NULL};
+  pid_t child;
+  int status;
+
+  printf("\nStarting shared-memory cache tests...\n");
+  printf("\tsharing across processes... ");
+
+  for (uint32_t i = 0; i < 300; ++i)
+    data[i] = (uint8_t)(i * 3);
+
+  shm_cache_unlink(name);
+  assert(!shm_cache_enabled());
+  assert(shm_cache_get(&event) == 1);
+
+  // Geometry must be whole sets
+  assert(shm_cache_open(name, (SHM_CACHE_WAYS + 1), 256, 7) == -1);
+
+  // Another process fills the cache
+  child = fork();
+  assert(child >= 0);
+  if (!child) {
+    if (shm_cache_open(name, SHM_CACHE_WAYS, 256, 7))
+      _exit(1);
+    shm_cache_put(1, data, 200);
+    shm_cache_put(2, data, 300);
+    shm_cache_close();
+    _exit(0);
+  }
+  assert(waitpid(child, &status, 0) == child);
+  assert(WIFEXITED(status) && !WEXITSTATUS(status));
+
+  // Mismatched geometry is refused
+  assert(shm_cache_open(name, SHM_CACHE_WAYS, 512, 7) == -1);
+  assert(shm_cache_open(name, SHM_CACHE_WAYS, 256, 7) == 0);
+  metrics_reset();
+
+  assert(shm_cache_get(&event) == 0);
+  assert(event.data_length == 200);
+  assert(!memcmp(event.data, data, 200));
+  free_event(&event);
+
+  // Events too large for an entry are never cached
+  event.id = 2;
+  assert(shm_cache_get(&event) == 1);
+  assert(metrics_get(METRIC_CACHE_HITS) == 1);
+  assert(metrics_get(METRIC_CACHE_MISSES) == 1);
+
+  printf(" PASSED\n");
+  printf("\tinvalidation... ");
+
+  // Entries are keyed by subspace as well as identifier
+  shm_cache_close();
+  assert(shm_cache_open(name, SHM_CACHE_WAYS, 256, 8) == 0);
+  event.id = 1;
+  assert(shm_cache_get(&event) == 1);
+  shm_cache_put(1, (data + 1), 10);
+  shm_cache_invalidate_all();
+  assert(shm_cache_get(&event) == 1);
+  shm_cache_close();
+
+  assert(shm_cache_open(name, SHM_CACHE_WAYS, 256, 7) == 0);
+  assert(shm_cache_get(&event) == 0);
+  free_event(&event);
+  shm_cache_invalidate(1);
+  assert(shm_cache_get(&event) == 1);
+
+  printf(" PASSED\n");
+  printf("\tCLOCK eviction... ");
+
+  // With a single set, the entry read since the last sweep survives
+  metrics_reset();
+  for (uint64_t id = 10; id < (10 + SHM_CACHE_WAYS); ++id)
+    shm_cache_put(id, data, 8);
+  for (uint64_t id = 10; id < (10 + SHM_CACHE_WAYS); ++id) {
+    event.id = id;
+    assert(shm_cache_get(&event) == 0);
+    free_event(&event);
+  }
+  assert(metrics_get(METRIC_CACHE_EVICTIONS) == 0);
+
+  shm_cache_put(100, data, 8);
+  assert(metrics_get(METRIC_CACHE_EVICTIONS) == 1);
+  event.id = 10;
+  assert(shm_cache_get(&event) == 1);
+
+  // The sweep cleared every other reference bit, so one more read saves 12
+  event.id = 12;
+  assert(shm_cache_get(&event) == 0);
+  free_event(&event);
+  shm_cache_put(101, data, 8);
+  shm_cache_put(102, data, 8);
+  assert(shm_cache_get(&event) == 0);
+  free_event(&event);
+
+  shm_cache_close();
+  assert(shm_cache_unlink(name) == 0);
+
+  printf(" PASSED\n");
+  printf("Completed shared-memory cache tests.\n");
+}
+
+void test_archive(void) {
+  char dir[] = "/tmp/seguro-unit-archive-XXXXXX";
+  char path[ARCHIVE_PATH_MAX];
+  char sealed_path[ARCHIVE_PATH_MAX];
+  char overlap_path[ARCHIVE_PATH_MAX];
+  uint8_t key[CIPHER_KEY_SIZE];
+  uint64_t lengths[4] = {0, 100, (3 * ARCHIVE_BLOCK_SIZE), 5000};
+  uint8_t *data = malloc(lengths[2]);
+  ArchiveWriter writer;
+  Event event = {0, 0, NULL};
+  uint64_t last_id;
+
+  printf("\nStarting archive tests...\n");
+  printf("\tround trip... ");
+
+  assert(data);
+  assert(mkdtemp(dir));
+  for (uint64_t i = 0; i < lengths[2]; ++i)
+    data[i] = (uint8_t)((i * 13) ^ (i >> 11));
+
+  // An empty event, a small one, one spanning several blocks and another
+  // small one after it
+  assert(archive_writer_open(&writer, dir) == 0);
+  for (uint64_t id = 10; id < 14; ++id) {
+    Event added = {id, lengths[(id - 10)], data};
+    assert(archive_writer_add(&writer, &added) == 0);
+  }
+  assert(archive_writer_finish(&writer, path) == 0);
+  assert(strstr(path, ARCHIVE_SEGMENT_SUFFIX));
+
+  assert(!archive_enabled());
+  assert(archive_last_id(&last_id) == 1);
+  assert(archive_open(dir) == 0);
+  assert(archive_enabled());
+  assert(archive_last_id(&last_id) == 0);
+  assert(last_id == 13);
+
+  for (uint64_t id = 13; id >= 10; --id) {
+    event.id = id;
+    assert(archive_read_event(&event) == 0);
+    assert(event.data_length == lengths[(id - 10)]);
+    assert(!memcmp(event.data, data, event.data_length));
+    free_event(&event);
+  }
+
+  event.id = 9;
+  assert(archive_read_event(&event) == 1);
+  event.id = 14;
+  assert(archive_read_event(&event) == 1);
+
+  printf(" PASSED\n");
+  printf("\toverlapping segments... ");
+
+  // A segment covering an id already archived is never mapped
+  assert(archive_writer_open(&writer, dir) == 0);
+  event.id = 13;
+  event.data_length = 4;
+  event.data = data;
+  assert(archive_writer_add(&writer, &event) == 0);
+  assert(archive_writer_finish(&writer, overlap_path) == 0);
+  assert(archive_add_segment(overlap_path) == -1);
+  assert(unlink(overlap_path) == 0);
+
+  // Events must be added in order, and empty segments aren't written
+  assert(archive_writer_open(&writer, dir) == 0);
+  event.id = 20;
+  assert(archive_writer_add(&writer, &event) == 0);
+  assert(archive_writer_add(&writer, &event) == -1);
+  archive_writer_abort(&writer);
+  assert(archive_writer_open(&writer, dir) == 0);
+  assert(archive_writer_finish(&writer, overlap_path) == -1);
+
+  printf(" PASSED\n");
+  printf("\tsealed blocks... ");
+
+  for (uint32_t i = 0; i < CIPHER_KEY_SIZE; ++i)
+    key[i] = (uint8_t)(i * 5);
+  cipher_set_key(key);
+
+  assert(archive_writer_open(&writer, dir) == 0);
+  for (uint64_t id = 20; id < 22; ++id) {
+    Event added = {id, 5000, (data + id)};
+    assert(archive_writer_add(&writer, &added) == 0);
+  }
+  assert(archive_writer_finish(&writer, sealed_path) == 0);
+  assert(archive_add_segment(sealed_path) == 0);
+  assert(archive_last_id(&last_id) == 0);
+  assert(last_id == 21);
+
+  event.id = 21;
+  event.data = NULL;
+  assert(archive_read_event(&event) == 0);
+  assert(event.data_length == 5000);
+  assert(!memcmp(event.data, (data + 21), 5000));
+  free_event(&event);
+
+  // A different key can't open the blocks, once they're no longer cached
+  event.id = 11;
+  assert(archive_read_event(&event) == 0);
+  free_event(&event);
+  key[0] ^= 1;
+  cipher_set_key(key);
+  event.id = 20;
+  assert(archive_read_event(&event) == -1);
+  cipher_set_key(NULL);
+
+  archive_close();
+  assert(!archive_enabled());
+  assert(unlink(path) == 0);
+  assert(unlink(sealed_path) == 0);
+  assert(rmdir(dir) == 0);
+  free(data);
+
+  printf(" PASSED\n");
+  printf("Completed archive tests.\n");
+}
+
+void test_merkle(void) {
+  uint8_t data[(3 * OPTIMAL_VALUE_SIZE)];
+  uint64_t ids[4] = {5, 4100, 4101, (1ULL << 40)};
+  MerkleTree a, b;
+  MerkleSource source_a, source_b;
+  uint64_t diffs[2] = {0, 0};
+
+  printf("\nStarting Merkle summary tests...\n");
+  printf("\tnode indexes... ");
+
+  assert(merkle_node_index(0, (MERKLE_BUCKET_IDS - 1)) == 0);
+  assert(merkle_node_index(0, MERKLE_BUCKET_IDS) == 1);
+  assert(merkle_node_index(1, (MERKLE_BUCKET_IDS * MERKLE_FANOUT)) == 1);
+  assert(merkle_node_index((MERKLE_ROOT_LEVEL - 1), UINT64_MAX) <
+         MERKLE_FANOUT);
+  assert(merkle_node_index(MERKLE_ROOT_LEVEL, UINT64_MAX) == 0);
+
+  printf(" PASSED\n");
+  printf("\tcomparing summaries... ");
+
+  for (uint32_t i = 0; i < sizeof(data); ++i)
+    data[i] = (uint8_t)(i * 11);
+
+  // The same events added in any order summarise alike
+  merkle_tree_init(&a);
+  merkle_tree_init(&b);
+  for (uint32_t i = 0; i < 4; ++i) {
+    Event event = {ids[i], (sizeof(data) - i), data};
+    Event reversed = {ids[(3 - i)], (sizeof(data) - (3 - i)), data};
+
+    assert(merkle_tree_add_event(&a, &event) == 0);
+    assert(merkle_tree_add_event(&b, &reversed) == 0);
+  }
+  merkle_tree_finish(&a);
+  merkle_tree_finish(&b);
+  merkle_tree_source(&a, &source_a);
+  merkle_tree_source(&b, &source_b);
+
+  assert(merkle_diff(&source_a, &source_b, record_merkle_diff, diffs) == 0);
+  assert(a.num_nodes == b.num_nodes);
+
+  // A changed byte is traced to the buckets of every event holding it
+  merkle_tree_free(&b);
+  data[7] ^= 1;
+  for (uint32_t i = 0; i < 4; ++i) {
+    Event event = {ids[i], (sizeof(data) - i), data};
+
+    assert(merkle_tree_add_event(&b, &event) == 0);
+  }
+  merkle_tree_finish(&b);
+
+  assert(merkle_diff(&source_a, &source_b, record_merkle_diff, diffs) == 3);
+  assert(diffs[0] == (1ULL << 40));
+  assert(diffs[1] == ((1ULL << 40) + (MERKLE_BUCKET_IDS - 1)));
+
+  // An empty summary differs from every populated bucket
+  merkle_tree_free(&b);
+  merkle_tree_finish(&b);
+  assert(merkle_diff(&source_a, &source_b, NULL, NULL) == 3);
+  assert(merkle_diff(&source_b, &source_b, NULL, NULL) == 0);
+
+  merkle_tree_free(&a);
+  merkle_tree_free(&b);
+
+  printf(" PASSED\n");
+  printf("Completed Merkle summary tests.\n");
+}
+
+void record_merkle_diff(uint64_t first_id, uint64_t last_id, void *context) {
+  uint64_t *diffs = (uint64_t *)context;
+
+  // Keep the last bucket reported
+  diffs[0] = first_id;
+  diffs[1] = last_id;
+}
+
+void test_presence_bits(void) {
+  uint8_t bits[PRESENCE_CHUNK_SIZE];
+
+  printf("\nStarting present-id bitmap tests...\n");
+  printf("\tcounting bits... ");
+
+  memset(bits, 0, PRESENCE_CHUNK_SIZE);
+  assert(presence_count_bits(bits, 0, PRESENCE_CHUNK_IDS) == 0);
+
+  // Ranges starting and ending mid-word count the partial words bit by bit
+  memset(bits, 0xFF, PRESENCE_CHUNK_SIZE);
+  assert(presence_count_bits(bits, 0, PRESENCE_CHUNK_IDS) ==
+         PRESENCE_CHUNK_IDS);
+  assert(presence_count_bits(bits, 3, 200) == 197);
+  assert(presence_count_bits(bits, 70, 70) == 0);
+
+  bits[10] = 0x0F;
+  assert(presence_count_bits(bits, 0, 128) == 124);
+  assert(presence_count_bits(bits, 84, 88) == 0);
+
+  printf(" PASSED\n");
+  printf("\tfinding gaps... ");
+
+  assert(presence_first_clear(bits, 0, PRESENCE_CHUNK_IDS) == 84);
+  assert(presence_first_clear(bits, 87, PRESENCE_CHUNK_IDS) == 87);
+  assert(presence_first_clear(bits, 88, PRESENCE_CHUNK_IDS) ==
+         PRESENCE_CHUNK_IDS);
+  assert(presence_first_clear(bits, 0, 84) == 84);
+
+  bits[(PRESENCE_CHUNK_SIZE - 1)] = 0x7F;
+  assert(presence_first_clear(bits, 88, PRESENCE_CHUNK_IDS) ==
+         (PRESENCE_CHUNK_IDS - 1));
+
+  printf(" PASSED\n");
+  printf("Completed present-id bitmap tests.\n");
+}
+
+void test_lazy_span(void) {
+  uint32_t first, last;
+
+  printf("\nStarting lazy read tests...\n");
+  printf("\tfragment spans... ");
+
+  // The first fragment holds the oddly-sized start of the data
+  lazy_fragment_span(300, 0, 300, &first, &last);
+  assert((first == 0) && (last == 0));
+  lazy_fragment_span(300, 299, 2, &first, &last);
+  assert((first == 0) && (last == 1));
+  lazy_fragment_span(300, 300, OPTIMAL_VALUE_SIZE, &first, &last);
+  assert((first == 1) && (last == 1));
+  lazy_fragment_span(300, (300 + OPTIMAL_VALUE_SIZE), 1, &first, &last);
+  assert((first == 2) && (last == 2));
+
+  // A page may span several fragments, and a fragment several pages
+  lazy_fragment_span(OPTIMAL_VALUE_SIZE, 8192, 4096, &first, &last);
+  assert((first == 0) && (last == 1));
+  lazy_fragment_span(1, 0, (4 * OPTIMAL_VALUE_SIZE), &first, &last);
+  assert((first == 0) && (last == 4));
+
+  printf(" PASSED\n");
+  printf("\tfragment offsets... ");
+
+  assert(lazy_fragment_offset(300, 0) == 0);
+  assert(lazy_fragment_offset(300, 1) == 300);
+  assert(lazy_fragment_offset(300, 3) == (300 + (2 * OPTIMAL_VALUE_SIZE)));
+
+  printf(" PASSED\n");
+  printf("Completed lazy read tests.\n");
+}
+
+void test_reorder_runs(void) {
+  ReorderBuffer buffer;
+  Event event = {0};
+
+  printf("\nStarting reorder buffer tests...\n");
+  printf("\tplacing events... ");
+
+  assert(reorder_buffer_init(&buffer, 10, 0) == -1);
+  assert(reorder_buffer_init(&buffer, 10, 4) == 0);
+
+  // Ids are accepted once, and only within the window
+  event.id = 12;
+  assert(reorder_buffer_place(&buffer, &event) == 0);
+  assert(reorder_buffer_place(&buffer, &event) == -1);
+  event.id = 9;
+  assert(reorder_buffer_place(&buffer, &event) == -1);
+  event.id = 14;
+  assert(reorder_buffer_place(&buffer, &event) == 1);
+  event.id = 13;
+  assert(reorder_buffer_place(&buffer, &event) == 0);
+
+  printf(" PASSED\n");
+  printf("\ttaking runs... ");
+
+  // Nothing is released until the next id arrives, and then the whole run is
+  assert(reorder_buffer_take_run(&buffer) == 0);
+  event.id = 10;
+  assert(reorder_buffer_place(&buffer, &event) == 0);
+  assert(reorder_buffer_take_run(&buffer) == 1);
+  assert((buffer.run[0].id == 10) && (buffer.next_id == 11));
+  event.id = 11;
+  assert(reorder_buffer_place(&buffer, &event) == 0);
+  assert(reorder_buffer_take_run(&buffer) == 3);
+  assert((buffer.run[0].id == 11) && (buffer.run[2].id == 13));
+  assert(buffer.next_id == 14);
+
+  // The window wraps around the slots
+  for (uint64_t id = 17; id >= 14; --id) {
+    event.id = id;
+    assert(reorder_buffer_place(&buffer, &event) == 0);
+  }
+  assert(reorder_buffer_take_run(&buffer) == 4);
+  assert((buffer.run[0].id == 14) && (buffer.run[3].id == 17));
+
+  // Nothing was committed
+  assert(reorder_buffer_watermark(&buffer) == 10);
+  reorder_buffer_free(&buffer);
+
+  printf(" PASSED\n");
+  printf("Completed reorder buffer tests.\n");
+}
+
+void test_tenant_latency(void) {
+  TenantStats stats;
+
+  printf("\nStarting tenant latency tests...\n");
+  printf("\tbucketing latencies... ");
+
+  assert(tenant_latency_bucket(0) == 0);
+  assert(tenant_latency_bucket(1) == 0);
+  assert(tenant_latency_bucket(2) == 1);
+  assert(tenant_latency_bucket(3) == 1);
+  assert(tenant_latency_bucket(1024) == 10);
+  assert(tenant_latency_bucket(UINT64_MAX) == (TENANT_LATENCY_BUCKETS - 1));
+
+  printf(" PASSED\n");
+  printf("\testimating percentiles... ");
+
+  memset(&stats, 0, sizeof(TenantStats));
+  assert(tenant_latency_percentile(&stats, 99) == 0);
+
+  // 90 fast latencies and 10 slow ones
+  stats.latency_histogram[4] = 90;
+  stats.latency_histogram[12] = 10;
+  assert(tenant_latency_percentile(&stats, 50) == 31);
+  assert(tenant_latency_percentile(&stats, 90) == 31);
+  assert(tenant_latency_percentile(&stats, 91) == 8191);
+  assert(tenant_latency_percentile(&stats, 100) == 8191);
+
+  printf(" PASSED\n");
+  printf("Completed tenant latency tests.\n");
+}
+
+void test_batch_histogram(void) {
+  BatchHistogram histogram;
+
+  printf("\nStarting batch histogram tests...\n");
+  printf("\trecording batches... ");
+
+  batch_histogram_reset(&histogram);
+  assert(histogram.num_batches == 0);
+  assert(batch_histogram_percentile(&histogram, 50) == 0.0);
+
+  // 0.02 ms falls in [16, 32) us, 5 ms in [4096, 8192) us
+  for (uint32_t i = 0; i < 9; ++i)
+    batch_histogram_add(&histogram, 0.02);
+  batch_histogram_add(&histogram, 5.0);
+  assert(histogram.num_batches == 10);
+  assert(histogram.buckets[4] == 9);
+  assert(histogram.buckets[12] == 1);
+  assert((histogram.t_min == 0.02) && (histogram.t_max == 5.0));
+
+  printf(" PASSED\n");
+  printf("\testimating percentiles... ");
+
+  assert(batch_histogram_percentile(&histogram, 50) == 0.031);
+  assert(batch_histogram_percentile(&histogram, 90) == 0.031);
+
+  // Estimates never exceed the slowest batch
+  assert(batch_histogram_percentile(&histogram, 99) == 5.0);
+
+  printf(" PASSED\n");
+  printf("Completed batch histogram tests.\n");
+}
+
+void test_perf_counters(void) {
+  PerfCounters counters;
+  volatile uint8_t *pages;
+
+  printf("\nStarting performance counter tests...\n");
+  printf("\tscaling counts... ");
+
+  assert(perf_counter_scale(1000, 10, 10) == 1000);
+  assert(perf_counter_scale(1000, 10, 5) == 2000);
+  assert(perf_counter_scale(1000, 10, 0) == 0);
+
+  printf(" PASSED\n");
+  printf("\tcounting a phase... ");
+
+  // Software counters are usually available even in virtual machines. The
+  // allocation is above malloc's largest mmap threshold, so its pages are new.
+  if (!perf_counters_open(&counters)) {
+    perf_counters_start(&counters);
+    pages = malloc(64 * 1024 * 1024);
+    for (uint32_t i = 0; i < (64 * 1024 * 1024); i += 4096)
+      pages[i] = 1;
+    perf_counters_stop(&counters);
+    free((void *)pages);
+
+    if (counters.available[PERF_PAGE_FAULTS])
+      assert(counters.values[PERF_PAGE_FAULTS] > 0);
+    perf_counters_close(&counters);
+  }
+
+  printf(" PASSED\n");
+  printf("Completed performance counter tests.\n");
+}
+
+void test_baseline(void) {
+  char path[] = "/tmp/seguro-unit-baseline-XXXXXX";
+  double steady[8] = {100, 102, 98, 101, 99, 100, 103, 97};
+  double slower[8] = {80, 82, 78, 81, 79, 80, 83, 77};
+  const BaselineSeries *series;
+  BaselineSeries base, cand;
+  BaselineVerdict verdict;
+  BaselineEnv env, other;
+  BaselineRun run;
+  FILE *store;
+  uint64_t run_id;
+  double low, high;
+  int fd;
+
+  printf("\nStarting baseline tests...\n");
+  printf("\tbootstrap intervals... ");
+
+  // Identical trials can't show a change, and a 20% drop is shown clearly
+  assert(!baseline_bootstrap_ratio(steady, 8, steady, 8, 1, &low, &high));
+  assert((low < 1.0) && (high > 1.0));
+  assert(!baseline_bootstrap_ratio(steady, 8, slower, 8, 1, &low, &high));
+  assert((low > 0.75) && (high < 0.85));
+  assert(baseline_bootstrap_ratio(steady, 0, slower, 8, 1, &low, &high));
+
+  printf(" PASSED\n");
+  printf("\tcomparing runs... ");
+
+  memset(&base, 0, sizeof(BaselineSeries));
+  strcpy(base.name, "synchronous");
+  base.num_trials = 8;
+  memcpy(base.throughput, steady, sizeof(steady));
+  memcpy(base.p99, steady, sizeof(steady));
+  cand = base;
+
+  assert(!baseline_compare(&base, &cand, 0.05, &verdict));
+  assert(!verdict.regressed);
+
+  // Less throughput regresses, and so does a longer p99
+  memcpy(cand.throughput, slower, sizeof(slower));
+  assert(!baseline_compare(&base, &cand, 0.05, &verdict));
+  assert(verdict.regressed);
+  assert(!baseline_compare(&base, &cand, 0.30, &verdict));
+  assert(!verdict.regressed);
+  memcpy(cand.throughput, steady, sizeof(steady));
+  memcpy(base.p99, slower, sizeof(slower));
+  assert(!baseline_compare(&base, &cand, 0.05, &verdict));
+  assert(verdict.regressed);
+
+  printf(" PASSED\n");
+  printf("\tstoring runs... ");
+
+  fd = mkstemp(path);
+  assert(fd >= 0);
+  close(fd);
+
+  baseline_env_detect(&env);
+  assert(env.fingerprint && (env.num_cpus > 0));
+  other = env;
+  other.fingerprint = (env.fingerprint + 1);
+
+  for (uint32_t t = 0; t < 3; ++t) {
+    assert(!baseline_append(path, 10, &env, "sync\tbatch=1", t, steady[t],
+                            slower[t]));
+    assert(!baseline_append(path, 20, &other, "sync\tbatch=1", t, slower[t],
+                            steady[t]));
+    assert(!baseline_append(path, 30, &env, "async", t, steady[t], 1.0));
+  }
+
+  // The latest run, and the latest before it in the same environment
+  assert(!baseline_find_run(path, 0, 0, &run_id) && (run_id == 30));
+  assert(!baseline_find_run(path, 30, env.fingerprint, &run_id) &&
+         (run_id == 10));
+  assert(baseline_find_run(path, 10, 0, &run_id) == 1);
+
+  assert(!baseline_load_run(path, 10, &run));
+  assert((run.num_series == 1) && (run.env.fingerprint == env.fingerprint));
+  assert(!strcmp(run.env.cpu, env.cpu));
+  assert(!baseline_find_series(&run, "async"));
+  series = baseline_find_series(&run, "sync batch=1");
+  assert(series && (series->num_trials == 3));
+  assert((series->throughput[2] == steady[2]) && (series->p99[2] == slower[2]));
+  baseline_run_free(&run);
+  assert(baseline_load_run(path, 15, &run) == 1);
+
+  // Results which aren't finite are neither stored nor loaded
+  assert(baseline_append(path, 40, &env, "async", 0, NAN, 1.0) == -1);
+  assert(baseline_append(path, 40, &env, "async", 0, 1.0, INFINITY) == -1);
+  assert(!baseline_find_run(path, 0, 0, &run_id) && (run_id == 30));
+  assert(!baseline_append(path, 40, &env, "async", 0, steady[0], 1.0));
+  store = fopen(path, "a");
+  assert(store);
+  fprintf(store, "40\t%016llx\tx\tx\tx\t1\tx\tasync\t1\tnan\t1.0\n",
+          (unsigned long long)env.fingerprint);
+  fclose(store);
+  assert(!baseline_load_run(path, 40, &run));
+  series = baseline_find_series(&run, "async");
+  assert(series && (series->num_trials == 1));
+  baseline_run_free(&run);
+
+  unlink(path);
+
+  printf(" PASSED\n");
+  printf("Completed baseline tests.\n");
+}
+
+void test_fault_shares(void) {
+  FaultConfig config = {.not_committed = 0.1,
+                        .unknown_result = 0.05,
+                        .too_old = 0.2,
+                        .seed = 1};
+  uint32_t commits[3] = {0, 0, 0};
+  uint32_t reads = 0;
+  uint32_t num_draws = 20000;
+
+  printf("\nStarting fault injection tests...\n");
+  printf("\tconfiguring faults... ");
+
+  config.spike_rate = 1.5;
+  assert(fdb_set_faults(&config) == -1);
+  config.spike_rate = 0.0;
+  config.too_old = 0.9;
+  assert(fdb_set_faults(&config) == -1);
+  config.too_old = 0.2;
+  assert(fdb_set_faults(&config) == 0);
+
+  printf(" PASSED\n");
+  printf("\tdrawing faults... ");
+
+  for (uint32_t i = 0; i < num_draws; ++i) {
+    switch (fdb_fault_inject(FAULT_SITE_COMMIT)) {
+    case FDB_ERROR_NOT_COMMITTED:
+      ++commits[0];
+      break;
+    case FDB_ERROR_COMMIT_UNKNOWN_RESULT:
+      ++commits[1];
+      break;
+    case FDB_ERROR_TRANSACTION_TOO_OLD:
+      ++commits[2];
+      break;
+    default:
+      break;
+    }
+
+    // Reads can only expire
+    switch (fdb_fault_inject(FAULT_SITE_READ)) {
+    case 0:
+      break;
+    case FDB_ERROR_TRANSACTION_TOO_OLD:
+      ++reads;
+      break;
+    default:
+      assert(false);
+    }
+  }
+
+  // Each share is drawn to within a percentage point
+  assert(fabs(((double)commits[0] / num_draws) - 0.1) < 0.01);
+  assert(fabs(((double)commits[1] / num_draws) - 0.05) < 0.01);
+  assert(fabs(((double)commits[2] / num_draws) - 0.2) < 0.01);
+  assert(fabs(((double)reads / num_draws) - 0.2) < 0.01);
+
+  assert(fdb_set_faults(NULL) == 0);
+  assert(!fdb_fault_inject(FAULT_SITE_COMMIT));
+
   printf(" PASSED\n");
+  printf("Completed fault injection tests.\n");
 }
@@ -0,0 +1,159 @@
+/// @file analyze.c
+///
+/// Storage footprint analyzer for the Seguro event log. Reports payload bytes
+/// versus key and header bytes, key-value pairs per event, fragment
+/// utilization, amplification ratios, and projected savings from packing or
+/// compression.
+///
+/// Documentation links:
+///   https://www.gnu.org/software/libc/manual/html_node/Using-Getopt.html
+///   https://linux.die.net/man/3/getopt_long
+
+#include <foundationdb/fdb_c.h>
+#include <getopt.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "../fdb.h"
+#include "../fdb_footprint.h"
+
+//==============================================================================
+// Prototypes
+//==============================================================================
+
+/// Print usage instructions.
+///
+/// @param[in] name  Name of the executable.
+void print_usage(const char *name);
+
+/// Parse an unsigned 64-bit integer from a string, or exit on failure.
+///
+/// @param[in] str  The string to parse.
+///
+/// @return  The parsed integer.
+uint64_t parse_u64(const char *str);
+
+//==============================================================================
+// Functions
+//==============================================================================
+
+/// Execute the Seguro footprint analyzer.
+///
+/// @param[in] argc  Number of command-line options provided.
+/// @param[in] argv  Array of command-line options provided.
+///
+/// @return  0  Success
+/// @return  1  Failure (error occurred)
+int main(int argc, char **argv) {
+  FootprintStats stats;
+  FootprintReport report;
+  uint64_t start_id = 0;
+  uint64_t end_id = UINT64_MAX;
+  uint64_t stride = 1;
+  double kv_overhead = FOOTPRINT_DEFAULT_KV_OVERHEAD;
+  bool estimate_only = false;
+  int64_t estimate = 0;
+  int opt;
+
+  static struct option long_options[] = {
+      {"start", required_argument, 0, 's'},
+      {"end", required_argument, 0, 'e'},
+      {"stride", required_argument, 0, 'n'},
+      {"overhead", required_argument, 0, 'o'},
+      {"estimate", no_argument, 0, 'E'},
+      {"help", no_argument, 0, 'h'},
+      {0, 0, 0, 0},
+  };
+
+  while ((opt = getopt_long(argc, argv, "s:e:n:o:Eh", long_options, NULL)) !=
+         -1) {
+    switch (opt) {
+    case 's':
+      start_id = parse_u64(optarg);
+      break;
+    case 'e':
+      end_id = parse_u64(optarg);
+      break;
+    case 'n':
+      stride = parse_u64(optarg);
+      break;
+    case 'o':
+      kv_overhead = atof(optarg);
+      break;
+    case 'E':
+      estimate_only = true;
+      break;
+    case 'h':
+      print_usage(argv[0]);
+      return 0;
+    default:
+      print_usage(argv[0]);
+      return 1;
+    }
+  }
+
+  // Initialize FoundationDB database
+  fdb_init_database();
+  fdb_init_network_thread();
+
+  // Event keys are looked up in the layout the database was written in
+  if (fdb_load_key_format())
+    goto fail;
+
+  // The cluster estimate is cheap, so always print it
+  if (fdb_estimate_range_size(start_id, end_id, &estimate))
+    goto fail;
+  printf("  estimate  %lld bytes (cluster sampled)\n", (long long)estimate);
+
+  if (!estimate_only) {
+    footprint_init(&stats);
+    if (fdb_analyze_range(start_id, end_id, stride, &stats))
+      goto fail;
+
+    if (stride > 1)
+      printf("    stride  %llu (sampled)\n", (unsigned long long)stride);
+
+    footprint_report(&stats, kv_overhead, &report);
+    footprint_print(&stats, &report, stdout);
+  }
+
+  // Clean up FoundationDB database
+  fdb_shutdown_network_thread();
+  fdb_shutdown_database();
+
+  // Success
+  return 0;
+
+// Failure
+fail:
+  fprintf(stderr, "Fatal error during analysis\n");
+  fdb_shutdown_network_thread();
+  fdb_shutdown_database();
+  return 1;
+}
+
+void print_usage(const char *name) {
+  printf("usage: %s [options]\n", name);
+  printf("  -s, --start ID       first event in range (default 0)\n");
+  printf("  -e, --end ID         event one past the end of range (default "
+         "max)\n");
+  printf("  -n, --stride N       analyze one event per N ids (default 1)\n");
+  printf("  -o, --overhead B     storage bytes per key-value pair (default "
+         "%.0f)\n",
+         FOOTPRINT_DEFAULT_KV_OVERHEAD);
+  printf("  -E, --estimate       only print the cluster size estimate\n");
+}
+
+uint64_t parse_u64(const char *str) {
+  char *end;
+  unsigned long long parsed = strtoull(str, &end, 10);
+
+  if ((end == str) || *end) {
+    fprintf(stderr, "invalid number: %s\n", str);
+    exit(1);
+  }
+
+  return (uint64_t)parsed;
+}
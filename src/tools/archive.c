@@ -0,0 +1,141 @@
+/// @file archive.c
+///
+/// Cold-tier archival tool for the Seguro event log. Exports the events below
+/// a watermark into compressed segment files in a directory, then clears them
+/// from the cluster. Archived events stay readable by any process which opens
+/// the same directory with archive_open().
+///
+/// Documentation links:
+///   https://www.gnu.org/software/libc/manual/html_node/Using-Getopt.html
+///   https://linux.die.net/man/3/getopt_long
+
+#include <foundationdb/fdb_c.h>
+#include <getopt.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "../archive.h"
+#include "../fdb.h"
+
+// Default maximum number of events per segment
+#define ARCHIVE_DEFAULT_SEGMENT_EVENTS 100000
+
+//==============================================================================
+// Prototypes
+//==============================================================================
+
+/// Print usage instructions.
+///
+/// @param[in] name  Name of the executable.
+void print_usage(const char *name);
+
+/// Parse an unsigned 64-bit integer from a string, or exit on failure.
+///
+/// @param[in] str  The string to parse.
+///
+/// @return  The parsed integer.
+uint64_t parse_u64(const char *str);
+
+//==============================================================================
+// Functions
+//==============================================================================
+
+/// Execute the Seguro archival tool.
+///
+/// @param[in] argc  Number of command-line options provided.
+/// @param[in] argv  Array of command-line options provided.
+///
+/// @return  0  Success
+/// @return  1  Failure (error occurred)
+int main(int argc, char **argv) {
+  const char *dir = NULL;
+  uint64_t watermark = 0;
+  uint32_t segment_events = ARCHIVE_DEFAULT_SEGMENT_EVENTS;
+  int64_t archived;
+  int opt;
+
+  static struct option long_options[] = {
+      {"dir", required_argument, 0, 'd'},
+      {"below", required_argument, 0, 'b'},
+      {"segment-events", required_argument, 0, 's'},
+      {"help", no_argument, 0, 'h'},
+      {0, 0, 0, 0},
+  };
+
+  while ((opt = getopt_long(argc, argv, "d:b:s:h", long_options, NULL)) !=
+         -1) {
+    switch (opt) {
+    case 'd':
+      dir = optarg;
+      break;
+    case 'b':
+      watermark = parse_u64(optarg);
+      break;
+    case 's':
+      segment_events = (uint32_t)parse_u64(optarg);
+      if (!segment_events) {
+        fprintf(stderr, "invalid number of events: %s\n", optarg);
+        return 1;
+      }
+      break;
+    case 'h':
+      print_usage(argv[0]);
+      return 0;
+    default:
+      print_usage(argv[0]);
+      return 1;
+    }
+  }
+
+  if (!dir || (optind != argc)) {
+    print_usage(argv[0]);
+    return 1;
+  }
+
+  // Initialize FoundationDB database
+  fdb_init_database();
+  fdb_init_network_thread();
+
+  archived = fdb_archive_events(dir, watermark, segment_events);
+  archive_close();
+  if (archived < 0)
+    goto fail;
+
+  printf("archived %lld events below %llu\n", (long long)archived,
+         (unsigned long long)watermark);
+
+  // Clean up FoundationDB database
+  fdb_shutdown_network_thread();
+  fdb_shutdown_database();
+
+  // Success
+  return 0;
+
+// Failure
+fail:
+  fprintf(stderr, "Fatal error during archival\n");
+  fdb_shutdown_network_thread();
+  fdb_shutdown_database();
+  return 1;
+}
+
+void print_usage(const char *name) {
+  printf("usage: %s --dir DIR --below N [options]\n", name);
+  printf("  -d, --dir DIR            directory holding the segments\n");
+  printf("  -b, --below N            archive the events with lower ids\n");
+  printf("  -s, --segment-events N   events per segment (default %d)\n",
+         ARCHIVE_DEFAULT_SEGMENT_EVENTS);
+}
+
+uint64_t parse_u64(const char *str) {
+  char *end;
+  unsigned long long parsed = strtoull(str, &end, 10);
+
+  if ((end == str) || *end) {
+    fprintf(stderr, "invalid number: %s\n", str);
+    exit(1);
+  }
+
+  return (uint64_t)parsed;
+}
@@ -0,0 +1,161 @@
+/// @file compare.c
+///
+/// Benchmark comparison tool for Seguro. Compares two runs from a baseline
+/// store, written by the benchmarks with --baseline, and reports every
+/// benchmark whose throughput or p99 batch time regressed beyond a threshold.
+/// By default, the latest run is compared against the run before it in the
+/// same environment.
+///
+/// Documentation links:
+///   https://www.gnu.org/software/libc/manual/html_node/Using-Getopt.html
+///   https://linux.die.net/man/3/getopt_long
+
+#include <getopt.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "../baseline.h"
+
+//==============================================================================
+// Prototypes
+//==============================================================================
+
+/// Print usage instructions.
+///
+/// @param[in] name  Name of the executable.
+void print_usage(const char *name);
+
+/// Print the environment of a run.
+///
+/// @param[in] label  Label of the run.
+/// @param[in] run    Handle for the run.
+void print_run(const char *label, const BaselineRun *run);
+
+//==============================================================================
+// Functions
+//==============================================================================
+
+/// Execute the Seguro benchmark comparison tool.
+///
+/// @param[in] argc  Number of command-line options provided.
+/// @param[in] argv  Array of command-line options provided.
+///
+/// @return  0  Success (no benchmark regressed)
+/// @return  1  Failure (error occurred)
+/// @return  2  A benchmark regressed
+int main(int argc, char **argv) {
+  const char *path;
+  BaselineRun base, cand;
+  double threshold = BASELINE_DEFAULT_THRESHOLD;
+  uint64_t base_id = 0;
+  uint64_t cand_id = 0;
+  uint32_t num_regressed = 0;
+  int opt;
+
+  static struct option long_options[] = {
+      {"threshold", required_argument, 0, 't'},
+      {"base", required_argument, 0, 'b'},
+      {"candidate", required_argument, 0, 'c'},
+      {"help", no_argument, 0, 'h'},
+      {0, 0, 0, 0},
+  };
+
+  while ((opt = getopt_long(argc, argv, "t:b:c:h", long_options, NULL)) !=
+         -1) {
+    switch (opt) {
+    case 't':
+      threshold = (atof(optarg) / 100.0);
+      if (threshold <= 0.0) {
+        print_usage(argv[0]);
+        return 1;
+      }
+      break;
+    case 'b':
+      base_id = strtoull(optarg, NULL, 10);
+      break;
+    case 'c':
+      cand_id = strtoull(optarg, NULL, 10);
+      break;
+    case 'h':
+      print_usage(argv[0]);
+      return 0;
+    default:
+      print_usage(argv[0]);
+      return 1;
+    }
+  }
+
+  if (optind != (argc - 1)) {
+    print_usage(argv[0]);
+    return 1;
+  }
+  path = argv[optind];
+
+  // The latest run, and the run before it measured in the same environment
+  if (!cand_id && baseline_find_run(path, 0, 0, &cand_id))
+    goto find_fail;
+  if (baseline_load_run(path, cand_id, &cand))
+    goto find_fail;
+  if (!base_id &&
+      baseline_find_run(path, cand_id, cand.env.fingerprint, &base_id)) {
+    baseline_run_free(&cand);
+    goto find_fail;
+  }
+  if (baseline_load_run(path, base_id, &base)) {
+    baseline_run_free(&cand);
+    goto find_fail;
+  }
+
+  print_run("base", &base);
+  print_run("candidate", &cand);
+  if (base.env.fingerprint != cand.env.fingerprint)
+    printf("warning: the runs were measured in different environments\n");
+  printf("\n%-44s %-15s %s\n", "benchmark", "throughput", "p99 batch");
+
+  for (uint32_t i = 0; i < cand.num_series; ++i) {
+    const BaselineSeries *series = (cand.series + i);
+    const BaselineSeries *matched = baseline_find_series(&base, series->name);
+    BaselineVerdict verdict;
+
+    if (!matched || baseline_compare(matched, series, threshold, &verdict))
+      continue;
+
+    // Intervals are the candidate's value relative to the base's
+    printf("%-44s %6.3f-%-6.3f  %6.3f-%-6.3f  %s\n", series->name,
+           verdict.throughput_low, verdict.throughput_high, verdict.p99_low,
+           verdict.p99_high, (verdict.regressed ? "REGRESSED" : "ok"));
+    num_regressed += verdict.regressed;
+  }
+
+  printf("\n%u regressed beyond %.1f%%\n", num_regressed, (threshold * 100.0));
+
+  baseline_run_free(&base);
+  baseline_run_free(&cand);
+
+  // Success
+  return num_regressed ? 2 : 0;
+
+// Failure
+find_fail:
+  fprintf(stderr, "No runs to compare in %s\n", path);
+  return 1;
+}
+
+void print_usage(const char *name) {
+  printf("usage: %s [options] STORE\n", name);
+  printf("  -t, --threshold PCT  regression tolerated, in percent (default "
+         "%.0f)\n",
+         (BASELINE_DEFAULT_THRESHOLD * 100.0));
+  printf("  -b, --base RUN       run to compare against (default: the run "
+         "before the\n                       candidate in the same "
+         "environment)\n");
+  printf("  -c, --candidate RUN  run to compare (default: the latest run)\n");
+}
+
+void print_run(const char *label, const BaselineRun *run) {
+  printf("%9s  run %llu on %s (%s, %u cpus, kernel %s)\n", label,
+         (unsigned long long)run->id, run->env.host, run->env.cpu,
+         run->env.num_cpus, run->env.kernel);
+}
@@ -0,0 +1,136 @@
+/// @file migrate.c
+///
+/// Key layout migration tool for the Seguro event log. Moves every event
+/// key-value pair into the fixed or compact key layout, in batch-priority
+/// transactions, and records the layout in the database metadata. Events stay
+/// readable throughout, and an interrupted migration can simply be rerun.
+///
+/// Documentation links:
+///   https://www.gnu.org/software/libc/manual/html_node/Using-Getopt.html
+///   https://linux.die.net/man/3/getopt_long
+
+#include <foundationdb/fdb_c.h>
+#include <getopt.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../fdb.h"
+
+// Default maximum key-value pairs moved per transaction
+#define MIGRATE_DEFAULT_BATCH_KVS 1000
+
+//==============================================================================
+// Prototypes
+//==============================================================================
+
+/// Print usage instructions.
+///
+/// @param[in] name  Name of the executable.
+void print_usage(const char *name);
+
+/// Parse an unsigned 32-bit integer from a string, or exit on failure.
+///
+/// @param[in] str  The string to parse.
+///
+/// @return  The parsed integer.
+uint32_t parse_u32(const char *str);
+
+//==============================================================================
+// Functions
+//==============================================================================
+
+/// Execute the Seguro key layout migration tool.
+///
+/// @param[in] argc  Number of command-line options provided.
+/// @param[in] argv  Array of command-line options provided.
+///
+/// @return  0  Success
+/// @return  1  Failure (error occurred)
+int main(int argc, char **argv) {
+  KeyFormat format = KEY_FORMAT_COMPACT;
+  uint32_t batch_kvs = MIGRATE_DEFAULT_BATCH_KVS;
+  int64_t moved;
+  int opt;
+
+  static struct option long_options[] = {
+      {"format", required_argument, 0, 'f'},
+      {"batch", required_argument, 0, 'b'},
+      {"help", no_argument, 0, 'h'},
+      {0, 0, 0, 0},
+  };
+
+  while ((opt = getopt_long(argc, argv, "f:b:h", long_options, NULL)) != -1) {
+    switch (opt) {
+    case 'f':
+      if (!strcmp(optarg, "compact")) {
+        format = KEY_FORMAT_COMPACT;
+      } else if (!strcmp(optarg, "fixed")) {
+        format = KEY_FORMAT_FIXED;
+      } else {
+        fprintf(stderr, "invalid key format: %s\n", optarg);
+        return 1;
+      }
+      break;
+    case 'b':
+      batch_kvs = parse_u32(optarg);
+      break;
+    case 'h':
+      print_usage(argv[0]);
+      return 0;
+    default:
+      print_usage(argv[0]);
+      return 1;
+    }
+  }
+
+  // Initialize FoundationDB database
+  fdb_init_database();
+  fdb_init_network_thread();
+
+  if (fdb_load_key_format())
+    goto fail;
+
+  moved = fdb_migrate_keys(format, batch_kvs);
+  if (moved < 0)
+    goto fail;
+
+  printf("moved %lld key-value pairs to the %s key layout\n", (long long)moved,
+         (format == KEY_FORMAT_COMPACT) ? "compact" : "fixed");
+
+  // Clean up FoundationDB database
+  fdb_shutdown_network_thread();
+  fdb_shutdown_database();
+
+  // Success
+  return 0;
+
+// Failure
+fail:
+  fprintf(stderr, "Fatal error during migration\n");
+  fdb_shutdown_network_thread();
+  fdb_shutdown_database();
+  return 1;
+}
+
+void print_usage(const char *name) {
+  printf("usage: %s [options]\n", name);
+  printf("  -f, --format F       key layout to migrate to: compact or fixed "
+         "(default compact)\n");
+  printf("  -b, --batch N        key-value pairs moved per transaction "
+         "(default %d)\n",
+         MIGRATE_DEFAULT_BATCH_KVS);
+}
+
+uint32_t parse_u32(const char *str) {
+  char *end;
+  unsigned long parsed = strtoul(str, &end, 10);
+
+  if ((end == str) || *end || !parsed || (parsed > UINT32_MAX)) {
+    fprintf(stderr, "invalid number: %s\n", str);
+    exit(1);
+  }
+
+  return (uint32_t)parsed;
+}
@@ -0,0 +1,166 @@
+/// @file snapshot.c
+///
+/// Snapshot transfer tool for the Seguro event log. Uploads a snapshot file to
+/// the cluster and publishes it, or downloads the latest (or a given) snapshot
+/// to a file, so that a ship can boot from it and replay only the suffix of the
+/// log.
+///
+/// Documentation links:
+///   https://www.gnu.org/software/libc/manual/html_node/Using-Getopt.html
+///   https://linux.die.net/man/3/getopt_long
+
+#include <foundationdb/fdb_c.h>
+#include <getopt.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../fdb.h"
+#include "../fdb_blob.h"
+
+// Default number of transfer threads
+#define SNAPSHOT_DEFAULT_THREADS 8
+
+//==============================================================================
+// Prototypes
+//==============================================================================
+
+/// Print usage instructions.
+///
+/// @param[in] name  Name of the executable.
+void print_usage(const char *name);
+
+/// Parse an unsigned 64-bit integer from a string, or exit on failure.
+///
+/// @param[in] str  The string to parse.
+///
+/// @return  The parsed integer.
+uint64_t parse_u64(const char *str);
+
+//==============================================================================
+// Functions
+//==============================================================================
+
+/// Execute the Seguro snapshot transfer tool.
+///
+/// @param[in] argc  Number of command-line options provided.
+/// @param[in] argv  Array of command-line options provided.
+///
+/// @return  0  Success
+/// @return  1  Failure (error occurred)
+int main(int argc, char **argv) {
+  uint32_t num_threads = SNAPSHOT_DEFAULT_THREADS;
+  uint64_t event_id = 0;
+  bool have_event = false;
+  bool upload;
+  int err;
+  int opt;
+
+  static struct option long_options[] = {
+      {"event", required_argument, 0, 'e'},
+      {"threads", required_argument, 0, 't'},
+      {"help", no_argument, 0, 'h'},
+      {0, 0, 0, 0},
+  };
+
+  while ((opt = getopt_long(argc, argv, "e:t:h", long_options, NULL)) != -1) {
+    switch (opt) {
+    case 'e':
+      event_id = parse_u64(optarg);
+      have_event = true;
+      break;
+    case 't':
+      num_threads = (uint32_t)parse_u64(optarg);
+      if (!num_threads || (num_threads > 1024)) {
+        fprintf(stderr, "invalid number of threads: %s\n", optarg);
+        return 1;
+      }
+      break;
+    case 'h':
+      print_usage(argv[0]);
+      return 0;
+    default:
+      print_usage(argv[0]);
+      return 1;
+    }
+  }
+
+  if ((argc - optind) != 2) {
+    print_usage(argv[0]);
+    return 1;
+  }
+
+  if (!strcmp(argv[optind], "put")) {
+    upload = true;
+  } else if (!strcmp(argv[optind], "get")) {
+    upload = false;
+  } else {
+    print_usage(argv[0]);
+    return 1;
+  }
+
+  // An upload must say which events the snapshot covers
+  if (upload && !have_event) {
+    fprintf(stderr, "put requires --event\n");
+    return 1;
+  }
+
+  // Initialize FoundationDB database
+  fdb_init_database();
+  fdb_init_network_thread();
+
+  if (upload) {
+    if (fdb_put_snapshot(argv[(optind + 1)], event_id, num_threads))
+      goto fail;
+  } else {
+    if (!have_event) {
+      err = fdb_get_latest_snapshot(&event_id);
+      if (err > 0)
+        fprintf(stderr, "no snapshot has been published\n");
+      if (err)
+        goto fail;
+    }
+
+    if (fdb_get_snapshot(event_id, argv[(optind + 1)], num_threads))
+      goto fail;
+  }
+
+  printf("%s snapshot covering events up to %llu\n",
+         upload ? "uploaded" : "downloaded", (unsigned long long)event_id);
+
+  // Clean up FoundationDB database
+  fdb_shutdown_network_thread();
+  fdb_shutdown_database();
+
+  // Success
+  return 0;
+
+// Failure
+fail:
+  fprintf(stderr, "Fatal error during snapshot transfer\n");
+  fdb_shutdown_network_thread();
+  fdb_shutdown_database();
+  return 1;
+}
+
+void print_usage(const char *name) {
+  printf("usage: %s [options] put|get FILE\n", name);
+  printf("  -e, --event N        last event covered by the snapshot (default "
+         "latest, for get)\n");
+  printf("  -t, --threads N      transfer threads (default %d)\n",
+         SNAPSHOT_DEFAULT_THREADS);
+}
+
+uint64_t parse_u64(const char *str) {
+  char *end;
+  unsigned long long parsed = strtoull(str, &end, 10);
+
+  if ((end == str) || *end) {
+    fprintf(stderr, "invalid number: %s\n", str);
+    exit(1);
+  }
+
+  return (uint64_t)parsed;
+}
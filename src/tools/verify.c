@@ -0,0 +1,147 @@
+/// @file verify.c
+///
+/// Log verification tool for Seguro. Compares the Merkle summaries of the event
+/// log against the events actually stored, or against the summaries of a copy
+/// of the log in another cluster, and lists the ranges of event ids which
+/// differ. Can also rebuild the summaries from the stored events.
+///
+/// Documentation links:
+///   https://www.gnu.org/software/libc/manual/html_node/Using-Getopt.html
+///   https://linux.die.net/man/3/getopt_long
+
+#include <foundationdb/fdb_c.h>
+#include <getopt.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "../fdb.h"
+#include "../fdb_merkle.h"
+
+//==============================================================================
+// Prototypes
+//==============================================================================
+
+/// Print usage instructions.
+///
+/// @param[in] name  Name of the executable.
+void print_usage(const char *name);
+
+/// Print a range of event ids which differs between the two copies.
+void print_diff(uint64_t first_id, uint64_t last_id, void *context);
+
+//==============================================================================
+// Functions
+//==============================================================================
+
+/// Execute the Seguro log verification tool.
+///
+/// @param[in] argc  Number of command-line options provided.
+/// @param[in] argv  Array of command-line options provided.
+///
+/// @return  0  Success (the copies match)
+/// @return  1  Failure (error occurred)
+/// @return  2  The copies differ
+int main(int argc, char **argv) {
+  const char *against = NULL;
+  FDBDatabase *other = NULL;
+  MerkleTree tree;
+  MerkleSource stored, source;
+  bool rebuild = false;
+  int64_t num_diffs;
+  int opt;
+
+  static struct option long_options[] = {
+      {"against", required_argument, 0, 'a'},
+      {"rebuild", no_argument, 0, 'r'},
+      {"help", no_argument, 0, 'h'},
+      {0, 0, 0, 0},
+  };
+
+  while ((opt = getopt_long(argc, argv, "a:rh", long_options, NULL)) != -1) {
+    switch (opt) {
+    case 'a':
+      against = optarg;
+      break;
+    case 'r':
+      rebuild = true;
+      break;
+    case 'h':
+      print_usage(argv[0]);
+      return 0;
+    default:
+      print_usage(argv[0]);
+      return 1;
+    }
+  }
+
+  if ((optind != argc) || (against && rebuild)) {
+    print_usage(argv[0]);
+    return 1;
+  }
+
+  // Initialize FoundationDB database
+  fdb_init_database();
+  fdb_init_network_thread();
+  merkle_tree_init(&tree);
+
+  if (rebuild) {
+    if (fdb_merkle_rebuild())
+      goto fail;
+
+    printf("rebuilt summaries from the stored events\n");
+    num_diffs = 0;
+  } else {
+    fdb_merkle_source(NULL, &stored);
+
+    // Either another cluster's summaries, or a fresh summary of this one
+    if (against) {
+      if (fdb_check_error(fdb_create_database(against, &other)))
+        goto fail;
+      fdb_merkle_source(other, &source);
+    } else {
+      if (fdb_merkle_scan(&tree))
+        goto fail;
+      merkle_tree_source(&tree, &source);
+    }
+
+    num_diffs = merkle_diff(&stored, &source, print_diff, NULL);
+    if (num_diffs < 0)
+      goto fail;
+
+    printf("%lld differing buckets\n", (long long)num_diffs);
+  }
+
+  // Clean up FoundationDB database
+  merkle_tree_free(&tree);
+  if (other)
+    fdb_database_destroy(other);
+  fdb_shutdown_network_thread();
+  fdb_shutdown_database();
+
+  // Success
+  return num_diffs ? 2 : 0;
+
+// Failure
+fail:
+  fprintf(stderr, "Fatal error during verification\n");
+  merkle_tree_free(&tree);
+  if (other)
+    fdb_database_destroy(other);
+  fdb_shutdown_network_thread();
+  fdb_shutdown_database();
+  return 1;
+}
+
+void print_usage(const char *name) {
+  printf("usage: %s [options]\n", name);
+  printf("  -a, --against FILE   compare with the cluster of a cluster file, "
+         "instead of\n                       the stored events\n");
+  printf("  -r, --rebuild        rebuild the summaries from the stored "
+         "events\n");
+}
+
+void print_diff(uint64_t first_id, uint64_t last_id, void *context) {
+  printf("events %llu-%llu differ\n", (unsigned long long)first_id,
+         (unsigned long long)last_id);
+}